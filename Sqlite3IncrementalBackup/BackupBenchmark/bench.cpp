@@ -0,0 +1,590 @@
+//
+// bench.cpp
+// Backup, restore and verify benchmark of incremental backup against sqlite3_backup.
+//
+// BackupBenchmark [--sizes 10M,100M,1G] [--page-sizes 1024,4096,65536] [--journal wal,delete]
+//                 [--churn hotspot,append,random,vacuum] [--iterations 5] [--hash xxh64|xxh3|crc32c]
+//                 [--threads 0] [--dir bench_data] [--out bench.json]
+//
+
+#include "sqlite3.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <Sqlite3IncrementalBackup/api.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	const std::size_t ROW_PAYLOAD = 400;		//bytes of random payload per row
+	const std::size_t INSERT_BATCH = 10000;		//rows per generating transaction
+	const double HOTSPOT_FRACTION = 0.001;		//rows updated per hot-spot round
+	const double HOTSPOT_REGION = 0.01;			//hot rows are the first 1% of table
+	const double RANDOM_FRACTION = 0.01;		//rows updated per random round
+	const double APPEND_FRACTION = 0.01;		//rows appended per append round
+	const double VACUUM_FRACTION = 0.05;		//rows deleted before VACUUM per vacuum round
+	const char* BACKUP_NAME = "bench";
+
+	using Clock = std::chrono::steady_clock;
+
+	struct Config {
+		std::vector<uint64_t> sizes = { 10ull << 20, 100ull << 20 };
+		std::vector<int> pageSizes = { 1024, 4096, 65536 };
+		std::vector<std::string> journals = { "wal", "delete" };
+		std::vector<std::string> churns = { "hotspot", "append", "random", "vacuum" };
+		unsigned iterations = 5;
+		std::string dir = "bench_data";
+		std::string out = "bench.json";
+		sqlite3_inc_bkp::BackupOptions options;
+	};
+
+	struct Case {
+		uint64_t size;
+		int pageSize;
+		std::string journal;
+		std::string churn;
+	};
+
+	/// <summary>
+	/// Durations of one measured operation in milliseconds and bytes it processed, failed runs are counted but not sampled
+	/// </summary>
+	struct Samples {
+		std::vector<double> ms;
+		uint64_t bytes = 0;
+		unsigned failed = 0;
+
+		void Add(double sampleMs, uint64_t sampleBytes) {
+			ms.push_back(sampleMs);
+			bytes += sampleBytes;
+		}
+	};
+
+	struct BenchError : std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+
+	double ElapsedMs(Clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	uint64_t PeakRssBytes() {
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters = {};
+		GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+		return counters.PeakWorkingSetSize;
+#else
+		rusage usage = {};
+		getrusage(RUSAGE_SELF, &usage);
+		return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+	}
+
+	uint64_t ParseSize(const std::string& value) {
+		std::size_t end = 0;
+		uint64_t size = std::stoull(value, &end);
+		switch (end < value.size() ? value[end] : '\0') {
+		case 'G': case 'g': return size << 30;
+		case 'M': case 'm': return size << 20;
+		case 'K': case 'k': return size << 10;
+		default: return size;
+		}
+	}
+
+	std::vector<std::string> Split(const std::string& value) {
+		std::vector<std::string> parts;
+		std::stringstream stream(value);
+		std::string part;
+		while (std::getline(stream, part, ','))
+			if (!part.empty())
+				parts.push_back(part);
+		return parts;
+	}
+
+	std::string Escape(const std::string& value) {
+		std::string escaped;
+		for (char c : value) {
+			if (c == '"' || c == '\\')
+				escaped += '\\';
+			escaped += (static_cast<unsigned char>(c) < 0x20) ? ' ' : c;
+		}
+		return escaped;
+	}
+
+	void Exec(sqlite3* db, const std::string& sql) {
+		char* msg = nullptr;
+		if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &msg) != SQLITE_OK) {
+			std::string error = std::string("sqlite3 error [") + sql + "]: " + (msg ? msg : "");
+			sqlite3_free(msg);
+			throw BenchError(error);
+		}
+	}
+
+	int64_t QueryInt(sqlite3* db, const std::string& sql) {
+		sqlite3_stmt* stmt = nullptr;
+		if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+			throw BenchError(std::string("sqlite3 prepare error [") + sql + "]: " + sqlite3_errmsg(db));
+		int64_t value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+		sqlite3_finalize(stmt);
+		return value;
+	}
+
+	uint64_t DbBytes(sqlite3* db) {
+		return uint64_t(QueryInt(db, "PRAGMA page_count")) * uint64_t(QueryInt(db, "PRAGMA page_size"));
+	}
+
+	sqlite3* Open(const std::string& path) {
+		sqlite3* db = nullptr;
+		if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+			std::string error = "sqlite3 open error [" + path + "]: " + sqlite3_errmsg(db);
+			sqlite3_close(db);
+			throw BenchError(error);
+		}
+		return db;
+	}
+
+	//msg is taken by reference, it is read after the call filling it has returned
+	void Check(int rc, char*& msg, const char* operation) {
+		if (rc != 0) {
+			std::string error = std::string(operation) + " error (" + std::to_string(rc) + "): " + (msg ? msg : "");
+			delete[] msg;
+			msg = nullptr;
+			throw BenchError(error);
+		}
+	}
+
+	/// <summary>
+	/// Sample of operation returning rc, failure is reported and flagged instead of timed
+	/// </summary>
+	bool AddResult(Samples& samples, int rc, char*& msg, const char* operation, double sampleMs, uint64_t sampleBytes) {
+		if (rc == 0) {
+			samples.Add(sampleMs, sampleBytes);
+			return true;
+		}
+		std::cerr << operation << " error (" << rc << "): " << (msg ? msg : "") << "\n";
+		delete[] msg;
+		msg = nullptr;
+		++samples.failed;
+		return false;
+	}
+
+	void RemoveDb(const std::string& path) {
+		for (const char* suffix : { "", "-wal", "-shm", "-journal" })
+			boost::filesystem::remove(path + suffix);
+	}
+
+	void InsertRows(sqlite3* db, uint64_t rows) {
+		sqlite3_stmt* stmt = nullptr;
+		if (sqlite3_prepare_v2(db, "INSERT INTO bench (payload) VALUES (randomblob(?))", -1, &stmt, nullptr) != SQLITE_OK)
+			throw BenchError(std::string("sqlite3 prepare error: ") + sqlite3_errmsg(db));
+		Exec(db, "BEGIN");
+		for (uint64_t i = 0; i < rows; ++i) {
+			sqlite3_bind_int64(stmt, 1, ROW_PAYLOAD);
+			sqlite3_step(stmt);
+			sqlite3_reset(stmt);
+		}
+		Exec(db, "COMMIT");
+		sqlite3_finalize(stmt);
+	}
+
+	void UpdateRows(sqlite3* db, const std::vector<int64_t>& ids) {
+		sqlite3_stmt* stmt = nullptr;
+		if (sqlite3_prepare_v2(db, "UPDATE bench SET payload = randomblob(?) WHERE id = ?", -1, &stmt, nullptr) != SQLITE_OK)
+			throw BenchError(std::string("sqlite3 prepare error: ") + sqlite3_errmsg(db));
+		Exec(db, "BEGIN");
+		for (int64_t id : ids) {
+			sqlite3_bind_int64(stmt, 1, ROW_PAYLOAD);
+			sqlite3_bind_int64(stmt, 2, id);
+			sqlite3_step(stmt);
+			sqlite3_reset(stmt);
+		}
+		Exec(db, "COMMIT");
+		sqlite3_finalize(stmt);
+	}
+
+	/// <summary>
+	/// Seed database of one size, page size and journal mode, generated once and copied for every churn profile
+	/// </summary>
+	std::string MakeSeed(const Config& config, uint64_t size, int pageSize, const std::string& journal) {
+		const std::string path = (boost::filesystem::path(config.dir) /
+			("seed_" + std::to_string(size) + "_" + std::to_string(pageSize) + "_" + journal + ".sqlite")).string();
+		if (boost::filesystem::exists(path))
+			return path;
+
+		std::cerr << "Generating " << path << "...\n";
+		const std::string tmpPath = path + ".tmp";
+		RemoveDb(tmpPath);
+		sqlite3* db = Open(tmpPath);
+		try {
+			Exec(db, "PRAGMA page_size = " + std::to_string(pageSize));
+			Exec(db, "PRAGMA journal_mode = " + journal);
+			Exec(db, "PRAGMA synchronous = OFF");
+			Exec(db, "CREATE TABLE bench (id INTEGER PRIMARY KEY, payload BLOB)");
+			for (uint64_t bytes = DbBytes(db); bytes < size; bytes = DbBytes(db))
+				InsertRows(db, std::min<uint64_t>(INSERT_BATCH, (size - bytes) / ROW_PAYLOAD + 1));
+		}
+		catch (...) {
+			sqlite3_close(db);
+			throw;
+		}
+		//Closing the last connection checkpoints and removes WAL, copy of main file is the whole database
+		sqlite3_close(db);
+		boost::filesystem::rename(tmpPath, path);
+		return path;
+	}
+
+	/// <summary>
+	/// One round of churn profile: hot-spot updates, appends, random updates or deletes followed by VACUUM
+	/// </summary>
+	void ApplyChurn(sqlite3* db, const std::string& churn, std::mt19937_64& rng) {
+		const int64_t maxId = QueryInt(db, "SELECT max(id) FROM bench");
+		const int64_t rows = std::max<int64_t>(QueryInt(db, "SELECT count(*) FROM bench"), 1);
+		std::vector<int64_t> ids;
+		auto pick = [&](double fraction, int64_t range) {
+			std::uniform_int_distribution<int64_t> dist(1, std::max<int64_t>(range, 1));
+			const int64_t count = std::max<int64_t>(int64_t(rows * fraction), 1);
+			for (int64_t i = 0; i < count; ++i)
+				ids.push_back(dist(rng));
+		};
+
+		if (churn == "hotspot") {
+			pick(HOTSPOT_FRACTION, int64_t(maxId * HOTSPOT_REGION));
+			UpdateRows(db, ids);
+		}
+		else if (churn == "append") {
+			InsertRows(db, std::max<uint64_t>(uint64_t(rows * APPEND_FRACTION), 1));
+		}
+		else if (churn == "random") {
+			pick(RANDOM_FRACTION, maxId);
+			UpdateRows(db, ids);
+		}
+		else if (churn == "vacuum") {
+			pick(VACUUM_FRACTION, maxId);
+			Exec(db, "BEGIN");
+			for (int64_t id : ids)
+				Exec(db, "DELETE FROM bench WHERE id = " + std::to_string(id));
+			Exec(db, "COMMIT");
+			//Refill deleted rows so database size stays stable over rounds, then renumber pages
+			InsertRows(db, ids.size());
+			Exec(db, "VACUUM");
+		}
+		else {
+			throw BenchError("Unknown churn profile [" + churn + "]");
+		}
+	}
+
+	double NativeBackup(sqlite3* src, const std::string& dstPath) {
+		RemoveDb(dstPath);
+		sqlite3* dst = Open(dstPath);
+		const auto start = Clock::now();
+		sqlite3_backup* handle = sqlite3_backup_init(dst, "main", src, "main");
+		int rc = handle ? sqlite3_backup_step(handle, -1) : SQLITE_ERROR;
+		sqlite3_backup_finish(handle);
+		const double ms = ElapsedMs(start);
+		sqlite3_close(dst);
+		if (rc != SQLITE_DONE)
+			throw BenchError("sqlite3_backup error: " + std::string(sqlite3_errstr(rc)));
+		return ms;
+	}
+
+	std::string Fingerprint(sqlite3* db) {
+		return std::to_string(QueryInt(db, "SELECT count(*) FROM bench")) + ":" +
+			std::to_string(QueryInt(db, "SELECT total(length(payload)) + total(id) FROM bench"));
+	}
+
+	void WriteStats(std::ostream& out, const char* name, Samples& samples) {
+		std::sort(samples.ms.begin(), samples.ms.end());
+		auto percentile = [&samples](double p) {
+			if (samples.ms.empty())
+				return 0.0;
+			std::size_t rank = std::size_t(p * samples.ms.size() + 0.999999);
+			return samples.ms[std::min(std::max<std::size_t>(rank, 1), samples.ms.size()) - 1];
+		};
+		double total = 0;
+		for (double ms : samples.ms)
+			total += ms;
+		out << "\"" << name << "\": {\"count\": " << samples.ms.size() << ", \"failed\": " << samples.failed
+			<< ", \"meanMs\": " << (samples.ms.empty() ? 0.0 : total / samples.ms.size())
+			<< ", \"p50Ms\": " << percentile(0.50)
+			<< ", \"p95Ms\": " << percentile(0.95)
+			<< ", \"p99Ms\": " << percentile(0.99)
+			<< ", \"maxMs\": " << (samples.ms.empty() ? 0.0 : samples.ms.back())
+			<< ", \"mbPerSec\": " << (total > 0 ? samples.bytes / 1048576.0 / (total / 1000.0) : 0.0) << "}";
+	}
+
+	const char* PHASE_NAMES[] = { "manifestLoad", "read", "hash", "write", "commit", "manifestStore", "materialize", "restore" };
+	static_assert(sizeof(PHASE_NAMES) / sizeof(PHASE_NAMES[0]) == static_cast<std::size_t>(sqlite3_inc_bkp::BackupPhase::Count), "Phase names changed");
+
+	void AddStats(sqlite3_inc_bkp::BackupStats& total, const sqlite3_inc_bkp::BackupStats& stats) {
+		total.pagesScanned += stats.pagesScanned;
+		total.pagesDirty += stats.pagesDirty;
+		total.bytesWritten += stats.bytesWritten;
+		total.durationUs += stats.durationUs;
+		for (std::size_t p = 0; p < static_cast<std::size_t>(sqlite3_inc_bkp::BackupPhase::Count); ++p) {
+			total.phases[p].wallUs += stats.phases[p].wallUs;
+			total.phases[p].cpuUs += stats.phases[p].cpuUs;
+			total.phases[p].calls += stats.phases[p].calls;
+		}
+	}
+
+	/// <summary>
+	/// Engine counters and phase times summed over measured backups
+	/// </summary>
+	void WriteEngineStats(std::ostream& out, const char* name, const sqlite3_inc_bkp::BackupStats& stats) {
+		out << "\"" << name << "\": {\"pagesScanned\": " << stats.pagesScanned << ", \"pagesDirty\": " << stats.pagesDirty
+			<< ", \"bytesWritten\": " << stats.bytesWritten << ", \"durationUs\": " << stats.durationUs << ", \"phases\": {";
+		for (std::size_t p = 0; p < static_cast<std::size_t>(sqlite3_inc_bkp::BackupPhase::Count); ++p) {
+			out << (p ? ", " : "") << "\"" << PHASE_NAMES[p] << "\": {\"wallUs\": " << stats.phases[p].wallUs
+				<< ", \"cpuUs\": " << stats.phases[p].cpuUs << "}";
+		}
+		out << "}}";
+	}
+
+	/// <summary>
+	/// Run one configuration, returns JSON object of its results
+	/// </summary>
+	std::string RunCase(const Config& config, const Case& c) {
+		const boost::filesystem::path caseDir = boost::filesystem::path(config.dir) /
+			("case_" + std::to_string(c.size) + "_" + std::to_string(c.pageSize) + "_" + c.journal + "_" + c.churn);
+		boost::filesystem::remove_all(caseDir);
+		boost::filesystem::create_directories(caseDir);
+		const std::string dbPath = (caseDir / "db.sqlite").string();
+		const std::string backupDir = (caseDir / "backup").string() + "/";
+		const std::string nativePath = (caseDir / "native.sqlite").string();
+		const std::string restorePath = (caseDir / "restore.sqlite").string();
+		const std::string nativeRestorePath = (caseDir / "native_restore.sqlite").string();
+		boost::filesystem::create_directories(backupDir);
+		boost::filesystem::copy_file(MakeSeed(config, c.size, c.pageSize, c.journal), dbPath);
+
+		std::mt19937_64 rng(c.size ^ uint64_t(c.pageSize));
+		Samples initial, backup, native, restore, nativeRestore, verify;
+		sqlite3_inc_bkp::BackupStats stats, backupStats;
+		bool consistent = true;
+		char* msg = nullptr;
+		sqlite3* db = Open(dbPath);
+		try {
+			Exec(db, "PRAGMA synchronous = OFF");
+			uint64_t dbBytes = DbBytes(db);
+			auto start = Clock::now();
+			Check(sqlite3_inc_bkp::backup(db, backupDir.c_str(), BACKUP_NAME, &msg, nullptr, config.options), msg, "backup");
+			initial.Add(ElapsedMs(start), dbBytes);
+
+			for (unsigned i = 0; i < config.iterations; ++i) {
+				ApplyChurn(db, c.churn, rng);
+				dbBytes = DbBytes(db);
+
+				start = Clock::now();
+				Check(sqlite3_inc_bkp::backup(db, backupDir.c_str(), BACKUP_NAME, &msg, nullptr, config.options, &stats), msg, "backup");
+				backup.Add(ElapsedMs(start), dbBytes);
+				AddStats(backupStats, stats);
+				native.Add(NativeBackup(db, nativePath), dbBytes);
+
+				//Full restore into empty database, a failed restore leaves the case inconsistent
+				RemoveDb(restorePath);
+				sqlite3* dst = Open(restorePath);
+				start = Clock::now();
+				int rc = sqlite3_inc_bkp::read_backup(dst, backupDir.c_str(), BACKUP_NAME, &msg, nullptr, 0, config.options);
+				if (AddResult(restore, rc, msg, "read_backup", ElapsedMs(start), dbBytes))
+					consistent = consistent && Fingerprint(dst) == Fingerprint(db);
+				else
+					consistent = false;
+				sqlite3_close(dst);
+
+				//Verify hashes every page of backup against its manifest without restoring it
+				sqlite3_inc_bkp::VerifyResult result;
+				start = Clock::now();
+				rc = sqlite3_inc_bkp::verify_backup(backupDir.c_str(), BACKUP_NAME, &msg, nullptr, config.options, 0, &result);
+				if (!AddResult(verify, rc, msg, "verify_backup", ElapsedMs(start), dbBytes))
+					consistent = false;
+
+				sqlite3* nativeSrc = Open(nativePath);
+				nativeRestore.Add(NativeBackup(nativeSrc, nativeRestorePath), dbBytes);
+				sqlite3_close(nativeSrc);
+			}
+		}
+		catch (...) {
+			sqlite3_close(db);
+			throw;
+		}
+		const uint64_t finalBytes = DbBytes(db);
+		sqlite3_close(db);
+		boost::filesystem::remove_all(caseDir);
+
+		std::ostringstream out;
+		out << "{\"dbSizeTarget\": " << c.size << ", \"dbSizeBytes\": " << finalBytes << ", \"pageSize\": " << c.pageSize
+			<< ", \"journal\": \"" << c.journal << "\", \"churn\": \"" << c.churn << "\", \"iterations\": " << config.iterations << ", ";
+		WriteStats(out, "initialBackup", initial);
+		out << ", ";
+		WriteStats(out, "backup", backup);
+		out << ", ";
+		WriteStats(out, "nativeBackup", native);
+		out << ", ";
+		WriteStats(out, "restore", restore);
+		out << ", ";
+		WriteStats(out, "nativeRestore", nativeRestore);
+		out << ", ";
+		WriteStats(out, "verify", verify);
+		out << ", ";
+		WriteEngineStats(out, "backupEngine", backupStats);
+		out << ", \"consistent\": " << (consistent ? "true" : "false") << ", \"peakRssBytes\": " << PeakRssBytes() << "}";
+		return out.str();
+	}
+
+	std::string ErrorResult(const Case& c, const std::string& error) {
+		return "{\"dbSizeTarget\": " + std::to_string(c.size) + ", \"pageSize\": " + std::to_string(c.pageSize) +
+			", \"journal\": \"" + c.journal + "\", \"churn\": \"" + c.churn + "\", \"error\": \"" + Escape(error) + "\"}";
+	}
+
+	/// <summary>
+	/// Run configuration in a child process on Linux so peak RSS belongs to this configuration only
+	/// </summary>
+	std::string RunIsolated(const Config& config, const Case& c) {
+#ifndef _WIN32
+		int fds[2];
+		if (pipe(fds) == 0) {
+			const pid_t pid = fork();
+			if (pid == 0) {
+				close(fds[0]);
+				std::string result;
+				try {
+					result = RunCase(config, c);
+				}
+				catch (const std::exception& e) {
+					result = ErrorResult(c, e.what());
+				}
+				for (std::size_t written = 0; written < result.size();) {
+					const ssize_t n = write(fds[1], result.data() + written, result.size() - written);
+					if (n <= 0)
+						break;
+					written += std::size_t(n);
+				}
+				close(fds[1]);
+				_exit(0);
+			}
+			close(fds[1]);
+			if (pid > 0) {
+				std::string result;
+				char buffer[4096];
+				ssize_t n;
+				while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+					result.append(buffer, std::size_t(n));
+				close(fds[0]);
+				int status = 0;
+				waitpid(pid, &status, 0);
+				if (result.empty())
+					result = ErrorResult(c, "benchmark process exited with status " + std::to_string(status));
+				return result;
+			}
+			close(fds[0]);
+		}
+#endif
+		try {
+			return RunCase(config, c);
+		}
+		catch (const std::exception& e) {
+			return ErrorResult(c, e.what());
+		}
+	}
+
+	bool ParseArgs(int argc, char** argv, Config& config) {
+		for (int i = 1; i + 1 < argc; i += 2) {
+			const std::string key = argv[i], value = argv[i + 1];
+			if (key == "--sizes") {
+				config.sizes.clear();
+				for (const std::string& size : Split(value))
+					config.sizes.push_back(ParseSize(size));
+			}
+			else if (key == "--page-sizes") {
+				config.pageSizes.clear();
+				for (const std::string& pageSize : Split(value))
+					config.pageSizes.push_back(std::stoi(pageSize));
+			}
+			else if (key == "--journal")
+				config.journals = Split(value);
+			else if (key == "--churn")
+				config.churns = Split(value);
+			else if (key == "--iterations")
+				config.iterations = unsigned(std::stoul(value));
+			else if (key == "--threads")
+				config.options.threads = unsigned(std::stoul(value));
+			else if (key == "--hash" && value == "xxh64")
+				config.options.hashAlgorithm = sqlite3_inc_bkp::HashAlgorithm::Xxh64;
+			else if (key == "--hash" && value == "xxh3")
+				config.options.hashAlgorithm = sqlite3_inc_bkp::HashAlgorithm::Xxh3;
+			else if (key == "--hash" && value == "crc32c")
+				config.options.hashAlgorithm = sqlite3_inc_bkp::HashAlgorithm::Crc32c;
+			else if (key == "--dir")
+				config.dir = value;
+			else if (key == "--out")
+				config.out = value;
+			else
+				return false;
+		}
+		return argc % 2 == 1;
+	}
+}
+
+int main(int argc, char** argv) {
+	Config config;
+	config.options.hashAlgorithm = sqlite3_inc_bkp::HashAlgorithm::Xxh64;
+	try {
+		if (!ParseArgs(argc, argv, config)) {
+			std::cerr << "Usage: " << argv[0] << " [--sizes 10M,100M,1G] [--page-sizes 1024,4096,65536] [--journal wal,delete]\n"
+				"\t[--churn hotspot,append,random,vacuum] [--iterations 5] [--hash xxh64|xxh3|crc32c] [--threads 0]\n"
+				"\t[--dir bench_data] [--out bench.json]\n";
+			return 1;
+		}
+		boost::filesystem::create_directories(config.dir);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Invalid arguments: " << e.what() << "\n";
+		return 1;
+	}
+
+	std::vector<std::string> results;
+	for (uint64_t size : config.sizes) {
+		for (int pageSize : config.pageSizes) {
+			for (const std::string& journal : config.journals) {
+				for (const std::string& churn : config.churns) {
+					const Case c = { size, pageSize, journal, churn };
+					std::cerr << "Size " << size << " page " << pageSize << " " << journal << " " << churn << "...\n";
+					try {
+						//Seed is generated by parent, isolated runs only copy it
+						MakeSeed(config, size, pageSize, journal);
+						results.push_back(RunIsolated(config, c));
+					}
+					catch (const std::exception& e) {
+						results.push_back(ErrorResult(c, e.what()));
+					}
+					std::cerr << results.back() << "\n";
+				}
+			}
+		}
+	}
+
+	std::ofstream out(config.out);
+	out << "{\"sqliteVersion\": \"" << sqlite3_libversion() << "\", \"hash\": \""
+		<< (config.options.hashAlgorithm == sqlite3_inc_bkp::HashAlgorithm::Crc32c ? "crc32c"
+			: config.options.hashAlgorithm == sqlite3_inc_bkp::HashAlgorithm::Xxh3 ? "xxh3" : "xxh64")
+		<< "\", \"iterations\": " << config.iterations << ", \"results\": [\n";
+	for (std::size_t i = 0; i < results.size(); ++i)
+		out << "  " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+	out << "]}\n";
+	return out ? 0 : 1;
+}
@@ -3,9 +3,14 @@
 #include <iostream>
 #include <xxhash.h>
 #include <fstream>
+#include <atomic>
 #include <chrono>
+#include <future>
+#include <thread>
 #include <boost/filesystem.hpp>
 #include <Sqlite3IncrementalBackup/api.h>
+#include <Sqlite3IncrementalBackup/hasher.h>
+#include <Sqlite3IncrementalBackup/manifest.h>
 
 #define TIMER_START(timer_name) auto _##timer_name = std::chrono::high_resolution_clock::now();
 #define TIMER_GET(timer_name, measure) std::chrono::duration_cast<std::chrono::##measure>(std::chrono::high_resolution_clock::now() - _##timer_name).count()
@@ -111,31 +116,36 @@ std::string genWord() {
 	}
 }
 
-bool compareDb() {
-#ifdef IN_MEMORY_CACHE
-	return true;
-#endif 
-
-	std::ifstream fsrc(dbPath, std::ios::binary);
-	std::ifstream f1(dbPath, std::ifstream::binary | std::ifstream::ate);
-	std::ifstream f2(dbBackupPath, std::ifstream::binary | std::ifstream::ate);
-
-	if (f1.fail() || f2.fail()) {
-		std::cerr << "File problem";
-		return false; 
-	}
-
-	if (f1.tellg() != f2.tellg()) {
-		std::cerr << "Size mismatch";
-		return false; 
+//Rows of table in key order, restored table is compared with its source by content
+std::string tableContent(sqlite3* db, const char* table) {
+	std::string content;
+	sqlite3_stmt* stmt = nullptr;
+	const std::string query = std::string("SELECT * FROM ") + table + " ORDER BY 1";
+	if (SQLITE_OK != sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, NULL))
+		return content;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		for (int i = 0; i < sqlite3_column_count(stmt); ++i) {
+			const unsigned char* value = sqlite3_column_text(stmt, i);
+			content += value ? reinterpret_cast<const char*>(value) : "NULL";
+			content += '\x1f';
+		}
+		content += '\n';
 	}
+	sqlite3_finalize(stmt);
+	return content;
+}
 
-	//seek back to beginning and use std::equal to compare contents
-	f1.seekg(0, std::ifstream::beg);
-	f2.seekg(0, std::ifstream::beg);
-	return std::equal(std::istreambuf_iterator<char>(f1.rdbuf()),
-		std::istreambuf_iterator<char>(),
-		std::istreambuf_iterator<char>(f2.rdbuf()));
+//Latest backup restored into a fresh in-memory database holds the rows of db
+bool compareDb(sqlite3* db) {
+	sqlite3* restored = nullptr;
+	sqlite3_open_v2(":memory:", &restored, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	char* msg = nullptr;
+	bool equal = 0 == sqlite3_inc_bkp::read_backup(restored, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); });
+	equal = equal && tableContent(restored, "test") == tableContent(db, "test");
+	sqlite3_close_v2(restored);
+	if (!equal)
+		std::cerr << "Content mismatch";
+	return equal;
 }
 
 bool backup(sqlite3 *db) {
@@ -146,7 +156,13 @@ bool backup(sqlite3 *db) {
 	return status;
 }
 
+bool backup(sqlite3* db, const sqlite3_inc_bkp::BackupOptions& options) {
+	char* msg = nullptr;
+	return 0 == sqlite3_inc_bkp::backup(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options);
+}
+
 void clear() {
+	sqlite3_inc_bkp::clear_backup(".\\", "test", nullptr);
 	std::remove(".\\.test.manifest");
 	std::remove(dbPath);
 	std::remove(dbBackupPath);
@@ -175,7 +191,7 @@ TEST(InitBackup, BackupTest) {
 	auto timeNative = TIMER_GET(nativeTimer, milliseconds);
 	std::cout << "Backup time [" << time << "]ms" << " VS Native backup time["<< timeNative <<"]ms"<<std::endl;
 
-	EXPECT_TRUE(compareDb());
+	EXPECT_TRUE(compareDb(db));
 }
 
 
@@ -190,7 +206,7 @@ TEST(UpdateAndBackup, BackupTest) {
 	backupNative(db);
 	auto timeNative = TIMER_GET(nativeTimer, milliseconds);
 	std::cout << "Backup time [" << time << "]ms" << " VS Native backup time[" << timeNative << "]ms" << std::endl;
-	EXPECT_TRUE(compareDb());	
+	EXPECT_TRUE(compareDb(db));	
 }
 
 TEST(WriteMoreAndBackup, BackupTest) {
@@ -204,7 +220,7 @@ TEST(WriteMoreAndBackup, BackupTest) {
 	backupNative(db);
 	auto timeNative = TIMER_GET(nativeTimer, milliseconds);
 	std::cout << "Backup time [" << time << "]ms" << " VS Native backup time[" << timeNative << "]ms" << std::endl;
-	EXPECT_TRUE(compareDb());
+	EXPECT_TRUE(compareDb(db));
 }
 
 TEST(UpdatePartAndBackup, BackupTest) {
@@ -218,7 +234,1149 @@ TEST(UpdatePartAndBackup, BackupTest) {
 	backupNative(db);
 	auto timeNative = TIMER_GET(nativeTimer, milliseconds);
 	std::cout << "Backup time [" << time << "]ms" << " VS Native backup time[" << timeNative << "]ms" << std::endl;
-	EXPECT_TRUE(compareDb());
+	EXPECT_TRUE(compareDb(db));
+}
+
+TEST(ParallelUpdateAndBackup, BackupTest) {
+	sqlite3* db = openDb();
+	updateDb(db, 0, 100 * loadParameter, genWord);
+	sqlite3_inc_bkp::BackupOptions options;
+	options.threads = 4;
+	options.batchPages = 64;
+	std::cout << "Backup started...\n";
+	TIMER_START(backupTimer);
+	EXPECT_TRUE(backup(db, options));
+	auto time = TIMER_GET(backupTimer, milliseconds);
+	std::cout << "Backup time with " << options.threads << " threads [" << time << "]ms" << std::endl;
+	EXPECT_TRUE(compareDb(db));
+}
+
+TEST(StreamWriterUpdateAndBackup, BackupTest) {
+	sqlite3* db = openDb();
+	updateDb(db, 0, 100 * loadParameter, genWord);
+	sqlite3_inc_bkp::BackupOptions options;
+	options.writeBackend = sqlite3_inc_bkp::WriteBackend::Stream;
+	std::cout << "Backup started...\n";
+	TIMER_START(backupTimer);
+	EXPECT_TRUE(backup(db, options));
+	auto time = TIMER_GET(backupTimer, milliseconds);
+	std::cout << "Backup time with stream writer [" << time << "]ms" << std::endl;
+	EXPECT_TRUE(compareDb(db));
+}
+
+TEST(BuiltinHashBackup, BackupTest) {
+	sqlite3* db = openDb();
+	updateDb(db, 0, 100 * loadParameter, genWord);
+	sqlite3_inc_bkp::BackupOptions options;
+	options.hashAlgorithm = sqlite3_inc_bkp::HashAlgorithm::Crc32c;
+	char* msg = nullptr;
+	std::cout << "Backup started...\n";
+	TIMER_START(backupTimer);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "test", &msg, nullptr, options));
+	auto time = TIMER_GET(backupTimer, milliseconds);
+	std::cout << "Backup time with built-in CRC32C [" << time << "]ms" << std::endl;
+
+	//Built-in algorithm is recorded in manifest, restore needs no callback
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, nullptr, 0, options));
+	sqlite3_close_v2(dst);
+	EXPECT_TRUE(compareDb(db));
+}
+
+TEST(Xxh64Hasher, BackupTest) {
+	//Reference XXH64 values of seed 0
+	const std::pair<const char*, uint64_t> vectors[] = {
+		{ "", 0xEF46DB3751D8E999ull },
+		{ "a", 0xD24EC4F1A98C6E5Bull },
+		{ "abc", 0x44BC2CF5AD770999ull },
+		{ "message digest", 0x066ED728FCEEB3BEull },
+		{ "abcdefghijklmnopqrstuvwxyz", 0xCFE1F278FA89835Cull },
+		{ "Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ull },
+	};
+	sqlite3_inc_bkp::Xxh64Hasher hasher;
+	for (const auto& v : vectors) {
+		EXPECT_EQ(v.second, hasher(v.first, strlen(v.first))) << "\"" << v.first << "\"";
+	}
+
+	//Pages of all tail lengths, batch of policy hashes each page as xxHash library does
+	const std::size_t pageSize = 4096 + 31, count = 8;
+	std::vector<char> pages(pageSize * count);
+	for (std::size_t i = 0; i < pages.size(); ++i) {
+		pages[i] = static_cast<char>(i * 131 + i / 7);
+	}
+	for (std::size_t size = 0; size <= 64; ++size) {
+		EXPECT_EQ(XXH64(pages.data(), size, 0), hasher(pages.data(), size)) << size;
+	}
+	auto batch = sqlite3_inc_bkp::PageHasher::Create<sqlite3_inc_bkp::Xxh64Hasher>();
+	EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Xxh64, batch.algorithm);
+	std::vector<sqlite3_inc_bkp::hash_t> hashes(count);
+	batch.batch(pages.data(), pageSize, count, hashes.data());
+	for (std::size_t i = 0; i < count; ++i) {
+		EXPECT_EQ(XXH64(pages.data() + i * pageSize, pageSize, 0), hashes[i]) << i;
+	}
+}
+
+TEST(Xxh3Hasher, BackupTest) {
+	//Reference XXH3 64-bit values of seed 0 and default secret
+	const std::pair<const char*, uint64_t> vectors[] = {
+		{ "", 0x2D06800538D394C2ull },
+		{ "a", 0xE6C632B61E964E1Full },
+		{ "abc", 0x78AF5F94892F3950ull },
+		{ "message digest", 0x160D8E9329BE94F9ull },
+		{ "abcdefghijklmnopqrstuvwxyz", 0x810F9CA067FBB90Cull },
+		{ "Nobody inspects the spammish repetition", 0x6CB00603B5CC47E9ull },
+	};
+	sqlite3_inc_bkp::Xxh3Hasher hasher;
+	for (const auto& v : vectors) {
+		EXPECT_EQ(v.second, hasher(v.first, strlen(v.first))) << "\"" << v.first << "\"";
+	}
+
+	//Every length class up to several blocks of accumulators, kernel picked by CPU gives the same values
+	std::vector<char> data(3 * 4096 + 64);
+	for (std::size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<char>(i * 131 + i / 7);
+	}
+	auto selected = sqlite3_inc_bkp::PageHasher::Select(sqlite3_inc_bkp::HashAlgorithm::Xxh3, nullptr);
+	EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Xxh3, selected.algorithm);
+	for (std::size_t size = 0; size <= 3 * 1024 + 64; ++size) {
+		const uint64_t expected = XXH3_64bits(data.data() + 1, size);
+		EXPECT_EQ(expected, hasher(data.data() + 1, size)) << size;
+		EXPECT_EQ(expected, selected.single(data.data() + 1, size)) << size;
+	}
+	for (std::size_t pageSize : { 512, 1024, 4096 }) {
+		const std::size_t count = data.size() / pageSize;
+		std::vector<sqlite3_inc_bkp::hash_t> hashes(count);
+		selected.batch(data.data(), pageSize, count, hashes.data());
+		for (std::size_t i = 0; i < count; ++i) {
+			EXPECT_EQ(XXH3_64bits(data.data() + i * pageSize, pageSize), hashes[i]) << pageSize << " " << i;
+		}
+	}
+}
+
+TEST(SteppedBackup, BackupTest) {
+	sqlite3* db = openDb();
+	updateDb(db, 0, 100 * loadParameter, genWord);
+	sqlite3_inc_bkp::BackupOptions options;
+	char* msg = nullptr;
+	std::cout << "Backup started...\n";
+	TIMER_START(backupTimer);
+	sqlite3_inc_bkp::backup_handle* handle = sqlite3_inc_bkp::backup_init(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options);
+	ASSERT_NE(nullptr, handle);
+	bool done = false;
+	int steps = 0;
+	while (!done) {
+		ASSERT_EQ(0, sqlite3_inc_bkp::backup_step(handle, 1000, 10, &done, &msg));
+		//Writer between steps, its pages are reread by the last step
+		if (++steps == 1)
+			updateDb(db, 0, loadParameter, genWord);
+	}
+	sqlite3_inc_bkp::backup_finish(handle);
+	auto time = TIMER_GET(backupTimer, milliseconds);
+	std::cout << "Stepped backup time [" << time << "]ms in " << steps << " steps" << std::endl;
+	EXPECT_TRUE(compareDb(db));
+}
+
+TEST(StaleSteppedBackup, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	std::remove(".\\stale.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "stale", &msg);
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\stale.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	sqlite3_exec(db, "CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+
+	//Rollback journal commit between steps makes every pass stale, stepping ends busy instead of reading all pages in one transaction
+	sqlite3_inc_bkp::backup_handle* handle = sqlite3_inc_bkp::backup_init(db, ".\\", "stale", &msg, hash, sqlite3_inc_bkp::BackupOptions());
+	ASSERT_NE(nullptr, handle);
+	bool done = false;
+	int rc = 0;
+	for (int steps = 0; rc == 0 && !done && steps < 10000; ++steps) {
+		rc = sqlite3_inc_bkp::backup_step(handle, 10, 0, &done, &msg);
+		sqlite3_exec(db, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 1", nullptr, nullptr, nullptr);
+	}
+	EXPECT_EQ(9, rc);
+	EXPECT_FALSE(done);
+	sqlite3_inc_bkp::backup_finish(handle);
+
+	//Quiet database is copied by the first pass
+	handle = sqlite3_inc_bkp::backup_init(db, ".\\", "stale", &msg, hash, sqlite3_inc_bkp::BackupOptions());
+	ASSERT_NE(nullptr, handle);
+	done = false;
+	for (int steps = 0; !done && steps < 10000; ++steps)
+		ASSERT_EQ(0, sqlite3_inc_bkp::backup_step(handle, 10, 0, &done, &msg));
+	EXPECT_TRUE(done);
+	sqlite3_inc_bkp::backup_finish(handle);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "stale", &msg, hash));
+	EXPECT_EQ(tableContent(db, "test"), tableContent(dst, "test"));
+	sqlite3_close_v2(dst);
+	sqlite3_close_v2(db);
+	sqlite3_inc_bkp::clear_backup(".\\", "stale", &msg);
+	std::remove(".\\stale.sqlite");
+}
+
+TEST(AsyncBackup, BackupTest) {
+	sqlite3* db = openDb();
+	updateDb(db, 0, 100 * loadParameter, genWord);
+	char* msg = nullptr;
+	int progressCalls = 0;
+	sqlite3_inc_bkp::BackupProgress last;
+	sqlite3_inc_bkp::backup_task* task = sqlite3_inc_bkp::backup_async(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(),
+		[&progressCalls, &last](const sqlite3_inc_bkp::BackupProgress& progress) { ++progressCalls; last = progress; }, 10);
+	ASSERT_NE(nullptr, task);
+	bool done = false;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_wait(task, -1, &done, &msg));
+	EXPECT_TRUE(done);
+	EXPECT_TRUE(progressCalls > 0 && last.done);
+	std::cout << "Async backup scanned " << last.pagesScanned << " pages, " << last.pagesDirty << " dirty" << std::endl;
+	sqlite3_inc_bkp::backup_release(task);
+	EXPECT_TRUE(compareDb(db));
+}
+
+TEST(AsyncBackupCancel, BackupTest) {
+	sqlite3* db = openDb();
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	uint64_t oldest = 0, latest = 0;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_generations(".\\", "test", &oldest, &latest, &msg));
+	const std::string content = tableContent(db, "test");
+
+	//Backup thread is held in its first traced phase until cancel is requested, so it is noticed before the first step
+	updateDb(db, 0, loadParameter, genWord);
+	std::promise<void> cancelRequested;
+	std::shared_future<void> cancelSeen = cancelRequested.get_future().share();
+	std::atomic<bool> held{ false };
+	sqlite3_inc_bkp::BackupOptions options;
+	options.trace = [cancelSeen, &held](sqlite3_inc_bkp::BackupPhase, bool begin) {
+		if (begin && !held.exchange(true))
+			cancelSeen.wait();
+	};
+	int progressCalls = 0;
+	sqlite3_inc_bkp::backup_task* task = sqlite3_inc_bkp::backup_async(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options,
+		[&progressCalls](const sqlite3_inc_bkp::BackupProgress&) { ++progressCalls; }, 10);
+	ASSERT_NE(nullptr, task);
+	sqlite3_inc_bkp::backup_cancel(task);
+	cancelRequested.set_value();
+	bool done = false;
+	EXPECT_EQ(7, sqlite3_inc_bkp::backup_wait(task, -1, &done, &msg));
+	EXPECT_TRUE(done);
+	EXPECT_EQ(0, progressCalls);
+	sqlite3_inc_bkp::backup_release(task);
+
+	//Previous generation stays the latest one and restores the content it was taken of
+	uint64_t cancelledOldest = 0, cancelledLatest = 0;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_generations(".\\", "test", &cancelledOldest, &cancelledLatest, &msg));
+	EXPECT_EQ(latest, cancelledLatest);
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	EXPECT_EQ(content, tableContent(dst, "test"));
+	sqlite3_close_v2(dst);
+}
+
+TEST(BackupStats, BackupTest) {
+	sqlite3* db = openDb();
+	updateDb(db, 0, 10 * loadParameter, genWord);
+	sqlite3_inc_bkp::BackupOptions options;
+	std::atomic<int> traceBegins(0), traceEnds(0);
+	options.trace = [&traceBegins, &traceEnds](sqlite3_inc_bkp::BackupPhase, bool begin) { ++(begin ? traceBegins : traceEnds); };
+	sqlite3_inc_bkp::BackupStats stats;
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0 && stats.pagesDirty <= stats.pagesScanned);
+	EXPECT_EQ(stats.batches, stats.batchHash.count);
+	EXPECT_EQ(1u, stats.phase(sqlite3_inc_bkp::BackupPhase::ManifestStore).calls);
+	EXPECT_EQ(traceBegins.load(), traceEnds.load());
+	std::cout << "Backup [" << stats.durationUs << "]us: read [" << stats.phase(sqlite3_inc_bkp::BackupPhase::Read).wallUs
+		<< "]us, hash [" << stats.phase(sqlite3_inc_bkp::BackupPhase::Hash).cpuUs << "]us cpu, write [" << stats.phase(sqlite3_inc_bkp::BackupPhase::Write).wallUs << "]us" << std::endl;
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, 0, options, &stats));
+	sqlite3_close_v2(dst);
+	EXPECT_TRUE(stats.pagesRestored > 0);
+	EXPECT_EQ(1u, stats.phase(sqlite3_inc_bkp::BackupPhase::Restore).calls);
+}
+
+TEST(FreePagesBackup, BackupTest) {
+	//Pages of dropped table stay in free list, they are neither read nor written
+	sqlite3* db = openDb();
+	sqlite3_exec(db, "CREATE TABLE freed AS SELECT col1, col2 || col2 || col2 AS col2 FROM test", nullptr, nullptr, nullptr);
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	sqlite3_exec(db, "DROP TABLE freed", nullptr, nullptr, nullptr);
+
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesFree > 0);
+	EXPECT_TRUE(stats.pagesDirty < stats.pagesFree);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	std::string integrity;
+	sqlite3_exec(dst, "PRAGMA integrity_check", [](void* result, int, char** values, char**) {
+		*static_cast<std::string*>(result) = values[0];
+		return 0;
+	}, &integrity, nullptr);
+	EXPECT_EQ("ok", integrity);
+	sqlite3_close_v2(dst);
+}
+
+//Polls status until the backup ran runs times, false after 30s
+bool waitRuns(sqlite3_inc_bkp::backup_scheduler* scheduler, uint64_t id, uint64_t runs, sqlite3_inc_bkp::ScheduleStatus& status) {
+	char* msg = nullptr;
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (std::chrono::steady_clock::now() < deadline) {
+		if (sqlite3_inc_bkp::backup_scheduler_status(scheduler, id, &status, &msg) == 0 && status.runs >= runs)
+			return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+TEST(SchedulerBackup, BackupTest) {
+	sqlite3* db = openDb();
+	sqlite3_inc_bkp::SchedulerOptions schedulerOptions;
+	schedulerOptions.threads = 2;
+	schedulerOptions.maxConcurrentIo = 1;
+	char* msg = nullptr;
+	sqlite3_inc_bkp::backup_scheduler* scheduler = sqlite3_inc_bkp::backup_scheduler_create(schedulerOptions, &msg);
+	ASSERT_TRUE(scheduler != nullptr);
+
+	//With one I/O slot no two I/O phases of both backups overlap, hashing does not hold the slot
+	std::atomic<int> ioPhases{ 0 };
+	std::atomic<int> maxIoPhases{ 0 };
+	sqlite3_inc_bkp::BackupOptions options;
+	options.trace = [&ioPhases, &maxIoPhases](sqlite3_inc_bkp::BackupPhase phase, bool begin) {
+		if (phase == sqlite3_inc_bkp::BackupPhase::Hash)
+			return;
+		if (!begin) {
+			--ioPhases;
+			return;
+		}
+		const int current = ++ioPhases;
+		int observed = maxIoPhases;
+		while (current > observed && !maxIoPhases.compare_exchange_weak(observed, current)) {}
+	};
+	uint64_t ids[2] = {};
+	const char* names[2] = { "scheduled1", "scheduled2" };
+	for (int i = 0; i < 2; ++i)
+		EXPECT_EQ(0, sqlite3_inc_bkp::backup_scheduler_add(scheduler, db, ".\\", names[i], &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, 0, i, &ids[i]));
+	EXPECT_EQ(8, sqlite3_inc_bkp::backup_scheduler_add(scheduler, db, ".\\", names[0], &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), 0, 0, nullptr));
+
+	//First backup is due at once, without interval the next one runs only when triggered
+	sqlite3_inc_bkp::ScheduleStatus status;
+	for (int i = 0; i < 2; ++i) {
+		ASSERT_TRUE(waitRuns(scheduler, ids[i], 1, status));
+		EXPECT_EQ(0, status.lastResult);
+		EXPECT_EQ(-1, status.nextDueMs);
+		EXPECT_TRUE(status.lastStats.pagesDirty > 0);
+	}
+	EXPECT_EQ(1, maxIoPhases.load());
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_scheduler_trigger(scheduler, ids[0], &msg));
+	ASSERT_TRUE(waitRuns(scheduler, ids[0], 2, status));
+	EXPECT_EQ(0, status.lastStats.pagesDirty);
+
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_scheduler_remove(scheduler, ids[1], &msg));
+	EXPECT_EQ(8, sqlite3_inc_bkp::backup_scheduler_status(scheduler, ids[1], &status, &msg));
+	sqlite3_inc_bkp::backup_scheduler_release(scheduler);
+	for (int i = 0; i < 2; ++i)
+		sqlite3_inc_bkp::clear_backup(".\\", names[i], &msg);
+}
+
+TEST(ThrottledBackup, BackupTest) {
+	sqlite3* db = openDb();
+	sqlite3_inc_bkp::BackupOptions options;
+	options.cacheMode = sqlite3_inc_bkp::CacheMode::Direct;
+	sqlite3_inc_bkp::BackupStats stats;
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "throttled", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, &stats));
+	EXPECT_EQ(0, stats.throttledReadBytes);
+	EXPECT_EQ(0, stats.throttledWriteBytes);
+
+	//Every page is read again and charged to read limit, at half of database size per second reader runs into debt beyond the burst
+	options.cacheMode = sqlite3_inc_bkp::CacheMode::DropBehind;
+	options.readBytesPerSec = stats.bytesRead / 2;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "throttled", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, &stats));
+	EXPECT_EQ(stats.bytesRead, stats.throttledReadBytes);
+	EXPECT_EQ(0, stats.throttledWriteBytes);
+	EXPECT_TRUE(stats.throttleWaitUs > 0);
+	std::cout << "Throttled backup [" << stats.durationUs << "]us" << std::endl;
+
+	//Full backup charges every written page to write limit
+	sqlite3_inc_bkp::clear_backup(".\\", "throttled", &msg);
+	options.readBytesPerSec = 0;
+	options.writeBytesPerSec = stats.bytesRead * 4;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "throttled", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, &stats));
+	EXPECT_TRUE(stats.bytesWritten > 0);
+	EXPECT_EQ(stats.bytesWritten, stats.throttledWriteBytes);
+	EXPECT_EQ(0, stats.throttledReadBytes);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "throttled", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	sqlite3_close_v2(dst);
+	sqlite3_inc_bkp::clear_backup(".\\", "throttled", &msg);
+}
+
+TEST(PageStoreBackup, BackupTest) {
+	auto storeBytes = [] {
+		uint64_t bytes = 0;
+		for (boost::filesystem::directory_iterator it(".\\pagestore"), end; it != end; ++it) {
+			if (it->path().extension() == ".chunk")
+				bytes += boost::filesystem::file_size(it->path());
+		}
+		return bytes;
+	};
+	sqlite3* db = openDb();
+	sqlite3_inc_bkp::BackupOptions options;
+	options.pageStore = ".\\pagestore";
+	sqlite3_inc_bkp::BackupStats stats;
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "stored1", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, &stats));
+	const uint64_t firstBytes = storeBytes();
+	EXPECT_TRUE(firstBytes > 0 && firstBytes <= stats.bytesWritten);
+
+	//Second backup of the same pages adds nothing to the store
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "stored2", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options, &stats));
+	EXPECT_EQ(firstBytes, storeBytes());
+
+	sqlite3_inc_bkp::clear_backup(".\\", "stored1", &msg);
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "stored2", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	std::string integrity;
+	sqlite3_exec(dst, "PRAGMA integrity_check", [](void* result, int, char** values, char**) {
+		*static_cast<std::string*>(result) = values[0];
+		return 0;
+	}, &integrity, nullptr);
+	EXPECT_EQ("ok", integrity);
+	sqlite3_close_v2(dst);
+
+	//Pages of the last backup leaving the store are collected
+	sqlite3_inc_bkp::clear_backup(".\\", "stored2", &msg);
+	EXPECT_EQ(0, storeBytes());
+}
+
+TEST(DiffBackups, BackupTest) {
+	sqlite3* db = openDb();
+	sqlite3_inc_bkp::BackupStats stats;
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "diff1", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "diff2", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	std::vector<sqlite3_inc_bkp::PageRange> ranges;
+	EXPECT_EQ(0, sqlite3_inc_bkp::diff_backups(".\\", "diff1", "diff2", &ranges, &msg));
+	EXPECT_TRUE(ranges.empty());
+
+	//Only subtrees over changed pages differ
+	updateDb(db, 200 * loadParameter, loadParameter, genWord);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "diff1", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	EXPECT_EQ(0, sqlite3_inc_bkp::diff_backups(".\\", "diff1", "diff2", &ranges, &msg));
+	uint64_t differing = 0;
+	for (const auto& range : ranges)
+		differing += range.count;
+	EXPECT_TRUE(differing > 0 && differing < stats.pagesScanned);
+
+	EXPECT_EQ(5, sqlite3_inc_bkp::diff_backups(".\\", "diff1", "missing", &ranges, &msg));
+	sqlite3_inc_bkp::clear_backup(".\\", "diff1", &msg);
+	sqlite3_inc_bkp::clear_backup(".\\", "diff2", &msg);
+}
+
+TEST(VerifyBackup, BackupTest) {
+	sqlite3* db = openDb();
+	char* msg = nullptr;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "verified", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	sqlite3_inc_bkp::VerifyResult result;
+	EXPECT_EQ(0, sqlite3_inc_bkp::verify_backup(".\\", "verified", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), 0, &result));
+	EXPECT_TRUE(result.pagesChecked > 0 && result.mismatched.empty());
+	const uint64_t pageCount = result.pagesChecked + result.pagesSkipped;
+
+	//Scrub runs of a third of backup cover it in three runs and wrap around
+	uint64_t scrubbed = 0;
+	for (int run = 0; run < 3; ++run) {
+		EXPECT_EQ(0, sqlite3_inc_bkp::verify_backup(".\\", "verified", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), pageCount / 3 + 1, &result));
+		scrubbed += result.pagesChecked + result.pagesSkipped;
+	}
+	EXPECT_EQ(pageCount, scrubbed);
+	EXPECT_EQ(1, result.nextPage);
+
+	//Damaged page 1 of image is reported without restoring backup
+	{
+		std::fstream file(".\\verified_backup.sqlite", std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(200);
+		file.write("it is wednesday my dudes", 24);
+	}
+	EXPECT_EQ(5, sqlite3_inc_bkp::verify_backup(".\\", "verified", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), 0, &result));
+	ASSERT_EQ(1, result.mismatched.size());
+	EXPECT_EQ(1, result.mismatched[0].first);
+	sqlite3_inc_bkp::clear_backup(".\\", "verified", &msg);
+}
+
+TEST(StreamBackup, BackupTest) {
+	sqlite3* db = openDb();
+	char* msg = nullptr;
+	std::remove(".\\streamed.sqlite");
+	std::remove(".\\streamed.sqlite.manifest");
+	auto stream = [&](const char* path) {
+		FILE* file = std::fopen(path, "wb");
+		sqlite3_inc_bkp::BackupOptions options;
+		options.outputFd = _fileno(file);
+		const int rc = sqlite3_inc_bkp::backup(db, ".\\", "streamed", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, options);
+		std::fclose(file);
+		return rc;
+	};
+	auto apply = [&](const char* path) {
+		FILE* file = std::fopen(path, "rb");
+		const int rc = sqlite3_inc_bkp::apply_backup_stream(_fileno(file), ".\\streamed.sqlite", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); });
+		std::fclose(file);
+		return rc;
+	};
+	EXPECT_EQ(0, stream(".\\stream1.bin"));
+	EXPECT_FALSE(boost::filesystem::exists(".\\streamed_backup.sqlite"));
+	EXPECT_EQ(0, apply(".\\stream1.bin"));
+
+	//Delta stream holds only changed pages and applies only on top of the stream before it
+	updateDb(db, 100 * loadParameter, loadParameter, genWord);
+	EXPECT_EQ(0, stream(".\\stream2.bin"));
+	EXPECT_TRUE(boost::filesystem::file_size(".\\stream2.bin") < boost::filesystem::file_size(".\\stream1.bin"));
+	EXPECT_EQ(0, apply(".\\stream2.bin"));
+	EXPECT_EQ(5, apply(".\\stream2.bin"));
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(".\\streamed.sqlite", &dst, SQLITE_OPEN_READONLY, nullptr);
+	std::string integrity;
+	sqlite3_exec(dst, "PRAGMA integrity_check", [](void* result, int, char** values, char**) {
+		*static_cast<std::string*>(result) = values[0];
+		return 0;
+	}, &integrity, nullptr);
+	EXPECT_EQ("ok", integrity);
+	sqlite3_close_v2(dst);
+	sqlite3_close_v2(db);
+	sqlite3_inc_bkp::clear_backup(".\\", "streamed", &msg);
+	std::remove(".\\stream1.bin");
+	std::remove(".\\stream2.bin");
+}
+
+TEST(SchemasBackup, BackupTest) {
+	sqlite3* db = openDb();
+	char* msg = nullptr;
+	std::remove(".\\attached.sqlite");
+	std::remove(".\\escaped.sqlite");
+	sqlite3_exec(db, "ATTACH '.\\attached.sqlite' AS aux", nullptr, nullptr, nullptr);
+	sqlite3_exec(db, "CREATE TABLE aux.test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) INSERT INTO aux.test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	//Alias reaching out of backup directory is escaped
+	sqlite3_exec(db, "ATTACH '.\\escaped.sqlite' AS \"..\\esc\";"
+		"CREATE TABLE \"..\\esc\".test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 500) INSERT INTO \"..\\esc\".test SELECT i, 'it is thursday my dudes' FROM n", nullptr, nullptr, nullptr);
+	const std::string mainContent = tableContent(db, "main.test");
+	const std::string auxContent = tableContent(db, "aux.test");
+	const std::string escContent = tableContent(db, "\"..\\esc\".test");
+	EXPECT_FALSE(auxContent.empty());
+	EXPECT_FALSE(escContent.empty());
+	std::vector<std::string> schemas;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_schemas(db, ".\\", "schemas", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &schemas));
+	EXPECT_EQ((std::vector<std::string>{ "main", "aux", "..\\esc" }), schemas);
+	EXPECT_TRUE(boost::filesystem::exists(".\\schemas.aux_backup.sqlite"));
+	EXPECT_TRUE(boost::filesystem::exists(".\\schemas.-2e2e5c657363_backup.sqlite"));
+	EXPECT_FALSE(boost::filesystem::exists(".\\schemas...\\esc_backup.sqlite"));
+	sqlite3_exec(db, "DETACH aux; DETACH \"..\\esc\"", nullptr, nullptr, nullptr);
+
+	//Restore needs databases attached under the names they were backed up with
+	std::remove(".\\schemas_main.sqlite");
+	std::remove(".\\schemas_aux.sqlite");
+	std::remove(".\\schemas_esc.sqlite");
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(".\\schemas_main.sqlite", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_schemas(dst, ".\\", "schemas", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &schemas));
+	EXPECT_EQ(1, schemas.size());
+	sqlite3_exec(dst, "ATTACH '.\\schemas_aux.sqlite' AS aux; ATTACH '.\\schemas_esc.sqlite' AS \"..\\esc\"", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_schemas(dst, ".\\", "schemas", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &schemas));
+	EXPECT_EQ(3, schemas.size());
+	EXPECT_EQ(mainContent, tableContent(dst, "main.test"));
+	EXPECT_EQ(auxContent, tableContent(dst, "aux.test"));
+	EXPECT_EQ(escContent, tableContent(dst, "\"..\\esc\".test"));
+	sqlite3_close_v2(dst);
+	sqlite3_close_v2(db);
+
+	sqlite3_inc_bkp::clear_backup(".\\", "schemas.main", &msg);
+	sqlite3_inc_bkp::clear_backup(".\\", "schemas.aux", &msg);
+	sqlite3_inc_bkp::clear_backup(".\\", "schemas.-2e2e5c657363", &msg);
+	std::remove(".\\attached.sqlite");
+	std::remove(".\\escaped.sqlite");
+	std::remove(".\\schemas_main.sqlite");
+	std::remove(".\\schemas_aux.sqlite");
+	std::remove(".\\schemas_esc.sqlite");
+}
+
+TEST(SessionBackup, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	std::remove(".\\session.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "session", &msg);
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\session.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	sqlite3_exec(db, "CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	sqlite3_inc_bkp::backup_session* session = sqlite3_inc_bkp::open_session(db, ".\\", "session", &msg, hash, sqlite3_inc_bkp::BackupOptions());
+	ASSERT_TRUE(session != nullptr);
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::session_backup(session, &msg, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0);
+	EXPECT_EQ(0, sqlite3_inc_bkp::session_backup(session, &msg, &stats));
+	EXPECT_EQ(0, stats.pagesDirty);
+
+	//Backup made outside the session is picked up by the next session backup
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 1", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "session", &msg, hash));
+	EXPECT_EQ(0, sqlite3_inc_bkp::session_backup(session, &msg, &stats));
+	EXPECT_EQ(0, stats.pagesDirty);
+
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is wednesday my dudes' WHERE col1 = 1", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::session_backup(session, &msg, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0 && stats.pagesDirty < stats.pagesScanned);
+	sqlite3_inc_bkp::close_session(session);
+	sqlite3_close_v2(db);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "session", &msg, hash));
+	sqlite3_close_v2(dst);
+	sqlite3_inc_bkp::clear_backup(".\\", "session", &msg);
+	std::remove(".\\session.sqlite");
+}
+
+TEST(ExtentBackup, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	std::remove(".\\extent.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "extent", &msg);
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\extent.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	sqlite3_exec(db, "CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 20000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	sqlite3_inc_bkp::BackupOptions options;
+	options.extentPages = 8;
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "extent", &msg, hash, options, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0);
+
+	//Changed row rewrites the whole extents holding its pages
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 10000", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "extent", &msg, hash, options, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0 && stats.pagesDirty < stats.pagesScanned);
+	EXPECT_EQ(0, stats.pagesDirty % options.extentPages);
+	sqlite3_close_v2(db);
+
+	sqlite3_inc_bkp::VerifyResult result;
+	EXPECT_EQ(0, sqlite3_inc_bkp::verify_backup(".\\", "extent", &msg, hash, options, 0, &result));
+	EXPECT_TRUE(result.pagesChecked > 0 && result.mismatched.empty());
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "extent", &msg, hash));
+	sqlite3_close_v2(dst);
+	sqlite3_inc_bkp::clear_backup(".\\", "extent", &msg);
+	std::remove(".\\extent.sqlite");
+}
+
+TEST(BoundedManifestBackup, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	std::remove(".\\bounded.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "bounded", &msg);
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\bounded.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	//Small pages give a manifest of several window segments, smallest budget makes a segment 512 entries
+	sqlite3_exec(db, "PRAGMA page_size=512; CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 50000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	sqlite3_inc_bkp::BackupOptions options;
+	options.manifestMemory = 1;
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "bounded", &msg, hash, options, &stats));
+	EXPECT_TRUE(stats.pagesScanned > 4 * 512);
+	EXPECT_TRUE(stats.pagesDirty > 0);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "bounded", &msg, hash, options, &stats));
+	EXPECT_EQ(0, stats.pagesDirty);
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 10000", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "bounded", &msg, hash, options, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0 && stats.pagesDirty < stats.pagesScanned);
+
+	//Segments written back behind the window are rolled back when backup is abandoned
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is friday my dudes'", nullptr, nullptr, nullptr);
+	sqlite3_inc_bkp::backup_handle* handle = sqlite3_inc_bkp::backup_init(db, ".\\", "bounded", &msg, hash, options);
+	ASSERT_NE(nullptr, handle);
+	bool done = false;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_step(handle, 3 * 512, 0, &done, &msg));
+	EXPECT_FALSE(done);
+	sqlite3_inc_bkp::backup_finish(handle);
+	sqlite3_inc_bkp::VerifyResult result;
+	EXPECT_EQ(0, sqlite3_inc_bkp::verify_backup(".\\", "bounded", &msg, hash, sqlite3_inc_bkp::BackupOptions(), 0, &result));
+	EXPECT_TRUE(result.pagesChecked > 0 && result.mismatched.empty());
+
+	//Changed entries written back by the window are in manifest once backup commits
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "bounded", &msg, hash, options, &stats));
+	EXPECT_TRUE(stats.pagesDirty > 4 * 512);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "bounded", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_EQ(0, stats.pagesDirty);
+	EXPECT_EQ(0, sqlite3_inc_bkp::verify_backup(".\\", "bounded", &msg, hash, sqlite3_inc_bkp::BackupOptions(), 0, &result));
+	EXPECT_TRUE(result.mismatched.empty());
+	sqlite3_close_v2(db);
+	sqlite3_inc_bkp::clear_backup(".\\", "bounded", &msg);
+	std::remove(".\\bounded.sqlite");
+}
+
+TEST(TrackedBackup, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	auto pageCount = [](sqlite3* db) {
+		int count = 0;
+		sqlite3_exec(db, "PRAGMA page_count", [](void* result, int, char** values, char**) {
+			*static_cast<int*>(result) = atoi(values[0]);
+			return 0;
+		}, &count, nullptr);
+		return static_cast<uint64_t>(count);
+	};
+	std::remove(".\\tracked.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "tracked", &msg);
+	EXPECT_EQ(0, sqlite3_inc_bkp::register_tracking_vfs("tracking", false, &msg));
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\tracked.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "tracking");
+	EXPECT_EQ(0, sqlite3_inc_bkp::track_dirty_pages(db, ".\\", "tracked", &msg));
+	sqlite3_exec(db, "CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "tracked", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_EQ(pageCount(db), stats.pagesScanned);
+	sqlite3_close_v2(db);
+
+	//Pages written after reopen are read from bitmap persisted by the previous connection
+	sqlite3_open_v2(".\\tracked.sqlite", &db, SQLITE_OPEN_READWRITE, "tracking");
+	EXPECT_EQ(0, sqlite3_inc_bkp::track_dirty_pages(db, ".\\", "tracked", &msg));
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 5000", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "tracked", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0);
+	EXPECT_TRUE(stats.pagesScanned < pageCount(db) / 2);
+	const std::string content = tableContent(db, "test");
+	sqlite3_close_v2(db);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "tracked", &msg, hash));
+	EXPECT_EQ(content, tableContent(dst, "test"));
+	sqlite3_close_v2(dst);
+	sqlite3_inc_bkp::clear_backup(".\\", "tracked", &msg);
+	std::remove(".\\.tracked.dirty");
+	std::remove(".\\tracked.sqlite");
+
+	//Caller's read transaction began before another connection wrote, the backup reads the old page from its snapshot.
+	//The page must not be taken as consumed, the next backup reads it again
+	std::remove(".\\overlap.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "overlap", &msg);
+	sqlite3_open_v2(".\\overlap.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "tracking");
+	EXPECT_EQ(0, sqlite3_inc_bkp::track_dirty_pages(db, ".\\", "overlap", &msg));
+	sqlite3_exec(db, "PRAGMA journal_mode=WAL;"
+		"CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "overlap", &msg, hash));
+	const std::string before = tableContent(db, "test");
+
+	sqlite3* other = nullptr;
+	sqlite3_open_v2(".\\overlap.sqlite", &other, SQLITE_OPEN_READWRITE, "tracking");
+	EXPECT_EQ(SQLITE_OK, sqlite3_exec(db, "BEGIN; SELECT count(*) FROM test", nullptr, nullptr, nullptr));
+	EXPECT_EQ(SQLITE_OK, sqlite3_exec(other, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 5000", nullptr, nullptr, nullptr));
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "overlap", &msg, hash));
+	EXPECT_EQ(before, tableContent(db, "test"));
+	EXPECT_EQ(SQLITE_OK, sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr));
+
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "overlap", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_EQ(pageCount(db), stats.pagesScanned);
+	const std::string after = tableContent(other, "test");
+	EXPECT_NE(before, after);
+	sqlite3_close_v2(other);
+	sqlite3_close_v2(db);
+
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "overlap", &msg, hash));
+	EXPECT_EQ(after, tableContent(dst, "test"));
+	sqlite3_close_v2(dst);
+	sqlite3_inc_bkp::clear_backup(".\\", "overlap", &msg);
+	std::remove(".\\.overlap.dirty");
+	std::remove(".\\overlap.sqlite-wal");
+	std::remove(".\\overlap.sqlite-shm");
+	std::remove(".\\overlap.sqlite");
+}
+
+TEST(ManifestDamage, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	std::remove(".\\damaged.sqlite");
+	sqlite3_inc_bkp::clear_backup(".\\", "damaged", &msg);
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\damaged.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	sqlite3_exec(db, "CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "damaged", &msg, hash));
+
+	//Entry of page 5 follows 64 bytes of header and four entries, its tree leaf covers pages 1-64
+	std::fstream file(".\\.damaged.manifest", std::ios::in | std::ios::out | std::ios::binary);
+	uint64_t entry = 0;
+	file.seekg(64 + 4 * sizeof(entry));
+	file.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+	entry ^= 1;
+	file.seekp(64 + 4 * sizeof(entry));
+	file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+	file.close();
+	EXPECT_EQ(5, sqlite3_inc_bkp::verify_backup(".\\", "damaged", &msg, hash, sqlite3_inc_bkp::BackupOptions(), 0, nullptr));
+	EXPECT_NE(std::string::npos, std::string(msg).find("pages 1-64"));
+
+	//Backup checking its manifest copies the damaged range again
+	sqlite3_inc_bkp::BackupOptions options;
+	options.verifyManifest = true;
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "damaged", &msg, hash, options, &stats));
+	EXPECT_EQ(64, stats.pagesDirty);
+	EXPECT_EQ(0, sqlite3_inc_bkp::verify_backup(".\\", "damaged", &msg, hash, sqlite3_inc_bkp::BackupOptions(), 0, nullptr));
+	sqlite3_close_v2(db);
+
+	//V1 manifest holds no header, its root hash can not be checked without hash function
+	std::ofstream legacy(".\\.legacy.manifest", std::ios::binary);
+	const uint64_t hashes[3] = { 1, 2, 3 };
+	legacy.write(reinterpret_cast<const char*>(hashes), sizeof(hashes));
+	legacy.close();
+	std::vector<sqlite3_inc_bkp::PageRange> ranges;
+	EXPECT_EQ(3, sqlite3_inc_bkp::diff_backups(".\\", "damaged", "legacy", &ranges, &msg));
+	std::remove(".\\.legacy.manifest");
+	sqlite3_inc_bkp::clear_backup(".\\", "damaged", &msg);
+	std::remove(".\\damaged.sqlite");
+}
+
+//V2 manifest fixture: header with sum of mixed (pgno, hash) pairs as root, then capacity page hashes
+void writeV2Manifest(const char* path, const std::vector<uint64_t>& hashes, std::size_t capacity, uint64_t rootDelta) {
+	sqlite3_inc_bkp::ManifestHeader header = {};
+	header.magic = 0x4D4B4249;
+	header.version = 2;
+	header.pageSize = 4096;
+	header.hashAlgorithm = static_cast<uint32_t>(sqlite3_inc_bkp::HashAlgorithm::Xxh64);
+	header.pageCount = hashes.size();
+	header.capacity = capacity;
+	for (std::size_t i = 0; i < hashes.size(); ++i) {
+		header.rootHash += sqlite3_inc_bkp::tools::MixEntry(i + 1, hashes[i]);
+	}
+	header.rootHash += rootDelta;
+	std::vector<uint64_t> entries(hashes);
+	entries.resize(capacity, 0);
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(uint64_t));
+}
+
+//V1 manifest fixture: hash of the page hashes array followed by the array
+void writeV1Manifest(const char* path, const std::vector<uint64_t>& hashes, uint64_t rootDelta) {
+	const uint64_t root = XXH64(hashes.data(), hashes.size() * sizeof(uint64_t), 0) + rootDelta;
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(&root), sizeof(root));
+	file.write(reinterpret_cast<const char*>(hashes.data()), hashes.size() * sizeof(uint64_t));
+}
+
+uint32_t manifestVersion(const char* path) {
+	sqlite3_inc_bkp::ManifestHeader header = {};
+	std::ifstream file(path, std::ios::binary);
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	return header.version;
+}
+
+TEST(ManifestConversion, BackupTest) {
+	const char* path = ".\\.fixture.manifest";
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	std::vector<uint64_t> hashes;
+	for (uint64_t i = 1; i <= 100; ++i) {
+		hashes.push_back(i * 0x9E3779B97F4A7C15ull);
+	}
+	auto expectEntries = [&hashes](const sqlite3_inc_bkp::Manifest& manifest) {
+		ASSERT_EQ(hashes.size(), manifest.PageCount());
+		EXPECT_EQ(1, manifest.ExtentPages());
+		EXPECT_TRUE(manifest.IsCommitted());
+		EXPECT_TRUE(manifest.Verify().empty());
+		for (std::size_t pgno = 1; pgno <= hashes.size(); ++pgno) {
+			EXPECT_EQ(hashes[pgno - 1], manifest.Get(pgno)) << pgno;
+		}
+	};
+
+	//V2 keeps page size and algorithm, read only open converts in memory and leaves file as it is
+	writeV2Manifest(path, hashes, 128, 0);
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		manifest.Open(path, true, nullptr);
+		expectEntries(manifest);
+		EXPECT_EQ(4096, manifest.PageSize());
+		EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Xxh64, manifest.Algorithm());
+	}
+	EXPECT_EQ(2, manifestVersion(path));
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		manifest.Open(path, false, nullptr);
+		expectEntries(manifest);
+		EXPECT_EQ(4096, manifest.PageSize());
+		EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Xxh64, manifest.Algorithm());
+	}
+	EXPECT_EQ(3, manifestVersion(path));
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		manifest.Open(path, true, nullptr);
+		expectEntries(manifest);
+	}
+
+	//V2 with wrong root is rejected read only and starts empty otherwise
+	writeV2Manifest(path, hashes, 128, 1);
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		EXPECT_ANY_THROW(manifest.Open(path, true, nullptr));
+		manifest.Open(path, false, nullptr);
+		EXPECT_EQ(0, manifest.PageCount());
+		EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Xxh64, manifest.Algorithm());
+	}
+
+	//V1 has no page size and was hashed by callback, its root needs the hash function
+	writeV1Manifest(path, hashes, 0);
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		EXPECT_ANY_THROW(manifest.Open(path, true, nullptr));
+		manifest.Open(path, true, hash);
+		expectEntries(manifest);
+		EXPECT_EQ(0, manifest.PageSize());
+		EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Callback, manifest.Algorithm());
+	}
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		manifest.Open(path, false, hash);
+		expectEntries(manifest);
+		EXPECT_EQ(sqlite3_inc_bkp::HashAlgorithm::Callback, manifest.Algorithm());
+	}
+	EXPECT_EQ(3, manifestVersion(path));
+
+	//V1 with wrong root is rejected read only and starts empty otherwise
+	writeV1Manifest(path, hashes, 1);
+	{
+		sqlite3_inc_bkp::Manifest manifest;
+		EXPECT_ANY_THROW(manifest.Open(path, true, hash));
+		manifest.Open(path, false, hash);
+		EXPECT_EQ(0, manifest.PageCount());
+	}
+	std::remove(path);
+}
+
+TEST(WalBackup, BackupTest) {
+	char* msg = nullptr;
+	auto hash = [](const void* data, std::size_t size) { return XXH64(data, size, 0); };
+	auto restored = [&]() {
+		sqlite3* dst = nullptr;
+		sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+		EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "wal", &msg, hash));
+		const std::string content = tableContent(dst, "test");
+		sqlite3_close_v2(dst);
+		return content;
+	};
+	std::remove(".\\wal.sqlite");
+	std::remove(".\\wal.sqlite-wal");
+	sqlite3_inc_bkp::clear_backup(".\\", "wal", &msg);
+	sqlite3* db = nullptr;
+	sqlite3_open_v2(".\\wal.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0; CREATE TABLE test (col1 NUM PRIMARY KEY, col2 TEXT);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10000) INSERT INTO test SELECT i, 'it is wednesday my dudes' FROM n", nullptr, nullptr, nullptr);
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "wal", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	const uint64_t fullScan = stats.pagesScanned;
+
+	//Frames appended since the marker are the only pages read
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is thursday my dudes' WHERE col1 = 100", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "wal", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesScanned > 0 && stats.pagesScanned < fullScan);
+	EXPECT_EQ(tableContent(db, "test"), restored());
+
+	//Checkpoint and restart of WAL drop frames the marker points into, backup scans database again
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is friday my dudes' WHERE col1 = 5000; PRAGMA wal_checkpoint(TRUNCATE);"
+		"UPDATE test SET col2 = 'it is saturday my dudes' WHERE col1 = 9000", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "wal", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_EQ(fullScan, stats.pagesScanned);
+	EXPECT_EQ(tableContent(db, "test"), restored());
+
+	//Marker taken by that scan is incremental again
+	sqlite3_exec(db, "UPDATE test SET col2 = 'it is sunday my dudes' WHERE col1 = 1", nullptr, nullptr, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(db, ".\\", "wal", &msg, hash, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesScanned < fullScan);
+	EXPECT_EQ(tableContent(db, "test"), restored());
+	sqlite3_close_v2(db);
+
+	sqlite3_inc_bkp::clear_backup(".\\", "wal", &msg);
+	std::remove(".\\wal.sqlite");
+}
+
+TEST(DifferentialRestore, BackupTest) {
+	//Stale copy of database, only pages changed since it was taken are written back
+	sqlite3* dst = openDb();
+	sqlite3_inc_bkp::BackupOptions options;
+	options.differentialRestore = true;
+	char* msg = nullptr;
+	TIMER_START(restoreTimer);
+	int rc = sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, 0, options);
+	auto time = TIMER_GET(restoreTimer, milliseconds);
+	std::cout << "Differential restore time [" << time << "]ms" << std::endl;
+	EXPECT_EQ(0, rc);
+
+	std::string integrity;
+	sqlite3_exec(dst, "PRAGMA integrity_check", [](void* result, int, char** values, char**) {
+		*static_cast<std::string*>(result) = values[0];
+		return 0;
+	}, &integrity, nullptr);
+	EXPECT_EQ("ok", integrity);
+	sqlite3_close_v2(dst);
+
+	//File destinations with fewer and with more pages than backup are extended and truncated to its page count
+	auto pragma = [](sqlite3* db, const char* name) {
+		sqlite3_stmt* stmt = nullptr;
+		sqlite3_prepare_v2(db, (std::string("PRAGMA ") + name).c_str(), -1, &stmt, nullptr);
+		const sqlite3_int64 value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+		sqlite3_finalize(stmt);
+		return value;
+	};
+	sqlite3* full = nullptr;
+	sqlite3_open_v2(":memory:", &full, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(full, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	const sqlite3_int64 backupPages = pragma(full, "page_count");
+	const sqlite3_int64 pageSize = pragma(full, "page_size");
+	sqlite3_close_v2(full);
+	const sqlite3_int64 destinationRows[2] = { 1, backupPages + 100 };
+	for (sqlite3_int64 rows : destinationRows) {
+		std::remove(".\\differential.sqlite");
+		sqlite3_open_v2(".\\differential.sqlite", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+		const std::string fill = "PRAGMA page_size = " + std::to_string(pageSize) + "; CREATE TABLE test(col1 INTEGER PRIMARY KEY, col2 BLOB); WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < "
+			+ std::to_string(rows) + ") INSERT INTO test SELECT i, randomblob(" + std::to_string(pageSize) + ") FROM n";
+		EXPECT_EQ(SQLITE_OK, sqlite3_exec(dst, fill.c_str(), nullptr, nullptr, nullptr));
+		EXPECT_TRUE(rows == 1 ? pragma(dst, "page_count") < backupPages : pragma(dst, "page_count") > backupPages);
+		EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, 0, options));
+		EXPECT_EQ(backupPages, pragma(dst, "page_count"));
+		EXPECT_TRUE(compareDb(dst));
+		//Destination in sync with backup takes no page
+		sqlite3_inc_bkp::BackupStats stats;
+		EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, 0, options, &stats));
+		EXPECT_EQ(0, stats.pagesRestored);
+		sqlite3_close_v2(dst);
+		EXPECT_EQ(static_cast<uintmax_t>(backupPages * pageSize), boost::filesystem::file_size(".\\differential.sqlite"));
+	}
+	std::remove(".\\differential.sqlite");
+}
+
+TEST(ZeroCopyRestore, BackupTest) {
+	char* msg = nullptr;
+	auto integrity = [](sqlite3* db) {
+		std::string result;
+		sqlite3_exec(db, "PRAGMA integrity_check", [](void* result, int, char** values, char**) {
+			*static_cast<std::string*>(result) = values[0];
+			return 0;
+		}, &result, nullptr);
+		return result;
+	};
+
+	//Closed destination file is replaced by clone of backup image
+	std::remove(".\\cloned.sqlite");
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup_file(".\\", "test", ".\\cloned.sqlite", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, 0, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesRestored > 0);
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(".\\cloned.sqlite", &dst, SQLITE_OPEN_READWRITE, nullptr);
+	EXPECT_EQ("ok", integrity(dst));
+	sqlite3_close_v2(dst);
+	std::remove(".\\cloned.sqlite");
+
+	//In-memory destination takes backup image as its buffer and stays writable
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	EXPECT_EQ("ok", integrity(dst));
+	EXPECT_EQ(SQLITE_OK, sqlite3_exec(dst, "UPDATE test SET col2 = 'dudes' WHERE col1 = 1", nullptr, nullptr, nullptr));
+	sqlite3_close_v2(dst);
+}
+
+TEST(MemdbBackup, BackupTest) {
+	char* msg = nullptr;
+	//Private memdb database is hashed in place from its buffer
+	sqlite3* src = nullptr;
+	sqlite3_open_v2("file:memdb_source?vfs=memdb", &src, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, nullptr);
+	EXPECT_EQ(SQLITE_OK, sqlite3_exec(src, "CREATE TABLE test(col1 INTEGER PRIMARY KEY, col2 BLOB); WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO test SELECT i, randomblob(1000) FROM n", nullptr, nullptr, nullptr));
+	sqlite3_inc_bkp::clear_backup(".\\", "memdb", &msg);
+	sqlite3_inc_bkp::BackupStats stats;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(src, ".\\", "memdb", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesScanned > 0 && stats.pagesDirty == stats.pagesScanned);
+
+	//Only changed pages are written by the second backup
+	EXPECT_EQ(SQLITE_OK, sqlite3_exec(src, "UPDATE test SET col2 = randomblob(1000) WHERE col1 = 100", nullptr, nullptr, nullptr));
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup(src, ".\\", "memdb", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, sqlite3_inc_bkp::BackupOptions(), &stats));
+	EXPECT_TRUE(stats.pagesDirty > 0 && stats.pagesDirty < stats.pagesScanned);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(":memory:", &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "memdb", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }));
+	int rows = 0;
+	sqlite3_exec(dst, "SELECT count(*) FROM test", [](void* rows, int, char** values, char**) {
+		*static_cast<int*>(rows) = std::atoi(values[0]);
+		return 0;
+	}, &rows, nullptr);
+	EXPECT_EQ(200, rows);
+	sqlite3_close_v2(dst);
+	sqlite3_close_v2(src);
+	sqlite3_inc_bkp::clear_backup(".\\", "memdb", &msg);
+}
+
+TEST(GenerationsRestore, BackupTest) {
+	char* msg = nullptr;
+	uint64_t oldest = 0, latest = 0;
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_generations(".\\", "test", &oldest, &latest, &msg));
+	EXPECT_TRUE(oldest > 0 && oldest < latest);
+
+	sqlite3* dst = nullptr;
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, oldest));
+	EXPECT_EQ(3, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, latest + 1));
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, latest));
+	const std::string latestContent = tableContent(dst, "test");
+	sqlite3_close_v2(dst);
+
+	//Only the latest generation stays restorable, base image becomes latest state
+	EXPECT_EQ(0, sqlite3_inc_bkp::compact_backup(".\\", "test", 1, &msg));
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_generations(".\\", "test", &oldest, &latest, &msg));
+	EXPECT_EQ(oldest, latest);
+	sqlite3_open_v2(dbPath, &dst, g_flags, nullptr);
+	EXPECT_EQ(0, sqlite3_inc_bkp::read_backup(dst, ".\\", "test", &msg, [](const void* data, std::size_t size) { return XXH64(data, size, 0); }, latest));
+	EXPECT_EQ(latestContent, tableContent(dst, "test"));
+	sqlite3_close_v2(dst);
+
+	//Backup keeping two generations merges older segments itself
+	sqlite3* db = openDb();
+	sqlite3_inc_bkp::BackupOptions options;
+	options.retainGenerations = 2;
+	for (int i = 0; i < 3; ++i) {
+		updateDb(db, i * loadParameter, loadParameter, genWord);
+		EXPECT_TRUE(backup(db, options));
+	}
+	EXPECT_EQ(0, sqlite3_inc_bkp::backup_generations(".\\", "test", &oldest, &latest, &msg));
+	EXPECT_EQ(oldest + 1, latest);
+	EXPECT_TRUE(compareDb(db));
+
+	//Segments outgrowing the byte bound are merged whatever the generation count, the latest one is kept
+	options.retainGenerations = 100;
+	options.retainSegmentBytes = 1;
+	for (int i = 0; i < 3; ++i) {
+		updateDb(db, i * loadParameter, loadParameter, genWord);
+		EXPECT_TRUE(backup(db, options));
+		EXPECT_EQ(0, sqlite3_inc_bkp::backup_generations(".\\", "test", &oldest, &latest, &msg));
+		EXPECT_EQ(oldest + 1, latest);
+	}
+	EXPECT_TRUE(compareDb(db));
+	sqlite3_close_v2(db);
 }
 
 TEST(CorruptCheck, BackupTest) {
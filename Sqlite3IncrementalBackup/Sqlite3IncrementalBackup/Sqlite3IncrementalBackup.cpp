@@ -6,7 +6,12 @@
 #include <exception>
 #include <string.h>
 
+#include "async.h"
 #include "backup.h"
+#include "scheduler.h"
+#include "schemas.h"
+#include "sink.h"
+#include "vfs.h"
 
 namespace sqlite3_inc_bkp {
 	
@@ -14,29 +19,481 @@ namespace sqlite3_inc_bkp {
 		if (errmsg) {
 			const std::size_t msgSize = strlen(e.what());
 			*errmsg = new char[msgSize + 1];
-			strcpy_s(*errmsg, msgSize + 1, e.what());
+			memcpy(*errmsg, e.what(), msgSize + 1);
 		}
 	}
 
+	void fillStats(const std::unique_ptr<IBackup>& backup, BackupStats* stats) {
+		if (stats && backup)
+			*stats = backup->Stats();
+	}
+
 	int backup(sqlite3* db, const char* path, const char* name, char **errmsg, std::function<uint64_t(const void*, std::size_t)> f)
 	{
+		return backup(db, path, name, errmsg, f, BackupOptions());
+	}
+
+	int backup(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options)
+	{
+		return backup(db, path, name, errmsg, f, options, nullptr);
+	}
+
+	int backup(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, BackupStats* stats)
+	{
+		std::unique_ptr<IBackup> instance;
 		try {
-			IBackup::Create(IBackup::Version::V1, path, name, f)->Write(db);
+			instance = IBackup::Create(IBackup::Version::V1, path, name, f, options);
+			instance->Write(db);
+			fillStats(instance, stats);
 			return 0;
 		}
 		catch (const BackupException &e) {
+			fillStats(instance, stats);
 			handleError(e, errmsg);
 			return static_cast<int>(e.code());
 		}
 		catch (const std::exception &e) {
+			fillStats(instance, stats);
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	struct backup_handle {
+		std::unique_ptr<IBackup> backup;
+	};
+
+	backup_handle* backup_init(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options) {
+		try {
+			auto handle = std::make_unique<backup_handle>();
+			handle->backup = IBackup::Create(IBackup::Version::V1, path, name, f, options);
+			handle->backup->Begin(db);
+			return handle.release();
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return nullptr;
+		}
+	}
+
+	int backup_step(backup_handle* handle, int nPages, unsigned timeBudgetMs, bool* done, char** errmsg) {
+		try {
+			if (!handle) {
+				throw BackupException("Stepped backup handle is null", BackupException::Error::BackupInit);
+			}
+			const bool finished = handle->backup->Step(nPages, timeBudgetMs);
+			if (done)
+				*done = finished;
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	void backup_finish(backup_handle* handle) {
+		delete handle;
+	}
+
+	struct backup_session {
+		std::unique_ptr<IBackup> backup;
+		sqlite3* db = nullptr;
+	};
+
+	backup_session* open_session(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options) {
+		try {
+			auto session = std::make_unique<backup_session>();
+			session->db = db;
+			session->backup = IBackup::Create(IBackup::Version::V1, path, name, f, options);
+			session->backup->OpenSession(db);
+			return session.release();
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return nullptr;
+		}
+	}
+
+	int session_backup(backup_session* session, char** errmsg, BackupStats* stats) {
+		try {
+			if (!session) {
+				throw BackupException("Backup session is null", BackupException::Error::BackupInit);
+			}
+			session->backup->Write(session->db);
+			fillStats(session->backup, stats);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			if (session)
+				fillStats(session->backup, stats);
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			if (session)
+				fillStats(session->backup, stats);
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	void close_session(backup_session* session) {
+		delete session;
+	}
+
+	struct backup_task {
+		std::unique_ptr<AsyncBackup> backup;
+	};
+
+	backup_task* backup_async(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options,
+		std::function<void(const BackupProgress&)> progress, unsigned progressIntervalMs) {
+		try {
+			auto task = std::make_unique<backup_task>();
+			task->backup = std::make_unique<AsyncBackup>(IBackup::Create(IBackup::Version::V1, path, name, f, options), db, progress, progressIntervalMs);
+			return task.release();
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return nullptr;
+		}
+	}
+
+	int backup_wait(backup_task* task, int timeoutMs, bool* done, char** errmsg) {
+		try {
+			if (!task) {
+				throw BackupException("Backup task is null", BackupException::Error::BackupInit);
+			}
+			const bool finished = task->backup->Wait(timeoutMs);
+			if (done)
+				*done = finished;
+			if (finished && task->backup->Error())
+				std::rethrow_exception(task->backup->Error());
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	void backup_cancel(backup_task* task) {
+		if (task)
+			task->backup->Cancel();
+	}
+
+	void backup_release(backup_task* task) {
+		delete task;
+	}
+
+	struct backup_scheduler {
+		std::unique_ptr<BackupScheduler> scheduler;
+	};
+
+	backup_scheduler* backup_scheduler_create(const SchedulerOptions& options, char** errmsg) {
+		try {
+			auto scheduler = std::make_unique<backup_scheduler>();
+			scheduler->scheduler = std::make_unique<BackupScheduler>(options);
+			return scheduler.release();
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return nullptr;
+		}
+	}
+
+	int backup_scheduler_add(backup_scheduler* scheduler, sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f,
+		const BackupOptions& options, unsigned intervalMs, int priority, uint64_t* id) {
+		try {
+			if (!scheduler) {
+				throw BackupException("Backup scheduler is null", BackupException::Error::Scheduling);
+			}
+			const uint64_t added = scheduler->scheduler->Add(db, path, name, f, options, intervalMs, priority);
+			if (id)
+				*id = added;
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int backup_scheduler_remove(backup_scheduler* scheduler, uint64_t id, char** errmsg) {
+		try {
+			if (!scheduler) {
+				throw BackupException("Backup scheduler is null", BackupException::Error::Scheduling);
+			}
+			scheduler->scheduler->Remove(id);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int backup_scheduler_trigger(backup_scheduler* scheduler, uint64_t id, char** errmsg) {
+		try {
+			if (!scheduler) {
+				throw BackupException("Backup scheduler is null", BackupException::Error::Scheduling);
+			}
+			scheduler->scheduler->Trigger(id);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int backup_scheduler_status(backup_scheduler* scheduler, uint64_t id, ScheduleStatus* status, char** errmsg) {
+		try {
+			if (!scheduler) {
+				throw BackupException("Backup scheduler is null", BackupException::Error::Scheduling);
+			}
+			const ScheduleStatus current = scheduler->scheduler->Status(id);
+			if (status)
+				*status = current;
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
 			handleError(e, errmsg);
 			return -1;
 		}
 	}
 
+	void backup_scheduler_release(backup_scheduler* scheduler) {
+		delete scheduler;
+	}
+
 	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f) {
+		return read_backup(dst, path, name, errmsg, f, 0);
+	}
+
+	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation) {
+		return read_backup(dst, path, name, errmsg, f, generation, BackupOptions());
+	}
+
+	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation, const BackupOptions& options) {
+		return read_backup(dst, path, name, errmsg, f, generation, options, nullptr);
+	}
+
+	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation, const BackupOptions& options, BackupStats* stats) {
+		std::unique_ptr<IBackup> instance;
+		try {
+			instance = IBackup::Create(IBackup::Version::V1, path, name, f, options);
+			instance->Read(dst, generation);
+			fillStats(instance, stats);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			fillStats(instance, stats);
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			fillStats(instance, stats);
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int read_backup_file(const char* path, const char* name, const char* dstPath, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation, const BackupOptions& options, BackupStats* stats) {
+		std::unique_ptr<IBackup> instance;
+		try {
+			instance = IBackup::Create(IBackup::Version::V1, path, name, f, options);
+			instance->ReadFile(dstPath, generation);
+			fillStats(instance, stats);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			fillStats(instance, stats);
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			fillStats(instance, stats);
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int register_tracking_vfs(const char* vfsName, bool makeDefault, char** errmsg) {
+		try {
+			RegisterTrackingVfs(vfsName, makeDefault);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int track_dirty_pages(sqlite3* db, const char* path, const char* name, char** errmsg) {
+		try {
+			IBackup::Create(IBackup::Version::V1, path, name, nullptr)->Track(db);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int backup_generations(const char* path, const char* name, uint64_t* oldest, uint64_t* latest, char** errmsg) {
+		try {
+			uint64_t first = 0, last = 0;
+			IBackup::Create(IBackup::Version::V1, path, name, nullptr)->Generations(first, last);
+			if (oldest)
+				*oldest = first;
+			if (latest)
+				*latest = last;
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int diff_backups(const char* path, const char* name, const char* otherName, std::vector<PageRange>* ranges, char** errmsg) {
+		try {
+			std::vector<PageRange> diff = IBackup::Create(IBackup::Version::V1, path, name, nullptr)->Diff(otherName);
+			if (ranges)
+				*ranges = std::move(diff);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int verify_backup(const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, uint64_t scrubPages, VerifyResult* result) {
+		VerifyResult verified;
+		try {
+			IBackup::Create(IBackup::Version::V1, path, name, f, options)->Verify(scrubPages, verified);
+			if (result)
+				*result = std::move(verified);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			if (result)
+				*result = std::move(verified);
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			if (result)
+				*result = std::move(verified);
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int backup_schemas(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, std::vector<std::string>* schemas) {
+		std::vector<std::string> done;
+		try {
+			BackupSchemas(db, path, name, f, options, done);
+			if (schemas)
+				*schemas = done;
+			return 0;
+		}
+		catch (const BackupException& e) {
+			if (schemas)
+				*schemas = done;
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			if (schemas)
+				*schemas = done;
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int read_schemas(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, std::vector<std::string>* schemas) {
+		std::vector<std::string> done;
+		try {
+			RestoreSchemas(dst, path, name, f, options, done);
+			if (schemas)
+				*schemas = done;
+			return 0;
+		}
+		catch (const BackupException& e) {
+			if (schemas)
+				*schemas = done;
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			if (schemas)
+				*schemas = done;
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int apply_backup_stream(int fd, const char* imagePath, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f) {
+		try {
+			ApplyStream(fd, imagePath, f);
+			return 0;
+		}
+		catch (const BackupException& e) {
+			handleError(e, errmsg);
+			return static_cast<int>(e.code());
+		}
+		catch (const std::exception& e) {
+			handleError(e, errmsg);
+			return -1;
+		}
+	}
+
+	int compact_backup(const char* path, const char* name, unsigned retainGenerations, char** errmsg) {
 		try {
-			IBackup::Create(IBackup::Version::V1, path, name, f)->Read(dst);
+			IBackup::Create(IBackup::Version::V1, path, name, nullptr)->Compact(retainGenerations);
 			return 0;
 		}
 		catch (const BackupException& e) {
@@ -1,10 +1,235 @@
 ﻿#ifndef API_H
 #define API_H
 
+#include <cstdint>
 #include <functional>
+#include <string>
+#include <vector>
 
 struct sqlite3;
 namespace sqlite3_inc_bkp {	
+	/// <summary>
+	/// Backend writing dirty pages to backup image
+	/// </summary>
+	enum class WriteBackend {
+		Auto,		//IoUring if available, else Vectored, else Stream
+		Stream,		//std::ofstream, one seek per extent
+		Vectored,	//pwritev per extent (Linux)
+		IoUring		//writev requests in flight up to ioQueueDepth (Linux, built with SQLITE3_INC_BKP_IO_URING)
+	};
+
+	/// <summary>
+	/// Use of OS page cache by files written by backup
+	/// </summary>
+	enum class CacheMode {
+		Default,	//written files stay cached
+		DropBehind,	//image, segments and manifest are written back and dropped from page cache as they are written (Linux)
+		Direct		//base image is written with O_DIRECT by Auto and Vectored backends, other files drop behind (Linux)
+	};
+
+	/// <summary>
+	/// Page hash algorithm, recorded in manifest and segments of backup
+	/// </summary>
+	enum class HashAlgorithm : uint32_t {
+		Callback = 0,	//hash callback passed to API method
+		Xxh64 = 1,		//built-in XXH64, seed 0
+		Crc32c = 2,		//built-in CRC32C of both page halves, SSE4.2 multi-buffer kernel if CPU has it
+		Xxh3 = 3		//built-in XXH3 64-bit, seed 0 and default secret, AVX2 kernel if CPU has it
+	};
+
+	/// <summary>
+	/// Timed phase of backup and restore, see BackupStats and BackupOptions::trace
+	/// </summary>
+	enum class BackupPhase : uint32_t {
+		ManifestLoad,	//open and check manifest of page hashes
+		Read,			//read batch of pages from SQLite
+		Hash,			//hash batch of pages, runs on hashing threads
+		Write,			//compare batch with manifest and write dirty pages to backup image
+		Commit,			//finish segment or image and record generation
+		ManifestStore,	//commit manifest of page hashes
+		Materialize,	//build image of restored generation and check it
+		Restore,		//write pages to destination database
+		Count
+	};
+
+	/// <summary>
+	/// Tuning parameters of backup engine
+	/// </summary>
+	struct BackupOptions {
+		/// <summary>Number of page hashing threads, 0 - number of hardware threads</summary>
+		unsigned threads = 0;
+		/// <summary>Number of pages read from database and handed to a hashing thread at once</summary>
+		std::size_t batchPages = 256;
+		/// <summary>For WAL databases read only pages of frames committed since previous backup, falls back to full scan if WAL was reset</summary>
+		bool walIncremental = true;
+		/// <summary>Read only pages recorded by tracking VFS, see register_tracking_vfs and track_dirty_pages</summary>
+		bool dirtyTracking = true;
+		/// <summary>Schema of connection backed up and restored, main or name of attached database. See backup_schemas for every schema at once</summary>
+		std::string schema = "main";
+		/// <summary>Backend writing contiguous runs of dirty pages to backup image</summary>
+		WriteBackend writeBackend = WriteBackend::Auto;
+		/// <summary>Number of extent writes in flight for IoUring backend</summary>
+		unsigned ioQueueDepth = 32;
+		/// <summary>Limit of bytes per second read from database by backup and differential restore, 0 - unlimited</summary>
+		uint64_t readBytesPerSec = 0;
+		/// <summary>Limit of bytes per second written to backup image and segments, 0 - unlimited</summary>
+		uint64_t writeBytesPerSec = 0;
+		/// <summary>Keep backup files out of OS page cache so backup does not evict the working set of database</summary>
+		CacheMode cacheMode = CacheMode::Default;
+		/// <summary>Directory of page store shared by backups, every distinct page is kept once across databases and generations, empty - backup keeps
+		/// its own image. Backup stays in its store when opened later without this option, naming another store starts the backup over in it</summary>
+		std::string pageStore;
+		/// <summary>Write pages changed since the previous stream and the manifest as a sequential stream to this descriptor (file, pipe or socket)
+		/// instead of backup image, see apply_backup_stream. Only the manifest is kept in backup directory, -1 - write backup image</summary>
+		int outputFd = -1;
+		/// <summary>Restore hashes destination pages and writes only pages differing from backup, destination is grown or truncated to backup page count</summary>
+		bool differentialRestore = false;
+		/// <summary>Page hash, hash callback may be empty for built-in algorithms. Changing it makes the next backup copy every page</summary>
+		HashAlgorithm hashAlgorithm = HashAlgorithm::Callback;
+		/// <summary>Pages covered by one manifest hash, 1 - every page is hashed. Extent of N pages makes manifest N times smaller, a changed page
+		/// rewrites its whole extent and free pages are copied with it. Changing it makes the next backup copy every page. Page store and stream
+		/// backups need 1</summary>
+		std::size_t extentPages = 1;
+		/// <summary>Bytes of manifest page hashes kept mapped while database is scanned, 0 - whole manifest stays mapped. Hashes behind the scan
+		/// are written back if changed and released, hashes ahead of it are read ahead, so memory of backup does not grow with database (Linux)</summary>
+		std::size_t manifestMemory = 0;
+		/// <summary>Check manifest against its hash tree before backup, pages of damaged entries are copied again. Restore, diff_backups and
+		/// verify_backup always check it</summary>
+		bool verifyManifest = false;
+		/// <summary>Latest generations kept restorable, older delta segments are merged into base image after every backup.
+		/// 0 - segments are merged only by compact_backup</summary>
+		unsigned retainGenerations = 8;
+		/// <summary>Bytes of delta segments replayed by restore of the latest generation, older segments are merged into base image once
+		/// retained ones outgrow it even if fewer than retainGenerations generations are kept. The latest segment is always kept.
+		/// 0 - size of base image</summary>
+		uint64_t retainSegmentBytes = 0;
+		/// <summary>Called at begin and end of every timed phase on the thread running it, Read, Hash and Write phases are traced per batch
+		/// concurrently from pipeline threads. Must not throw, may be empty</summary>
+		std::function<void(BackupPhase phase, bool begin)> trace;
+	};
+
+	/// <summary>
+	/// Progress of running backup
+	/// </summary>
+	struct BackupProgress {
+		/// <summary>Pages read and hashed, pages reread by the last step or by repeated passes are counted again</summary>
+		uint64_t pagesScanned = 0;
+		/// <summary>Pages differing from backup, written to backup image</summary>
+		uint64_t pagesDirty = 0;
+		/// <summary>Bytes of dirty pages written to backup image</summary>
+		uint64_t bytesWritten = 0;
+		/// <summary>Scan pass, pass is repeated if pages changed during it can not be found</summary>
+		unsigned pass = 1;
+		/// <summary>Pages of current pass already scanned</summary>
+		uint64_t passPagesDone = 0;
+		/// <summary>Database page count when current pass started</summary>
+		uint64_t passPagesTotal = 0;
+		/// <summary>Estimated time until the end of current pass, -1 if unknown</summary>
+		int64_t etaMs = -1;
+		/// <summary>Backup is finished and committed</summary>
+		bool done = false;
+	};
+
+	/// <summary>
+	/// Histogram of latencies, bucket 0 counts latencies under 1 us, bucket i latencies in [2^(i-1), 2^i) us, the last bucket everything above
+	/// </summary>
+	struct LatencyHistogram {
+		static constexpr std::size_t BUCKETS = 32;
+		uint64_t count = 0;
+		uint64_t totalUs = 0;
+		uint64_t maxUs = 0;
+		uint64_t buckets[BUCKETS] = {};
+	};
+
+	/// <summary>
+	/// Time spent in a phase, summed over threads running it
+	/// </summary>
+	struct PhaseTime {
+		uint64_t wallUs = 0;
+		uint64_t cpuUs = 0;
+		uint64_t calls = 0;
+	};
+
+	/// <summary>
+	/// Statistics of one backup or restore call. Read, Hash and Write phases overlap in the pipeline, their sum may exceed durationUs
+	/// </summary>
+	struct BackupStats {
+		/// <summary>Pages read from SQLite and hashed</summary>
+		uint64_t pagesScanned = 0;
+		/// <summary>Pages differing from backup, written to backup image</summary>
+		uint64_t pagesDirty = 0;
+		/// <summary>Free-list leaf pages skipped without hashing or copying</summary>
+		uint64_t pagesFree = 0;
+		/// <summary>Pages written to destination database by restore</summary>
+		uint64_t pagesRestored = 0;
+		uint64_t bytesRead = 0;
+		uint64_t bytesWritten = 0;
+		/// <summary>Bytes charged to readBytesPerSec and writeBytesPerSec limits and time spent sleeping on them, 0 without limits</summary>
+		uint64_t throttledReadBytes = 0;
+		uint64_t throttledWriteBytes = 0;
+		uint64_t throttleWaitUs = 0;
+		/// <summary>Pipeline batches, batch histograms hold read, hash and write latency of every batch</summary>
+		uint64_t batches = 0;
+		/// <summary>Wall time of the whole call</summary>
+		uint64_t durationUs = 0;
+		PhaseTime phases[static_cast<std::size_t>(BackupPhase::Count)];
+		LatencyHistogram batchRead;
+		LatencyHistogram batchHash;
+		LatencyHistogram batchWrite;
+
+		inline const PhaseTime& phase(BackupPhase p) const { return phases[static_cast<std::size_t>(p)]; }
+	};
+
+	/// <summary>
+	/// Run of count pages starting from page first
+	/// </summary>
+	struct PageRange {
+		uint64_t first = 0;
+		uint64_t count = 0;
+	};
+
+	/// <summary>
+	/// Result of verify_backup
+	/// </summary>
+	struct VerifyResult {
+		/// <summary>Pages of backup image hashed and compared with manifest</summary>
+		uint64_t pagesChecked = 0;
+		/// <summary>Pages without hash in manifest (free-list pages), not checked</summary>
+		uint64_t pagesSkipped = 0;
+		/// <summary>Page the next scrub run starts from, 1 after a run reached the last page</summary>
+		uint64_t nextPage = 1;
+		/// <summary>Pages whose content does not match manifest, in ascending order</summary>
+		std::vector<PageRange> mismatched;
+	};
+
+	/// <summary>
+	/// Parameters of multi-database backup scheduler
+	/// </summary>
+	struct SchedulerOptions {
+		/// <summary>Number of workers running backups, 0 - number of hardware threads</summary>
+		unsigned threads = 0;
+		/// <summary>Number of I/O phases of backups running at once (manifest load, batch read and write, commit), a phase waits for a slot when it begins
+		/// and hashing runs outside of slots, 0 - threads</summary>
+		unsigned maxConcurrentIo = 0;
+	};
+
+	/// <summary>
+	/// State of database scheduled by backup_scheduler_add
+	/// </summary>
+	struct ScheduleStatus {
+		/// <summary>Finished backups, failed ones included</summary>
+		uint64_t runs = 0;
+		uint64_t failures = 0;
+		/// <summary>Result of the last backup, codes of backup method</summary>
+		int lastResult = 0;
+		/// <summary>Backup of database is running now</summary>
+		bool running = false;
+		/// <summary>Time until the next backup, 0 - due or queued, -1 - not scheduled</summary>
+		int64_t nextDueMs = -1;
+		/// <summary>Statistics of the last backup</summary>
+		BackupStats lastStats;
+	};
+
 	/// <summary>
 	/// API method to make an incremental backup of your open SQLITE3 database
 	/// </summary>
@@ -16,6 +241,209 @@ namespace sqlite3_inc_bkp {
 	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
 	int backup(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f);
 
+	/// <summary>
+	/// API method to make an incremental backup of your open SQLITE3 database with tuned engine
+	/// </summary>
+	/// <param name="db">Opened SQLITE3 database instance</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="options">Engine parameters</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options);
+
+	/// <summary>
+	/// API method to make an incremental backup of your open SQLITE3 database with tuned engine and statistics
+	/// </summary>
+	/// <param name="db">Opened SQLITE3 database instance</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="options">Engine parameters</param>
+	/// <param name="stats">Statistics of the call, filled on error too, may be nullptr</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, BackupStats* stats);
+
+	/// <summary>
+	/// Stepped incremental backup started by backup_init
+	/// </summary>
+	struct backup_handle;
+
+	/// <summary>
+	/// API method to start an incremental backup copied by backup_step calls, like sqlite3_backup_init
+	/// </summary>
+	/// <param name="db">Opened SQLITE3 database instance, must outlive the handle</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned handle nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="options">Engine parameters</param>
+	/// <returns>Handle to pass to backup_step and backup_finish, nullptr on error</returns>	
+	backup_handle* backup_init(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options);
+
+	/// <summary>
+	/// API method to copy the next range of pages of a stepped backup. Every step holds a read transaction only for its own duration,
+	/// pages changed between steps are reread by the last step, so finished backup is a snapshot of database at the last step.
+	/// If changed pages can not be found (no WAL frames or tracking VFS to read them from) the scan is repeated,
+	/// after 3 stale passes the step fails with error 9 (busy) and backup can be started again. In-memory database is copied by the first step
+	/// </summary>
+	/// <param name="handle">Handle returned by backup_init</param>
+	/// <param name="nPages">Maximum number of pages read by the step, <= 0 - unlimited</param>
+	/// <param name="timeBudgetMs">Step stops reading pages after this time, 0 - unlimited. The last step is not bounded</param>
+	/// <param name="done">Set to true when backup is finished and committed</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code, after an error the handle can only be finished</returns>	
+	int backup_step(backup_handle* handle, int nPages, unsigned timeBudgetMs, bool* done, char** errmsg);
+
+	/// <summary>
+	/// API method to release a stepped backup, unfinished backup is abandoned and the previous generation stays intact
+	/// </summary>
+	/// <param name="handle">Handle returned by backup_init, may be nullptr</param>
+	void backup_finish(backup_handle* handle);
+
+	/// <summary>
+	/// Backup session of one database started by open_session
+	/// </summary>
+	struct backup_session;
+
+	/// <summary>
+	/// API method to open a session for repeated incremental backups of one database. Session keeps manifest of page hashes mapped
+	/// and the page scan statement prepared between backups, manifest is read again only if another writer changed the backup
+	/// </summary>
+	/// <param name="db">Opened SQLITE3 database instance, must outlive the session</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned session nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="options">Engine parameters of every backup of the session</param>
+	/// <returns>Session to pass to session_backup and close_session, nullptr on error</returns>	
+	backup_session* open_session(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options);
+
+	/// <summary>
+	/// API method to make an incremental backup of the session database, same as backup with session options
+	/// </summary>
+	/// <param name="session">Session returned by open_session</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="stats">Statistics of the backup, may be nullptr. Filled on error too</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code, session stays usable after an error</returns>	
+	int session_backup(backup_session* session, char** errmsg, BackupStats* stats);
+
+	/// <summary>
+	/// API method to release a backup session
+	/// </summary>
+	/// <param name="session">Session returned by open_session, may be nullptr</param>
+	void close_session(backup_session* session);
+
+	/// <summary>
+	/// Backup running on a library-owned thread, started by backup_async
+	/// </summary>
+	struct backup_task;
+
+	/// <summary>
+	/// API method to run an incremental backup on a library-owned thread as a sequence of backup_step steps
+	/// </summary>
+	/// <param name="db">Opened SQLITE3 database instance in serialized threading mode, must outlive the task</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned task nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="options">Engine parameters</param>
+	/// <param name="progress">Callback called on backup thread after every step, last call has done set, may be empty</param>
+	/// <param name="progressIntervalMs">Duration of one step, cancellation is noticed between steps</param>
+	/// <returns>Task to pass to backup_wait, backup_cancel and backup_release, nullptr on error</returns>	
+	backup_task* backup_async(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options,
+		std::function<void(const BackupProgress&)> progress, unsigned progressIntervalMs);
+
+	/// <summary>
+	/// API method to wait for a backup started by backup_async
+	/// </summary>
+	/// <param name="task">Task returned by backup_async</param>
+	/// <param name="timeoutMs">Time to wait, < 0 - until backup ends, 0 - only check</param>
+	/// <param name="done">Set to true if backup ended, result of backup is returned then</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success or still running, -1 if unhandled exception, > 0 error code, 7 if backup was cancelled</returns>	
+	int backup_wait(backup_task* task, int timeoutMs, bool* done, char** errmsg);
+
+	/// <summary>
+	/// API method to cancel a backup started by backup_async, the backup stops after current step
+	/// and the previous generation stays intact and restorable
+	/// </summary>
+	/// <param name="task">Task returned by backup_async</param>
+	void backup_cancel(backup_task* task);
+
+	/// <summary>
+	/// API method to release a backup started by backup_async, running backup is cancelled and waited for
+	/// </summary>
+	/// <param name="task">Task returned by backup_async, may be nullptr</param>
+	void backup_release(backup_task* task);
+
+	/// <summary>
+	/// Pool of workers running backups of many databases, created by backup_scheduler_create
+	/// </summary>
+	struct backup_scheduler;
+
+	/// <summary>
+	/// API method to start a scheduler running backups of registered databases on a bounded pool of workers.
+	/// Due backups are queued by priority, idle workers steal queued backups of busy ones
+	/// </summary>
+	/// <param name="options">Number of workers and cap of concurrent backups</param>
+	/// <param name="errmsg">Pointer to write error message, if returned scheduler nothing will be written</param>
+	/// <returns>Scheduler to pass to other backup_scheduler methods, nullptr on error</returns>	
+	backup_scheduler* backup_scheduler_create(const SchedulerOptions& options, char** errmsg);
+
+	/// <summary>
+	/// API method to register a database with a scheduler, its first backup is due at once
+	/// </summary>
+	/// <param name="scheduler">Scheduler returned by backup_scheduler_create</param>
+	/// <param name="db">Opened SQLITE3 database instance in serialized threading mode, must stay open until removed or scheduler is released</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup, one registration per backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from workers and hashing threads</param>
+	/// <param name="options">Engine parameters, threads 0 means one hashing thread per backup as workers already run in parallel</param>
+	/// <param name="intervalMs">Time from the end of one backup to the start of the next, 0 - backups only when triggered</param>
+	/// <param name="priority">Higher priority backups are started first when several are due</param>
+	/// <param name="id">Set to id of registration</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup_scheduler_add(backup_scheduler* scheduler, sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f,
+		const BackupOptions& options, unsigned intervalMs, int priority, uint64_t* id);
+
+	/// <summary>
+	/// API method to unregister a database, waits for its running backup
+	/// </summary>
+	/// <param name="scheduler">Scheduler returned by backup_scheduler_create</param>
+	/// <param name="id">Id returned by backup_scheduler_add</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup_scheduler_remove(backup_scheduler* scheduler, uint64_t id, char** errmsg);
+
+	/// <summary>
+	/// API method to make the next backup of a registered database due now, a running backup is followed by another one
+	/// </summary>
+	/// <param name="scheduler">Scheduler returned by backup_scheduler_create</param>
+	/// <param name="id">Id returned by backup_scheduler_add</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup_scheduler_trigger(backup_scheduler* scheduler, uint64_t id, char** errmsg);
+
+	/// <summary>
+	/// API method to get results of backups of a registered database
+	/// </summary>
+	/// <param name="scheduler">Scheduler returned by backup_scheduler_create</param>
+	/// <param name="id">Id returned by backup_scheduler_add</param>
+	/// <param name="status">Filled with state of registration</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup_scheduler_status(backup_scheduler* scheduler, uint64_t id, ScheduleStatus* status, char** errmsg);
+
+	/// <summary>
+	/// API method to stop a scheduler, running backups are waited for and queued ones are dropped
+	/// </summary>
+	/// <param name="scheduler">Scheduler returned by backup_scheduler_create, may be nullptr</param>
+	void backup_scheduler_release(backup_scheduler* scheduler);
+
 	/// <summary>
 	/// API method to read an incremental backup to your open SQLITE3 database
 	/// </summary>
@@ -27,6 +455,175 @@ namespace sqlite3_inc_bkp {
 	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
 	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f);
 
+	/// <summary>
+	/// API method to read a retained generation of an incremental backup to your open SQLITE3 database
+	/// </summary>
+	/// <param name="dst">Opened SQLITE3 database instance</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm uint64_t<hash sum> hash_algorithm(const void *<data>, size_t<size of data>)</param>
+	/// <param name="generation">Generation to restore, 0 - latest, see backup_generations</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation);
+
+	/// <summary>
+	/// API method to read a retained generation of an incremental backup to your open SQLITE3 database with tuned engine
+	/// </summary>
+	/// <param name="dst">Opened SQLITE3 database instance</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="generation">Generation to restore, 0 - latest, see backup_generations</param>
+	/// <param name="options">Engine parameters</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation, const BackupOptions& options);
+
+	/// <summary>
+	/// API method to read a retained generation of an incremental backup to your open SQLITE3 database with tuned engine and statistics.
+	/// In-memory destination takes the checked backup image as its database buffer with sqlite3_deserialize instead of copying it page by page
+	/// </summary>
+	/// <param name="dst">Opened SQLITE3 database instance</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="generation">Generation to restore, 0 - latest, see backup_generations</param>
+	/// <param name="options">Engine parameters</param>
+	/// <param name="stats">Statistics of the call, filled on error too, may be nullptr</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int read_backup(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation, const BackupOptions& options, BackupStats* stats);
+
+	/// <summary>
+	/// API method to restore a retained generation of an incremental backup as database file, destination must not be open.
+	/// Backup image is checked as by read_backup and cloned without passing through SQLite: reflink where filesystem shares extents,
+	/// copy_file_range elsewhere on Linux, plain copy on other platforms. Destination with its journal and WAL is replaced at once
+	/// </summary>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="dstPath">Path of database file to create or replace</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm uint64_t<hash sum> hash_algorithm(const void *<data>, size_t<size of data>)</param>
+	/// <param name="generation">Generation to restore, 0 - latest, see backup_generations</param>
+	/// <param name="options">Engine parameters</param>
+	/// <param name="stats">Statistics of the call, filled on error too, may be nullptr</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int read_backup_file(const char* path, const char* name, const char* dstPath, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, uint64_t generation, const BackupOptions& options, BackupStats* stats);
+
+	/// <summary>
+	/// API method to get range of generations which can be restored, every backup call adds one generation
+	/// </summary>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="oldest">Oldest retained generation, 0 if backup is empty</param>
+	/// <param name="latest">Latest generation, 0 if backup is empty</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int backup_generations(const char* path, const char* name, uint64_t* oldest, uint64_t* latest, char** errmsg);
+
+	/// <summary>
+	/// API method to find pages whose content differs between two backups of one directory by comparing their manifest hash trees,
+	/// neither backup image is read. Backups of different page size or hash algorithm differ in every page. V1 manifest can not be read
+	/// without hash function, the next backup converts it
+	/// </summary>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="otherName">Name of backup to compare with</param>
+	/// <param name="ranges">Ranges of differing pages in ascending order, a page present in only one backup differs</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int diff_backups(const char* path, const char* name, const char* otherName, std::vector<PageRange>* ranges, char** errmsg);
+
+	/// <summary>
+	/// API method to check pages of the latest generation of backup against its manifest without restoring it. Backup files are mapped
+	/// and pages are hashed in place on options.threads threads, throttled by options.readBytesPerSec. Scrub run checks the next
+	/// scrubPages pages after the ones checked by the previous run and wraps around at the last page, so repeated runs cover whole backup
+	/// </summary>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from options.threads threads</param>
+	/// <param name="options">Engine parameters</param>
+	/// <param name="scrubPages">Pages checked by one scrub run, 0 - check every page and keep scrub position</param>
+	/// <param name="result">Checked pages and mismatched page ranges, filled on error too, may be nullptr</param>
+	/// <returns>0 if every checked page matches, 5 if some do not, -1 if unhandled exception, > 0 error code </returns>	
+	int verify_backup(const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, uint64_t scrubPages, VerifyResult* result);
+
+	/// <summary>
+	/// API method to make incremental backups of every database of connection, main and attached ones, in one read transaction.
+	/// Database of schema s is backed up as backup name.s (s hex-encoded behind a dash unless it is of [A-Za-z0-9_]), one schema
+	/// after another as they share the connection. WAL databases are scanned in full as their WAL marker can not be advanced within the shared transaction
+	/// </summary>
+	/// <param name="db">Opened SQLITE3 database instance</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup set</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm, called concurrently from backup threads</param>
+	/// <param name="options">Engine parameters, options.schema is ignored</param>
+	/// <param name="schemas">Schemas backed up, may be nullptr</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code of the first failed schema, backups of the others are kept</returns>	
+	int backup_schemas(sqlite3* db, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, std::vector<std::string>* schemas);
+
+	/// <summary>
+	/// API method to restore every database of connection, main and attached ones, from backups made by backup_schemas.
+	/// Schemas are restored one after another in PRAGMA database_list order, restore stops at the first error
+	/// </summary>
+	/// <param name="dst">Opened SQLITE3 database instance with databases attached under the names they were backed up with</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup set</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm uint64_t<hash sum> hash_algorithm(const void *<data>, size_t<size of data>)</param>
+	/// <param name="options">Engine parameters, options.schema is ignored</param>
+	/// <param name="schemas">Schemas restored, may be nullptr</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int read_schemas(sqlite3* dst, const char* path, const char* name, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f, const BackupOptions& options, std::vector<std::string>* schemas);
+
+	/// <summary>
+	/// API method to apply backup streams written with BackupOptions::outputFd to an image file, streams are read until end of descriptor.
+	/// Delta stream is applied only on top of the stream before it, the manifest of the last applied stream is kept as imagePath.manifest.
+	/// Stream cut before its end leaves image unusable until a stream of every page is applied
+	/// </summary>
+	/// <param name="fd">Descriptor open for reading</param>
+	/// <param name="imagePath">Path to image, created by a stream of every page</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <param name="f">callback of hash algorithm to check pages hashed with HashAlgorithm::Callback, may be empty then pages are not checked</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int apply_backup_stream(int fd, const char* imagePath, char** errmsg, std::function<uint64_t(const void*, std::size_t)> f);
+
+	/// <summary>
+	/// API method to merge delta segments of old generations into base image of backup,
+	/// may run on a background thread concurrently with backup and read_backup of the same backup
+	/// </summary>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="retainGenerations">Number of latest generations kept restorable, at least 1. Fewer are kept if their segments outgrow
+	/// base image, see BackupOptions::retainSegmentBytes</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int compact_backup(const char* path, const char* name, unsigned retainGenerations, char** errmsg);
+
+	/// <summary>
+	/// API method to register VFS which records pages written to database files, open production connections with it
+	/// </summary>
+	/// <param name="vfsName">Name of VFS to pass to sqlite3_open_v2, wraps current default VFS</param>
+	/// <param name="makeDefault">Make tracking VFS default for all new connections</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int register_tracking_vfs(const char* vfsName, bool makeDefault, char** errmsg);
+
+	/// <summary>
+	/// API method to bind dirty page tracking of database opened with tracking VFS to a backup,
+	/// bitmap of written pages is persisted next to backup manifest and backup reads only those pages.
+	/// Every writer of database must use tracking VFS
+	/// </summary>
+	/// <param name="db">SQLITE3 database instance opened with tracking VFS</param>
+	/// <param name="path">Path to backup directory</param>
+	/// <param name="name">Name of backup</param>
+	/// <param name="errmsg">Pointer to write error message, if returned true nothing will be written</param>
+	/// <returns>0 if success, -1 if unhandled exception, > 0 error code </returns>	
+	int track_dirty_pages(sqlite3* db, const char* path, const char* name, char** errmsg);
+
 	/// <summary>
 	/// API method to clear an incremental backup
 	/// </summary>
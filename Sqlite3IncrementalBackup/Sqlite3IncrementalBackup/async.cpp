@@ -0,0 +1,64 @@
+#include "async.h"
+
+#include <chrono>
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const unsigned ASYNC_DEFAULT_STEP_MS = 100;
+	}
+
+	AsyncBackup::AsyncBackup(std::unique_ptr<IBackup> backup, sqlite3* db, const progress_func& progress, unsigned progressIntervalMs)
+		: backup(std::move(backup)), db(db), progress(progress), progressIntervalMs(progressIntervalMs ? progressIntervalMs : ASYNC_DEFAULT_STEP_MS) {
+		this->worker = std::thread(&AsyncBackup::Run, this);
+	}
+
+	AsyncBackup::~AsyncBackup() {
+		this->Cancel();
+		if (this->worker.joinable())
+			this->worker.join();
+	}
+
+	void AsyncBackup::Cancel() {
+		this->cancelled = true;
+	}
+
+	bool AsyncBackup::Wait(int timeoutMs) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		if (timeoutMs < 0)
+			this->finishedCondition.wait(lock, [this] { return this->finished; });
+		else
+			this->finishedCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return this->finished; });
+		return this->finished;
+	}
+
+	std::exception_ptr AsyncBackup::Error() const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->error;
+	}
+
+	void AsyncBackup::Run() {
+		std::exception_ptr error;
+		try {
+			this->backup->Begin(this->db);
+			bool done = false;
+			while (!done) {
+				if (this->cancelled) {
+					throw BackupException("Cancelled by caller", BackupException::Error::Cancelled);
+				}
+				done = this->backup->Step(0, this->progressIntervalMs);
+				if (this->progress)
+					this->progress(this->backup->Progress());
+			}
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		//Unfinished generation is rolled back before waiters see the result
+		this->backup.reset();
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->error = error;
+		this->finished = true;
+		this->finishedCondition.notify_all();
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "api.h"
+#include "backup.h"
+
+struct sqlite3;
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Stepped backup running on its own thread, cancellation is checked between steps
+	/// </summary>
+	class AsyncBackup {
+	public:
+		using progress_func = std::function<void(const BackupProgress&)>;
+
+		AsyncBackup(std::unique_ptr<IBackup> backup, sqlite3* db, const progress_func& progress, unsigned progressIntervalMs);
+		AsyncBackup(const AsyncBackup&) = delete;
+		AsyncBackup& operator=(const AsyncBackup&) = delete;
+		~AsyncBackup();
+
+		void Cancel();
+
+		/// <summary>
+		/// Wait until backup ends
+		/// </summary>
+		/// <param name="timeoutMs">Time to wait, < 0 - infinite</param>
+		/// <returns>true if backup ended</returns>
+		bool Wait(int timeoutMs);
+
+		/// <summary>
+		/// Exception backup ended with, nullptr on success
+		/// </summary>
+		std::exception_ptr Error() const;
+
+	private:
+		void Run();
+
+	private:
+		std::unique_ptr<IBackup> backup;
+		sqlite3* db;
+		progress_func progress;
+		unsigned progressIntervalMs;
+		std::atomic<bool> cancelled{ false };
+		mutable std::mutex mutex;
+		std::condition_variable finishedCondition;
+		bool finished = false;
+		std::exception_ptr error;
+		std::thread worker;
+	};
+}//namespace sqlite3_inc_bkp
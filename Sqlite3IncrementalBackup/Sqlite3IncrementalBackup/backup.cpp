@@ -1,174 +1,1425 @@
 #include "backup.h"
+#include "clone.h"
+#include "pipeline.h"
+#include "sink.h"
+#include "verify.h"
+#include "wal.h"
+#include "writer.h"
+#include <optional>
 #include <sqlite3.h>
 
 namespace sqlite3_inc_bkp {
+	namespace {
+		const unsigned STEP_MAX_PASSES = 3;
+		const std::size_t STEP_CHUNK_BATCHES = 8;
+		const std::size_t HEADER_WRITE_VERSION = 18;	//offsets in database header of page 1
+		const std::size_t HEADER_READ_VERSION = 19;
+		const std::size_t HEADER_CHANGE_COUNTER = 24;
+		const std::size_t HEADER_FREELIST_TRUNK = 32;
+		const std::size_t HEADER_FREELIST_COUNT = 36;
+		const std::size_t REPORTED_RANGES = 4;
+		const char* const IMAGE_SCHEMA = "main";
+
+		uint32_t ReadBigEndian32(const unsigned char* p) {
+			return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+		}
+
+		/// <summary>
+		/// Text of the first page ranges for error messages
+		/// </summary>
+		std::string FormatRanges(const std::vector<PageRange>& ranges) {
+			std::string text;
+			for (std::size_t i = 0; i < std::min(ranges.size(), REPORTED_RANGES); ++i) {
+				text += i ? ", " : "";
+				text += ranges[i].count == 1 ? tools::FormatString::format("%llu", static_cast<unsigned long long>(ranges[i].first))
+					: tools::FormatString::format("%llu-%llu", static_cast<unsigned long long>(ranges[i].first), static_cast<unsigned long long>(ranges[i].first + ranges[i].count - 1));
+			}
+			if (ranges.size() > REPORTED_RANGES)
+				text += ", ...";
+			return text;
+		}
+	}
 	
 	std::string BackupV1::GetPageHashesCacheFilePath() const {
-		return tools::FormatString::format("%s\\.%s.manifest", this->workspace.string().c_str(), this->name);
+		return this->GetPageHashesCacheFilePath(this->name);
+	}
+
+	std::string BackupV1::GetPageHashesCacheFilePath(const std::string& backupName) const {
+		return tools::FormatString::format("%s\\.%s.manifest", this->workspace.string().c_str(), backupName);
 	}
 	
+	std::string BackupV1::GetWalMarkerFilePath() const {
+		return tools::FormatString::format("%s\\.%s.walmark", this->workspace.string().c_str(), this->name);
+	}
+
+	std::string BackupV1::GetScrubCursorFilePath() const {
+		return tools::FormatString::format("%s\\.%s.scrub", this->workspace.string().c_str(), this->name);
+	}
+
+	std::string BackupV1::GetGenerationFilePrefix() const {
+		return tools::FormatString::format("%s\\.%s", this->workspace.string().c_str(), this->name);
+	}
+
+	BackupV1::~BackupV1() {
+		//Abandoned delta generation or stream leaves previous one restorable, base image written in place can not be rolled back
+		if (this->generationState.lastGeneration != 0 || this->options.outputFd >= 0)
+			this->manifest.Rollback();
+	}
+
+	void BackupV1::OpenManifest() {
+		if (!this->hasher) {
+			throw BackupException("Hash function is not set", BackupException::Error::BackupInit);
+		}
+		this->manifest.SetResidentLimit(this->options.manifestMemory);
+		this->manifest.Open(this->GetPageHashesCacheFilePath(), false, this->hashFunction);
+		this->manifest.SetAlgorithm(this->hasher.algorithm);
+		this->manifest.SetExtentPages(this->options.extentPages);
+		//Entries of damaged subtrees are dropped, only their pages are copied again. Manifest left by an interrupted backup is empty already
+		if (this->options.verifyManifest && this->manifest.IsCommitted()) {
+			for (const PageRange& range : this->manifest.Verify()) {
+				for (uint64_t pgno = range.first; pgno < range.first + range.count; ++pgno)
+					this->manifest.Set(static_cast<std::size_t>(pgno), 0);
+			}
+		}
+	}
+
 	void BackupV1::BackupImpl(sqlite3* src) {
-		std::string manifestFile = this->GetPageHashesCacheFilePath();
-			
-		this->hashes.clear();
-		if (boost::filesystem::exists(manifestFile)) {
-			ReadPageHashes(manifestFile.c_str());
-		}	
-		
-		auto stmtRead = GetPageCursor(src);		
-		std::size_t i = 1;
+		this->stats.Start();
+		this->progress = BackupProgress();
+		this->AttachPageStore();
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestLoad);
+			this->LoadManifest();
+		}
+		auto writer = this->BeginGeneration();
 
-		if (!boost::filesystem::exists(this->GetBackupDbPath())) {
-			std::ofstream fdbn(this->GetBackupDbPath(), std::ios::binary);
-			fdbn.close();
+		if (this->options.dirtyTracking) {
+			auto tracker = DirtyPageTracker::Find(this->GetDbPath(src));
+			if (tracker && tracker->IsBoundTo(this->GetDirtyPagesFilePath())) {
+				std::remove(this->GetWalMarkerFilePath().c_str());
+				this->BackupTrackedImpl(src, *tracker, *writer);
+				return;
+			}
 		}
-		//boost::filesystem::resize_file(this->GetBackupDbPath(), this->GetPageCount(src) * 4096);
-		
-		if (this->hashes.empty())
-			this->hashes.push_back(0);
-
-		std::ofstream fdb(this->GetBackupDbPath(), std::ios::in | std::ios::out | std::ios::binary);
-		while (1) {
-			int status = sqlite3_step(stmtRead);
-			if (status == SQLITE_DONE) break;
-
-			else if (status == SQLITE_ROW) {	
-				const void* data = sqlite3_column_blob(stmtRead, 0);
-				const std::size_t size = sqlite3_column_bytes(stmtRead, 0);
-				
-				hash_t inputHash = this->hashFunction(data, size);
-		
-				if (i >= this->hashes.size()) {					
-					WritePage(i - 1, data, size, fdb);					
-					this->hashes.push_back(inputHash);
-				}
-				else if (this->hashes.at(i) != (inputHash = this->hashFunction(data, size))) {					
-					WritePage(i - 1, data, size, fdb);
-					this->hashes.at(i) = inputHash;
+
+		const bool walMode = this->options.walIncremental && this->IsWalMode(src);
+		WalMarker marker;
+		std::size_t pageCount = 0;
+		if (walMode && this->manifest.PageCount() > 0 && WalIndex::ReadMarker(this->GetWalMarkerFilePath(), marker) && this->BackupWalImpl(src, marker, *writer, pageCount)) {
+			this->CommitGeneration(*writer, pageCount);
+			WalIndex::WriteMarker(this->GetWalMarkerFilePath(), marker);
+			return;
+		}
+
+		//Full scan, the marker is taken before the scan snapshot so the next WAL backup rereads the frames in between
+		std::remove(this->GetWalMarkerFilePath().c_str());
+		WalMarker nextMarker;
+		const bool haveMarker = walMode && WalIndex::Scan(this->GetWalPath(src), nextMarker, nullptr);
+
+		//Free pages are taken from the scan snapshot, a page reused after it must not be skipped. Snapshot of caller's transaction
+		//may be older than the marker, frames in between would be skipped by the next WAL backup, so no marker is written then
+		const bool ownTransaction = sqlite3_exec(src, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+		try {
+			pageCount = this->GetPageCount(src, this->Schema());
+			const std::vector<bool> freePages = this->GetFreePages(src, this->Schema(), pageCount);
+			if (!this->ProcessImage(src, pageCount, *writer, freePages))
+				pageCount = std::max(pageCount, this->ProcessPages(this->GetScanCursor(src), *writer, &freePages));
+			this->manifest.Truncate(pageCount);
+			if (ownTransaction)
+				sqlite3_exec(src, "COMMIT", nullptr, nullptr, nullptr);
+		}
+		catch (...) {
+			if (ownTransaction)
+				sqlite3_exec(src, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+
+		this->CommitGeneration(*writer, pageCount);
+		if (haveMarker && ownTransaction)
+			WalIndex::WriteMarker(this->GetWalMarkerFilePath(), nextMarker);
+	}
+
+	bool BackupV1::BackupWalImpl(sqlite3* src, WalMarker& marker, PageWriter& writer, std::size_t& pageCount) {
+		const std::string walPath = this->GetWalPath(src);
+		std::set<std::size_t> pages;
+		if (!WalIndex::Scan(walPath, marker, &pages))
+			return false;
+
+		//Pin the read snapshot, frames committed before it are all behind the second scan
+		if (sqlite3_exec(src, "BEGIN", nullptr, nullptr, nullptr) != SQLITE_OK)
+			return false;
+		try {
+			pageCount = this->GetPageCount(src, this->Schema());
+			WalMarker snapshotMarker = marker;
+			if (!WalIndex::Scan(walPath, snapshotMarker, &pages) || pages.size() > pageCount / 2) {
+				sqlite3_exec(src, "ROLLBACK", nullptr, nullptr, nullptr);
+				return false;
+			}
+
+			this->manifest.Truncate(pageCount);
+			pages.erase(pages.upper_bound(pageCount), pages.end());
+			this->ExpandToExtents(pages, pageCount);
+
+			const std::vector<bool> freePages = this->GetFreePages(src, this->Schema(), pageCount);
+			if (!pages.empty()) {
+				auto stmtRead = this->GetPageCursor(src, this->Schema(), pages);
+				this->ProcessPages(stmtRead, writer, &freePages);
+			}
+			else {
+				this->MarkFreePages(freePages);
+			}
+			sqlite3_exec(src, "COMMIT", nullptr, nullptr, nullptr);
+		}
+		catch (...) {
+			sqlite3_exec(src, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+		return true;
+	}
+
+	std::string BackupV1::GetDbPath(sqlite3* db) const {
+		const char* dbFile = sqlite3_db_filename(db, this->Schema());
+		return dbFile ? std::string(dbFile) : std::string();
+	}
+
+	std::string BackupV1::GetDirtyPagesFilePath() const {
+		return tools::FormatString::format("%s\\.%s.dirty", this->workspace.string().c_str(), this->name);
+	}
+
+	std::string BackupV1::GetDirtyMarkFilePath() const {
+		return tools::FormatString::format("%s\\.%s.dirtymark", this->workspace.string().c_str(), this->name);
+	}
+
+	void BackupV1::TrackImpl(sqlite3* db) {
+		auto tracker = DirtyPageTracker::Find(this->GetDbPath(db));
+		if (!tracker) {
+			throw BackupException(tools::FormatString::format("Database [%s] is not opened with tracking VFS", this->GetDbPath(db).c_str()).c_str(), BackupException::Error::Tracking);
+		}
+		tracker->Bind(this->GetDirtyPagesFilePath());
+	}
+
+	void BackupV1::BackupTrackedImpl(sqlite3* src, DirtyPageTracker& tracker, PageWriter& writer) {
+		uint64_t consumed = 0;
+		std::ifstream fMark(this->GetDirtyMarkFilePath(), std::ios::binary);
+		const bool haveMark = fMark.is_open() && fMark.read(reinterpret_cast<char*>(&consumed), sizeof(consumed));
+		fMark.close();
+		std::remove(this->GetDirtyMarkFilePath().c_str());
+
+		//Pages written before the swap are in swapped generation, pages written up to the snapshot are peeked after it
+		std::set<std::size_t> pages;
+		const uint64_t generation = tracker.Swap(pages);
+		bool incremental = haveMark && consumed == generation && this->manifest.PageCount() > 0;
+
+		const bool ownTransaction = sqlite3_exec(src, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+		std::size_t pageCount = 0;
+		try {
+			pageCount = this->GetPageCount(src, this->Schema());
+			if (incremental) {
+				tracker.Peek(pages);
+				incremental = pages.size() <= pageCount / 2;
+			}
+
+			this->manifest.Truncate(pageCount);
+			const std::vector<bool> freePages = this->GetFreePages(src, this->Schema(), pageCount);
+			if (incremental) {
+				pages.erase(pages.upper_bound(pageCount), pages.end());
+				this->ExpandToExtents(pages, pageCount);
+				if (!pages.empty())
+					this->ProcessPages(this->GetPageCursor(src, this->Schema(), pages), writer, &freePages);
+				else
+					this->MarkFreePages(freePages);
+			}
+			else {
+				this->ProcessPages(this->GetScanCursor(src), writer, &freePages);
+			}
+			if (ownTransaction)
+				sqlite3_exec(src, "COMMIT", nullptr, nullptr, nullptr);
+		}
+		catch (...) {
+			if (ownTransaction)
+				sqlite3_exec(src, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+
+		this->CommitGeneration(writer, pageCount);
+		//Snapshot of caller's transaction may be older than the swap, pages written in between were read stale.
+		//Without the mark the next backup scans every page, as the full scan leaves no WAL marker
+		if (!ownTransaction)
+			return;
+		const uint64_t next = generation + 1;
+		std::ofstream fNextMark(this->GetDirtyMarkFilePath(), std::ios::binary);
+		fNextMark.write(reinterpret_cast<const char*>(&next), sizeof(next));
+	}
+
+	BackupV1::StepState::~StepState() {
+		if (this->tracker)
+			this->tracker->Unwatch(this->watch);
+	}
+
+	void BackupV1::BeginImpl(sqlite3* src) {
+		this->stats.Start();
+		this->AttachPageStore();
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestLoad);
+			this->OpenManifest();
+		}
+		this->step = std::make_unique<StepState>();
+		StepState& s = *this->step;
+		s.db = src;
+		s.writer = this->BeginGeneration();
+
+		const std::string dbPath = this->GetDbPath(src);
+		if (dbPath.empty()) {
+			//In-memory database has neither WAL nor change counter, it is copied by one step in one transaction
+			s.phase = StepPhase::Final;
+			s.whole = true;
+			return;
+		}
+		if (this->options.dirtyTracking)
+			s.tracker = DirtyPageTracker::Find(dbPath);
+		if (s.tracker)
+			s.watch = s.tracker->Watch();
+		else
+			s.walMode = this->IsWalMode(src);
+		this->RestartPass();
+	}
+
+	bool BackupV1::StepImpl(int nPages, unsigned timeBudgetMs) {
+		if (!this->step) {
+			throw BackupException("Stepped backup is not started", BackupException::Error::BackupInit);
+		}
+		StepState& s = *this->step;
+		if (s.failed) {
+			throw BackupException("Stepped backup failed on previous step", BackupException::Error::BackupInit);
+		}
+		try {
+			bool budgetLeft = true;
+			if (s.phase == StepPhase::Scan)
+				budgetLeft = this->ScanStep(nPages, timeBudgetMs);
+			if (s.phase == StepPhase::Final && budgetLeft)
+				this->FinalStep();
+		}
+		catch (...) {
+			//Manifest may hold hashes of pages not flushed to image, generation stays uncommitted
+			s.failed = true;
+			throw;
+		}
+		return s.phase == StepPhase::Done;
+	}
+
+	bool BackupV1::ScanStep(int nPages, unsigned timeBudgetMs) {
+		StepState& s = *this->step;
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeBudgetMs);
+		const std::size_t extentPages = this->manifest.ExtentPages();
+		const std::size_t chunkPages = (std::max<std::size_t>(this->options.batchPages, 1) * STEP_CHUNK_BATCHES + extentPages - 1) / extentPages * extentPages;
+		std::size_t read = 0;
+		auto budgetLeft = [&] {
+			return (nPages <= 0 || read < static_cast<std::size_t>(nPages))
+				&& (timeBudgetMs == 0 || std::chrono::steady_clock::now() < deadline);
+		};
+
+		const bool ownTransaction = sqlite3_exec(s.db, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+		try {
+			//Page count pins the read snapshot of the step, changes committed before it are collected after it
+			const std::vector<bool> freePages = this->GetFreePages(s.db, this->Schema(), this->GetPageCount(s.db, this->Schema()));
+			this->CollectStepChanges();
+			while (s.nextPage <= s.scanCount && (read == 0 || budgetLeft())) {
+				std::size_t count = std::min(chunkPages, s.scanCount - s.nextPage + 1);
+				if (nPages > 0)
+					count = std::min(count, static_cast<std::size_t>(nPages) - read);
+				//Chunk ends on extent boundary, extent is hashed from pages of one snapshot
+				count = std::min((count + extentPages - 1) / extentPages * extentPages, s.scanCount - s.nextPage + 1);
+				//Free pages of step snapshot are not read, a page reused after it is a change reread by the last step
+				std::set<std::size_t> pages;
+				for (std::size_t pgno = s.nextPage; pgno < s.nextPage + count; ++pgno) {
+					if (pgno >= freePages.size() || !freePages[pgno])
+						pages.insert(pages.end(), pgno);
 				}
-				++i;				
+				this->stats.AddFree(count - pages.size());
+				if (!pages.empty())
+					this->ProcessPages(this->GetPageCursor(s.db, this->Schema(), pages), *s.writer);
+				s.nextPage += count;
+				read += count;
+			}
+			this->MarkFreePages(freePages);
+			if (ownTransaction)
+				sqlite3_exec(s.db, "COMMIT", nullptr, nullptr, nullptr);
+		}
+		catch (...) {
+			if (ownTransaction)
+				sqlite3_exec(s.db, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+
+		//Pages not scanned yet are read by later steps from later snapshots
+		s.changed.erase(s.changed.lower_bound(s.nextPage), s.changed.upper_bound(s.scanCount));
+		if (s.nextPage > s.scanCount)
+			s.phase = StepPhase::Final;
+		return budgetLeft();
+	}
+
+	void BackupV1::FinalStep() {
+		StepState& s = *this->step;
+		if (s.stale && s.pass < STEP_MAX_PASSES) {
+			++s.pass;
+			this->RestartPass();
+			return;
+		}
+
+		//Marker taken before the final snapshot lets the next WAL backup reread the frames after it
+		WalMarker nextMarker = s.marker;
+		const bool haveMarker = s.walMode && s.haveMarker && !s.stale && this->options.walIncremental
+			&& WalIndex::Scan(this->GetWalPath(s.db), nextMarker, nullptr)
+			&& nextMarker.salt1 == s.marker.salt1 && nextMarker.salt2 == s.marker.salt2;
+
+		const bool ownTransaction = sqlite3_exec(s.db, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+		std::size_t pageCount = 0;
+		try {
+			pageCount = this->GetPageCount(s.db, this->Schema());
+			this->CollectStepChanges();
+			if (s.stale && s.pass < STEP_MAX_PASSES) {
+				if (ownTransaction)
+					sqlite3_exec(s.db, "COMMIT", nullptr, nullptr, nullptr);
+				++s.pass;
+				this->RestartPass();
+				return;
+			}
+			//Reading every page in the last snapshot would hold one long transaction, caller retries when database is quieter
+			if (s.stale) {
+				throw BackupException(tools::FormatString::format("Changed pages of [%s] are unknown after %u passes", this->GetDbPath(s.db).c_str(), s.pass).c_str(), BackupException::Error::Busy);
+			}
+
+			this->manifest.Truncate(pageCount);
+			const std::vector<bool> freePages = this->GetFreePages(s.db, this->Schema(), pageCount);
+			if (s.whole) {
+				this->ProcessPages(this->GetScanCursor(s.db), *s.writer, &freePages);
+			}
+			else {
+				s.changed.erase(s.changed.upper_bound(pageCount), s.changed.end());
+				this->ExpandToExtents(s.changed, pageCount);
+				if (!s.changed.empty())
+					this->ProcessPages(this->GetPageCursor(s.db, this->Schema(), s.changed), *s.writer, &freePages);
+				else
+					this->MarkFreePages(freePages);
 			}
+			if (ownTransaction)
+				sqlite3_exec(s.db, "COMMIT", nullptr, nullptr, nullptr);
+		}
+		catch (...) {
+			if (ownTransaction)
+				sqlite3_exec(s.db, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+
+		this->CommitGeneration(*s.writer, pageCount);
+		s.phase = StepPhase::Done;
+		if (haveMarker)
+			WalIndex::WriteMarker(this->GetWalMarkerFilePath(), nextMarker);
+	}
+
+	void BackupV1::RestartPass() {
+		//Change source is reset before the first snapshot of the pass, earlier changes are read by the pass itself
+		StepState& s = *this->step;
+		s.phase = StepPhase::Scan;
+		s.stale = false;
+		s.nextPage = 1;
+		s.passStart = std::chrono::steady_clock::now();
+		if (s.tracker) {
+			s.tracker->CollectWatched(s.watch, s.changed);
+		}
+		else if (s.walMode) {
+			s.marker = WalMarker();
+			s.haveMarker = WalIndex::Scan(this->GetWalPath(s.db), s.marker, nullptr);
+		}
+		else {
+			s.changeCounter = this->GetChangeCounter(s.db);
+		}
+		s.changed.clear();
+		s.scanCount = this->GetPageCount(s.db, this->Schema());
+	}
+
+	BackupProgress BackupV1::ProgressImpl() const {
+		BackupProgress progress = this->progress;
+		if (!this->step)
+			return progress;
+		const StepState& s = *this->step;
+		progress.pass = s.pass;
+		progress.passPagesTotal = s.scanCount;
+		progress.passPagesDone = s.phase == StepPhase::Scan ? s.nextPage - 1 : s.scanCount;
+		progress.done = s.phase == StepPhase::Done;
+		if (progress.done) {
+			progress.etaMs = 0;
+		}
+		else if (progress.passPagesDone > 0) {
+			const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - s.passStart).count();
+			progress.etaMs = static_cast<int64_t>(elapsed * (progress.passPagesTotal - progress.passPagesDone) / progress.passPagesDone);
+		}
+		return progress;
+	}
+
+	BackupStats BackupV1::StatsImpl() const {
+		return this->stats.Get();
+	}
+
+	BackupV1::SessionState::~SessionState() {
+		sqlite3_finalize(this->scanCursor);
+	}
+
+	void BackupV1::OpenSessionImpl(sqlite3* db) {
+		this->session = std::make_unique<SessionState>();
+		this->session->db = db;
+		this->AttachPageStore();
+		this->OpenManifest();
+		this->StampSession();
+	}
+
+	void BackupV1::LoadManifest() {
+		if (this->session) {
+			//Manifest stays mapped while nothing but this session committed the backup, another writer moves generation or root
+			const bool current = this->session->warm && this->manifest.IsOpen() && this->manifest.IsCommitted()
+				&& this->manifest.Root() == this->session->root && this->manifest.PageCount() == this->session->pageCount
+				&& this->GetLastGeneration() == this->session->generation;
+			this->session->warm = false;
+			if (current)
+				return;
+			//Entries left by a failed backup of the session are restored before the file is mapped again
+			if (this->manifest.IsOpen())
+				this->manifest.Rollback();
+			this->manifest.Close();
+		}
+		this->OpenManifest();
+	}
+
+	void BackupV1::StampSession() {
+		if (!this->session)
+			return;
+		this->session->generation = this->GetLastGeneration();
+		this->session->root = this->manifest.Root();
+		this->session->pageCount = this->manifest.PageCount();
+		this->session->warm = this->manifest.IsCommitted();
+	}
+
+	uint64_t BackupV1::GetLastGeneration() const {
+		if (this->options.outputFd >= 0)
+			return 0;
+		return this->pageMaps.IsAttached() ? this->pageMaps.Load().lastGeneration : this->generations.Load().lastGeneration;
+	}
+
+	sqlite3_stmt* BackupV1::GetScanCursor(sqlite3* db) {
+		if (!this->session || this->session->db != db)
+			return this->GetPageCursor(db, this->Schema());
+		if (!this->session->scanCursor)
+			this->session->scanCursor = this->GetPageCursor(db, this->Schema());
+		return this->session->scanCursor;
+	}
+
+	void BackupV1::ReleaseCursor(sqlite3_stmt* stmt) {
+		//Session statement is only reset, it releases its read lock and is stepped again by the next scan
+		if (this->session && stmt == this->session->scanCursor)
+			sqlite3_reset(stmt);
+		else
+			sqlite3_finalize(stmt);
+	}
+
+	void BackupV1::CollectStepChanges() {
+		StepState& s = *this->step;
+		if (s.stale || s.whole)
+			return;
+		if (s.tracker) {
+			s.tracker->CollectWatched(s.watch, s.changed);
+		}
+		else if (s.walMode) {
+			//WAL restarted since the last scan may have dropped frames never seen, their pages are unknown
+			const std::string walPath = this->GetWalPath(s.db);
+			WalMarker marker = s.marker;
+			if (!s.haveMarker)
+				s.stale = WalIndex::Scan(walPath, marker, nullptr);
+			else if (!WalIndex::Scan(walPath, marker, &s.changed) || marker.checkpointSeq != s.marker.checkpointSeq
+				|| marker.salt1 != s.marker.salt1 || marker.salt2 != s.marker.salt2)
+				s.stale = true;
 			else
-				throw BackupException(tools::FormatString::format("Error fetching data: %s", sqlite3_errstr(status)).c_str(), BackupException::Error::SelectPages);
-		}		
+				s.marker = marker;
+		}
+		else if (this->GetChangeCounter(s.db) != s.changeCounter) {
+			s.stale = true;
+		}
+	}
+
+	uint32_t BackupV1::GetChangeCounter(sqlite3* db) const {
+		//File change counter at offset 24 of database header, incremented by every commit in rollback journal mode
+		auto stmtRead = this->GetPageCursor(db, this->Schema(), 1);
+		uint32_t counter = 0;
+		if (sqlite3_step(stmtRead) == SQLITE_ROW && sqlite3_column_bytes(stmtRead, 1) >= static_cast<int>(HEADER_CHANGE_COUNTER + 4)) {
+			const unsigned char* data = reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmtRead, 1));
+			counter = ReadBigEndian32(data + HEADER_CHANGE_COUNTER);
+		}
 		sqlite3_finalize(stmtRead);
-		fdb.close();
+		return counter;
+	}
 
-		this->hashes.at(0) = this->hashFunction(reinterpret_cast<char *>(&this->hashes[1]), (this->hashes.size() - 1) * sizeof(hash_t));
-		WritePageHashes();		
-	}		
-	
-	void BackupV1::ReadImpl(sqlite3* dst) {
-		//Check backup file
-		if (!boost::filesystem::exists(this->GetBackupDbPath())) {
+	PagePipeline::Sink BackupV1::GetPageSink(PageWriter& writer, std::size_t& lastPage) {
+		//Sink runs on the single writer thread, the only one touching manifest and writer
+		return [this, &writer, &lastPage](const PageBatch& batch) {
+			this->manifest.SetPageSize(batch.pageSize);
+			this->progress.pagesScanned += batch.size();
+			//Scan visits pages in ascending order, manifest entries of batch are mapped in and earlier ones released
+			if (batch.size())
+				this->manifest.Advance(batch.pages.back());
+			const std::size_t extentPages = this->manifest.ExtentPages();
+			std::size_t dirty = 0;
+			for (std::size_t j = 0; j < batch.size();) {
+				//Run of consecutive pages of one extent shares its hash, changed extent is written whole
+				const std::size_t i = batch.pages[j];
+				const hash_t inputHash = batch.pageHashes[j];
+				std::size_t run = 1;
+				while (j + run < batch.size() && batch.pages[j + run] == i + run && (i + run - 1) / extentPages == (i - 1) / extentPages)
+					++run;
+				const std::size_t last = i + run - 1;
+
+				if (last > this->manifest.PageCount() || this->manifest.Get(i) != inputHash) {
+					for (std::size_t k = 0; k < run; ++k)
+						writer.Copy(i + k, batch.page(j + k), batch.pageSize);
+					this->manifest.Set(last, inputHash);
+					dirty += run;
+				}
+				lastPage = std::max(lastPage, last);
+				j += run;
+			}
+			this->progress.pagesDirty += dirty;
+			this->progress.bytesWritten += dirty * batch.pageSize;
+			this->stats.AddWritten(dirty, dirty * batch.pageSize);
+		};
+	}
+
+	std::size_t BackupV1::ProcessPages(sqlite3_stmt* stmtRead, PageWriter& writer, const std::vector<bool>* freePages) {
+		PagePipeline pipeline(this->hasher, this->options.threads, this->options.batchPages, &this->stats, &this->readLimiter, this->manifest.ExtentPages());
+		std::size_t lastPage = 0;
+		try {
+			pipeline.Run(stmtRead, this->GetPageSink(writer, lastPage), freePages);
+		}
+		catch (...) {
+			this->ReleaseCursor(stmtRead);
+			throw;
+		}
+		this->ReleaseCursor(stmtRead);
+		if (freePages)
+			this->MarkFreePages(*freePages);
+		return lastPage;
+	}
+
+	bool BackupV1::ProcessImage(sqlite3* db, std::size_t pageCount, PageWriter& writer, const std::vector<bool>& freePages) {
+#ifdef SQLITE_OMIT_DESERIALIZE
+		return false;
+#else
+		//Read transaction keeps other connections from writing the buffer, but another thread of this connection may write inside it
+		//and move the buffer. Connection mutex is held until the image is read, connection without mutex is not shared by threads
+		sqlite3_mutex* mutex = sqlite3_db_mutex(db);
+		sqlite3_mutex_enter(mutex);
+		try {
+			//Private database of memdb VFS (deserialized or opened by URI vfs=memdb) lives in one buffer, it is returned without copy.
+			//Shared memdb databases and databases of other VFS return null and are read by cursor
+			sqlite3_int64 size = 0;
+			const char* image = reinterpret_cast<const char*>(sqlite3_serialize(db, this->Schema(), &size, SQLITE_SERIALIZE_NOCOPY));
+			const std::size_t pageSize = image != nullptr && pageCount != 0 ? this->GetPageSize(db, this->Schema()) : 0;
+			if (pageSize == 0 || static_cast<uint64_t>(size) < static_cast<uint64_t>(pageCount) * pageSize) {
+				sqlite3_mutex_leave(mutex);
+				return false;
+			}
+			PagePipeline pipeline(this->hasher, this->options.threads, this->options.batchPages, &this->stats, &this->readLimiter, this->manifest.ExtentPages());
+			std::size_t lastPage = 0;
+			pipeline.Run(image, pageSize, pageCount, this->GetPageSink(writer, lastPage), &freePages);
+		}
+		catch (...) {
+			sqlite3_mutex_leave(mutex);
+			throw;
+		}
+		sqlite3_mutex_leave(mutex);
+		this->MarkFreePages(freePages);
+		return true;
+#endif
+	}
+
+	std::vector<bool> BackupV1::GetFreePages(sqlite3* db, const char* schema, std::size_t pageCount) const {
+		//Trunk pages hold the free list itself and are copied, only leaf pages are free. A malformed list frees nothing
+		std::vector<bool> freePages;
+		//Free page is hashed and copied as part of its extent
+		if (this->manifest.IsOpen() && this->manifest.ExtentPages() > 1)
+			return freePages;
+		auto stmtRead = this->GetPageCursor(db, schema, 1);
+		std::size_t trunk = 0, total = 0;
+		if (sqlite3_step(stmtRead) == SQLITE_ROW && sqlite3_column_bytes(stmtRead, 1) >= static_cast<int>(HEADER_FREELIST_COUNT + 4)) {
+			const unsigned char* data = reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmtRead, 1));
+			trunk = ReadBigEndian32(data + HEADER_FREELIST_TRUNK);
+			total = ReadBigEndian32(data + HEADER_FREELIST_COUNT);
+		}
+		sqlite3_finalize(stmtRead);
+		if (total == 0 || trunk == 0)
+			return freePages;
+
+		freePages.assign(pageCount + 1, false);
+		std::vector<bool> trunks(pageCount + 1, false);
+		std::size_t listed = 0;
+		while (trunk != 0) {
+			if (trunk < 2 || trunk > pageCount || trunks[trunk] || freePages[trunk] || ++listed > total)
+				return std::vector<bool>();
+			trunks[trunk] = true;
+			stmtRead = this->GetPageCursor(db, schema, std::set<std::size_t>{ trunk });
+			const unsigned char* data = nullptr;
+			std::size_t size = 0;
+			if (sqlite3_step(stmtRead) == SQLITE_ROW) {
+				data = reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmtRead, 1));
+				size = static_cast<std::size_t>(sqlite3_column_bytes(stmtRead, 1));
+			}
+			const std::size_t leafCount = data && size >= 8 ? ReadBigEndian32(data + 4) : 0;
+			bool valid = data && size >= 8 && leafCount <= (size - 8) / 4 && listed + leafCount <= total;
+			const std::size_t next = valid ? ReadBigEndian32(data) : 0;
+			for (std::size_t k = 0; valid && k < leafCount; ++k) {
+				const std::size_t leaf = ReadBigEndian32(data + 8 + 4 * k);
+				valid = leaf >= 2 && leaf <= pageCount && !freePages[leaf] && !trunks[leaf];
+				if (valid)
+					freePages[leaf] = true;
+			}
+			sqlite3_finalize(stmtRead);
+			if (!valid)
+				return std::vector<bool>();
+			listed += leafCount;
+			trunk = next;
+		}
+		return listed == total ? freePages : std::vector<bool>();
+	}
+
+	void BackupV1::MarkFreePages(const std::vector<bool>& freePages) {
+		this->freeList = freePages;
+		for (std::size_t pgno = 1; pgno < freePages.size(); ++pgno) {
+			if (freePages[pgno] && (pgno > this->manifest.PageCount() || this->manifest.Get(pgno) != 0))
+				this->manifest.Set(pgno, 0);
+		}
+	}
+
+	void BackupV1::ExpandToExtents(std::set<std::size_t>& pages, std::size_t pageCount) const {
+		const std::size_t extentPages = this->manifest.ExtentPages();
+		if (extentPages == 1)
+			return;
+		//Last extent cut by truncation has unknown hash until it is hashed again
+		if (pageCount % extentPages != 0 && pageCount <= this->manifest.PageCount() && this->manifest.Get(pageCount) == 0)
+			pages.insert(pageCount);
+		std::set<std::size_t> extents;
+		for (std::size_t pgno : pages) {
+			const std::size_t first = (pgno - 1) / extentPages * extentPages + 1;
+			for (std::size_t i = first; i < first + extentPages && i <= pageCount; ++i)
+				extents.insert(extents.end(), i);
+		}
+		pages.swap(extents);
+	}
+
+	void BackupV1::PunchFreePages(std::size_t pageCount) {
+		//Old contents of pages on the free list of backed up snapshot are released. Zero manifest hash alone may mean unknown contents
+		const uint64_t pageSize = this->manifest.PageSize();
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		for (std::size_t pgno = 2; pgno < std::min(this->freeList.size(), pageCount + 1); ++pgno) {
+			if (!this->freeList[pgno])
+				continue;
+			if (!ranges.empty() && ranges.back().first + ranges.back().second == (pgno - 1) * pageSize)
+				ranges.back().second += pageSize;
+			else
+				ranges.emplace_back((pgno - 1) * pageSize, pageSize);
+		}
+		if (!ranges.empty())
+			tools::PunchHoles(this->GetBackupDbPath(), ranges);
+	}
+
+	void BackupV1::AttachPageStore() {
+		//Checked before anything is attached or cleared
+		if (this->options.extentPages > 1 && (!this->options.pageStore.empty() || this->options.outputFd >= 0)) {
+			throw BackupException("Extents of several pages need own backup image, page store and stream keep hashes of single pages", BackupException::Error::BackupInit);
+		}
+		if (this->options.pageStore.empty() || this->options.outputFd >= 0)
+			return;
+		const std::string directory = boost::filesystem::absolute(this->options.pageStore).string();
+		if (this->pageMaps.Directory() == directory)
+			return;
+		//Generations of own image or of another store are not carried over, the first generation in the store copies every page
+		this->ClearImpl();
+		this->pageMaps.Attach(directory);
+	}
+
+	std::unique_ptr<PageWriter> BackupV1::BeginGeneration() {
+		std::unique_ptr<PageWriter> writer;
+		this->freeList.clear();
+		if (this->options.outputFd >= 0) {
+			//Stream holds pages changed since the previous stream, neither image nor generations are touched
+			this->generationState = GenerationState();
+			writer = std::make_unique<SinkWriter>(this->options.outputFd, this->manifest);
+		}
+		else if (this->pageMaps.IsAttached()) {
+			this->generationState = this->pageMaps.Load();
+			//Unchanged pages take their keys from the previous map, without one every page is copied
+			if (this->generationState.lastGeneration == 0)
+				this->manifest.Truncate(0);
+			writer = this->pageMaps.BeginGeneration(this->generationState.lastGeneration + 1);
+		}
+		else {
+			this->generationState = this->generations.Load();
+			if (this->generationState.lastGeneration != 0) {
+				const uint64_t generation = this->generationState.lastGeneration + 1;
+				writer = std::make_unique<SegmentWriter>(this->generations.GetSegmentPath(generation), generation);
+			}
+			else {
+				if (!boost::filesystem::exists(this->GetBackupDbPath())) {
+					std::ofstream fdbn(this->GetBackupDbPath(), std::ios::binary);
+					fdbn.close();
+				}
+				writer = PageWriter::Create(this->GetBackupDbPath(), this->options);
+			}
+		}
+		writer->SetIoPolicy(&this->writeLimiter, this->options.cacheMode != CacheMode::Default);
+		return writer;
+	}
+
+	void BackupV1::CommitGeneration(PageWriter& writer, std::size_t pageCount) {
+		//Dirty pages of the last batches are still queued in writer
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::Write);
+			writer.Flush();
+		}
+		if (this->options.outputFd >= 0) {
+			//Stream carries the committed manifest, so it is committed first
+			{
+				StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestStore);
+				this->manifest.Commit();
+			}
+			{
+				StatsRecorder::Scope scope(&this->stats, BackupPhase::Commit);
+				try {
+					static_cast<SinkWriter&>(writer).Finish(this->GetPageHashesCacheFilePath(), pageCount);
+				}
+				catch (...) {
+					//Consumer got no End record and drops the stream, the next stream copies every page
+					this->manifest.Truncate(0);
+					this->manifest.Commit();
+					throw;
+				}
+			}
+			this->StampSession();
+			this->stats.Stop();
+			return;
+		}
+		//Generation is recorded before manifest, a crash in between leaves manifest uncommitted and the next backup copies every page
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::Commit);
+			if (this->pageMaps.IsAttached()) {
+				StoreWriter& stored = static_cast<StoreWriter&>(writer);
+				stored.Finish(this->manifest, pageCount, this->freeList);
+				stored.ReleaseCache();
+			}
+			else if (this->generationState.lastGeneration != 0) {
+				SegmentWriter& segment = static_cast<SegmentWriter&>(writer);
+				segment.Finish(this->manifest, pageCount);
+				segment.ReleaseCache();
+				this->generations.CommitSegment(segment.Generation());
+			}
+			else {
+				boost::filesystem::resize_file(this->GetBackupDbPath(), static_cast<uint64_t>(pageCount) * this->manifest.PageSize());
+				this->PunchFreePages(pageCount);
+				writer.ReleaseCache();
+				//Extent hash does not check page 1 alone, base image written with extents records no page hash
+				const hash_t pageHash = pageCount > 0 && this->manifest.ExtentPages() == 1 ? this->manifest.Get(1) : 0;
+				this->generations.CommitBase(1, pageHash, this->manifest.Algorithm(), this->manifest.PageSize());
+			}
+		}
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestStore);
+			this->manifest.Commit();
+			if (this->options.cacheMode != CacheMode::Default)
+				this->manifest.DropCache();
+		}
+		this->StampSession();
+		//Merge runs once backup is committed, merge interrupted here is finished before base image is read again
+		if (this->options.retainGenerations > 0) {
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::Commit);
+			this->CompactImpl(this->options.retainGenerations);
+		}
+		this->stats.Stop();
+	}
+
+	void BackupV1::CompactImpl(unsigned retainGenerations) {
+		if (this->pageMaps.IsAttached())
+			this->pageMaps.Compact(retainGenerations);
+		else
+			this->generations.Compact(retainGenerations, this->options);
+	}
+
+	void BackupV1::GenerationsImpl(uint64_t& oldest, uint64_t& latest) {
+		const GenerationState state = this->pageMaps.IsAttached() ? this->pageMaps.Load() : this->generations.Load();
+		oldest = state.compactTarget ? state.compactTarget : state.baseGeneration;
+		latest = state.lastGeneration;
+	}
+
+	std::vector<PageRange> BackupV1::DiffImpl(const char* otherName) {
+		auto open = [this](Manifest& manifest, const std::string& path) {
+			if (!boost::filesystem::exists(path)) {
+				throw BackupException(tools::FormatString::format("Integrity file [%s] not exists", path.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			manifest.Open(path, true, this->hashFunction);
+			if (!manifest.IsCommitted()) {
+				throw BackupException(tools::FormatString::format("Integrity file [%s] corrupted", path.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			const std::vector<PageRange> damaged = manifest.Verify();
+			if (!damaged.empty()) {
+				throw BackupException(tools::FormatString::format("Integrity file [%s] corrupted, pages %s", path.c_str(), FormatRanges(damaged).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+		};
+		Manifest other;
+		open(this->manifest, this->GetPageHashesCacheFilePath());
+		open(other, this->GetPageHashesCacheFilePath(otherName));
+
+		//Hashes of different page size or algorithm are not comparable, every page differs
+		if (this->manifest.PageSize() != other.PageSize() || this->manifest.Algorithm() != other.Algorithm() || this->manifest.ExtentPages() != other.ExtentPages()) {
+			const std::size_t pageCount = std::max(this->manifest.PageCount(), other.PageCount());
+			return pageCount ? std::vector<PageRange>{ { 1, pageCount } } : std::vector<PageRange>();
+		}
+		return this->manifest.Diff(other);
+	}
+
+	void BackupV1::VerifyImpl(uint64_t scrubPages, VerifyResult& result) {
+		const bool stored = this->pageMaps.IsAttached();
+		if (!stored && !boost::filesystem::exists(this->GetBackupDbPath())) {
 			throw BackupException(tools::FormatString::format("Backup file [%s] not exists", this->GetBackupDbPath().c_str()).c_str(), BackupException::Error::BackupInit);
 		}
+		this->stats.Start();
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestLoad);
+			IntegrityCheck();
+		}
+		const PageHasher hasher = this->manifest.Algorithm() == this->hasher.algorithm ? this->hasher : PageHasher::Select(this->manifest.Algorithm(), this->hashFunction);
+		if (!hasher) {
+			throw BackupException("Hash function is not set", BackupException::Error::BackupInit);
+		}
+
+		//Scrub run continues after the pages checked by the previous one
+		const std::size_t pageCount = this->manifest.PageCount();
+		std::size_t first = 1;
+		std::size_t count = pageCount;
+		if (scrubPages > 0) {
+			uint64_t cursor = 0;
+			std::ifstream fCursor(this->GetScrubCursorFilePath(), std::ios::binary);
+			if (fCursor.read(reinterpret_cast<char*>(&cursor), sizeof(cursor)) && cursor >= 1 && cursor <= pageCount)
+				first = static_cast<std::size_t>(cursor);
+			//Extent is checked whole, scrub run covers whole extents
+			const std::size_t extentPages = this->manifest.ExtentPages();
+			first = (first - 1) / extentPages * extentPages + 1;
+			count = static_cast<std::size_t>(std::min<uint64_t>((scrubPages + extentPages - 1) / extentPages * extentPages, pageCount - first + 1));
+		}
+
+		//Generations are read in place from base image and segments, page store backup is materialized
+		RestoreSource source;
+		ImageLayout layout;
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::Materialize);
+			if (stored) {
+				source = this->pageMaps.Materialize(0);
+				layout = ImageLayout::Single(source.path, this->manifest.PageSize());
+			}
+			else
+				layout = this->generations.Locate(this->manifest.PageSize(), this->options);
+		}
+		try {
+			const ImageVerifier verifier(hasher, this->options.threads, this->options.batchPages, &this->readLimiter, this->options.cacheMode != CacheMode::Default);
+			verifier.Run(this->manifest, layout, first, count, result);
+		}
+		catch (...) {
+			if (source.temporary)
+				std::remove(source.path.c_str());
+			throw;
+		}
+		if (source.temporary)
+			std::remove(source.path.c_str());
+		this->stats.AddRead(static_cast<std::size_t>(result.pagesChecked), static_cast<std::size_t>(result.pagesChecked * this->manifest.PageSize()));
+
+		result.nextPage = first + count > pageCount ? 1 : first + count;
+		if (scrubPages > 0) {
+			std::ofstream fCursor(this->GetScrubCursorFilePath(), std::ios::binary);
+			fCursor.write(reinterpret_cast<const char*>(&result.nextPage), sizeof(result.nextPage));
+		}
+		this->stats.Stop();
+		if (!result.mismatched.empty()) {
+			throw BackupException(tools::FormatString::format("Backup file [%s] corrupted, pages %s", this->GetBackupDbPath().c_str(), FormatRanges(result.mismatched).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+		}
+	}
+
+	void BackupV1::ReadImpl(sqlite3* dst, uint64_t generation) {
+		//Check backup file, backup in page store is checked by materializing its map
+		const bool stored = this->pageMaps.IsAttached();
+		if (!stored && !boost::filesystem::exists(this->GetBackupDbPath())) {
+			throw BackupException(tools::FormatString::format("Backup file [%s] not exists", this->GetBackupDbPath().c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+		this->stats.Start();
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestLoad);
+			IntegrityCheck();
+		}
+
+		//Materialize phase covers applying segments and checking page 1 of the image
+		std::optional<StatsRecorder::Scope> materializeScope;
+		materializeScope.emplace(&this->stats, BackupPhase::Materialize);
+		RestoreSource source = stored ? this->pageMaps.Materialize(generation) : this->generations.Materialize(generation, this->hashFunction, this->options);
 		sqlite3* bckp = nullptr;
-		int rc = sqlite3_open_v2(this->GetBackupDbPath().c_str(), &bckp, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+		auto release = [&source, &bckp] {
+			sqlite3_close(bckp);
+			if (source.temporary)
+				std::remove(source.path.c_str());
+		};
+		int rc = sqlite3_open_v2(source.path.c_str(), &bckp, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
 		if (rc != SQLITE_OK) {
+			release();
 			throw BackupException(tools::FormatString::format("sqlite3 open error: (%d) %s", rc, sqlite3_errstr(rc)).c_str(), BackupException::Error::BackupInit);
 		}
-		
-		IntegrityCheck(dst, bckp);
-		
-		//Read
-		
-		auto loadFromBackup = sqlite3_backup_init(
-			dst, "main",
-			bckp, "main");
-		if (loadFromBackup == nullptr) {
-			throw BackupException("sqlite3 backup init error", BackupException::Error::BackupInit);
+
+		try {
+			//Latest generation is checked against manifest, older ones against hash recorded with generation,
+			//base image written before generations has no recorded hash
+			const hash_t expectedHash = source.latest ? this->manifest.Get(1) : source.pageHash;
+			if (expectedHash != 0)
+				CheckDbIntegrity(bckp, expectedHash, source.latest ? this->manifest.Algorithm() : source.hashAlgorithm, source.latest ? this->manifest.ExtentPages() : 1);
+			materializeScope.reset();
+
+			//Read
+			const bool deserialized = this->IsMemoryDb(dst) && this->DeserializeImpl(dst, source.path, this->GetPageCount(bckp, IMAGE_SCHEMA), this->GetPageSize(bckp, IMAGE_SCHEMA));
+			if (!deserialized && (!this->options.differentialRestore || !this->ReadDifferentialImpl(dst, bckp, source.latest))) {
+				StatsRecorder::Scope scope(&this->stats, BackupPhase::Restore);
+				auto loadFromBackup = sqlite3_backup_init(
+					dst, this->Schema(),
+					bckp, IMAGE_SCHEMA);
+				if (loadFromBackup == nullptr) {
+					throw BackupException("sqlite3 backup init error", BackupException::Error::BackupInit);
+				}
+
+				rc = sqlite3_backup_step(loadFromBackup, -1);
+				this->stats.AddRestored(static_cast<std::size_t>(sqlite3_backup_pagecount(loadFromBackup)));
+				sqlite3_backup_finish(loadFromBackup);
+				if (rc != SQLITE_DONE) {
+					throw BackupException(tools::FormatString::format("sqlite3 backup error: (%d) %s", rc, sqlite3_errstr(rc)).c_str(), BackupException::Error::BackupInit);
+				}
+			}
 		}
-		
-		rc = sqlite3_backup_step(loadFromBackup, -1);
+		catch (...) {
+			release();
+			throw;
+		}
+		release();
+		this->stats.Stop();
+	}
+
+	void BackupV1::ReadFileImpl(const char* dstPath, uint64_t generation) {
+		const bool stored = this->pageMaps.IsAttached();
+		if (!stored && !boost::filesystem::exists(this->GetBackupDbPath())) {
+			throw BackupException(tools::FormatString::format("Backup file [%s] not exists", this->GetBackupDbPath().c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+		this->stats.Start();
+		{
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::ManifestLoad);
+			IntegrityCheck();
+		}
+
+		std::optional<StatsRecorder::Scope> materializeScope;
+		materializeScope.emplace(&this->stats, BackupPhase::Materialize);
+		RestoreSource source = stored ? this->pageMaps.Materialize(generation) : this->generations.Materialize(generation, this->hashFunction, this->options);
+		const std::string target(dstPath);
+		const std::string tmpPath = target + ".restore";
+		try {
+			//Materialized copy is moved in place, image is cloned so backup keeps its own
+			boost::system::error_code error;
+			if (source.temporary)
+				boost::filesystem::rename(source.path, tmpPath, error);
+			if (!source.temporary || error)
+				tools::CloneFile(source.path, tmpPath, true);
+
+			//Copy is checked before it replaces destination, latest generation page by page against manifest
+			std::size_t pageCount = 0;
+			if (source.latest) {
+				const PageHasher hasher = this->manifest.Algorithm() == this->hasher.algorithm ? this->hasher : PageHasher::Select(this->manifest.Algorithm(), this->hashFunction);
+				if (!hasher) {
+					throw BackupException("Hash function is not set", BackupException::Error::BackupInit);
+				}
+				VerifyResult result;
+				const ImageVerifier verifier(hasher, this->options.threads, this->options.batchPages, &this->readLimiter, this->options.cacheMode != CacheMode::Default);
+				verifier.Run(this->manifest, ImageLayout::Single(tmpPath, this->manifest.PageSize()), 1, this->manifest.PageCount(), result);
+				if (!result.mismatched.empty()) {
+					throw BackupException(tools::FormatString::format("Restored file [%s] corrupted, pages %s", tmpPath.c_str(), FormatRanges(result.mismatched).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+				}
+				pageCount = this->manifest.PageCount();
+			}
+			else {
+				sqlite3* bckp = nullptr;
+				int rc = sqlite3_open_v2(tmpPath.c_str(), &bckp, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+				try {
+					if (rc != SQLITE_OK) {
+						throw BackupException(tools::FormatString::format("sqlite3 open error: (%d) %s", rc, sqlite3_errstr(rc)).c_str(), BackupException::Error::BackupInit);
+					}
+					if (source.pageHash != 0)
+						CheckDbIntegrity(bckp, source.pageHash, source.hashAlgorithm, 1);
+					pageCount = this->GetPageCount(bckp, IMAGE_SCHEMA);
+				}
+				catch (...) {
+					sqlite3_close(bckp);
+					throw;
+				}
+				sqlite3_close(bckp);
+			}
+			materializeScope.reset();
+
+			StatsRecorder::Scope scope(&this->stats, BackupPhase::Restore);
+			//Journal or WAL left by replaced database would be applied to restored one
+			for (const char* suffix : { "-journal", "-wal", "-shm" })
+				std::remove((target + suffix).c_str());
+			boost::filesystem::rename(tmpPath, target);
+			this->stats.AddRestored(pageCount);
+		}
+		catch (...) {
+			if (source.temporary)
+				std::remove(source.path.c_str());
+			std::remove(tmpPath.c_str());
+			throw;
+		}
+		if (source.temporary)
+			std::remove(source.path.c_str());
+		this->stats.Stop();
+	}
+
+	bool BackupV1::IsMemoryDb(sqlite3* db) const {
+		//In-memory database has no file name
+		const char* dbFile = sqlite3_db_filename(db, this->Schema());
+		return dbFile && *dbFile == '\0';
+	}
+
+	bool BackupV1::DeserializeImpl(sqlite3* dst, const std::string& imagePath, std::size_t pageCount, std::size_t pageSize) {
+#ifdef SQLITE_OMIT_DESERIALIZE
+		return false;
+#else
+		const uint64_t size = static_cast<uint64_t>(pageCount) * pageSize;
+		if (size <= HEADER_READ_VERSION || boost::filesystem::file_size(imagePath) < size)
+			return false;
+		unsigned char* data = static_cast<unsigned char*>(sqlite3_malloc64(size));
+		if (data == nullptr)
+			return false;
+		std::ifstream fImage(imagePath, std::ios::binary);
+		if (!fImage.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(size))) {
+			sqlite3_free(data);
+			throw BackupException(tools::FormatString::format("Error reading backup file [%s]", imagePath.c_str()).c_str(), BackupException::Error::BackupLoad);
+		}
+		//In-memory database has no WAL, image of WAL database is switched to rollback journal
+		if (data[HEADER_WRITE_VERSION] == 2 && data[HEADER_READ_VERSION] == 2)
+			data[HEADER_WRITE_VERSION] = data[HEADER_READ_VERSION] = 1;
+		//Connection owns buffer from here, it is freed on error too
+		if (sqlite3_deserialize(dst, this->Schema(), data, static_cast<sqlite3_int64>(size), static_cast<sqlite3_int64>(size), SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE) != SQLITE_OK)
+			return false;
+		this->stats.AddRestored(pageCount);
+		return true;
+#endif
+	}
+
+	bool BackupV1::ReadDifferentialImpl(sqlite3* dst, sqlite3* src, bool latest) {
+		const std::size_t pageCount = this->GetPageCount(src, IMAGE_SCHEMA);
+		const std::size_t pageSize = this->GetPageSize(src, IMAGE_SCHEMA);
+		if (!this->hasher || pageCount == 0 || this->GetPageSize(dst, this->Schema()) != pageSize)
+			return false;
+		const std::size_t dstPageCount = this->GetPageCount(dst, this->Schema());
+		if (dstPageCount < pageCount && !this->ExtendDb(dst, pageCount, pageSize))
+			return false;
+
+		//Destination is locked for writing before hashing, so hashed pages are the pages overwritten
+		if (sqlite3_exec(dst, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK)
+			return false;
+		if (dstPageCount > pageCount && !this->TruncateDb(dst, pageCount)) {
+			sqlite3_exec(dst, "ROLLBACK", nullptr, nullptr, nullptr);
+			return false;
+		}
+		try {
+			//Free pages of backup are left as they are in destination, their contents are never read
+			const std::vector<bool> freePages = this->GetFreePages(src, IMAGE_SCHEMA, pageCount);
+			const std::vector<hash_t> dstHashes = this->HashPages(this->GetPageCursor(dst, this->Schema()), &freePages);
+			std::vector<hash_t> srcHashes;
+			if (latest && this->manifest.PageCount() == pageCount && this->manifest.Algorithm() == this->hasher.algorithm && this->manifest.ExtentPages() == 1)
+				srcHashes.assign(this->manifest.Entries(), this->manifest.Entries() + pageCount);
+			else
+				srcHashes = this->HashPages(this->GetPageCursor(src, IMAGE_SCHEMA), &freePages);
+
+			//Page 1 of destination with another page count always differs, its header page count is rewritten with it
+			std::set<std::size_t> pages;
+			for (std::size_t pgno = 1; pgno <= pageCount; ++pgno) {
+				if (pgno < freePages.size() && freePages[pgno])
+					continue;
+				if (pgno > dstHashes.size() || pgno > srcHashes.size() || dstHashes[pgno - 1] != srcHashes[pgno - 1])
+					pages.insert(pgno);
+			}
+			if (!pages.empty())
+				this->WritePages(dst, src, pages);
+
+			int rc = sqlite3_exec(dst, "COMMIT", nullptr, nullptr, nullptr);
+			if (rc != SQLITE_OK) {
+				throw BackupException(tools::FormatString::format("sqlite3 commit error: (%d) %s", rc, sqlite3_errmsg(dst)).c_str(), BackupException::Error::BackupLoad);
+			}
+		}
+		catch (...) {
+			sqlite3_exec(dst, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+		return true;
+	}
+
+	bool BackupV1::ExtendDb(sqlite3* dst, std::size_t pageCount, std::size_t pageSize) {
+		//sqlite_dbpage only updates existing pages: the file is grown first, then page count in header of page 1 is raised
+		//in its own transaction. WAL page count comes from the commit frame, not from the file, so WAL databases are copied whole
+		if (this->IsWalMode(dst))
+			return false;
+		int chunkSize = static_cast<int>(pageSize);
+		sqlite3_int64 size = static_cast<sqlite3_int64>(pageCount) * pageSize;
+		sqlite3_file* file = nullptr;
+		sqlite3_int64 fileSize = 0;
+		//Windows VFS honours size hint only with chunk size set, page-size chunks keep the file a whole number of pages
+		if (sqlite3_file_control(dst, this->Schema(), SQLITE_FCNTL_CHUNK_SIZE, &chunkSize) != SQLITE_OK
+			|| sqlite3_file_control(dst, this->Schema(), SQLITE_FCNTL_SIZE_HINT, &size) != SQLITE_OK
+			|| sqlite3_file_control(dst, this->Schema(), SQLITE_FCNTL_FILE_POINTER, &file) != SQLITE_OK
+			|| file == nullptr || file->pMethods == nullptr
+			|| file->pMethods->xFileSize(file, &fileSize) != SQLITE_OK || fileSize < size)
+			return false;
+
+		if (sqlite3_exec(dst, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK)
+			return false;
+		sqlite3_stmt* stmtWrite = nullptr;
+		try {
+			std::vector<unsigned char> page1;
+			auto stmtRead = this->GetPageCursor(dst, this->Schema(), 1);
+			if (sqlite3_step(stmtRead) == SQLITE_ROW) {
+				const unsigned char* data = reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmtRead, 1));
+				page1.assign(data, data + sqlite3_column_bytes(stmtRead, 1));
+			}
+			sqlite3_finalize(stmtRead);
+			if (page1.size() != pageSize) {
+				sqlite3_exec(dst, "ROLLBACK", nullptr, nullptr, nullptr);
+				return false;
+			}
+			//Big-endian in-header database size, new pages stay unreferenced until the restore transaction
+			page1[28] = static_cast<unsigned char>(pageCount >> 24);
+			page1[29] = static_cast<unsigned char>(pageCount >> 16);
+			page1[30] = static_cast<unsigned char>(pageCount >> 8);
+			page1[31] = static_cast<unsigned char>(pageCount);
+
+			stmtWrite = this->GetPageUpdate(dst);
+			this->UpdatePage(dst, stmtWrite, 1, page1.data(), page1.size());
+			sqlite3_finalize(stmtWrite);
+			stmtWrite = nullptr;
+			int rc = sqlite3_exec(dst, "COMMIT", nullptr, nullptr, nullptr);
+			if (rc != SQLITE_OK) {
+				throw BackupException(tools::FormatString::format("sqlite3 commit error: (%d) %s", rc, sqlite3_errmsg(dst)).c_str(), BackupException::Error::BackupLoad);
+			}
+		}
+		catch (...) {
+			sqlite3_finalize(stmtWrite);
+			sqlite3_exec(dst, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw;
+		}
+		return this->GetPageCount(dst, this->Schema()) == pageCount;
+	}
+
+	std::vector<hash_t> BackupV1::HashPages(sqlite3_stmt* stmtRead, const std::vector<bool>* skipPages) {
+		PagePipeline pipeline(this->hasher, this->options.threads, this->options.batchPages, &this->stats, &this->readLimiter);
+		std::vector<hash_t> hashes;
+		try {
+			pipeline.Run(stmtRead, [&hashes](const PageBatch& batch) {
+				for (std::size_t j = 0; j < batch.size(); ++j) {
+					const std::size_t i = batch.pages[j];
+					if (i > hashes.size())
+						hashes.resize(i, 0);
+					hashes[i - 1] = batch.pageHashes[j];
+				}
+			}, skipPages);
+		}
+		catch (...) {
+			sqlite3_finalize(stmtRead);
+			throw;
+		}
+		sqlite3_finalize(stmtRead);
+		return hashes;
+	}
+
+	bool BackupV1::TruncateDb(sqlite3* dst, std::size_t pageCount) {
+		//Insert of null data drops the page and all after it when transaction commits, SQLite before 3.44 refuses it and
+		//destination is copied whole
+		sqlite3_stmt* stmt = nullptr;
+		const std::string query("INSERT INTO sqlite_dbpage(pgno, data, schema) VALUES(?1, NULL, " + tools::QuoteSql(this->Schema(), '\'') + ")");
+		if (sqlite3_prepare_v2(dst, query.c_str(), query.size(), &stmt, nullptr) != SQLITE_OK)
+			return false;
+		sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(pageCount + 1));
+		const int rc = sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		return rc == SQLITE_DONE;
+	}
+
+	sqlite3_stmt* BackupV1::GetPageUpdate(sqlite3* dst) const {
+		sqlite3_stmt* stmt = nullptr;
+		const std::string query("UPDATE sqlite_dbpage SET data = ?2 WHERE pgno = ?1 AND schema = " + tools::QuoteSql(this->Schema(), '\''));
+		int rc = sqlite3_prepare_v2(dst, query.c_str(), query.size(), &stmt, nullptr);
+		if (rc != SQLITE_OK) {
+			throw BackupException(tools::FormatString::format("Error preparing SQL query '%s' : %s", query.c_str(), sqlite3_errstr(rc)).c_str(), BackupException::Error::BackupLoad);
+		}
+		return stmt;
+	}
+
+	void BackupV1::UpdatePage(sqlite3* dst, sqlite3_stmt* stmtWrite, std::size_t pgno, const void* data, std::size_t size) const {
+		sqlite3_bind_int64(stmtWrite, 1, static_cast<sqlite3_int64>(pgno));
+		sqlite3_bind_blob(stmtWrite, 2, data, static_cast<int>(size), SQLITE_STATIC);
+		const int rc = sqlite3_step(stmtWrite);
+		sqlite3_reset(stmtWrite);
 		if (rc != SQLITE_DONE) {
-			throw BackupException(tools::FormatString::format("sqlite3 backup error: (%d) %s", rc, sqlite3_errstr(rc)).c_str(), BackupException::Error::BackupInit);
+			throw BackupException(tools::FormatString::format("Error writing page %d : %s", pgno, sqlite3_errmsg(dst)).c_str(), BackupException::Error::BackupLoad);
 		}
-		sqlite3_backup_finish(loadFromBackup);
 	}
 
-	void BackupV1::IntegrityCheck(sqlite3 *dst, sqlite3 *src) {
+	void BackupV1::WritePages(sqlite3* dst, sqlite3* src, const std::set<std::size_t>& pages) {
+		StatsRecorder::Scope scope(&this->stats, BackupPhase::Restore);
+		sqlite3_stmt* stmtWrite = this->GetPageUpdate(dst);
+		sqlite3_stmt* stmtRead = nullptr;
+		try {
+			stmtRead = this->GetPageCursor(src, IMAGE_SCHEMA, pages);
+			int rc = SQLITE_OK;
+			while ((rc = sqlite3_step(stmtRead)) == SQLITE_ROW) {
+				this->UpdatePage(dst, stmtWrite, static_cast<std::size_t>(sqlite3_column_int64(stmtRead, 0)), sqlite3_column_blob(stmtRead, 1), sqlite3_column_bytes(stmtRead, 1));
+				this->stats.AddRestored(1);
+			}
+			if (rc != SQLITE_DONE) {
+				throw BackupException(tools::FormatString::format("Error fetching data: %s", sqlite3_errstr(rc)).c_str(), BackupException::Error::BackupLoad);
+			}
+		}
+		catch (...) {
+			sqlite3_finalize(stmtRead);
+			sqlite3_finalize(stmtWrite);
+			throw;
+		}
+		sqlite3_finalize(stmtRead);
+		sqlite3_finalize(stmtWrite);
+	}
+
+	void BackupV1::IntegrityCheck() {
 		if (!boost::filesystem::exists(this->GetPageHashesCacheFilePath())) {
 			throw BackupException(tools::FormatString::format("Integrity file [%s] not exists", this->GetBackupDbPath().c_str()).c_str(), BackupException::Error::IntegrityCheck);
 		}
-		this->ReadPageHashes(this->GetPageHashesCacheFilePath().c_str());
-		hash_t currdatahash = this->hashFunction(reinterpret_cast<char*>(&this->hashes[1]), (this->hashes.size() - 1) * sizeof(hash_t));
-		if (this->hashes.at(0) != currdatahash) {
+		this->manifest.Open(this->GetPageHashesCacheFilePath(), true, this->hashFunction);
+		if (!this->manifest.IsCommitted() || this->manifest.PageCount() == 0) {
 			throw BackupException(tools::FormatString::format("Integrity file [%s] corrupted", this->GetPageHashesCacheFilePath().c_str()).c_str(), BackupException::Error::IntegrityCheck);
 		}
-		CheckDbIntegrity(src);
+		const std::vector<PageRange> damaged = this->manifest.Verify();
+		if (!damaged.empty()) {
+			throw BackupException(tools::FormatString::format("Integrity file [%s] corrupted, pages %s", this->GetPageHashesCacheFilePath().c_str(), FormatRanges(damaged).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+		}
 	}
 
-	void BackupV1::CheckDbIntegrity(sqlite3* src) {
-		auto stmtRead = this->GetPageCursor(src, 1);
+	void BackupV1::CheckDbIntegrity(sqlite3* src, hash_t expectedHash, HashAlgorithm algorithm, std::size_t extentPages) {
+		//Backup written with another algorithm is checked with it, callback algorithm can not be checked without callback
+		const PageHasher hasher = algorithm == this->hasher.algorithm ? this->hasher : PageHasher::Select(algorithm, this->hashFunction);
+		if (!hasher)
+			return;
+		auto stmtRead = this->GetPageCursor(src, IMAGE_SCHEMA, static_cast<int>(extentPages));
 		int status = sqlite3_step(stmtRead);		
 		hash_t inputHash = 0;
-		if (status == SQLITE_ROW) {
-			const void* data = sqlite3_column_blob(stmtRead, 0);
-			const std::size_t size = sqlite3_column_bytes(stmtRead, 0);
+		if (status == SQLITE_ROW && extentPages == 1) {
+			const void* data = sqlite3_column_blob(stmtRead, 1);
+			const std::size_t size = sqlite3_column_bytes(stmtRead, 1);
 
-			inputHash = this->hashFunction(data, size);
+			inputHash = hasher.single(data, size);
+		}
+		else if (status == SQLITE_ROW) {
+			//First extent is hashed as one buffer of its pages
+			std::vector<char> extent;
+			for (; status == SQLITE_ROW; status = sqlite3_step(stmtRead)) {
+				const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(stmtRead, 1));
+				extent.insert(extent.end(), data, data + sqlite3_column_bytes(stmtRead, 1));
+			}
+			inputHash = hasher.single(extent.data(), extent.size());
 		}
 		else
 			throw BackupException(tools::FormatString::format("Error fetching data: %s", sqlite3_errstr(status)).c_str(), BackupException::Error::IntegrityCheck);			
 		
 		sqlite3_finalize(stmtRead);	
 		
-		if (inputHash != this->hashes.at(1)) {
+		if (inputHash != expectedHash) {
 			throw BackupException("Sqlite3 database check integrity failed", BackupException::Error::IntegrityCheck);
 		}
 	}
 
 	void BackupV1::ClearImpl() {
-		this->hashes.clear();
+		this->manifest.Close();
+		this->pageMaps.Clear();
+		this->generations.Clear();
 		std::remove(this->GetPageHashesCacheFilePath().c_str());
+		std::remove(this->GetWalMarkerFilePath().c_str());
+		std::remove(this->GetDirtyMarkFilePath().c_str());
+		std::remove(this->GetScrubCursorFilePath().c_str());
 		std::remove(this->GetBackupDbPath().c_str());
 	}
 
-	void BackupV1::WritePageHashes() const {		
-		std::ofstream fManifest(this->GetPageHashesCacheFilePath(), std::ios::binary);
-		std::for_each(this->hashes.begin(), this->hashes.end(), [&fManifest](hash_t sum) {
-			fManifest.write(reinterpret_cast<const char*>(&sum), sizeof(sum));
-		});		
+	sqlite3_stmt* BackupV1::GetPageCursor(sqlite3 *db, const char* schema, int limit) const {
+		sqlite3_stmt* stmt = nullptr;		
+		const std::string query( limit == -1 ? tools::FormatString::format("SELECT pgno, data FROM sqlite_dbpage(%s)", tools::QuoteSql(schema, '\''))
+			: tools::FormatString::format("SELECT pgno, data FROM sqlite_dbpage(%s) ORDER BY pgno LIMIT %d", tools::QuoteSql(schema, '\''), limit));
+		int rc = sqlite3_prepare_v2(db, query.c_str(), query.size(), &stmt, nullptr);
+		if (rc != SQLITE_OK) {
+			throw BackupException(tools::FormatString::format("Error preparing SQL query '%s' : %s", query.c_str(), sqlite3_errstr(rc)).c_str(), BackupException::Error::SelectPages);
+		}
+		return stmt;
 	}
-	
-	void BackupV1::WritePage(std::size_t i, const void* data, std::size_t size, std::ofstream &fdb) {
-		auto path = this->GetBackupDbPath();		
-		if (!fdb.is_open())
-			throw BackupException("Backup database file is not open", BackupException::Error::BackupInit);
-		fdb.seekp(i * size);
-		fdb.write(reinterpret_cast<const char*>(data), size);		
+
+	sqlite3_stmt* BackupV1::GetPageCursor(sqlite3* db, const char* schema, const std::set<std::size_t>& pages) const {
+		std::string list;
+		for (std::size_t pgno : pages) {
+			if (!list.empty())
+				list += ',';
+			list += std::to_string(pgno);
+		}
+		sqlite3_stmt* stmt = nullptr;
+		const std::string query(tools::FormatString::format("SELECT pgno, data FROM sqlite_dbpage(%s) WHERE pgno IN (%s) ORDER BY pgno", tools::QuoteSql(schema, '\''), list));
+		int rc = sqlite3_prepare_v2(db, query.c_str(), query.size(), &stmt, nullptr);
+		if (rc != SQLITE_OK) {
+			throw BackupException(tools::FormatString::format("Error preparing SQL query for %d pages : %s", pages.size(), sqlite3_errstr(rc)).c_str(), BackupException::Error::SelectPages);
+		}
+		return stmt;
 	}
-	
-	void BackupV1::ReadPageHashes(const char *path) {
-		std::ifstream fManifest(path, std::ios::binary);
-		
-		this->hashes.clear();
-		this->hashes.reserve(fManifest.tellg()/sizeof(hash_t));		
-		fManifest.seekg(0);
-		while(1) {
-			hash_t sum = 0;
-			fManifest.read(reinterpret_cast<char*>(&sum), sizeof(sum));
-			if (fManifest.eof())
-				break;
-			this->hashes.push_back(sum);
+
+	bool BackupV1::IsWalMode(sqlite3* db) const {
+		sqlite3_stmt* stmt = nullptr;
+		const std::string query("PRAGMA " + tools::QuoteSql(this->Schema(), '"') + ".journal_mode");
+		if (sqlite3_prepare_v2(db, query.c_str(), query.size(), &stmt, nullptr) != SQLITE_OK)
+			return false;
+		bool wal = false;
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char* mode = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+			wal = mode && boost::iequals(mode, "wal");
 		}
-		
+		sqlite3_finalize(stmt);
+		return wal;
 	}
-	
-	sqlite3_stmt* BackupV1::GetPageCursor(sqlite3 *db, int limit) const {
-		sqlite3_stmt* stmt = nullptr;		
-		const std::string query( limit == -1 ? std::string("SELECT data FROM sqlite_dbpage('main')") : tools::FormatString::format("SELECT data FROM sqlite_dbpage('main') ORDER BY pgno LIMIT %d", limit));
+
+	std::string BackupV1::GetWalPath(sqlite3* db) const {
+		const std::string dbPath = this->GetDbPath(db);
+		return dbPath.empty() ? dbPath : dbPath + "-wal";
+	}
+
+	std::size_t BackupV1::GetPageSize(sqlite3* db, const char* schema) const {
+		sqlite3_stmt* stmt = nullptr;
+		const std::string query("PRAGMA " + tools::QuoteSql(schema, '"') + ".page_size");
 		int rc = sqlite3_prepare_v2(db, query.c_str(), query.size(), &stmt, nullptr);
 		if (rc != SQLITE_OK) {
 			throw BackupException(tools::FormatString::format("Error preparing SQL query '%s' : %s", query.c_str(), sqlite3_errstr(rc)).c_str(), BackupException::Error::SelectPages);
 		}
-		return stmt;
+		sqlite3_step(stmt);
+		std::size_t pageSize = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+		return pageSize;
 	}
 
-	std::size_t BackupV1::GetPageCount(sqlite3* db) const {
+	std::size_t BackupV1::GetPageCount(sqlite3* db, const char* schema) const {
 		sqlite3_stmt* stmt = nullptr;		
-		const std::string query("SELECT pgno FROM sqlite_dbpage('main') ORDER BY pgno DESC LIMIT 1");
+		const std::string query("PRAGMA " + tools::QuoteSql(schema, '"') + ".page_count");
 		int rc = sqlite3_prepare_v2(db, query.c_str(), query.size(), &stmt, nullptr);
 		if (rc != SQLITE_OK) {
 			throw BackupException(tools::FormatString::format("Error preparing SQL query '%s' : %s", query.c_str(), sqlite3_errstr(rc)).c_str(), BackupException::Error::SelectPages);
@@ -192,11 +1443,19 @@ namespace sqlite3_inc_bkp {
 		return tools::FormatString::format("%s%s_backup.sqlite", this->workspace.string().c_str(), this->name);
 	}
 
-	std::unique_ptr <IBackup> IBackup::Create(Version v, const char* path, const char* name, hash_func f) {
+	std::unique_ptr <IBackup> IBackup::Create(Version v, const char* path, const char* name, hash_func f, const BackupOptions& options) {
+		switch (v) {
+		case Version::V1:
+		default:
+			return std::make_unique<BackupV1>(path, name, f, options);
+		}
+	}
+
+	std::unique_ptr <IBackup> IBackup::Create(Version v, const char* path, const char* name, const PageHasher& hasher, const BackupOptions& options) {
 		switch (v) {
 		case Version::V1:
 		default:
-			return std::make_unique<BackupV1>(path, name, f);
+			return std::make_unique<BackupV1>(path, name, hasher, options);
 		}
 	}
 
@@ -1,17 +1,26 @@
 #pragma once
 
+#include <chrono>
+#include <set>
 #include <string>
 #include <stdio.h>
 
 #include <boost/filesystem.hpp>
+#include "api.h"
 #include "exception.h"
+#include "generation.h"
+#include "hasher.h"
+#include "manifest.h"
+#include "pagestore.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "throttle.h"
+#include "vfs.h"
+#include "wal.h"
 
 struct sqlite3_stmt;
 struct sqlite3;
 namespace sqlite3_inc_bkp {
-	using hash_t = uint64_t;
-	using hash_func = std::function<hash_t(const void*, std::size_t)>;
-
 	/// <summary>
 	/// Interface class of incremental backup implemention
 	/// </summary>
@@ -22,10 +31,26 @@ namespace sqlite3_inc_bkp {
 			V1
 		};
 		
-		static std::unique_ptr <IBackup> Create(Version v, const char* path, const char* name, hash_func f);
+		static std::unique_ptr <IBackup> Create(Version v, const char* path, const char* name, hash_func f, const BackupOptions& options = BackupOptions());
+
+		/// <summary>
+		/// Create backup hashing pages with hasher, options.hashAlgorithm is ignored. Use PageHasher::Create for compile-time hasher policy
+		/// </summary>
+		static std::unique_ptr <IBackup> Create(Version v, const char* path, const char* name, const PageHasher& hasher, const BackupOptions& options = BackupOptions());
 		virtual void Write(sqlite3* db) = 0;
-		virtual void Read(sqlite3* dst) = 0;
+		virtual void Read(sqlite3* dst, uint64_t generation) = 0;
+		virtual void ReadFile(const char* dstPath, uint64_t generation) = 0;
 		virtual void Clear() = 0;
+		virtual void Track(sqlite3* db) = 0;
+		virtual void Compact(unsigned retainGenerations) = 0;
+		virtual void Generations(uint64_t& oldest, uint64_t& latest) = 0;
+		virtual std::vector<PageRange> Diff(const char* otherName) = 0;
+		virtual void Verify(uint64_t scrubPages, VerifyResult& result) = 0;
+		virtual void Begin(sqlite3* db) = 0;
+		virtual bool Step(int nPages, unsigned timeBudgetMs) = 0;
+		virtual void OpenSession(sqlite3* db) = 0;
+		virtual BackupProgress Progress() const = 0;
+		virtual BackupStats Stats() const = 0;
 
 		
 		virtual ~IBackup() {}
@@ -34,7 +59,13 @@ namespace sqlite3_inc_bkp {
 	template <typename T>
 	class Backup : public IBackup {
 	public:
-		Backup<T>(const char* path, const char* name, hash_func func) : workspace(path), name(name), hashFunction(func) {
+		Backup<T>(const char* path, const char* name, hash_func func, const BackupOptions& options)
+			: workspace(path), name(name), hashFunction(func), hasher(PageHasher::Select(options.hashAlgorithm, func)), options(options) {
+			CreateWorkspaceIfNotExists();
+		}
+
+		Backup<T>(const char* path, const char* name, const PageHasher& hasher, const BackupOptions& options)
+			: workspace(path), name(name), hashFunction(hasher.algorithm == HashAlgorithm::Callback ? hasher.single : hash_func()), hasher(hasher), options(options) {
 			CreateWorkspaceIfNotExists();
 		}
 		
@@ -43,15 +74,70 @@ namespace sqlite3_inc_bkp {
 			pThis->BackupImpl(db);
 		}		
 
-		 void Read(sqlite3* dst) override {
+		 void Read(sqlite3* dst, uint64_t generation) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->ReadImpl(dst, generation);
+		}
+
+		void ReadFile(const char* dstPath, uint64_t generation) override {
 			auto pThis = static_cast<T*>(this);
-			pThis->ReadImpl(dst);
+			pThis->ReadFileImpl(dstPath, generation);
 		}
 
 		void Clear() override {
 			auto pThis = static_cast<T*>(this);
 			pThis->ClearImpl();
 		}
+
+		void Track(sqlite3* db) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->TrackImpl(db);
+		}
+
+		void Compact(unsigned retainGenerations) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->CompactImpl(retainGenerations);
+		}
+
+		void Generations(uint64_t& oldest, uint64_t& latest) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->GenerationsImpl(oldest, latest);
+		}
+
+		std::vector<PageRange> Diff(const char* otherName) override {
+			auto pThis = static_cast<T*>(this);
+			return pThis->DiffImpl(otherName);
+		}
+
+		void Verify(uint64_t scrubPages, VerifyResult& result) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->VerifyImpl(scrubPages, result);
+		}
+
+		void Begin(sqlite3* db) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->BeginImpl(db);
+		}
+
+		bool Step(int nPages, unsigned timeBudgetMs) override {
+			auto pThis = static_cast<T*>(this);
+			return pThis->StepImpl(nPages, timeBudgetMs);
+		}
+
+		void OpenSession(sqlite3* db) override {
+			auto pThis = static_cast<T*>(this);
+			pThis->OpenSessionImpl(db);
+		}
+
+		BackupProgress Progress() const override {
+			auto pThis = static_cast<const T*>(this);
+			return pThis->ProgressImpl();
+		}
+
+		BackupStats Stats() const override {
+			auto pThis = static_cast<const T*>(this);
+			return pThis->StatsImpl();
+		}
 	private:
 		void CreateWorkspaceIfNotExists() {
 			if (boost::filesystem::exists(workspace) && boost::filesystem::is_directory(workspace)) {
@@ -70,7 +156,9 @@ namespace sqlite3_inc_bkp {
 	protected:
 		boost::filesystem::path workspace;
 		std::string name;
-		hash_func hashFunction;
+		hash_func hashFunction;		//callback of HashAlgorithm::Callback, may be empty
+		PageHasher hasher;			//hash of pages of new backups
+		BackupOptions options;
 	};		
 
 	/// <summary>
@@ -78,34 +166,172 @@ namespace sqlite3_inc_bkp {
 	/// </summary>
 	class BackupV1 : public Backup<BackupV1> {
 	public:		
-		BackupV1(const char* path, const char* name, hash_func func) : Backup<BackupV1>(path, name, func) {}
+		BackupV1(const char* path, const char* name, hash_func func, const BackupOptions& options)
+			: Backup<BackupV1>(path, name, func, options), generations(this->GetBackupDbPath(), this->GetGenerationFilePrefix()), pageMaps(this->GetGenerationFilePrefix()), stats(options.trace),
+			readLimiter(options.readBytesPerSec), writeLimiter(options.writeBytesPerSec) {
+			this->stats.Watch(&this->readLimiter, &this->writeLimiter);
+		}
+		BackupV1(const char* path, const char* name, const PageHasher& hasher, const BackupOptions& options)
+			: Backup<BackupV1>(path, name, hasher, options), generations(this->GetBackupDbPath(), this->GetGenerationFilePrefix()), pageMaps(this->GetGenerationFilePrefix()), stats(options.trace),
+			readLimiter(options.readBytesPerSec), writeLimiter(options.writeBytesPerSec) {
+			this->stats.Watch(&this->readLimiter, &this->writeLimiter);
+		}
+		~BackupV1();
 	//Implementation backup method
 		void BackupImpl(sqlite3* db);
-		void ReadImpl(sqlite3* dst);
+		void ReadImpl(sqlite3* dst, uint64_t generation);
+		void ReadFileImpl(const char* dstPath, uint64_t generation);
 		void ClearImpl();
+		void TrackImpl(sqlite3* db);
+		void CompactImpl(unsigned retainGenerations);
+		void GenerationsImpl(uint64_t& oldest, uint64_t& latest);
+		std::vector<PageRange> DiffImpl(const char* otherName);
+		void VerifyImpl(uint64_t scrubPages, VerifyResult& result);
+		void BeginImpl(sqlite3* db);
+		bool StepImpl(int nPages, unsigned timeBudgetMs);
+		void OpenSessionImpl(sqlite3* db);
+		BackupProgress ProgressImpl() const;
+		BackupStats StatsImpl() const;
+	private:
+	//Reading data for backup, cursor returns (pgno, data) rows. Backed up database is options.schema of connection, backup image is main schema of its own
+		inline const char* Schema() const { return this->options.schema.c_str(); }
+		sqlite3_stmt* GetPageCursor(sqlite3* db, const char* schema, int limit = -1) const;
+		sqlite3_stmt* GetPageCursor(sqlite3* db, const char* schema, const std::set<std::size_t>& pages) const;
+		std::size_t GetPageCount(sqlite3* db, const char* schema) const;		
+		std::size_t GetPageSize(sqlite3* db, const char* schema) const;
+		std::size_t ProcessPages(sqlite3_stmt* stmtRead, PageWriter& writer, const std::vector<bool>* freePages = nullptr);
+		//Pages of in-memory database are hashed in place from its image, false if database has no contiguous image
+		bool ProcessImage(sqlite3* db, std::size_t pageCount, PageWriter& writer, const std::vector<bool>& freePages);
+		PagePipeline::Sink GetPageSink(PageWriter& writer, std::size_t& lastPage);
+
+	private:
+	//Free-list leaf pages hold no data, they are neither hashed nor copied and have zero hash in manifest. With extents of several pages
+	//free pages are hashed and copied with their extent
+		std::vector<bool> GetFreePages(sqlite3* db, const char* schema, std::size_t pageCount) const;
+		void MarkFreePages(const std::vector<bool>& freePages);
+		void PunchFreePages(std::size_t pageCount);
+
+	private:
+	//Extents, one manifest hash covers options.extentPages pages. Changed pages are widened to whole extents before they are read
+		void ExpandToExtents(std::set<std::size_t>& pages, std::size_t pageCount) const;
+	
+	private:
+	//Incremental backup of changed pages from WAL frames
+		bool IsWalMode(sqlite3* db) const;
+		std::string GetWalPath(sqlite3* db) const;
+		std::string GetWalMarkerFilePath() const;
+		bool BackupWalImpl(sqlite3* src, WalMarker& marker, PageWriter& writer, std::size_t& pageCount);
+
 	private:
-	//Reading data for backup
-		sqlite3_stmt* GetPageCursor(sqlite3* db, int limit = -1) const;
-		std::size_t GetPageCount(sqlite3* db) const;		
+	//Incremental backup of pages recorded by tracking VFS
+		std::string GetDbPath(sqlite3* db) const;
+		std::string GetDirtyPagesFilePath() const;
+		std::string GetDirtyMarkFilePath() const;
+		void BackupTrackedImpl(sqlite3* src, DirtyPageTracker& tracker, PageWriter& writer);
 	
 	private:
 	//Reading from backup
-		void IntegrityCheck(sqlite3 *dst, sqlite3* src);
-		void CheckDbIntegrity(sqlite3* src);
+		void IntegrityCheck();
+		void CheckDbIntegrity(sqlite3* src, hash_t expectedHash, HashAlgorithm algorithm, std::size_t extentPages);
+		std::string GetScrubCursorFilePath() const;
+
+	private:
+	//Restore without pager, in-memory destination takes image as its buffer, file destination is replaced by clone of image
+		bool IsMemoryDb(sqlite3* db) const;
+		bool DeserializeImpl(sqlite3* dst, const std::string& imagePath, std::size_t pageCount, std::size_t pageSize);
+
+	private:
+	//Differential restore, only pages differing from backup are written to destination
+		bool ReadDifferentialImpl(sqlite3* dst, sqlite3* src, bool latest);
+		bool ExtendDb(sqlite3* dst, std::size_t pageCount, std::size_t pageSize);
+		bool TruncateDb(sqlite3* dst, std::size_t pageCount);
+		std::vector<hash_t> HashPages(sqlite3_stmt* stmtRead, const std::vector<bool>* skipPages = nullptr);
+		sqlite3_stmt* GetPageUpdate(sqlite3* dst) const;
+		void UpdatePage(sqlite3* dst, sqlite3_stmt* stmtWrite, std::size_t pgno, const void* data, std::size_t size) const;
+		void WritePages(sqlite3* dst, sqlite3* src, const std::set<std::size_t>& pages);
 
 	private:
 	//Caching hashes on disk
 		std::string GetPageHashesCacheFilePath() const;
-		void WritePageHashes() const;
-		void ReadPageHashes(const char *path);
+		std::string GetPageHashesCacheFilePath(const std::string& backupName) const;
 		
 	private:
 	//Writing backup
-		void WritePage(std::size_t i, const void* data, std::size_t size, std::ofstream &f);
+		void OpenManifest();
 		sqlite3* GetBackupDb() const;		
 		std::string GetBackupDbPath() const;
+
+	private:
+	//Generations, first one is written in place into base image, next ones are appended as delta segments
+		std::string GetGenerationFilePrefix() const;
+		std::unique_ptr<PageWriter> BeginGeneration();
+		void CommitGeneration(PageWriter& writer, std::size_t pageCount);
+
+	private:
+	//Generations kept as page maps in shared page store instead of own image and segments
+		void AttachPageStore();
 	
 	private:
-		std::vector<hash_t> hashes;
+	//Stepped backup, every step scans a page range in its own read transaction, last step rereads pages changed meanwhile
+		enum class StepPhase {
+			Scan,
+			Final,
+			Done
+		};
+		struct StepState {
+			~StepState();
+			sqlite3* db = nullptr;
+			std::unique_ptr<PageWriter> writer;
+			StepPhase phase = StepPhase::Scan;
+			std::shared_ptr<DirtyPageTracker> tracker;	//changed pages are recorded by tracker watch
+			uint64_t watch = 0;
+			bool walMode = false;						//changed pages are read from WAL frames after marker
+			bool haveMarker = false;
+			WalMarker marker;
+			uint32_t changeCounter = 0;					//rollback journal, any commit between steps makes the pass stale
+			std::set<std::size_t> changed;
+			bool stale = false;							//pass may miss changed pages, it is repeated
+			bool whole = false;							//in-memory database, copied by one step in one transaction
+			unsigned pass = 1;
+			std::size_t nextPage = 1;
+			std::size_t scanCount = 0;
+			std::chrono::steady_clock::time_point passStart;
+			bool failed = false;
+		};
+		bool ScanStep(int nPages, unsigned timeBudgetMs);
+		void FinalStep();
+		void RestartPass();
+		void CollectStepChanges();
+		uint32_t GetChangeCounter(sqlite3* db) const;
+
+	private:
+	//Session, backups of one connection share manifest and scan statement. Manifest is reopened if the backup was changed by another writer
+		struct SessionState {
+			~SessionState();
+			sqlite3* db = nullptr;
+			sqlite3_stmt* scanCursor = nullptr;	//full scan of db, reset after every scan
+			bool warm = false;					//manifest committed by this session and matching stamp
+			uint64_t generation = 0;			//stamp taken after the last commit
+			hash_t root = 0;
+			std::size_t pageCount = 0;
+		};
+		void LoadManifest();
+		void StampSession();
+		uint64_t GetLastGeneration() const;
+		sqlite3_stmt* GetScanCursor(sqlite3* db);
+		void ReleaseCursor(sqlite3_stmt* stmt);
+
+	private:
+		Manifest manifest;
+		GenerationStore generations;
+		PageMaps pageMaps;
+		GenerationState generationState = {};
+		std::vector<bool> freeList;		//free-list leaf pages of snapshot written by current generation, kept by MarkFreePages
+		std::unique_ptr<StepState> step;
+		std::unique_ptr<SessionState> session;
+		BackupProgress progress;
+		StatsRecorder stats;
+		RateLimiter readLimiter;
+		RateLimiter writeLimiter;
 	};
 }//namespace sqlite3_inc_bkp
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "clone.h"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include "exception.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+#ifdef __linux__
+		const std::size_t COPY_BUFFER_BYTES = 1 << 20;
+
+		/// <summary>
+		/// Clone or copy in kernel, false if neither is supported for the pair of files and nothing was copied
+		/// </summary>
+		bool CloneInKernel(int in, int out, uint64_t size, tools::CloneMethod& method) {
+#ifdef FICLONE
+			if (::ioctl(out, FICLONE, in) == 0) {
+				method = tools::CloneMethod::Reflink;
+				return true;
+			}
+#endif
+			uint64_t copied = 0;
+			while (copied < size) {
+				const ssize_t rc = ::copy_file_range(in, nullptr, out, nullptr, static_cast<std::size_t>(size - copied), 0);
+				if (rc < 0 && errno == EINTR)
+					continue;
+				//Filesystems without support fail the first call, before anything is copied
+				if (rc < 0 && copied == 0 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL))
+					return false;
+				if (rc <= 0) {
+					throw BackupException(tools::FormatString::format("Error copying file: %s", std::strerror(rc < 0 ? errno : EIO)).c_str(), BackupException::Error::BackupLoad);
+				}
+				copied += static_cast<uint64_t>(rc);
+			}
+			method = tools::CloneMethod::CopyRange;
+			return true;
+		}
+
+		void CopyPlain(int in, int out) {
+			std::vector<char> buffer(COPY_BUFFER_BYTES);
+			for (;;) {
+				ssize_t rc = ::read(in, buffer.data(), buffer.size());
+				if (rc < 0 && errno == EINTR)
+					continue;
+				if (rc == 0)
+					return;
+				for (ssize_t written = 0; rc > 0 && written < rc;) {
+					const ssize_t w = ::write(out, buffer.data() + written, static_cast<std::size_t>(rc - written));
+					if (w < 0 && errno == EINTR)
+						continue;
+					if (w <= 0)
+						rc = -1;
+					else
+						written += w;
+				}
+				if (rc < 0) {
+					throw BackupException(tools::FormatString::format("Error copying file: %s", std::strerror(errno)).c_str(), BackupException::Error::BackupLoad);
+				}
+			}
+		}
+#endif
+	}
+
+	tools::CloneMethod tools::CloneFile(const std::string& from, const std::string& to, bool sync) {
+		std::remove(to.c_str());
+#ifdef __linux__
+		const int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+		if (in < 0) {
+			throw BackupException(tools::FormatString::format("Could not open file [%s]: %s", from.c_str(), std::strerror(errno)).c_str(), BackupException::Error::BackupLoad);
+		}
+		struct stat info;
+		int out = ::fstat(in, &info) == 0 ? ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 0777) : -1;
+		if (out < 0) {
+			const int error = errno;
+			::close(in);
+			throw BackupException(tools::FormatString::format("Could not create file [%s]: %s", to.c_str(), std::strerror(error)).c_str(), BackupException::Error::BackupLoad);
+		}
+		CloneMethod method = CloneMethod::Copy;
+		try {
+			if (!CloneInKernel(in, out, static_cast<uint64_t>(info.st_size), method))
+				CopyPlain(in, out);
+			if (sync && ::fdatasync(out) != 0) {
+				throw BackupException(tools::FormatString::format("Error syncing file [%s]: %s", to.c_str(), std::strerror(errno)).c_str(), BackupException::Error::BackupLoad);
+			}
+		}
+		catch (...) {
+			::close(in);
+			::close(out);
+			std::remove(to.c_str());
+			throw;
+		}
+		::close(in);
+		::close(out);
+		return method;
+#else
+		boost::filesystem::copy_file(from, to);
+		return CloneMethod::Copy;
+#endif
+	}
+}//namespace sqlite3_inc_bkp
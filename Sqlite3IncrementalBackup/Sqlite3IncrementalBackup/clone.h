@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+namespace sqlite3_inc_bkp {
+	namespace tools {
+		enum class CloneMethod {
+			Reflink,	//destination shares extents of source until either is written (Linux FICLONE)
+			CopyRange,	//data copied inside kernel without passing user space (Linux copy_file_range)
+			Copy		//plain copy
+		};
+
+		/// <summary>
+		/// Copy file into new file to, replacing it
+		/// </summary>
+		/// <param name="sync">Sync copy before return (Linux only)</param>
+		CloneMethod CloneFile(const std::string& from, const std::string& to, bool sync);
+	}
+}//namespace sqlite3_inc_bkp
@@ -2,11 +2,41 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
 
 #define MESSAGE_BUFFER_SIZE 0x100
 
 namespace sqlite3_inc_bkp {
+	using hash_t = uint64_t;
+	using hash_func = std::function<hash_t(const void*, std::size_t)>;
+
 	namespace tools {
+		/// <summary>
+		/// splitmix64 finalizer of (pgno, hash) pair, sum of mixed entries changes if any entry or its position changes
+		/// </summary>
+		inline uint64_t MixEntry(std::size_t pgno, hash_t hash) {
+			uint64_t z = hash + uint64_t(pgno) * 0x9E3779B97F4A7C15ull;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+		/// <summary>
+		/// Name as SQL string literal with quote '\'' or identifier with quote '"'
+		/// </summary>
+		inline std::string QuoteSql(const char* text, char quote) {
+			std::string quoted(1, quote);
+			for (; *text; ++text) {
+				if (*text == quote)
+					quoted += quote;
+				quoted += *text;
+			}
+			quoted += quote;
+			return quoted;
+		}
+
 		struct FormatString {
 		public:
 			template <typename... Args>
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <exception>
+#include <string>
 #include "common.h"
 
 namespace sqlite3_inc_bkp {
@@ -11,7 +12,11 @@ namespace sqlite3_inc_bkp {
 			SelectPages,
 			BackupInit,
 			BackupLoad,
-			IntegrityCheck
+			IntegrityCheck,
+			Tracking,
+			Cancelled,
+			Scheduling,
+			Busy
 		};
 		inline Error code() const { return _error; }
 	private:
@@ -25,6 +30,14 @@ namespace sqlite3_inc_bkp {
 				return "Failed load from backup file";
 			case Error::IntegrityCheck:
 				return "Backup file corrupted";
+			case Error::Tracking:
+				return "Failed dirty page tracking";
+			case Error::Cancelled:
+				return "Backup cancelled";
+			case Error::Scheduling:
+				return "Failed scheduling backup";
+			case Error::Busy:
+				return "Database changed during every backup pass";
 			case Error::Unknown:
 			default:
 				return "Unknown error";
@@ -41,9 +54,12 @@ namespace sqlite3_inc_bkp {
 			return std::string(msg);
 		}
 	public:
-		BackupException(const char* message, Error err = Error::Unknown) : _error(err), std::exception(ErrorFullStr(err, message).c_str()) {}
+		BackupException(const char* message, Error err = Error::Unknown) : _error(err), _message(ErrorFullStr(err, message)) {}
+
+		const char* what() const noexcept override { return _message.c_str(); }
 
 	private:
 		Error _error;
+		std::string _message;
 	};
 }
\ No newline at end of file
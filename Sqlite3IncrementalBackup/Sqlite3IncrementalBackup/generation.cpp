@@ -0,0 +1,437 @@
+#include "generation.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include "clone.h"
+#include "exception.h"
+#include "hasher.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t GENERATION_MAGIC = 0x474B4249; //IBKG
+		const uint32_t GENERATION_VERSION = 1;
+		const uint32_t SEGMENT_MAGIC = 0x534B4249; //IBKS
+		const uint32_t SEGMENT_VERSION = 1;
+
+		std::mutex g_locksMutex;
+
+		/// <summary>
+		/// Reader of finished delta segment
+		/// </summary>
+		class SegmentReader {
+		public:
+			/// <returns>false if segment is missing, was not finished or its index is corrupted</returns>
+			bool Open(const std::string& path) {
+				this->path = path;
+				this->fSegment.open(path, std::ios::binary | std::ios::ate);
+				if (!this->fSegment.is_open())
+					return false;
+				const uint64_t size = static_cast<uint64_t>(this->fSegment.tellg());
+				if (size < sizeof(SegmentFooter))
+					return false;
+				this->fSegment.seekg(size - sizeof(SegmentFooter));
+				if (!this->fSegment.read(reinterpret_cast<char*>(&this->footer), sizeof(this->footer)))
+					return false;
+				if (this->footer.magic != SEGMENT_MAGIC || this->footer.version != SEGMENT_VERSION || this->footer.pageSize == 0
+					|| this->footer.entryCount * (this->footer.pageSize + sizeof(SegmentEntry)) + sizeof(SegmentFooter) != size)
+					return false;
+
+				this->entries.resize(static_cast<std::size_t>(this->footer.entryCount));
+				this->fSegment.seekg(this->footer.entryCount * this->footer.pageSize);
+				if (!this->fSegment.read(reinterpret_cast<char*>(this->entries.data()), this->entries.size() * sizeof(SegmentEntry)))
+					return false;
+				hash_t checksum = 0;
+				for (const SegmentEntry& entry : this->entries)
+					checksum += tools::MixEntry(static_cast<std::size_t>(entry.pgno), entry.hash);
+				return checksum == this->footer.checksum;
+			}
+
+			/// <summary>
+			/// Read pages of count consecutive entries starting from entry first
+			/// </summary>
+			void Read(std::size_t first, std::size_t count, char* data) {
+				this->fSegment.seekg(static_cast<uint64_t>(first) * this->footer.pageSize);
+				if (!this->fSegment.read(data, count * this->footer.pageSize))
+					throw BackupException(tools::FormatString::format("Error reading segment file [%s]", this->path.c_str()).c_str(), BackupException::Error::BackupLoad);
+			}
+
+		public:
+			SegmentFooter footer = {};
+			std::vector<SegmentEntry> entries;
+
+		private:
+			std::string path;
+			std::ifstream fSegment;
+		};
+	}
+
+	SegmentWriter::SegmentWriter(const std::string& path, uint64_t generation)
+		: PageWriter(path), generation(generation), fSegment(path, std::ios::binary | std::ios::trunc) {
+		if (!this->fSegment.is_open())
+			throw BackupException(tools::FormatString::format("Segment file [%s] is not open", path.c_str()).c_str(), BackupException::Error::BackupInit);
+	}
+
+	void SegmentWriter::WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) {
+		this->pageSize = parts.front().size;
+		const uint64_t first = offset / this->pageSize + 1;
+		for (std::size_t i = 0; i < parts.size(); ++i) {
+			this->pages.push_back(first + i);
+			this->fSegment.write(reinterpret_cast<const char*>(parts[i].data), parts[i].size);
+		}
+		if (!this->fSegment)
+			throw BackupException(tools::FormatString::format("Error writing segment file [%s]", this->path.c_str()).c_str(), BackupException::Error::BackupInit);
+	}
+
+	void SegmentWriter::Sync() {
+		if (this->fSegment.is_open())
+			this->fSegment.flush();
+	}
+
+	void SegmentWriter::Finish(const Manifest& manifest, std::size_t pageCount) {
+		SegmentFooter footer = {};
+		footer.magic = SEGMENT_MAGIC;
+		footer.version = SEGMENT_VERSION;
+		footer.generation = this->generation;
+		footer.pageCount = pageCount;
+		footer.entryCount = this->pages.size();
+		footer.pageSize = static_cast<uint32_t>(this->pageSize ? this->pageSize : manifest.PageSize());
+		footer.hashAlgorithm = static_cast<uint32_t>(manifest.Algorithm());
+
+		//Page rewritten later in the same generation keeps only its last copy indexed, older slots get pgno 0.
+		//Hash of extent of several pages does not check a single page, such pages are indexed with unknown zero hash
+		const bool pageHashes = manifest.ExtentPages() == 1;
+		std::vector<SegmentEntry> index(this->pages.size());
+		std::set<uint64_t> seen;
+		for (std::size_t i = this->pages.size(); i-- > 0;) {
+			if (!seen.insert(this->pages[i]).second)
+				continue;
+			index[i].pgno = this->pages[i];
+			index[i].hash = pageHashes ? manifest.Get(static_cast<std::size_t>(this->pages[i])) : 0;
+		}
+		for (std::size_t i = 0; i < index.size(); ++i)
+			footer.checksum += tools::MixEntry(static_cast<std::size_t>(index[i].pgno), index[i].hash);
+		this->fSegment.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(SegmentEntry));
+		this->fSegment.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+		this->fSegment.close();
+		if (!this->fSegment)
+			throw BackupException(tools::FormatString::format("Error writing segment file [%s]", this->path.c_str()).c_str(), BackupException::Error::BackupInit);
+	}
+
+	GenerationStore::GenerationStore(const std::string& imagePath, const std::string& filePrefix)
+		: imagePath(imagePath), statePath(filePrefix + ".generations"), filePrefix(filePrefix), locks(GetLocks(statePath)) {
+	}
+
+	std::shared_ptr<GenerationStore::Locks> GenerationStore::GetLocks(const std::string& statePath) {
+		static std::map<std::string, std::shared_ptr<Locks>> registry;
+		std::lock_guard<std::mutex> lock(g_locksMutex);
+		auto& locks = registry[statePath];
+		if (!locks)
+			locks = std::make_shared<Locks>();
+		return locks;
+	}
+
+	std::string GenerationStore::GetSegmentPath(uint64_t generation) const {
+		return tools::FormatString::format("%s.%d.segment", this->filePrefix, generation);
+	}
+
+	GenerationState GenerationStore::Load() const {
+		std::lock_guard<std::mutex> lock(this->locks->state);
+		return this->LoadUnlocked();
+	}
+
+	GenerationState GenerationStore::LoadUnlocked() const {
+		GenerationState state = {};
+		state.magic = GENERATION_MAGIC;
+		state.version = GENERATION_VERSION;
+
+		std::ifstream fState(this->statePath, std::ios::binary);
+		if (fState.is_open()) {
+			GenerationState stored = {};
+			if (!fState.read(reinterpret_cast<char*>(&stored), sizeof(stored)) || stored.magic != GENERATION_MAGIC || stored.version != GENERATION_VERSION) {
+				throw BackupException(tools::FormatString::format("Generation file [%s] corrupted", this->statePath.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			return stored;
+		}
+		//Image written before generations were introduced is the only generation
+		if (boost::filesystem::exists(this->imagePath) && boost::filesystem::file_size(this->imagePath) > 0) {
+			state.baseGeneration = 1;
+			state.lastGeneration = 1;
+		}
+		return state;
+	}
+
+	void GenerationStore::SaveUnlocked(const GenerationState& state) const {
+		const std::string tmpPath = this->statePath + ".tmp";
+		{
+			std::ofstream fState(tmpPath, std::ios::binary | std::ios::trunc);
+			fState.write(reinterpret_cast<const char*>(&state), sizeof(state));
+			if (!fState) {
+				throw BackupException(tools::FormatString::format("Could not write generation file [%s]", tmpPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		boost::filesystem::rename(tmpPath, this->statePath);
+	}
+
+	void GenerationStore::CommitBase(uint64_t generation, hash_t pageHash, HashAlgorithm hashAlgorithm, std::size_t pageSize) {
+		std::lock_guard<std::mutex> lock(this->locks->state);
+		GenerationState state = {};
+		state.magic = GENERATION_MAGIC;
+		state.version = GENERATION_VERSION;
+		state.baseGeneration = generation;
+		state.lastGeneration = generation;
+		state.basePageHash = pageHash;
+		state.pageSize = static_cast<uint32_t>(pageSize);
+		state.hashAlgorithm = static_cast<uint32_t>(hashAlgorithm);
+		this->SaveUnlocked(state);
+	}
+
+	void GenerationStore::CommitSegment(uint64_t generation) {
+		std::lock_guard<std::mutex> lock(this->locks->state);
+		GenerationState state = this->LoadUnlocked();
+		state.lastGeneration = generation;
+		this->SaveUnlocked(state);
+	}
+
+	RestoreSource GenerationStore::Materialize(uint64_t generation, const hash_func& callback, const BackupOptions& options) {
+		RestoreSource source;
+		source.lock = std::unique_lock<std::mutex>(this->locks->base);
+		GenerationState state = this->Load();
+		if (state.compactTarget != 0) {
+			this->CompactTo(state.compactTarget, options);
+			state = this->Load();
+		}
+
+		const uint64_t target = generation ? generation : state.lastGeneration;
+		if (state.lastGeneration == 0 || target < state.baseGeneration || target > state.lastGeneration) {
+			throw BackupException(tools::FormatString::format("Generation %d is not retained, retained generations %d..%d", target, state.baseGeneration, state.lastGeneration).c_str(), BackupException::Error::BackupLoad);
+		}
+		source.generation = target;
+		source.latest = target == state.lastGeneration;
+		if (target == state.baseGeneration) {
+			source.path = this->imagePath;
+			source.pageHash = state.basePageHash;
+			source.hashAlgorithm = static_cast<HashAlgorithm>(state.hashAlgorithm);
+			return source;
+		}
+
+		//Page 1 of base image is overwritten by segments, so base is verified before it is copied
+		const PageHasher baseHasher = PageHasher::Select(static_cast<HashAlgorithm>(state.hashAlgorithm), callback);
+		if (baseHasher && state.basePageHash != 0) {
+			std::vector<char> page(state.pageSize);
+			std::ifstream fImage(this->imagePath, std::ios::binary);
+			if (!fImage.read(page.data(), page.size()) || baseHasher.single(page.data(), page.size()) != state.basePageHash) {
+				throw BackupException(tools::FormatString::format("Backup image [%s] corrupted", this->imagePath.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+		}
+
+		source.path = this->imagePath + ".restore";
+		source.temporary = true;
+		std::remove(source.path.c_str());
+		tools::CloneFile(this->imagePath, source.path, false);
+		try {
+			const ApplyResult result = this->Apply(source.path, state, target, &callback, false, options);
+			source.pageHash = result.pageHash;
+			source.hashAlgorithm = result.hashAlgorithm;
+		}
+		catch (...) {
+			std::remove(source.path.c_str());
+			throw;
+		}
+		return source;
+	}
+
+	ImageLayout ImageLayout::Single(const std::string& path, std::size_t pageSize) {
+		ImageLayout layout;
+		layout.files.push_back(path);
+		layout.pageSize = pageSize;
+		const std::size_t pageCount = pageSize ? static_cast<std::size_t>(boost::filesystem::file_size(path) / pageSize) : 0;
+		layout.pages.resize(pageCount);
+		for (std::size_t i = 0; i < pageCount; ++i)
+			layout.pages[i] = std::make_pair(0u, static_cast<uint32_t>(i));
+		return layout;
+	}
+
+	ImageLayout GenerationStore::Locate(std::size_t pageSize, const BackupOptions& options) {
+		std::unique_lock<std::mutex> lock(this->locks->base);
+		GenerationState state = this->Load();
+		if (state.compactTarget != 0) {
+			this->CompactTo(state.compactTarget, options);
+			state = this->Load();
+		}
+		if (state.lastGeneration == 0) {
+			throw BackupException(tools::FormatString::format("Backup file [%s] not exists", this->imagePath.c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+
+		ImageLayout layout = ImageLayout::Single(this->imagePath, pageSize);
+		layout.lock = std::move(lock);
+		if (state.lastGeneration == state.baseGeneration)
+			return layout;
+
+		//Newest copy of every page wins like in Apply, pages past page count of the last generation are dropped
+		std::vector<bool> covered;
+		for (uint64_t g = state.lastGeneration; g > state.baseGeneration; --g) {
+			SegmentReader segment;
+			if (!segment.Open(this->GetSegmentPath(g)) || segment.footer.generation != g || segment.footer.pageSize != pageSize) {
+				throw BackupException(tools::FormatString::format("Segment file [%s] corrupted", this->GetSegmentPath(g).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			if (g == state.lastGeneration) {
+				const std::size_t pageCount = static_cast<std::size_t>(segment.footer.pageCount);
+				covered.assign(pageCount + 1, false);
+				layout.pages.resize(pageCount, std::make_pair(0u, 0u));
+				for (std::size_t i = 0; i < pageCount; ++i)
+					layout.pages[i] = std::make_pair(0u, static_cast<uint32_t>(i));
+			}
+			const uint32_t file = static_cast<uint32_t>(layout.files.size());
+			layout.files.push_back(this->GetSegmentPath(g));
+			for (std::size_t k = 0; k < segment.entries.size(); ++k) {
+				const std::size_t pgno = static_cast<std::size_t>(segment.entries[k].pgno);
+				if (pgno == 0 || pgno >= covered.size() || covered[pgno])
+					continue;
+				covered[pgno] = true;
+				layout.pages[pgno - 1] = std::make_pair(file, static_cast<uint32_t>(k));
+			}
+		}
+		return layout;
+	}
+
+	void GenerationStore::Compact(unsigned retainGenerations, const BackupOptions& options) {
+		std::lock_guard<std::mutex> lock(this->locks->base);
+		const GenerationState state = this->Load();
+		uint64_t target = state.compactTarget;
+		if (target == 0) {
+			const uint64_t retain = std::max(1u, retainGenerations);
+			target = state.lastGeneration >= retain ? state.lastGeneration - retain + 1 : 0;
+			//Replay of the latest restore stays bounded, the latest segment is kept so its predecessor stays restorable
+			boost::system::error_code ec;
+			const uint64_t bound = options.retainSegmentBytes ? options.retainSegmentBytes : boost::filesystem::file_size(this->imagePath, ec);
+			uint64_t retained = 0;
+			for (uint64_t g = state.lastGeneration; !ec && g > std::max(target, state.baseGeneration); --g) {
+				retained += boost::filesystem::file_size(this->GetSegmentPath(g), ec);
+				if (!ec && retained > bound && g < state.lastGeneration) {
+					target = g;
+					break;
+				}
+			}
+		}
+		if (target > state.baseGeneration)
+			this->CompactTo(target, options);
+	}
+
+	void GenerationStore::CompactTo(uint64_t target, const BackupOptions& options) {
+		GenerationState state;
+		{
+			std::lock_guard<std::mutex> lock(this->locks->state);
+			state = this->LoadUnlocked();
+			state.compactTarget = target > state.baseGeneration ? target : 0;
+			this->SaveUnlocked(state);
+			if (state.compactTarget == 0)
+				return;
+		}
+
+		//Interrupted merge leaves base image ahead of baseGeneration, it is redone before anything reads base again
+		const ApplyResult result = this->Apply(this->imagePath, state, target, nullptr, true, options);
+		const uint64_t oldBase = state.baseGeneration;
+		{
+			std::lock_guard<std::mutex> lock(this->locks->state);
+			state = this->LoadUnlocked();
+			state.baseGeneration = target;
+			state.compactTarget = 0;
+			state.basePageHash = result.pageHash;
+			state.hashAlgorithm = static_cast<uint32_t>(result.hashAlgorithm);
+			state.pageSize = static_cast<uint32_t>(result.pageSize);
+			this->SaveUnlocked(state);
+		}
+		for (uint64_t g = oldBase + 1; g <= target; ++g)
+			std::remove(this->GetSegmentPath(g).c_str());
+	}
+
+	GenerationStore::ApplyResult GenerationStore::Apply(const std::string& imagePath, const GenerationState& state, uint64_t target, const hash_func* callback, bool compaction, const BackupOptions& options) const {
+		std::vector<std::unique_ptr<SegmentReader>> segments;
+		for (uint64_t g = state.baseGeneration + 1; g <= target; ++g) {
+			auto segment = std::make_unique<SegmentReader>();
+			if (!segment->Open(this->GetSegmentPath(g)) || segment->footer.generation != g) {
+				throw BackupException(tools::FormatString::format("Segment file [%s] corrupted", this->GetSegmentPath(g).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			segments.push_back(std::move(segment));
+		}
+
+		ApplyResult result;
+		result.pageCount = static_cast<std::size_t>(segments.back()->footer.pageCount);
+		result.pageSize = segments.back()->footer.pageSize;
+		result.pageHash = state.basePageHash;
+		result.hashAlgorithm = static_cast<HashAlgorithm>(state.hashAlgorithm);
+
+		//Newest version of every page wins, older copies are never read
+		std::vector<bool> covered(result.pageCount + 1, false);
+		bool pageHashFound = false;
+		const std::size_t chunkPages = std::max<std::size_t>(options.batchPages, 1);
+		std::vector<std::size_t> selected;
+		std::vector<char> chunk;
+		//Compaction runs in background and is throttled like backup, restore materializes at full speed
+		RateLimiter limiter(compaction ? options.writeBytesPerSec : 0);
+		auto writer = PageWriter::Create(imagePath, options);
+		writer->SetIoPolicy(&limiter, compaction && options.cacheMode != CacheMode::Default);
+		for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+			SegmentReader& segment = **it;
+			const std::size_t pageSize = segment.footer.pageSize;
+			//Restore verifies every segment whose hash it can compute
+			const PageHasher hasher = callback && !compaction ? PageHasher::Select(static_cast<HashAlgorithm>(segment.footer.hashAlgorithm), *callback) : PageHasher();
+			selected.clear();
+			for (std::size_t k = 0; k < segment.entries.size(); ++k) {
+				const std::size_t pgno = static_cast<std::size_t>(segment.entries[k].pgno);
+				if (pgno == 0 || pgno > result.pageCount || covered[pgno])
+					continue;
+				covered[pgno] = true;
+				selected.push_back(k);
+				if (pgno == 1 && !pageHashFound) {
+					result.pageHash = segment.entries[k].hash;
+					result.hashAlgorithm = static_cast<HashAlgorithm>(segment.footer.hashAlgorithm);
+					pageHashFound = true;
+				}
+			}
+
+			//Selected entries are read with one read per run of up to chunkPages slots
+			std::size_t i = 0;
+			while (i < selected.size()) {
+				const std::size_t first = selected[i];
+				std::size_t j = i + 1;
+				while (j < selected.size() && selected[j] - first < chunkPages)
+					++j;
+				chunk.resize((selected[j - 1] - first + 1) * pageSize);
+				segment.Read(first, selected[j - 1] - first + 1, chunk.data());
+				for (std::size_t k = i; k < j; ++k) {
+					const SegmentEntry& entry = segment.entries[selected[k]];
+					const char* page = chunk.data() + (selected[k] - first) * pageSize;
+					if (hasher && entry.hash != 0 && hasher.single(page, pageSize) != entry.hash) {
+						throw BackupException(tools::FormatString::format("Page %d of generation %d corrupted", entry.pgno, segment.footer.generation).c_str(), BackupException::Error::IntegrityCheck);
+					}
+					writer->Add(static_cast<std::size_t>(entry.pgno), page, pageSize);
+				}
+				writer->Flush();
+				i = j;
+			}
+		}
+		writer->ReleaseCache();
+		writer.reset();
+		boost::filesystem::resize_file(imagePath, static_cast<uint64_t>(result.pageCount) * result.pageSize);
+		return result;
+	}
+
+	void GenerationStore::Clear() {
+		std::lock_guard<std::mutex> baseLock(this->locks->base);
+		std::lock_guard<std::mutex> stateLock(this->locks->state);
+		GenerationState state = {};
+		try {
+			state = this->LoadUnlocked();
+		}
+		catch (const BackupException&) {
+		}
+		for (uint64_t g = state.baseGeneration + 1; g <= state.lastGeneration || boost::filesystem::exists(this->GetSegmentPath(g)); ++g)
+			std::remove(this->GetSegmentPath(g).c_str());
+		std::remove(this->statePath.c_str());
+		std::remove((this->imagePath + ".restore").c_str());
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+#include "manifest.h"
+#include "writer.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Retained generations of backup, base image holds baseGeneration, segments base + 1..last are deltas on top of it
+	/// </summary>
+	struct GenerationState {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t baseGeneration;
+		uint64_t lastGeneration;	//0 - no backup written yet
+		uint64_t compactTarget;		//generation being merged into base image, 0 if none
+		hash_t basePageHash;		//hash of page 1 of base image, 0 if unknown
+		uint32_t pageSize;			//page size of base image
+		uint32_t hashAlgorithm;		//HashAlgorithm of basePageHash
+		uint32_t reserved[4];
+	};
+	static_assert(sizeof(GenerationState) == 64, "Generation state layout changed");
+
+	/// <summary>
+	/// Footer of delta segment file: entryCount pages, then entryCount SegmentEntry, then footer
+	/// </summary>
+	struct SegmentFooter {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t generation;
+		uint64_t pageCount;		//database page count at generation
+		uint64_t entryCount;
+		uint64_t checksum;		//sum of mixed (pgno, hash) entries
+		uint32_t pageSize;
+		uint32_t hashAlgorithm;	//HashAlgorithm of entry hashes
+		uint32_t reserved[4];
+	};
+	static_assert(sizeof(SegmentFooter) == 64, "Segment footer layout changed");
+
+	struct SegmentEntry {
+		uint64_t pgno;
+		hash_t hash;	//0 if unknown, page of backup hashing extents of several pages
+	};
+
+	/// <summary>
+	/// Writer of delta segment, extents are appended sequentially in arrival order
+	/// </summary>
+	class SegmentWriter : public PageWriter {
+	public:
+		SegmentWriter(const std::string& path, uint64_t generation);
+
+		/// <summary>
+		/// Append index with manifest hashes of written pages and footer, segment is valid only after Finish
+		/// </summary>
+		void Finish(const Manifest& manifest, std::size_t pageCount);
+		inline uint64_t Generation() const { return generation; }
+
+	protected:
+		void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override;
+
+		void Sync() override;
+
+	private:
+		uint64_t generation;
+		std::size_t pageSize = 0;
+		std::vector<uint64_t> pages;
+		std::ofstream fSegment;
+	};
+
+	/// <summary>
+	/// Image file to restore a generation from, base image stays locked against compaction while source is alive
+	/// </summary>
+	struct RestoreSource {
+		std::string path;
+		uint64_t generation = 0;
+		hash_t pageHash = 0;		//expected hash of page 1, 0 if unknown
+		HashAlgorithm hashAlgorithm = HashAlgorithm::Callback;	//algorithm of pageHash
+		bool latest = false;		//generation is the last one
+		bool temporary = false;		//path is materialized copy, remove after restore
+		std::unique_lock<std::mutex> lock;
+	};
+
+	/// <summary>
+	/// Files holding pages of the last generation, every page is read in place from the newest segment holding it or from base image.
+	/// Base image stays locked against compaction while layout is alive
+	/// </summary>
+	struct ImageLayout {
+		std::vector<std::string> files;		//base image, then segments
+		std::vector<std::pair<uint32_t, uint32_t>> pages;	//file and page slot in it, page pgno at index pgno - 1
+		std::size_t pageSize = 0;
+		std::unique_lock<std::mutex> lock;
+
+		/// <summary>
+		/// Layout of plain image file, page pgno is slot pgno - 1
+		/// </summary>
+		static ImageLayout Single(const std::string& path, std::size_t pageSize);
+	};
+
+	/// <summary>
+	/// Base image, delta segments and state file of one backup
+	/// </summary>
+	class GenerationStore {
+	public:
+		/// <param name="imagePath">Path to base image</param>
+		/// <param name="filePrefix">Prefix of state and segment file paths</param>
+		GenerationStore(const std::string& imagePath, const std::string& filePrefix);
+
+		/// <summary>
+		/// Current state, existing image without state file is a single legacy base generation
+		/// </summary>
+		GenerationState Load() const;
+		std::string GetSegmentPath(uint64_t generation) const;
+
+		/// <summary>
+		/// Record generation written in place into base image, drops all retained generations
+		/// </summary>
+		void CommitBase(uint64_t generation, hash_t pageHash, HashAlgorithm hashAlgorithm, std::size_t pageSize);
+
+		/// <summary>
+		/// Record finished segment as last generation
+		/// </summary>
+		void CommitSegment(uint64_t generation);
+
+		/// <summary>
+		/// Resolve image of generation, base image is used directly if no segment is applied
+		/// </summary>
+		/// <param name="generation">Retained generation, 0 - last one</param>
+		/// <param name="callback">Hash callback to verify pages hashed with HashAlgorithm::Callback, may be empty</param>
+		RestoreSource Materialize(uint64_t generation, const hash_func& callback, const BackupOptions& options);
+
+		/// <summary>
+		/// Locate pages of the last generation without copying base image, pending compaction is finished first
+		/// </summary>
+		/// <param name="pageSize">Page size of the last generation, segments of another page size are corrupted</param>
+		ImageLayout Locate(std::size_t pageSize, const BackupOptions& options);
+
+		/// <summary>
+		/// Merge segments older than the last retainGenerations generations into base image, and older segments while retained ones
+		/// exceed options.retainSegmentBytes
+		/// </summary>
+		void Compact(unsigned retainGenerations, const BackupOptions& options);
+
+		/// <summary>
+		/// Remove state file, segments and restore copies
+		/// </summary>
+		void Clear();
+
+	private:
+		struct Locks {
+			std::mutex state;	//state file
+			std::mutex base;	//base image contents
+		};
+		struct ApplyResult {
+			std::size_t pageCount = 0;
+			std::size_t pageSize = 0;
+			hash_t pageHash = 0;
+			HashAlgorithm hashAlgorithm = HashAlgorithm::Callback;
+		};
+
+		static std::shared_ptr<Locks> GetLocks(const std::string& statePath);
+		GenerationState LoadUnlocked() const;
+		void SaveUnlocked(const GenerationState& state) const;
+		void CompactTo(uint64_t target, const BackupOptions& options);
+		//Compaction merges segments into base image, restore into its clone
+		ApplyResult Apply(const std::string& imagePath, const GenerationState& state, uint64_t target, const hash_func* callback, bool compaction, const BackupOptions& options) const;
+
+	private:
+		std::string imagePath;
+		std::string statePath;
+		std::string filePrefix;
+		std::shared_ptr<Locks> locks;
+	};
+}//namespace sqlite3_inc_bkp
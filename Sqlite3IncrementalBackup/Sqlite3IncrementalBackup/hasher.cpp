@@ -0,0 +1,464 @@
+#include "hasher.h"
+
+#include <array>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SQLITE3_INC_BKP_SSE42
+#define SQLITE3_INC_BKP_AVX2
+#include <immintrin.h>
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SSE42_TARGET
+#define AVX2_TARGET
+#else
+#include <cpuid.h>
+#define SSE42_TARGET __attribute__((target("sse4.2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t CRC32C_POLY = 0x82F63B78; //reflected Castagnoli polynomial
+		const std::size_t CRC32C_LANES = 4;		//pages hashed at once by multi-buffer kernel
+
+		const uint64_t PRIME32_1 = 0x9E3779B1, PRIME32_2 = 0x85EBCA77, PRIME32_3 = 0xC2B2AE3D;
+		const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull, PRIME64_2 = 0xC2B2AE3D27D4EB4Full, PRIME64_3 = 0x165667B19E3779F9ull;
+		const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull, PRIME64_5 = 0x27D4EB2F165667C5ull;
+		const uint64_t PRIME_MX1 = 0x165667919E3779F9ull, PRIME_MX2 = 0x9FB21C651E98DF25ull;
+		const std::size_t XXH3_STRIPE_LEN = 64;		//input bytes of one accumulate round
+		const std::size_t XXH3_SECRET_SIZE = 192;
+		const std::size_t XXH3_STRIPES_PER_BLOCK = (XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / 8;	//secret advances 8 bytes per stripe
+		const std::size_t XXH3_BLOCK_LEN = XXH3_STRIPE_LEN * XXH3_STRIPES_PER_BLOCK;
+		const std::size_t XXH3_MIDSIZE_MAX = 240;	//longer inputs go through accumulators
+
+		//Default secret of XXH3, values of the other secret are different hashes
+		alignas(64) const unsigned char XXH3_SECRET[XXH3_SECRET_SIZE] = {
+			0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+			0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+			0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+			0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+			0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+			0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+			0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+			0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+			0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+			0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+			0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+			0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+		};
+
+		std::array<uint32_t, 256> MakeCrc32cTable() {
+			std::array<uint32_t, 256> table = {};
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t crc = i;
+				for (int k = 0; k < 8; ++k)
+					crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+				table[i] = crc;
+			}
+			return table;
+		}
+
+		const uint32_t SHA256_K[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		inline uint32_t RotateRight32(uint32_t x, int r) {
+			return (x >> r) | (x << (32 - r));
+		}
+
+		void Sha256Block(uint32_t* state, const unsigned char* block) {
+			uint32_t w[64];
+			for (int i = 0; i < 16; ++i)
+				w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) | uint32_t(block[4 * i + 3]);
+			for (int i = 16; i < 64; ++i) {
+				const uint32_t s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				const uint32_t s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+			uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+			for (int i = 0; i < 64; ++i) {
+				const uint32_t t1 = h + (RotateRight32(e, 6) ^ RotateRight32(e, 11) ^ RotateRight32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+				const uint32_t t2 = (RotateRight32(a, 2) ^ RotateRight32(a, 13) ^ RotateRight32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+			state[5] += f;
+			state[6] += g;
+			state[7] += h;
+		}
+
+		inline uint64_t Mul128Fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+			const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+			return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+			uint64_t high = 0;
+			const uint64_t low = _umul128(a, b, &high);
+			return low ^ high;
+#else
+			const uint64_t ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF), hl = (a >> 32) * (b & 0xFFFFFFFF);
+			const uint64_t lh = (a & 0xFFFFFFFF) * (b >> 32), hh = (a >> 32) * (b >> 32);
+			const uint64_t cross = (ll >> 32) + (hl & 0xFFFFFFFF) + lh;
+			return ((cross << 32) | (ll & 0xFFFFFFFF)) ^ (hh + (hl >> 32) + (cross >> 32));
+#endif
+		}
+
+		inline uint64_t Swap64(uint64_t x) {
+			x = ((x & 0x00FF00FF00FF00FFull) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFull);
+			x = ((x & 0x0000FFFF0000FFFFull) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFull);
+			return (x << 32) | (x >> 32);
+		}
+
+		inline uint64_t Xxh64Avalanche(uint64_t h) {
+			h ^= h >> 33;
+			h *= PRIME64_2;
+			h ^= h >> 29;
+			h *= PRIME64_3;
+			return h ^ (h >> 32);
+		}
+
+		inline uint64_t Xxh3Avalanche(uint64_t h) {
+			h ^= h >> 37;
+			h *= PRIME_MX1;
+			return h ^ (h >> 32);
+		}
+
+		inline uint64_t Xxh3Mix16(const unsigned char* p, const unsigned char* secret) {
+			return Mul128Fold64(tools::Read64(p) ^ tools::Read64(secret), tools::Read64(p + 8) ^ tools::Read64(secret + 8));
+		}
+
+		/// <summary>
+		/// XXH3 of at most XXH3_MIDSIZE_MAX bytes, no accumulators
+		/// </summary>
+		uint64_t Xxh3Short(const unsigned char* p, std::size_t size) {
+			const unsigned char* secret = XXH3_SECRET;
+			if (size == 0)
+				return Xxh64Avalanche(tools::Read64(secret + 56) ^ tools::Read64(secret + 64));
+			if (size <= 3) {
+				const uint32_t combined = (uint32_t(p[0]) << 16) | (uint32_t(p[size >> 1]) << 24) | uint32_t(p[size - 1]) | (uint32_t(size) << 8);
+				return Xxh64Avalanche(uint64_t(combined) ^ (tools::Read32(secret) ^ tools::Read32(secret + 4)));
+			}
+			if (size <= 8) {
+				const uint64_t input = tools::Read32(p + size - 4) + (uint64_t(tools::Read32(p)) << 32);
+				uint64_t h = input ^ (tools::Read64(secret + 8) ^ tools::Read64(secret + 16));
+				h ^= tools::RotateLeft64(h, 49) ^ tools::RotateLeft64(h, 24);
+				h *= PRIME_MX2;
+				h ^= (h >> 35) + size;
+				h *= PRIME_MX2;
+				return h ^ (h >> 28);
+			}
+			if (size <= 16) {
+				const uint64_t low = tools::Read64(p) ^ (tools::Read64(secret + 24) ^ tools::Read64(secret + 32));
+				const uint64_t high = tools::Read64(p + size - 8) ^ (tools::Read64(secret + 40) ^ tools::Read64(secret + 48));
+				return Xxh3Avalanche(size + Swap64(low) + high + Mul128Fold64(low, high));
+			}
+			uint64_t acc = size * PRIME64_1;
+			if (size <= 128) {
+				//Pairs of 16 bytes from both ends meet in the middle
+				const std::size_t pairs = (size - 1) / 32 + 1;
+				for (std::size_t i = pairs; i-- > 0;) {
+					acc += Xxh3Mix16(p + 16 * i, secret + 32 * i);
+					acc += Xxh3Mix16(p + size - 16 * (i + 1), secret + 32 * i + 16);
+				}
+				return Xxh3Avalanche(acc);
+			}
+			const std::size_t rounds = size / 16;
+			for (std::size_t i = 0; i < 8; ++i)
+				acc += Xxh3Mix16(p + 16 * i, secret + 16 * i);
+			acc = Xxh3Avalanche(acc);
+			for (std::size_t i = 8; i < rounds; ++i)
+				acc += Xxh3Mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+			acc += Xxh3Mix16(p + size - 16, secret + 136 - 17);
+			return Xxh3Avalanche(acc);
+		}
+
+		inline void Xxh3InitAcc(uint64_t* acc) {
+			const uint64_t init[8] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+			std::memcpy(acc, init, sizeof(init));
+		}
+
+		uint64_t Xxh3Merge(const uint64_t* acc, std::size_t size) {
+			uint64_t result = size * PRIME64_1;
+			for (std::size_t i = 0; i < 4; ++i)
+				result += Mul128Fold64(acc[2 * i] ^ tools::Read64(XXH3_SECRET + 11 + 16 * i), acc[2 * i + 1] ^ tools::Read64(XXH3_SECRET + 11 + 16 * i + 8));
+			return Xxh3Avalanche(result);
+		}
+
+		inline void Xxh3Accumulate512(uint64_t* acc, const unsigned char* p, const unsigned char* secret) {
+			for (std::size_t i = 0; i < 8; ++i) {
+				const uint64_t data = tools::Read64(p + 8 * i);
+				const uint64_t key = data ^ tools::Read64(secret + 8 * i);
+				acc[i ^ 1] += data;
+				acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+			}
+		}
+
+		inline void Xxh3Scramble(uint64_t* acc, const unsigned char* secret) {
+			for (std::size_t i = 0; i < 8; ++i)
+				acc[i] = (acc[i] ^ (acc[i] >> 47) ^ tools::Read64(secret + 8 * i)) * PRIME32_1;
+		}
+
+		/// <summary>
+		/// XXH3 of more than XXH3_MIDSIZE_MAX bytes: blocks of stripes, scramble after each block, last stripe ends at the end of input
+		/// </summary>
+		uint64_t Xxh3Long(const unsigned char* p, std::size_t size) {
+			uint64_t acc[8];
+			Xxh3InitAcc(acc);
+			const std::size_t blocks = (size - 1) / XXH3_BLOCK_LEN;
+			for (std::size_t n = 0; n < blocks; ++n) {
+				for (std::size_t s = 0; s < XXH3_STRIPES_PER_BLOCK; ++s)
+					Xxh3Accumulate512(acc, p + n * XXH3_BLOCK_LEN + s * XXH3_STRIPE_LEN, XXH3_SECRET + s * 8);
+				Xxh3Scramble(acc, XXH3_SECRET + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+			}
+			const std::size_t stripes = ((size - 1) - blocks * XXH3_BLOCK_LEN) / XXH3_STRIPE_LEN;
+			for (std::size_t s = 0; s < stripes; ++s)
+				Xxh3Accumulate512(acc, p + blocks * XXH3_BLOCK_LEN + s * XXH3_STRIPE_LEN, XXH3_SECRET + s * 8);
+			Xxh3Accumulate512(acc, p + size - XXH3_STRIPE_LEN, XXH3_SECRET + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - 7);
+			return Xxh3Merge(acc, size);
+		}
+
+		uint32_t Crc32cSoftware(const unsigned char* p, std::size_t size) {
+			static const std::array<uint32_t, 256> table = MakeCrc32cTable();
+			uint32_t crc = 0xFFFFFFFF;
+			for (std::size_t i = 0; i < size; ++i)
+				crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+			return ~crc;
+		}
+
+#ifdef SQLITE3_INC_BKP_SSE42
+		bool HasSse42() {
+#ifdef _MSC_VER
+			int info[4] = {};
+			__cpuid(info, 1);
+			return (info[2] & (1 << 20)) != 0;
+#else
+			unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+			return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 20)) != 0;
+#endif
+		}
+
+		SSE42_TARGET uint32_t Crc32cTail(uint32_t crc, const unsigned char* p, std::size_t size) {
+			for (std::size_t i = 0; i < size; ++i)
+				crc = _mm_crc32_u8(crc, p[i]);
+			return crc;
+		}
+
+		/// <summary>
+		/// CRC32C of lanes buffers of equal size, independent crc32 chains hide the 3-cycle latency of the instruction
+		/// </summary>
+		template <std::size_t Lanes>
+		SSE42_TARGET void Crc32cLanes(const unsigned char* const* buffers, std::size_t size, uint32_t* crcs) {
+			uint64_t state[Lanes];
+			for (std::size_t l = 0; l < Lanes; ++l)
+				state[l] = 0xFFFFFFFF;
+			const std::size_t words = size / 8;
+			for (std::size_t w = 0; w < words; ++w) {
+				for (std::size_t l = 0; l < Lanes; ++l)
+					state[l] = _mm_crc32_u64(state[l], tools::Read64(buffers[l] + w * 8));
+			}
+			for (std::size_t l = 0; l < Lanes; ++l)
+				crcs[l] = ~Crc32cTail(static_cast<uint32_t>(state[l]), buffers[l] + words * 8, size - words * 8);
+		}
+
+		SSE42_TARGET uint64_t Crc32cPageSse42(const void* data, std::size_t size) {
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+			const std::size_t half = size / 2;
+			uint32_t crcs[2];
+			if (half == size - half) {
+				const unsigned char* halves[2] = { p, p + half };
+				Crc32cLanes<2>(halves, half, crcs);
+			}
+			else {
+				Crc32cLanes<1>(&p, half, crcs);
+				const unsigned char* second = p + half;
+				Crc32cLanes<1>(&second, size - half, crcs + 1);
+			}
+			return (uint64_t(crcs[0]) << 32) | crcs[1];
+		}
+
+		SSE42_TARGET void Crc32cBatchSse42(const char* data, std::size_t pageSize, std::size_t count, hash_t* hashes) {
+			const std::size_t half = pageSize / 2;
+			std::size_t i = 0;
+			if (half == pageSize - half) {
+				//Both halves of CRC32C_LANES pages, 8 chains keep the crc32 unit busy every cycle
+				for (; i + CRC32C_LANES <= count; i += CRC32C_LANES) {
+					const unsigned char* buffers[CRC32C_LANES * 2];
+					for (std::size_t l = 0; l < CRC32C_LANES; ++l) {
+						buffers[2 * l] = reinterpret_cast<const unsigned char*>(data + (i + l) * pageSize);
+						buffers[2 * l + 1] = buffers[2 * l] + half;
+					}
+					uint32_t crcs[CRC32C_LANES * 2];
+					Crc32cLanes<CRC32C_LANES * 2>(buffers, half, crcs);
+					for (std::size_t l = 0; l < CRC32C_LANES; ++l)
+						hashes[i + l] = (uint64_t(crcs[2 * l]) << 32) | crcs[2 * l + 1];
+				}
+			}
+			for (; i < count; ++i)
+				hashes[i] = Crc32cPageSse42(data + i * pageSize, pageSize);
+		}
+#endif
+
+#ifdef SQLITE3_INC_BKP_AVX2
+		bool HasAvx2() {
+#ifdef _MSC_VER
+			int info[4] = {};
+			__cpuid(info, 1);
+			//OS must save YMM registers, XGETBV needs OSXSAVE
+			if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+				return false;
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+#else
+			//libgcc checks OS support of YMM state as well
+			return __builtin_cpu_supports("avx2");
+#endif
+		}
+
+		/// <summary>
+		/// Stripe of 64 bytes into two vectors of 4 accumulators, _mm256_mul_epu32 is the 32x32->64 multiply of scalar round
+		/// </summary>
+		AVX2_TARGET inline void Xxh3Accumulate512Avx2(__m256i* acc, const unsigned char* p, const unsigned char* secret) {
+			for (std::size_t i = 0; i < 2; ++i) {
+				const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * i));
+				const __m256i key = _mm256_xor_si256(data, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret + 32 * i)));
+				const __m256i product = _mm256_mul_epu32(key, _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+				const __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+				acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(product, swapped));
+			}
+		}
+
+		AVX2_TARGET inline void Xxh3ScrambleAvx2(__m256i* acc, const unsigned char* secret) {
+			const __m256i prime = _mm256_set1_epi32(static_cast<int>(PRIME32_1));
+			for (std::size_t i = 0; i < 2; ++i) {
+				const __m256i mixed = _mm256_xor_si256(_mm256_xor_si256(acc[i], _mm256_srli_epi64(acc[i], 47)),
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret + 32 * i)));
+				const __m256i low = _mm256_mul_epu32(mixed, prime);
+				const __m256i high = _mm256_mul_epu32(_mm256_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+				acc[i] = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+			}
+		}
+
+		AVX2_TARGET uint64_t Xxh3LongAvx2(const unsigned char* p, std::size_t size) {
+			alignas(32) uint64_t init[8];
+			Xxh3InitAcc(init);
+			__m256i acc[2] = { _mm256_load_si256(reinterpret_cast<const __m256i*>(init)), _mm256_load_si256(reinterpret_cast<const __m256i*>(init + 4)) };
+			const std::size_t blocks = (size - 1) / XXH3_BLOCK_LEN;
+			for (std::size_t n = 0; n < blocks; ++n) {
+				for (std::size_t s = 0; s < XXH3_STRIPES_PER_BLOCK; ++s)
+					Xxh3Accumulate512Avx2(acc, p + n * XXH3_BLOCK_LEN + s * XXH3_STRIPE_LEN, XXH3_SECRET + s * 8);
+				Xxh3ScrambleAvx2(acc, XXH3_SECRET + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+			}
+			const std::size_t stripes = ((size - 1) - blocks * XXH3_BLOCK_LEN) / XXH3_STRIPE_LEN;
+			for (std::size_t s = 0; s < stripes; ++s)
+				Xxh3Accumulate512Avx2(acc, p + blocks * XXH3_BLOCK_LEN + s * XXH3_STRIPE_LEN, XXH3_SECRET + s * 8);
+			Xxh3Accumulate512Avx2(acc, p + size - XXH3_STRIPE_LEN, XXH3_SECRET + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - 7);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(init), acc[0]);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(init + 4), acc[1]);
+			return Xxh3Merge(init, size);
+		}
+
+		uint64_t Xxh3PageAvx2(const void* data, std::size_t size) {
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+			return size <= XXH3_MIDSIZE_MAX ? Xxh3Short(p, size) : Xxh3LongAvx2(p, size);
+		}
+
+		void Xxh3BatchAvx2(const char* data, std::size_t pageSize, std::size_t count, hash_t* hashes) {
+			for (std::size_t i = 0; i < count; ++i)
+				hashes[i] = Xxh3PageAvx2(data + i * pageSize, pageSize);
+		}
+#endif
+	}
+
+	uint64_t tools::Xxh3(const void* data, std::size_t size) {
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		return size <= XXH3_MIDSIZE_MAX ? Xxh3Short(p, size) : Xxh3Long(p, size);
+	}
+
+	uint64_t tools::Crc32cPage(const void* data, std::size_t size) {
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		const std::size_t half = size / 2;
+		return (uint64_t(Crc32cSoftware(p, half)) << 32) | Crc32cSoftware(p + half, size - half);
+	}
+
+	void tools::Sha256(const void* data, std::size_t size, unsigned char digest[32]) {
+		uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		std::size_t i = 0;
+		for (; i + 64 <= size; i += 64)
+			Sha256Block(state, p + i);
+
+		//Tail, 0x80 terminator and bit length fill one or two last blocks
+		unsigned char tail[128] = {};
+		const std::size_t rest = size - i;
+		std::memcpy(tail, p + i, rest);
+		tail[rest] = 0x80;
+		const std::size_t tailSize = rest + 9 <= 64 ? 64 : 128;
+		const uint64_t bits = uint64_t(size) * 8;
+		for (int k = 0; k < 8; ++k)
+			tail[tailSize - 1 - k] = static_cast<unsigned char>(bits >> (8 * k));
+		for (std::size_t k = 0; k < tailSize; k += 64)
+			Sha256Block(state, tail + k);
+		for (int k = 0; k < 8; ++k) {
+			digest[4 * k] = static_cast<unsigned char>(state[k] >> 24);
+			digest[4 * k + 1] = static_cast<unsigned char>(state[k] >> 16);
+			digest[4 * k + 2] = static_cast<unsigned char>(state[k] >> 8);
+			digest[4 * k + 3] = static_cast<unsigned char>(state[k]);
+		}
+	}
+
+	PageHasher PageHasher::Select(HashAlgorithm algorithm, const hash_func& callback) {
+		switch (algorithm) {
+		case HashAlgorithm::Xxh64:
+			return Create<Xxh64Hasher>();
+		case HashAlgorithm::Xxh3: {
+#ifdef SQLITE3_INC_BKP_AVX2
+			static const bool avx2 = HasAvx2();
+			if (avx2) {
+				PageHasher hasher;
+				hasher.algorithm = HashAlgorithm::Xxh3;
+				hasher.single = Xxh3PageAvx2;
+				hasher.batch = Xxh3BatchAvx2;
+				return hasher;
+			}
+#endif
+			return Create<Xxh3Hasher>();
+		}
+		case HashAlgorithm::Crc32c: {
+#ifdef SQLITE3_INC_BKP_SSE42
+			static const bool sse42 = HasSse42();
+			if (sse42) {
+				PageHasher hasher;
+				hasher.algorithm = HashAlgorithm::Crc32c;
+				hasher.single = Crc32cPageSse42;
+				hasher.batch = Crc32cBatchSse42;
+				return hasher;
+			}
+#endif
+			return Create<Crc32cHasher>();
+		}
+		case HashAlgorithm::Callback:
+		default:
+			return callback ? Create(CallbackHasher{ callback }) : PageHasher();
+		}
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+
+#include "api.h"
+#include "common.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Hash count pages of pageSize bytes laid out back to back in data
+	/// </summary>
+	using batch_hash_func = std::function<void(const char* data, std::size_t pageSize, std::size_t count, hash_t* hashes)>;
+
+	namespace tools {
+		inline uint64_t RotateLeft64(uint64_t x, int r) {
+			return (x << r) | (x >> (64 - r));
+		}
+
+		inline uint64_t Read64(const unsigned char* p) {
+			uint64_t v;
+			std::memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		inline uint32_t Read32(const unsigned char* p) {
+			uint32_t v;
+			std::memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		/// <summary>
+		/// XXH64 of little-endian platform, same values as XXH64() of xxHash library
+		/// </summary>
+		inline uint64_t Xxh64(const void* data, std::size_t size, uint64_t seed) {
+			const uint64_t P1 = 0x9E3779B185EBCA87ull, P2 = 0xC2B2AE3D27D4EB4Full, P3 = 0x165667B19E3779F9ull;
+			const uint64_t P4 = 0x85EBCA77C2B2AE63ull, P5 = 0x27D4EB2F165667C5ull;
+			auto round = [P1, P2](uint64_t acc, uint64_t input) {
+				return RotateLeft64(acc + input * P2, 31) * P1;
+			};
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+			const unsigned char* end = p + size;
+			uint64_t h;
+			if (size >= 32) {
+				uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+				const unsigned char* limit = end - 32;
+				do {
+					v1 = round(v1, Read64(p));
+					v2 = round(v2, Read64(p + 8));
+					v3 = round(v3, Read64(p + 16));
+					v4 = round(v4, Read64(p + 24));
+					p += 32;
+				} while (p <= limit);
+				h = RotateLeft64(v1, 1) + RotateLeft64(v2, 7) + RotateLeft64(v3, 12) + RotateLeft64(v4, 18);
+				for (uint64_t v : { v1, v2, v3, v4 })
+					h = (h ^ round(0, v)) * P1 + P4;
+			}
+			else {
+				h = seed + P5;
+			}
+			h += size;
+			for (; p + 8 <= end; p += 8)
+				h = RotateLeft64(h ^ round(0, Read64(p)), 27) * P1 + P4;
+			if (p + 4 <= end) {
+				h = RotateLeft64(h ^ (uint64_t(Read32(p)) * P1), 23) * P2 + P3;
+				p += 4;
+			}
+			for (; p < end; ++p)
+				h = RotateLeft64(h ^ (uint64_t(*p) * P5), 11) * P1;
+			h ^= h >> 33;
+			h *= P2;
+			h ^= h >> 29;
+			h *= P3;
+			h ^= h >> 32;
+			return h;
+		}
+
+		/// <summary>
+		/// Portable XXH3 64-bit with seed 0 and default secret, same values as XXH3_64bits() of xxHash library
+		/// </summary>
+		uint64_t Xxh3(const void* data, std::size_t size);
+
+		/// <summary>
+		/// Page hash of CRC32C kernels: CRC32C of the first half of page in high word, of the second half in low word
+		/// </summary>
+		uint64_t Crc32cPage(const void* data, std::size_t size);
+
+		/// <summary>
+		/// SHA-256 digest of data, content key of pages in shared page store
+		/// </summary>
+		void Sha256(const void* data, std::size_t size, unsigned char digest[32]);
+	}
+
+	/// <summary>
+	/// Hasher policy calling user callback, the only policy with an indirect call per page
+	/// </summary>
+	struct CallbackHasher {
+		static constexpr HashAlgorithm algorithm = HashAlgorithm::Callback;
+		hash_func f;
+		inline hash_t operator()(const void* data, std::size_t size) const { return f(data, size); }
+	};
+
+	/// <summary>
+	/// Hasher policy of built-in XXH64 with seed 0
+	/// </summary>
+	struct Xxh64Hasher {
+		static constexpr HashAlgorithm algorithm = HashAlgorithm::Xxh64;
+		inline hash_t operator()(const void* data, std::size_t size) const { return tools::Xxh64(data, size, 0); }
+	};
+
+	/// <summary>
+	/// Hasher policy of portable XXH3 64-bit, PageHasher::Select uses AVX2 kernel with the same values if CPU has it
+	/// </summary>
+	struct Xxh3Hasher {
+		static constexpr HashAlgorithm algorithm = HashAlgorithm::Xxh3;
+		inline hash_t operator()(const void* data, std::size_t size) const { return tools::Xxh3(data, size); }
+	};
+
+	/// <summary>
+	/// Hasher policy of portable CRC32C page hash, PageHasher::Select uses SSE4.2 kernel with the same values if CPU has it
+	/// </summary>
+	struct Crc32cHasher {
+		static constexpr HashAlgorithm algorithm = HashAlgorithm::Crc32c;
+		inline hash_t operator()(const void* data, std::size_t size) const { return tools::Crc32cPage(data, size); }
+	};
+
+	/// <summary>
+	/// Page hash function with algorithm id recorded in manifest and segments,
+	/// batch function hashes a whole pipeline batch so per-page hash of a policy is inlined into its loop
+	/// </summary>
+	struct PageHasher {
+		HashAlgorithm algorithm = HashAlgorithm::Callback;
+		hash_func single;
+		batch_hash_func batch;
+
+		inline explicit operator bool() const { return static_cast<bool>(single); }
+
+		/// <summary>
+		/// Hasher of compile-time policy: struct with static algorithm id and hash_t operator()(const void*, size_t) const
+		/// </summary>
+		template <typename Policy>
+		static PageHasher Create(Policy policy = Policy()) {
+			PageHasher hasher;
+			hasher.algorithm = Policy::algorithm;
+			hasher.single = [policy](const void* data, std::size_t size) { return policy(data, size); };
+			hasher.batch = [policy](const char* data, std::size_t pageSize, std::size_t count, hash_t* hashes) {
+				for (std::size_t i = 0; i < count; ++i)
+					hashes[i] = policy(data + i * pageSize, pageSize);
+			};
+			return hasher;
+		}
+
+		/// <summary>
+		/// Hasher of algorithm, built-in kernel is picked by CPU features
+		/// </summary>
+		/// <param name="callback">Hash of HashAlgorithm::Callback, empty hasher is returned if it is not set</param>
+		static PageHasher Select(HashAlgorithm algorithm, const hash_func& callback);
+	};
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,635 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include "exception.h"
+#include "hasher.h"
+#include "throttle.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t MANIFEST_MAGIC = 0x4D4B4249; //IBKM
+		const uint32_t MANIFEST_VERSION = 3;
+		const uint32_t MANIFEST_VERSION_SUMMED = 2;	//root was sum of mixed (pgno, hash) pairs, no hash tree
+		const std::size_t MANIFEST_MIN_CAPACITY = 1024;
+		const std::size_t MANIFEST_UNDO_LIMIT = 1 << 22;
+		const std::size_t TREE_LEAF_ENTRIES = 64;
+		const std::size_t TREE_FANOUT = 16;
+		const std::size_t SEGMENT_ENTRIES = 1 << 15;	//256 KiB of entries, segments of small window shrink down to one OS page
+		const std::size_t WINDOW_MIN_SEGMENTS = 2;		//segment being visited and the one read ahead
+
+		enum ManifestState : uint32_t {
+			Committed = 0,
+			Updating = 1
+		};
+
+		/// <summary>
+		/// Node counts of tree levels over count entries, leaves first, the last level is the root
+		/// </summary>
+		std::vector<std::size_t> LevelSizes(std::size_t count) {
+			std::vector<std::size_t> sizes;
+			std::size_t size = (count + TREE_LEAF_ENTRIES - 1) / TREE_LEAF_ENTRIES;
+			while (size > 0) {
+				sizes.push_back(size);
+				if (size == 1)
+					break;
+				size = (size + TREE_FANOUT - 1) / TREE_FANOUT;
+			}
+			return sizes;
+		}
+
+		std::vector<std::size_t> LevelOffsets(std::size_t capacity) {
+			std::vector<std::size_t> offsets;
+			std::size_t offset = 0;
+			for (std::size_t size : LevelSizes(capacity)) {
+				offsets.push_back(offset);
+				offset += size;
+			}
+			offsets.push_back(offset);
+			return offsets;
+		}
+
+		inline std::size_t TreeSize(std::size_t capacity) {
+			return LevelOffsets(capacity).back();
+		}
+
+		inline uint64_t FileSize(std::size_t capacity) {
+			return sizeof(ManifestHeader) + (capacity + TreeSize(capacity)) * sizeof(hash_t);
+		}
+
+		inline hash_t HashLeaf(const hash_t* entries, std::size_t count, std::size_t leaf) {
+			const std::size_t first = leaf * TREE_LEAF_ENTRIES;
+			return tools::Xxh64(entries + first, std::min(TREE_LEAF_ENTRIES, count - first) * sizeof(hash_t), 0);
+		}
+
+		/// <summary>
+		/// Hash of inner node of level over its children in level below, seeded by level
+		/// </summary>
+		inline hash_t HashNode(const hash_t* children, std::size_t childCount, std::size_t node, std::size_t level) {
+			const std::size_t first = node * TREE_FANOUT;
+			return tools::Xxh64(children + first, std::min(TREE_FANOUT, childCount - first) * sizeof(hash_t), level);
+		}
+
+		/// <summary>
+		/// Hash all nodes of tree over count entries laid out by offsets
+		/// </summary>
+		/// <returns>Root hash, 0 if there are no entries</returns>
+		hash_t BuildTree(const hash_t* entries, std::size_t count, const std::vector<std::size_t>& offsets, hash_t* nodes) {
+			const std::vector<std::size_t> sizes = LevelSizes(count);
+			if (sizes.empty())
+				return 0;
+			for (std::size_t i = 0; i < sizes[0]; ++i)
+				nodes[offsets[0] + i] = HashLeaf(entries, count, i);
+			for (std::size_t level = 1; level < sizes.size(); ++level) {
+				for (std::size_t i = 0; i < sizes[level]; ++i)
+					nodes[offsets[level] + i] = HashNode(nodes + offsets[level - 1], sizes[level - 1], i, level);
+			}
+			return nodes[offsets[sizes.size() - 1]];
+		}
+
+		ManifestHeader MakeHeader(std::size_t pageCount, std::size_t capacity, std::size_t pageSize, HashAlgorithm algorithm) {
+			ManifestHeader header = {};
+			header.magic = MANIFEST_MAGIC;
+			header.version = MANIFEST_VERSION;
+			header.pageSize = static_cast<uint32_t>(pageSize);
+			header.hashAlgorithm = static_cast<uint32_t>(algorithm);
+			header.pageCount = pageCount;
+			header.capacity = capacity;
+			header.state = Committed;
+			return header;
+		}
+
+		/// <summary>
+		/// Append range of pages, adjacent ranges are merged
+		/// </summary>
+		void AddRange(std::vector<PageRange>& ranges, uint64_t first, uint64_t count) {
+			if (!ranges.empty() && ranges.back().first + ranges.back().count == first)
+				ranges.back().count += count;
+			else
+				ranges.push_back({ first, count });
+		}
+	}
+
+	Manifest::~Manifest() {
+		this->Close();
+	}
+
+	void Manifest::Open(const std::string& path, bool readOnly, const hash_func& f) {
+		this->Close();
+		this->path = path;
+		this->readOnly = readOnly;
+
+		if (!boost::filesystem::exists(path)) {
+			if (readOnly) {
+				throw BackupException(tools::FormatString::format("Integrity file [%s] not exists", path.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			this->Create(path, std::vector<hash_t>(), 0, HashAlgorithm::Callback);
+		}
+		else {
+			ManifestHeader stored = {};
+			std::ifstream fManifest(path, std::ios::binary);
+			fManifest.read(reinterpret_cast<char*>(&stored), sizeof(stored));
+			fManifest.close();
+
+			//V1 has no header, V2 has no hash tree, both keep page size and algorithm they have
+			if (stored.magic != MANIFEST_MAGIC || stored.version == MANIFEST_VERSION_SUMMED) {
+				const bool legacy = stored.magic != MANIFEST_MAGIC;
+				if (legacy && readOnly && !f) {
+					throw BackupException(tools::FormatString::format("Integrity file [%s] is V1 manifest, its root hash needs hash function", path.c_str()).c_str(), BackupException::Error::BackupLoad);
+				}
+				std::vector<hash_t> hashes;
+				const bool valid = legacy ? this->LoadLegacy(path, f, hashes) : this->LoadSummed(path, hashes);
+				const std::size_t pageSize = legacy ? 0 : stored.pageSize;
+				const HashAlgorithm algorithm = legacy ? HashAlgorithm::Callback : static_cast<HashAlgorithm>(stored.hashAlgorithm);
+				if (readOnly) {
+					if (!valid) {
+						throw BackupException(tools::FormatString::format("Integrity file [%s] corrupted", path.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+					}
+					const std::size_t headerWords = sizeof(ManifestHeader) / sizeof(uint64_t);
+					this->memory.assign(headerWords + hashes.size() + TreeSize(hashes.size()), 0);
+					this->header = reinterpret_cast<ManifestHeader*>(this->memory.data());
+					*this->header = MakeHeader(hashes.size(), hashes.size(), pageSize, algorithm);
+					this->entries = reinterpret_cast<hash_t*>(this->memory.data() + headerWords);
+					std::copy(hashes.begin(), hashes.end(), this->entries);
+					this->AttachTree();
+					this->RebuildTree();
+					return;
+				}
+				this->Create(path, valid ? hashes : std::vector<hash_t>(), pageSize, algorithm);
+			}
+		}
+
+		this->Map();
+		if (!readOnly && this->header->state != Committed) {
+			//Previous backup was interrupted, entries may describe pages never written to image
+			this->header->pageCount = 0;
+			this->header->rootHash = 0;
+		}
+	}
+
+	void Manifest::Close() {
+		this->region.reset();
+		this->mapping.reset();
+		this->memory.clear();
+		this->header = nullptr;
+		this->entries = nullptr;
+		this->nodes = nullptr;
+		this->levelOffsets.clear();
+		this->dirtyLeaves.clear();
+		this->leafDirty.clear();
+		this->undo.clear();
+		this->recorded.clear();
+		this->undoValid = false;
+		this->windowFirst = this->windowLast = 0;
+		this->segmentDirty.clear();
+	}
+
+	void Manifest::Map() {
+		using namespace boost::interprocess;
+		const boost::interprocess::mode_t mode = this->readOnly ? read_only : read_write;
+		try {
+			this->mapping = std::make_unique<file_mapping>(this->path.c_str(), mode);
+			this->region = std::make_unique<mapped_region>(*this->mapping, mode);
+		}
+		catch (const interprocess_exception& e) {
+			throw BackupException(tools::FormatString::format("Could not map manifest [%s] : %s", this->path.c_str(), e.what()).c_str(), BackupException::Error::IntegrityCheck);
+		}
+
+		this->header = reinterpret_cast<ManifestHeader*>(this->region->get_address());
+		this->entries = reinterpret_cast<hash_t*>(this->header + 1);
+		const std::size_t size = this->region->get_size();
+		if (size < sizeof(ManifestHeader) || this->header->magic != MANIFEST_MAGIC || this->header->version != MANIFEST_VERSION
+			|| this->EntryCount() > this->header->capacity
+			|| FileSize(static_cast<std::size_t>(this->header->capacity)) > size) {
+			this->Close();
+			throw BackupException(tools::FormatString::format("Integrity file [%s] corrupted", this->path.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+		}
+		this->AttachTree();
+	}
+
+	void Manifest::AttachTree() {
+		const std::size_t capacity = static_cast<std::size_t>(this->header->capacity);
+		this->nodes = this->entries + capacity;
+		this->levelOffsets = LevelOffsets(capacity);
+		this->dirtyLeaves.clear();
+		this->leafDirty.assign(this->levelOffsets.size() > 1 ? this->levelOffsets[1] : 0, false);
+	}
+
+	void Manifest::MarkLeaf(std::size_t entry) {
+		const std::size_t leaf = (entry - 1) / TREE_LEAF_ENTRIES;
+		if (this->leafDirty[leaf])
+			return;
+		this->leafDirty[leaf] = true;
+		this->dirtyLeaves.push_back(leaf);
+	}
+
+	void Manifest::RebuildTree() {
+		for (std::size_t leaf : this->dirtyLeaves)
+			this->leafDirty[leaf] = false;
+		this->dirtyLeaves.clear();
+		this->header->rootHash = BuildTree(this->entries, this->EntryCount(), this->levelOffsets, this->nodes);
+	}
+
+	void Manifest::Reroot() {
+		const std::size_t count = this->EntryCount();
+		const std::vector<std::size_t> sizes = LevelSizes(count);
+		std::vector<std::size_t> level;
+		level.swap(this->dirtyLeaves);
+		for (std::size_t leaf : level)
+			this->leafDirty[leaf] = false;
+
+		//Every level rehashes only ancestors of marked leaves, nodes past the end of a shrunk level are left as they are
+		for (std::size_t l = 0; l < sizes.size() && !level.empty(); ++l) {
+			std::sort(level.begin(), level.end());
+			level.erase(std::unique(level.begin(), level.end()), level.end());
+			while (!level.empty() && level.back() >= sizes[l])
+				level.pop_back();
+			for (std::size_t& i : level) {
+				this->nodes[this->levelOffsets[l] + i] = l == 0 ? HashLeaf(this->entries, count, i) : HashNode(this->nodes + this->levelOffsets[l - 1], sizes[l - 1], i, l);
+				i /= TREE_FANOUT;
+			}
+		}
+		this->header->rootHash = sizes.empty() ? 0 : this->Node(sizes.size() - 1, 0);
+	}
+
+	hash_t Manifest::Node(std::size_t level, std::size_t index) const {
+		return this->nodes[this->levelOffsets[level] + index];
+	}
+
+	void Manifest::Reserve(std::size_t entryCount) {
+		if (entryCount <= this->header->capacity)
+			return;
+		const std::size_t capacity = std::max<std::size_t>(entryCount, static_cast<std::size_t>(this->header->capacity) * 2);
+		this->region->flush();
+		this->region.reset();
+		this->mapping.reset();
+		boost::filesystem::resize_file(this->path, FileSize(capacity));
+		this->Map();
+		//Tree moves behind the grown entries, it is rebuilt once per doubling of capacity
+		this->header->capacity = capacity;
+		this->AttachTree();
+		this->RebuildTree();
+		this->ResetWindow();
+	}
+
+	void Manifest::BeginUpdate() {
+		if (this->header->state == Updating)
+			return;
+		this->undoHeader = *this->header;
+		this->undo.clear();
+		this->recorded.assign(this->EntryCount() + 1, false);
+		this->undoValid = true;
+		this->header->state = Updating;
+		this->region->flush(0, sizeof(ManifestHeader));
+	}
+
+	void Manifest::Record(std::size_t entry) {
+		//Entries past committed page count are not part of committed state
+		const uint64_t undoExtent = this->undoHeader.extentPages ? this->undoHeader.extentPages : 1;
+		if (!this->undoValid || entry > (this->undoHeader.pageCount + undoExtent - 1) / undoExtent || this->recorded[entry])
+			return;
+		//Undo log does not follow the resident window, an update rewritten through a small window is rolled back all the same
+		if (this->undo.size() >= MANIFEST_UNDO_LIMIT) {
+			this->undoValid = false;
+			this->undo.clear();
+			this->recorded.clear();
+			return;
+		}
+		this->recorded[entry] = true;
+		this->undo.emplace_back(entry, this->entries[entry - 1]);
+	}
+
+	void Manifest::Set(std::size_t pgno, hash_t hash) {
+		this->BeginUpdate();
+		const std::size_t entry = this->EntryOf(pgno);
+		if (pgno > this->header->pageCount) {
+			const std::size_t count = this->EntryCount();
+			this->Reserve(entry);
+			for (std::size_t i = count + 1; i < entry; ++i) {
+				this->Record(i);
+				this->entries[i - 1] = 0;
+				this->MarkLeaf(i);
+			}
+			this->header->pageCount = pgno;
+		}
+		this->Record(entry);
+		this->entries[entry - 1] = hash;
+		this->MarkLeaf(entry);
+		this->MarkSegment(entry);
+	}
+
+	void Manifest::Truncate(std::size_t pageCount) {
+		if (pageCount >= this->header->pageCount)
+			return;
+		this->BeginUpdate();
+		this->header->pageCount = pageCount;
+		//The last leaf loses entries, its ancestors are the right edge of the shrunk tree
+		if (pageCount > 0) {
+			const std::size_t last = this->EntryCount();
+			//Hash of cut extent covers pages gone now, it is unknown until the extent is hashed again
+			if (pageCount % this->ExtentPages() != 0) {
+				this->Record(last);
+				this->entries[last - 1] = 0;
+			}
+			this->MarkLeaf(last);
+		}
+	}
+
+	void Manifest::SetPageSize(std::size_t pageSize) {
+		if (this->header->pageSize == pageSize)
+			return;
+		this->BeginUpdate();
+		this->header->pageSize = static_cast<uint32_t>(pageSize);
+	}
+
+	void Manifest::SetAlgorithm(HashAlgorithm algorithm) {
+		if (this->Algorithm() == algorithm)
+			return;
+		this->Truncate(0);
+		this->BeginUpdate();
+		this->header->hashAlgorithm = static_cast<uint32_t>(algorithm);
+	}
+
+	void Manifest::SetExtentPages(std::size_t extentPages) {
+		extentPages = std::max<std::size_t>(extentPages, 1);
+		if (this->ExtentPages() == extentPages)
+			return;
+		this->Truncate(0);
+		this->BeginUpdate();
+		this->header->extentPages = static_cast<uint32_t>(extentPages);
+	}
+
+	std::vector<PageRange> Manifest::ToPages(const std::vector<PageRange>& entryRanges, uint64_t pageCount) const {
+		const uint64_t extentPages = this->ExtentPages();
+		if (extentPages == 1)
+			return entryRanges;
+		std::vector<PageRange> ranges;
+		for (const PageRange& range : entryRanges) {
+			const uint64_t first = (range.first - 1) * extentPages + 1;
+			const uint64_t last = std::min(pageCount, (range.first + range.count - 1) * extentPages);
+			if (first <= last)
+				AddRange(ranges, first, last - first + 1);
+		}
+		return ranges;
+	}
+
+	std::vector<PageRange> Manifest::Verify() const {
+		std::vector<PageRange> ranges;
+		const std::size_t count = this->EntryCount();
+		const std::vector<std::size_t> sizes = LevelSizes(count);
+		if (sizes.empty())
+			return ranges;
+		if (this->header->rootHash != this->Node(sizes.size() - 1, 0)) {
+			AddRange(ranges, 1, this->header->pageCount);
+			return ranges;
+		}
+
+		std::function<void(std::size_t, std::size_t)> visit = [&](std::size_t level, std::size_t index) {
+			const hash_t computed = level == 0 ? HashLeaf(this->entries, count, index) : HashNode(this->nodes + this->levelOffsets[level - 1], sizes[level - 1], index, level);
+			if (computed != this->Node(level, index)) {
+				uint64_t span = TREE_LEAF_ENTRIES;
+				for (std::size_t l = 0; l < level; ++l)
+					span *= TREE_FANOUT;
+				const uint64_t first = index * span;
+				AddRange(ranges, first + 1, std::min<uint64_t>(span, count - first));
+				return;
+			}
+			if (level == 0)
+				return;
+			//Leaves are visited in entry order, entries checked are paged through the resident window
+			if (level == 1)
+				this->Window(index * TREE_FANOUT * TREE_LEAF_ENTRIES + 1);
+			for (std::size_t child = index * TREE_FANOUT; child < std::min(sizes[level - 1], (index + 1) * TREE_FANOUT); ++child)
+				visit(level - 1, child);
+		};
+		visit(sizes.size() - 1, 0);
+		return this->ToPages(ranges, this->header->pageCount);
+	}
+
+	std::vector<PageRange> Manifest::Diff(const Manifest& other) const {
+		std::vector<PageRange> ranges;
+		//Both manifests hash extents of the same size, entries are compared and their ranges widened to pages
+		const std::size_t count = this->EntryCount();
+		const std::size_t otherCount = other.EntryCount();
+		const std::vector<std::size_t> sizes = LevelSizes(count);
+		const std::vector<std::size_t> otherSizes = LevelSizes(otherCount);
+		const std::size_t levels = std::max(sizes.size(), otherSizes.size());
+		const std::size_t total = std::max(count, otherCount);
+
+		//Node hash covers the entries under it and their count, equal nodes of equal position hold equal entries
+		std::function<void(std::size_t, std::size_t, uint64_t)> visit = [&](std::size_t level, std::size_t index, uint64_t span) {
+			const uint64_t first = index * span;
+			if (first >= total)
+				return;
+			const bool both = level < sizes.size() && index < sizes[level] && level < otherSizes.size() && index < otherSizes[level];
+			if (both && this->Node(level, index) == other.Node(level, index))
+				return;
+			if (level > 0) {
+				for (std::size_t child = index * TREE_FANOUT; child < (index + 1) * TREE_FANOUT; ++child)
+					visit(level - 1, child, span / TREE_FANOUT);
+				return;
+			}
+			for (std::size_t i = static_cast<std::size_t>(first); i < std::min<uint64_t>(first + span, total); ++i) {
+				if (i >= count || i >= otherCount || this->entries[i] != other.entries[i])
+					AddRange(ranges, i + 1, 1);
+			}
+		};
+		if (levels > 0) {
+			uint64_t span = TREE_LEAF_ENTRIES;
+			for (std::size_t l = 1; l < levels; ++l)
+				span *= TREE_FANOUT;
+			visit(levels - 1, 0, span);
+		}
+		return this->ToPages(ranges, std::max(this->header->pageCount, other.header->pageCount));
+	}
+
+	bool Manifest::IsCommitted() const {
+		return this->header->state == Committed;
+	}
+
+	void Manifest::Commit() {
+		if (this->readOnly || !this->region || this->header->state == Committed)
+			return;
+		this->Reroot();
+		this->header->state = Committed;
+		this->region->flush();
+		this->undo.clear();
+		this->recorded.clear();
+		this->undoValid = false;
+		//Manifest kept open between backups holds no entries resident
+		this->ResetWindow();
+	}
+
+	void Manifest::DropCache() {
+		if (!this->region || this->header->state != Committed)
+			return;
+#ifdef __linux__
+		::madvise(this->region->get_address(), this->region->get_size(), MADV_DONTNEED);
+#endif
+		tools::DropCache(this->path, false);
+	}
+
+	void Manifest::SetResidentLimit(std::size_t bytes) {
+		//Window holds at least WINDOW_MIN_SEGMENTS segments, budget below that many full segments makes them smaller
+		const std::size_t pageEntries = boost::interprocess::mapped_region::get_page_size() / sizeof(hash_t);
+		this->segmentEntries = bytes ? std::max(pageEntries, std::min(SEGMENT_ENTRIES, bytes / (WINDOW_MIN_SEGMENTS * sizeof(hash_t)))) : SEGMENT_ENTRIES;
+		this->windowSegments = bytes ? std::max(WINDOW_MIN_SEGMENTS, bytes / (this->segmentEntries * sizeof(hash_t))) : 0;
+		this->windowFirst = this->windowLast = 0;
+		this->segmentDirty.clear();
+	}
+
+	void Manifest::Window(std::size_t entry) const {
+		if (!this->windowSegments || !this->region)
+			return;
+		//Window ends with the segment after the one of entry, visit starting over before the window releases it
+		const std::size_t segment = (entry - 1) / this->segmentEntries;
+		const std::size_t last = segment + 2;
+		if (segment < this->windowFirst)
+			this->ResetWindow();
+		else if (last <= this->windowLast)
+			return;
+		const std::size_t first = last - std::min(last, this->windowSegments);
+		this->Evict(this->windowFirst, std::min(first, this->windowLast));
+		this->windowFirst = std::max(this->windowFirst, first);
+		this->windowLast = last;
+#ifdef __linux__
+		const std::size_t capacity = static_cast<std::size_t>(this->header->capacity);
+		const std::size_t pageSize = boost::interprocess::mapped_region::get_page_size();
+		const std::size_t next = (segment + 1) * this->segmentEntries;
+		if (next < capacity) {
+			char* begin = reinterpret_cast<char*>(this->entries + next);
+			char* aligned = begin - reinterpret_cast<std::uintptr_t>(begin) % pageSize;
+			::madvise(aligned, (std::min(this->segmentEntries, capacity - next) * sizeof(hash_t)) + (begin - aligned), MADV_WILLNEED);
+		}
+#endif
+	}
+
+	void Manifest::Evict(std::size_t first, std::size_t last) const {
+		const std::size_t capacity = static_cast<std::size_t>(this->header->capacity);
+		last = std::min(last, (capacity + this->segmentEntries - 1) / this->segmentEntries);
+		if (first >= last)
+			return;
+		char* const base = static_cast<char*>(this->region->get_address());
+		const std::size_t begin = reinterpret_cast<char*>(this->entries + first * this->segmentEntries) - base;
+		const std::size_t end = reinterpret_cast<char*>(this->entries + std::min(capacity, last * this->segmentEntries)) - base;
+#ifdef __linux__
+		//Pages shared with the segment after the range stay mapped, dirty pages stay in page cache when unmapped
+		const std::size_t pageSize = boost::interprocess::mapped_region::get_page_size();
+		const std::size_t alignedBegin = begin / pageSize * pageSize;
+		const std::size_t alignedEnd = end / pageSize * pageSize;
+		if (alignedBegin < alignedEnd)
+			::madvise(base + alignedBegin, alignedEnd - alignedBegin, MADV_DONTNEED);
+#endif
+		//Only changed segments are written back, write back starts without waiting for it
+		for (std::size_t segment = first; segment < std::min(last, this->segmentDirty.size()); ++segment) {
+			if (!this->segmentDirty[segment])
+				continue;
+			this->segmentDirty[segment] = false;
+			const std::size_t offset = begin + (segment - first) * this->segmentEntries * sizeof(hash_t);
+			const std::size_t size = std::min(this->segmentEntries * sizeof(hash_t), end - offset);
+#ifdef __linux__
+			::sync_file_range(this->mapping->get_mapping_handle().handle, static_cast<off_t>(offset), static_cast<off_t>(size), SYNC_FILE_RANGE_WRITE);
+#else
+			this->region->flush(offset, size, true);
+#endif
+		}
+	}
+
+	void Manifest::ResetWindow() const {
+		if (!this->windowSegments || !this->region)
+			return;
+		this->Evict(0, this->windowLast);
+		this->windowFirst = this->windowLast = 0;
+	}
+
+	void Manifest::MarkSegment(std::size_t entry) {
+		if (!this->windowSegments)
+			return;
+		const std::size_t segment = (entry - 1) / this->segmentEntries;
+		if (segment >= this->segmentDirty.size())
+			this->segmentDirty.resize(segment + 1, false);
+		this->segmentDirty[segment] = true;
+	}
+
+	void Manifest::Rollback() {
+		if (this->readOnly || !this->region || this->header->state == Committed || !this->undoValid)
+			return;
+		//Entries are flushed before the header marks them committed again
+		for (const auto& entry : this->undo) {
+			this->entries[entry.first - 1] = entry.second;
+			this->MarkLeaf(entry.first);
+		}
+		const uint64_t capacity = this->header->capacity;
+		*this->header = this->undoHeader;
+		this->header->capacity = capacity;
+		this->header->state = Updating;
+		if (this->header->pageCount > 0)
+			this->MarkLeaf(this->EntryCount());
+		this->Reroot();
+		this->region->flush();
+		this->header->state = Committed;
+		this->region->flush(0, sizeof(ManifestHeader));
+		this->undo.clear();
+		this->recorded.clear();
+		this->undoValid = false;
+	}
+
+	bool Manifest::LoadLegacy(const std::string& path, const hash_func& f, std::vector<hash_t>& hashes) const {
+		//V1 manifest: root hash of the array followed by page hashes
+		std::ifstream fManifest(path, std::ios::binary | std::ios::ate);
+		const std::size_t count = static_cast<std::size_t>(fManifest.tellg()) / sizeof(hash_t);
+		if (count == 0 || !f)
+			return false;
+		std::vector<hash_t> legacy(count);
+		fManifest.seekg(0);
+		if (!fManifest.read(reinterpret_cast<char*>(legacy.data()), count * sizeof(hash_t)))
+			return false;
+		if (legacy[0] != f(reinterpret_cast<const char*>(legacy.data() + 1), (count - 1) * sizeof(hash_t)))
+			return false;
+		hashes.assign(legacy.begin() + 1, legacy.end());
+		return true;
+	}
+
+	bool Manifest::LoadSummed(const std::string& path, std::vector<hash_t>& hashes) const {
+		//V2 manifest: header with sum of mixed (pgno, hash) pairs as root, then capacity page hashes
+		std::ifstream fManifest(path, std::ios::binary);
+		ManifestHeader stored = {};
+		if (!fManifest.read(reinterpret_cast<char*>(&stored), sizeof(stored)) || stored.state != Committed || stored.pageCount > stored.capacity)
+			return false;
+		hashes.resize(static_cast<std::size_t>(stored.pageCount));
+		if (!fManifest.read(reinterpret_cast<char*>(hashes.data()), hashes.size() * sizeof(hash_t)))
+			return false;
+		hash_t root = 0;
+		for (std::size_t i = 0; i < hashes.size(); ++i)
+			root += tools::MixEntry(i + 1, hashes[i]);
+		return root == stored.rootHash;
+	}
+
+	void Manifest::Create(const std::string& path, const std::vector<hash_t>& hashes, std::size_t pageSize, HashAlgorithm algorithm) const {
+		const std::string tmpPath = path + ".tmp";
+		const std::size_t capacity = std::max(hashes.size(), MANIFEST_MIN_CAPACITY);
+		ManifestHeader header = MakeHeader(hashes.size(), capacity, pageSize, algorithm);
+		std::vector<hash_t> entries(capacity, 0);
+		std::copy(hashes.begin(), hashes.end(), entries.begin());
+		std::vector<hash_t> tree(TreeSize(capacity), 0);
+		header.rootHash = BuildTree(entries.data(), hashes.size(), LevelOffsets(capacity), tree.data());
+		{
+			std::ofstream fManifest(tmpPath, std::ios::binary | std::ios::trunc);
+			fManifest.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			fManifest.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(hash_t));
+			fManifest.write(reinterpret_cast<const char*>(tree.data()), tree.size() * sizeof(hash_t));
+			if (!fManifest) {
+				throw BackupException(tools::FormatString::format("Could not write manifest [%s]", tmpPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		boost::filesystem::rename(tmpPath, path);
+	}
+}//namespace sqlite3_inc_bkp
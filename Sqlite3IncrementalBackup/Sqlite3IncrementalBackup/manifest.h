@@ -0,0 +1,184 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "api.h"
+#include "common.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Header of V3 manifest file, followed by capacity extent hashes, entry i covers pages i * extentPages + 1 .. (i + 1) * extentPages,
+	/// and hash tree laid out for capacity entries. Tree leaf hashes a run of 64 entries, inner node hashes up to 16 children, levels are stored leaves first
+	/// </summary>
+	struct ManifestHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t pageSize;
+		uint32_t hashAlgorithm;	//HashAlgorithm of entries
+		uint64_t pageCount;
+		uint64_t capacity;
+		uint64_t rootHash;		//root of hash tree over pageCount entries, updated on Commit
+		uint32_t state;			//ManifestState
+		uint32_t extentPages;	//pages hashed by one entry, 0 in manifests written before extents is one page
+		uint32_t reserved[4];
+	};
+	static_assert(sizeof(ManifestHeader) == 64, "Manifest header layout changed");
+
+	/// <summary>
+	/// Memory-mapped page hash manifest, entries are updated in place and flushed once on Commit.
+	/// Changed entries mark their tree leaves, Commit rehashes only marked leaves and their ancestors
+	/// </summary>
+	class Manifest {
+	public:
+		Manifest() = default;
+		Manifest(const Manifest&) = delete;
+		Manifest& operator=(const Manifest&) = delete;
+		~Manifest();
+
+		/// <summary>
+		/// Map manifest file, missing file is created, V1 and V2 manifests are converted (or loaded in memory if readOnly).
+		/// Manifest left uncommitted by an interrupted backup is reset to empty
+		/// </summary>
+		/// <param name="f">Hash function of legacy V1 root hash</param>
+		void Open(const std::string& path, bool readOnly, const hash_func& f);
+		void Close();
+		inline bool IsOpen() const { return header != nullptr; }
+
+		inline std::size_t PageCount() const { return static_cast<std::size_t>(header->pageCount); }
+		inline std::size_t PageSize() const { return header->pageSize; }
+		inline std::size_t ExtentPages() const { return header->extentPages ? header->extentPages : 1; }
+		inline hash_t Root() const { return header->rootHash; }
+
+		/// <summary>
+		/// Hash of extent holding page, hash of the page itself if extent is one page
+		/// </summary>
+		inline hash_t Get(std::size_t pgno) const { return entries[(pgno - 1) / ExtentPages()]; }
+
+		/// <summary>
+		/// Extent hashes, one per page if extent is one page
+		/// </summary>
+		inline const hash_t* Entries() const { return entries; }
+		inline HashAlgorithm Algorithm() const { return static_cast<HashAlgorithm>(header->hashAlgorithm); }
+
+		/// <summary>
+		/// Set hash of extent holding page, page count grows to pgno if needed
+		/// </summary>
+		void Set(std::size_t pgno, hash_t hash);
+
+		/// <summary>
+		/// Cut page count, hash of extent losing some of its pages is reset to zero
+		/// </summary>
+		void Truncate(std::size_t pageCount);
+		void SetPageSize(std::size_t pageSize);
+
+		/// <summary>
+		/// Switch number of pages hashed by one entry, entries of another extent size are dropped
+		/// </summary>
+		void SetExtentPages(std::size_t extentPages);
+
+		/// <summary>
+		/// Switch hash algorithm, entries of another algorithm are dropped
+		/// </summary>
+		void SetAlgorithm(HashAlgorithm algorithm);
+
+		/// <summary>
+		/// Check committed manifest against its hash tree from the root down, a node not matching its children marks all its pages
+		/// </summary>
+		/// <returns>Ranges of pages whose entries can not be trusted, empty if manifest is intact</returns>
+		std::vector<PageRange> Verify() const;
+
+		/// <summary>
+		/// Pages whose hashes differ between two committed manifests, only subtrees with differing node hashes are visited
+		/// </summary>
+		std::vector<PageRange> Diff(const Manifest& other) const;
+		bool IsCommitted() const;
+
+		/// <summary>
+		/// Mark manifest consistent and flush all changed entries with one msync
+		/// </summary>
+		void Commit();
+
+		/// <summary>
+		/// Unmap pages of committed manifest and drop them from OS page cache, they are read back on the next access
+		/// </summary>
+		void DropCache();
+
+		/// <summary>
+		/// Keep at most bytes of entries mapped while pages are visited in ascending order, 0 keeps every entry mapped.
+		/// Segments falling behind the window are written back if changed and unmapped, the segment ahead of it is read
+		/// ahead by the OS. Bound is held on Linux, elsewhere changed segments are only flushed early. Undo log of Rollback is
+		/// kept whole whatever the bound
+		/// </summary>
+		void SetResidentLimit(std::size_t bytes);
+
+		/// <summary>
+		/// Move resident window to entry of page, see SetResidentLimit
+		/// </summary>
+		inline void Advance(std::size_t pgno) { this->Window(this->EntryOf(pgno)); }
+
+		/// <summary>
+		/// Restore entries changed since the last Commit, manifest stays uncommitted if changes were not recorded
+		/// (manifest opened after an interrupted backup or too many entries changed)
+		/// </summary>
+		void Rollback();
+
+	private:
+		//Entries are numbered from 1 like pages, entry of page is its extent
+		inline std::size_t EntryOf(std::size_t pgno) const { return (pgno - 1) / ExtentPages() + 1; }
+		inline std::size_t EntryCount() const { return static_cast<std::size_t>((header->pageCount + ExtentPages() - 1) / ExtentPages()); }
+		std::vector<PageRange> ToPages(const std::vector<PageRange>& entryRanges, uint64_t pageCount) const;
+
+	private:
+		void Map();
+		void Reserve(std::size_t entryCount);
+		void BeginUpdate();
+		void Record(std::size_t entry);
+		bool LoadLegacy(const std::string& path, const hash_func& f, std::vector<hash_t>& hashes) const;
+		bool LoadSummed(const std::string& path, std::vector<hash_t>& hashes) const;
+		void Create(const std::string& path, const std::vector<hash_t>& hashes, std::size_t pageSize, HashAlgorithm algorithm) const;
+
+	private:
+	//Hash tree
+		void AttachTree();
+		void MarkLeaf(std::size_t entry);
+		void RebuildTree();
+		void Reroot();
+		hash_t Node(std::size_t level, std::size_t index) const;
+
+	private:
+	//Resident window, entries are mapped in and out in segments of consecutive entries
+		void Window(std::size_t entry) const;
+		void Evict(std::size_t first, std::size_t last) const;
+		void ResetWindow() const;
+		void MarkSegment(std::size_t entry);
+
+	private:
+		std::string path;
+		bool readOnly = false;
+		std::unique_ptr<boost::interprocess::file_mapping> mapping;
+		std::unique_ptr<boost::interprocess::mapped_region> region;
+		std::vector<uint64_t> memory;	//legacy manifest opened read only
+		ManifestHeader* header = nullptr;
+		hash_t* entries = nullptr;
+		hash_t* nodes = nullptr;
+		std::vector<std::size_t> levelOffsets;	//first node of every tree level laid out for capacity
+		std::vector<std::size_t> dirtyLeaves;
+		std::vector<bool> leafDirty;
+		//Undo log of update, previous header and first overwritten value of every entry
+		ManifestHeader undoHeader = {};
+		std::vector<std::pair<std::size_t, hash_t>> undo;
+		std::vector<bool> recorded;
+		bool undoValid = false;
+		//Segments [windowFirst, windowLast) may be resident, 0 windowSegments - no window
+		std::size_t segmentEntries = 0;
+		std::size_t windowSegments = 0;
+		mutable std::size_t windowFirst = 0;
+		mutable std::size_t windowLast = 0;
+		mutable std::vector<bool> segmentDirty;
+	};
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,800 @@
+#include "pagestore.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include "exception.h"
+#include "hasher.h"
+#include "throttle.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t STORE_MAGIC = 0x504B4249; //IBKP
+		const uint32_t STORE_VERSION = 1;
+		const uint32_t PAGEMAP_MAGIC = 0x504D4249; //IBMP
+		const uint32_t PAGEMAP_VERSION = 1;
+		const uint64_t CHUNK_BYTES = 64ull << 20;	//chunk file is closed once it would grow past this
+		const double CHUNK_REWRITE_LIVE = 0.5;		//chunk with smaller live share is rewritten by Collect
+		const std::string LINK_SUFFIX = ".store";
+		const std::string PAGEMAP_SUFFIX = ".pagemap";
+		const std::string CHUNK_SUFFIX = ".chunk";
+		const std::string HOLDER_SUFFIX = ".holder";
+		const char* const LOCK_FILE = "store.lock";
+
+		std::mutex g_registryMutex;
+
+		struct IndexHeader {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t epoch;		//incremented by every rewrite of index
+			uint32_t reserved[5];
+		};
+		static_assert(sizeof(IndexHeader) == 32, "Page store index header layout changed");
+
+		bool EndsWith(const std::string& s, const std::string& suffix) {
+			return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+		}
+
+		std::string FormatMapPath(const std::string& filePrefix, uint64_t generation) {
+			return tools::FormatString::format("%s.%d%s", filePrefix, generation, PAGEMAP_SUFFIX);
+		}
+
+		/// <summary>
+		/// Generations of finished page maps of backup, ascending
+		/// </summary>
+		std::vector<uint64_t> ListMapGenerations(const std::string& filePrefix) {
+			const boost::filesystem::path prefix(filePrefix);
+			const std::string stem = prefix.filename().string() + ".";
+			std::vector<uint64_t> generations;
+			boost::system::error_code ec;
+			for (boost::filesystem::directory_iterator it(prefix.parent_path(), ec), end; !ec && it != end; it.increment(ec)) {
+				const std::string fileName = it->path().filename().string();
+				if (fileName.compare(0, stem.size(), stem) != 0 || !EndsWith(fileName, PAGEMAP_SUFFIX))
+					continue;
+				const std::string number = fileName.substr(stem.size(), fileName.size() - stem.size() - PAGEMAP_SUFFIX.size());
+				if (number.empty() || number.size() > 19 || number.find_first_not_of("0123456789") != std::string::npos)
+					continue;
+				generations.push_back(std::stoull(number));
+			}
+			std::sort(generations.begin(), generations.end());
+			return generations;
+		}
+
+		/// <returns>false if map is missing, was not finished or its keys are corrupted</returns>
+		bool ReadPageMap(const std::string& path, PageMapHeader& header, std::vector<PageKey>& keys) {
+			std::ifstream fMap(path, std::ios::binary | std::ios::ate);
+			if (!fMap.is_open())
+				return false;
+			const uint64_t size = static_cast<uint64_t>(fMap.tellg());
+			fMap.seekg(0);
+			if (size < sizeof(PageMapHeader) || !fMap.read(reinterpret_cast<char*>(&header), sizeof(header)))
+				return false;
+			if (header.magic != PAGEMAP_MAGIC || header.version != PAGEMAP_VERSION || header.pageSize == 0
+				|| header.pageCount * sizeof(PageKey) + sizeof(PageMapHeader) != size)
+				return false;
+			keys.resize(static_cast<std::size_t>(header.pageCount));
+			if (!fMap.read(reinterpret_cast<char*>(keys.data()), keys.size() * sizeof(PageKey)))
+				return false;
+			return tools::Xxh64(keys.data(), keys.size() * sizeof(PageKey), 0) == header.checksum;
+		}
+
+		std::shared_ptr<std::mutex> GetRestoreMutex(const std::string& filePrefix) {
+			static std::map<std::string, std::shared_ptr<std::mutex>> registry;
+			std::lock_guard<std::mutex> lock(g_registryMutex);
+			auto& mutex = registry[filePrefix];
+			if (!mutex)
+				mutex = std::make_shared<std::mutex>();
+			return mutex;
+		}
+	}
+
+	PageKey PageKey::Of(const void* data, std::size_t size) {
+		unsigned char digest[32];
+		tools::Sha256(data, size, digest);
+		PageKey key;
+		std::memcpy(key.words, digest, sizeof(key.words));
+		return key;
+	}
+
+	std::shared_ptr<PageStore> PageStore::Open(const std::string& directory) {
+		static std::map<std::string, std::weak_ptr<PageStore>> registry;
+		const std::string absolute = boost::filesystem::absolute(directory).string();
+		std::lock_guard<std::mutex> lock(g_registryMutex);
+		auto store = registry[absolute].lock();
+		if (!store) {
+			store = std::make_shared<PageStore>(absolute);
+			registry[absolute] = store;
+		}
+		return store;
+	}
+
+	PageStore::PageStore(const std::string& directory)
+		: directory(directory), indexPath((boost::filesystem::path(directory) / "store.index").string()), rootsPath((boost::filesystem::path(directory) / "store.roots").string()) {
+		this->Load();
+	}
+
+	std::string PageStore::GetChunkPath(uint32_t chunk) const {
+		return (boost::filesystem::path(this->directory) / tools::FormatString::format("%08d%s", chunk, CHUNK_SUFFIX)).string();
+	}
+
+	void PageStore::Load() {
+		try {
+			boost::filesystem::create_directories(this->directory);
+			const std::string lockPath = (boost::filesystem::path(this->directory) / LOCK_FILE).string();
+			std::ofstream(lockPath, std::ios::app).close();
+			this->storeLock = std::make_unique<boost::interprocess::file_lock>(lockPath.c_str());
+		}
+		catch (const std::exception& e) {
+			throw BackupException(tools::FormatString::format("Could not create page store directory [%s] : %s", this->directory.c_str(), e.what()).c_str(), BackupException::Error::BackupInit);
+		}
+
+		StoreLock storeLock(*this);
+		if (!boost::filesystem::exists(this->indexPath)) {
+			IndexHeader header = {};
+			header.magic = STORE_MAGIC;
+			header.version = STORE_VERSION;
+			std::ofstream fNew(this->indexPath, std::ios::binary | std::ios::trunc);
+			fNew.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			if (!fNew) {
+				throw BackupException(tools::FormatString::format("Could not write page store index [%s]", this->indexPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		this->Refresh();
+
+		//Record pointing past the end of its chunk lost its page in a crash, the page is stored again by the next backup having it
+		std::map<uint32_t, uint64_t> chunkSizes;
+		for (boost::filesystem::directory_iterator it(this->directory), end; it != end; ++it) {
+			const std::string fileName = it->path().filename().string();
+			if (EndsWith(fileName, CHUNK_SUFFIX))
+				chunkSizes[static_cast<uint32_t>(std::strtoul(fileName.c_str(), nullptr, 10))] = boost::filesystem::file_size(it->path());
+		}
+		for (auto it = this->index.begin(); it != this->index.end();) {
+			auto chunk = chunkSizes.find(it->second.chunk);
+			if (chunk == chunkSizes.end() || it->second.offset + it->second.size > chunk->second)
+				it = this->index.erase(it);
+			else
+				++it;
+		}
+	}
+
+	void PageStore::Refresh() {
+		//Records appended by other processes since the last read are added, index rewritten by another process is read whole
+		std::ifstream fIndex(this->indexPath, std::ios::binary | std::ios::ate);
+		const uint64_t size = fIndex.is_open() ? static_cast<uint64_t>(fIndex.tellg()) : 0;
+		fIndex.seekg(0);
+		IndexHeader header = {};
+		if (size < sizeof(header) || !fIndex.read(reinterpret_cast<char*>(&header), sizeof(header))
+			|| header.magic != STORE_MAGIC || header.version != STORE_VERSION) {
+			throw BackupException(tools::FormatString::format("Page store index [%s] corrupted", this->indexPath.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+		}
+		const bool rewritten = this->indexSize == 0 || header.epoch != this->indexEpoch || size < this->indexSize;
+		if (rewritten) {
+			this->index.clear();
+			this->indexSize = sizeof(header);
+			this->indexEpoch = header.epoch;
+		}
+		const uint64_t records = (size - this->indexSize) / sizeof(IndexRecord);
+		std::vector<IndexRecord> loaded(static_cast<std::size_t>(records));
+		fIndex.seekg(this->indexSize);
+		if (!fIndex.read(reinterpret_cast<char*>(loaded.data()), loaded.size() * sizeof(IndexRecord))) {
+			throw BackupException(tools::FormatString::format("Error reading page store index [%s]", this->indexPath.c_str()).c_str(), BackupException::Error::BackupLoad);
+		}
+		for (const IndexRecord& record : loaded)
+			this->index[record.key] = record.location;
+		//Pages of this process not in index file yet stay known
+		if (rewritten) {
+			for (const IndexRecord& record : this->unsynced)
+				this->index[record.key] = record.location;
+		}
+		this->indexSize += records * sizeof(IndexRecord);
+		fIndex.close();
+		//Record cut by a crash is dropped before the next one is appended behind it
+		if (size != this->indexSize)
+			boost::filesystem::resize_file(this->indexPath, this->indexSize);
+	}
+
+	PageStore::StoreLock::StoreLock(PageStore& store)
+		: store(store) {
+		if (this->store.storeLockDepth++ == 0) {
+			try {
+				this->store.storeLock->lock();
+			}
+			catch (...) {
+				--this->store.storeLockDepth;
+				throw;
+			}
+		}
+	}
+
+	PageStore::StoreLock::~StoreLock() {
+		if (--this->store.storeLockDepth == 0) {
+			try {
+				this->store.storeLock->unlock();
+			}
+			catch (...) {
+			}
+		}
+	}
+
+	void PageStore::Hold() {
+		if (this->holds++ > 0)
+			return;
+		try {
+			StoreLock storeLock(*this);
+			std::random_device random;
+			const uint64_t nonce = (static_cast<uint64_t>(random()) << 32) | random();
+			this->holderPath = (boost::filesystem::path(this->directory) / (std::to_string(nonce) + HOLDER_SUFFIX)).string();
+			std::ofstream(this->holderPath, std::ios::trunc).close();
+			this->holderLock = std::make_unique<boost::interprocess::file_lock>(this->holderPath.c_str());
+			this->holderLock->lock();
+			//Another process may have collected and rewritten index while this one held nothing
+			this->Refresh();
+		}
+		catch (...) {
+			this->holds = 0;
+			this->holderLock.reset();
+			std::remove(this->holderPath.c_str());
+			throw;
+		}
+	}
+
+	void PageStore::Release() {
+		if (this->holds == 0 || --this->holds > 0)
+			return;
+		//Pages without index records on disk are forgotten, chunk of this process may be collected by another one from now on
+		for (const IndexRecord& record : this->unsynced)
+			this->index.erase(record.key);
+		this->unsynced.clear();
+		this->fChunk.close();
+		try {
+			StoreLock storeLock(*this);
+			this->holderLock->unlock();
+			this->holderLock.reset();
+			std::remove(this->holderPath.c_str());
+		}
+		catch (...) {
+			//Marker left behind is unlocked once the process ends, Collect removes it then
+		}
+	}
+
+	bool PageStore::HasOtherHolders() {
+		const std::string own = boost::filesystem::path(this->holderPath).filename().string();
+		std::vector<std::string> markers;
+		for (boost::filesystem::directory_iterator it(this->directory), end; it != end; ++it) {
+			const std::string fileName = it->path().filename().string();
+			if (EndsWith(fileName, HOLDER_SUFFIX) && (this->holds == 0 || fileName != own))
+				markers.push_back(it->path().string());
+		}
+		for (const std::string& marker : markers) {
+			//Marker of a process that ended without removing it is not locked any more
+			{
+				boost::interprocess::file_lock lock(marker.c_str());
+				if (!lock.try_lock())
+					return true;
+				lock.unlock();
+			}
+			std::remove(marker.c_str());
+		}
+		return false;
+	}
+
+	uint64_t PageStore::BeginSession() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->Hold();
+		const uint64_t session = this->nextSession++;
+		this->sessions[session];
+		return session;
+	}
+
+	void PageStore::EndSession(uint64_t session) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->sessions.erase(session))
+			this->Release();
+	}
+
+	PageKey PageStore::Put(uint64_t session, const void* data, std::size_t size) {
+		const PageKey key = PageKey::Of(data, size);
+		std::lock_guard<std::mutex> lock(this->mutex);
+		//Stored page is referenced by the session too, Collect must not drop it before the new map refers to it
+		this->sessions[session].push_back(key);
+		if (this->index.find(key) == this->index.end())
+			this->Append(key, reinterpret_cast<const char*>(data), size);
+		return key;
+	}
+
+	PageStore::Location PageStore::Append(const PageKey& key, const char* data, std::size_t size) {
+		if (this->fChunk.is_open() && this->activeSize + size > CHUNK_BYTES) {
+			//Index records of full chunk are written by the next sync, its data reaches storage first
+			this->fChunk.close();
+			if (!this->fChunk || !tools::SyncFile(this->GetChunkPath(this->activeChunk))) {
+				throw BackupException(tools::FormatString::format("Error writing chunk file [%s]", this->GetChunkPath(this->activeChunk).c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		if (!this->fChunk.is_open())
+			this->OpenChunk();
+		const Location location = { this->activeChunk, static_cast<uint32_t>(size), this->activeSize };
+		this->fChunk.write(data, size);
+		if (!this->fChunk) {
+			throw BackupException(tools::FormatString::format("Error writing chunk file [%s]", this->GetChunkPath(this->activeChunk).c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+		this->activeSize += size;
+		this->index[key] = location;
+		this->unsynced.push_back({ key, location });
+		return location;
+	}
+
+	void PageStore::OpenChunk() {
+		//Chunk number is taken under store lock, a chunk is written by the process that created it only
+		StoreLock storeLock(*this);
+		uint32_t lastChunk = 0;
+		for (boost::filesystem::directory_iterator it(this->directory), end; it != end; ++it) {
+			const std::string fileName = it->path().filename().string();
+			if (EndsWith(fileName, CHUNK_SUFFIX))
+				lastChunk = std::max(lastChunk, static_cast<uint32_t>(std::strtoul(fileName.c_str(), nullptr, 10)));
+		}
+		this->activeChunk = lastChunk + 1;
+		this->activeSize = 0;
+		this->fChunk.clear();
+		this->fChunk.open(this->GetChunkPath(this->activeChunk), std::ios::binary | std::ios::trunc);
+		if (!this->fChunk.is_open()) {
+			throw BackupException(tools::FormatString::format("Chunk file [%s] is not open", this->GetChunkPath(this->activeChunk).c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+	}
+
+	void PageStore::Read(const std::vector<PageKey>& keys, std::size_t pageSize, const std::function<void(std::size_t index, const char* data)>& sink) {
+		//Collect rewrites chunks under the same lock, read holds the store so Collect of another process leaves chunks in place
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->Hold();
+		try {
+			this->ReadHeld(keys, pageSize, sink);
+		}
+		catch (...) {
+			this->Release();
+			throw;
+		}
+		this->Release();
+	}
+
+	void PageStore::ReadHeld(const std::vector<PageKey>& keys, std::size_t pageSize, const std::function<void(std::size_t index, const char* data)>& sink) {
+		struct ChunkReader {
+			std::ifstream fChunk;
+			uint64_t position = 0;
+		};
+		//Map may refer to pages another process stored since the last look at index
+		{
+			StoreLock storeLock(*this);
+			this->Refresh();
+		}
+		if (this->fChunk.is_open())
+			this->fChunk.flush();
+		std::map<uint32_t, ChunkReader> readers;
+		std::vector<char> page(pageSize);
+		const std::vector<char> zeros(pageSize, 0);
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			if (keys[i].IsEmpty()) {
+				sink(i, zeros.data());
+				continue;
+			}
+			auto it = this->index.find(keys[i]);
+			if (it == this->index.end() || it->second.size != pageSize) {
+				throw BackupException(tools::FormatString::format("Page %d is missing in page store [%s]", i + 1, this->directory.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			const Location& location = it->second;
+			ChunkReader& reader = readers[location.chunk];
+			if (!reader.fChunk.is_open()) {
+				reader.fChunk.open(this->GetChunkPath(location.chunk), std::ios::binary);
+				reader.position = UINT64_MAX;
+			}
+			//Pages of one backup mostly follow each other in chunk, seek only when they do not
+			if (reader.position != location.offset)
+				reader.fChunk.seekg(location.offset);
+			if (!reader.fChunk.read(page.data(), pageSize)) {
+				throw BackupException(tools::FormatString::format("Error reading chunk file [%s]", this->GetChunkPath(location.chunk).c_str()).c_str(), BackupException::Error::BackupLoad);
+			}
+			reader.position = location.offset + pageSize;
+			if (PageKey::Of(page.data(), pageSize) != keys[i]) {
+				throw BackupException(tools::FormatString::format("Page %d corrupted in page store [%s]", i + 1, this->directory.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+			}
+			sink(i, page.data());
+		}
+	}
+
+	void PageStore::Sync() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->SyncUnlocked();
+	}
+
+	void PageStore::SyncUnlocked() {
+		if (this->fChunk.is_open() && !this->fChunk.flush()) {
+			throw BackupException(tools::FormatString::format("Error writing chunk file [%s]", this->GetChunkPath(this->activeChunk).c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+		if (this->unsynced.empty())
+			return;
+		if (this->fChunk.is_open() && !tools::SyncFile(this->GetChunkPath(this->activeChunk))) {
+			throw BackupException(tools::FormatString::format("Error syncing chunk file [%s]", this->GetChunkPath(this->activeChunk).c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+		//Records of other processes are read first, records of this one are appended behind them under store lock
+		StoreLock storeLock(*this);
+		this->Refresh();
+		{
+			std::ofstream fIndex(this->indexPath, std::ios::binary | std::ios::app);
+			fIndex.write(reinterpret_cast<const char*>(this->unsynced.data()), this->unsynced.size() * sizeof(IndexRecord));
+			fIndex.close();
+			if (!fIndex) {
+				throw BackupException(tools::FormatString::format("Error writing page store index [%s]", this->indexPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		if (!tools::SyncFile(this->indexPath)) {
+			throw BackupException(tools::FormatString::format("Error syncing page store index [%s]", this->indexPath.c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+		this->indexSize += this->unsynced.size() * sizeof(IndexRecord);
+		this->unsynced.clear();
+	}
+
+	void PageStore::DropCache(bool wait) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->SyncUnlocked();
+		if (this->fChunk.is_open())
+			tools::DropCache(this->GetChunkPath(this->activeChunk), wait);
+	}
+
+	std::vector<std::string> PageStore::LoadRoots() const {
+		std::vector<std::string> roots;
+		std::ifstream fRoots(this->rootsPath);
+		std::string root;
+		while (std::getline(fRoots, root)) {
+			if (!root.empty())
+				roots.push_back(root);
+		}
+		return roots;
+	}
+
+	void PageStore::SaveRoots(const std::vector<std::string>& roots) const {
+		const std::string tmpPath = this->rootsPath + ".tmp";
+		{
+			std::ofstream fRoots(tmpPath, std::ios::trunc);
+			for (const std::string& root : roots)
+				fRoots << root << '\n';
+			if (!fRoots) {
+				throw BackupException(tools::FormatString::format("Could not write page store roots [%s]", tmpPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		boost::filesystem::rename(tmpPath, this->rootsPath);
+	}
+
+	void PageStore::AddRoot(const std::string& filePrefix) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		StoreLock storeLock(*this);
+		std::vector<std::string> roots = this->LoadRoots();
+		if (std::find(roots.begin(), roots.end(), filePrefix) != roots.end())
+			return;
+		roots.push_back(filePrefix);
+		this->SaveRoots(roots);
+	}
+
+	void PageStore::RemoveRoot(const std::string& filePrefix) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		StoreLock storeLock(*this);
+		std::vector<std::string> roots = this->LoadRoots();
+		auto it = std::remove(roots.begin(), roots.end(), filePrefix);
+		if (it == roots.end())
+			return;
+		roots.erase(it, roots.end());
+		this->SaveRoots(roots);
+	}
+
+	void PageStore::RewriteIndex() {
+		const std::string tmpPath = this->indexPath + ".tmp";
+		IndexHeader header = {};
+		header.magic = STORE_MAGIC;
+		header.version = STORE_VERSION;
+		header.epoch = this->indexEpoch + 1;
+		{
+			std::ofstream fNew(tmpPath, std::ios::binary | std::ios::trunc);
+			fNew.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			for (const auto& entry : this->index) {
+				const IndexRecord record = { entry.first, entry.second };
+				fNew.write(reinterpret_cast<const char*>(&record), sizeof(record));
+			}
+			fNew.close();
+			if (!fNew || !tools::SyncFile(tmpPath)) {
+				throw BackupException(tools::FormatString::format("Could not write page store index [%s]", tmpPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		//Other processes see the new epoch and read the rewritten index whole
+		boost::filesystem::rename(tmpPath, this->indexPath);
+		this->indexEpoch = header.epoch;
+		this->indexSize = sizeof(header) + this->index.size() * sizeof(IndexRecord);
+		this->unsynced.clear();
+	}
+
+	void PageStore::Collect() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->SyncUnlocked();
+		StoreLock storeLock(*this);
+		//Pages stored by another process are referenced by no map until its backup finishes, nothing is dropped while one holds the store
+		if (this->HasOtherHolders())
+			return;
+		this->Refresh();
+
+		//Mark, backup removed without Clear has no link file any more and stops being a root
+		std::unordered_map<PageKey, uint32_t, PageKeyHash> references;
+		const std::vector<std::string> roots = this->LoadRoots();
+		std::vector<std::string> liveRoots;
+		PageMapHeader header = {};
+		std::vector<PageKey> keys;
+		for (const std::string& root : roots) {
+			if (!boost::filesystem::exists(root + LINK_SUFFIX))
+				continue;
+			liveRoots.push_back(root);
+			for (uint64_t generation : ListMapGenerations(root)) {
+				//Unreadable map may still be repaired, nothing is dropped until it is readable or removed
+				if (!ReadPageMap(FormatMapPath(root, generation), header, keys))
+					return;
+				for (const PageKey& key : keys) {
+					if (!key.IsEmpty())
+						++references[key];
+				}
+			}
+		}
+		for (const auto& session : this->sessions) {
+			for (const PageKey& key : session.second)
+				++references[key];
+		}
+		if (liveRoots.size() != roots.size())
+			this->SaveRoots(liveRoots);
+
+		//Sweep, live pages of sparse chunks are moved into the active chunk
+		bool dropped = false;
+		std::map<uint32_t, uint64_t> liveBytes;
+		for (auto it = this->index.begin(); it != this->index.end();) {
+			if (references.find(it->first) == references.end()) {
+				it = this->index.erase(it);
+				dropped = true;
+				continue;
+			}
+			liveBytes[it->second.chunk] += it->second.size;
+			++it;
+		}
+
+		std::set<uint32_t> removed;
+		std::set<uint32_t> rewritten;
+		for (boost::filesystem::directory_iterator it(this->directory), end; it != end; ++it) {
+			const std::string fileName = it->path().filename().string();
+			if (!EndsWith(fileName, CHUNK_SUFFIX))
+				continue;
+			const uint32_t chunk = static_cast<uint32_t>(std::strtoul(fileName.c_str(), nullptr, 10));
+			if (this->fChunk.is_open() && chunk == this->activeChunk)
+				continue;
+			const uint64_t live = liveBytes[chunk];
+			if (live == 0)
+				removed.insert(chunk);
+			else if (live < CHUNK_REWRITE_LIVE * boost::filesystem::file_size(it->path()))
+				rewritten.insert(chunk);
+		}
+
+		std::vector<std::pair<PageKey, Location>> moved;
+		for (const auto& entry : this->index) {
+			if (rewritten.count(entry.second.chunk))
+				moved.push_back(entry);
+		}
+		std::sort(moved.begin(), moved.end(), [](const std::pair<PageKey, Location>& a, const std::pair<PageKey, Location>& b) {
+			return a.second.chunk != b.second.chunk ? a.second.chunk < b.second.chunk : a.second.offset < b.second.offset;
+		});
+		std::vector<char> page;
+		std::ifstream fOld;
+		uint32_t oldChunk = 0;
+		for (const auto& entry : moved) {
+			if (!fOld.is_open() || oldChunk != entry.second.chunk) {
+				fOld.close();
+				fOld.clear();
+				oldChunk = entry.second.chunk;
+				fOld.open(this->GetChunkPath(oldChunk), std::ios::binary);
+			}
+			page.resize(entry.second.size);
+			fOld.seekg(entry.second.offset);
+			if (!fOld.read(page.data(), page.size())) {
+				throw BackupException(tools::FormatString::format("Error reading chunk file [%s]", this->GetChunkPath(oldChunk).c_str()).c_str(), BackupException::Error::BackupLoad);
+			}
+			this->Append(entry.first, page.data(), page.size());
+		}
+		fOld.close();
+
+		//Index is replaced only after moved pages reach their new chunk, old chunks go last
+		if (dropped || !moved.empty()) {
+			if (this->fChunk.is_open() && (!this->fChunk.flush() || !tools::SyncFile(this->GetChunkPath(this->activeChunk)))) {
+				throw BackupException(tools::FormatString::format("Error writing chunk file [%s]", this->GetChunkPath(this->activeChunk).c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+			this->RewriteIndex();
+		}
+		removed.insert(rewritten.begin(), rewritten.end());
+		for (uint32_t chunk : removed)
+			std::remove(this->GetChunkPath(chunk).c_str());
+	}
+
+	StoreWriter::StoreWriter(std::shared_ptr<PageStore> store, const std::string& mapPath, const std::string& previousMapPath, const std::string& filePrefix, uint64_t generation)
+		: PageWriter(mapPath), store(std::move(store)), previousMapPath(previousMapPath), filePrefix(filePrefix), generation(generation) {
+		this->session = this->store->BeginSession();
+	}
+
+	StoreWriter::~StoreWriter() {
+		this->store->EndSession(this->session);
+		std::remove((this->path + ".tmp").c_str());
+	}
+
+	void StoreWriter::WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) {
+		const uint64_t first = offset / parts.front().size + 1;
+		for (std::size_t i = 0; i < parts.size(); ++i)
+			this->pages.emplace_back(static_cast<std::size_t>(first + i), this->store->Put(this->session, parts[i].data, parts[i].size));
+	}
+
+	void StoreWriter::Sync() {
+		this->store->Sync();
+	}
+
+	void StoreWriter::DropCache(bool wait) {
+		this->store->DropCache(wait);
+	}
+
+	void StoreWriter::Finish(const Manifest& manifest, std::size_t pageCount, const std::vector<bool>& freePages) {
+		std::vector<PageKey> keys;
+		PageMapHeader header = {};
+		if (!this->previousMapPath.empty() && !ReadPageMap(this->previousMapPath, header, keys)) {
+			throw BackupException(tools::FormatString::format("Page map [%s] corrupted", this->previousMapPath.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+		}
+		keys.resize(pageCount);
+		for (const auto& page : this->pages) {
+			if (page.first <= pageCount)
+				keys[page.first - 1] = page.second;
+		}
+		//Only pages on the free list hold no data. Zero manifest hash also marks pages of unknown contents, they keep their previous key
+		for (std::size_t pgno = 1; pgno < std::min(freePages.size(), pageCount + 1); ++pgno) {
+			if (freePages[pgno])
+				keys[pgno - 1] = PageKey();
+		}
+
+		header = {};
+		header.magic = PAGEMAP_MAGIC;
+		header.version = PAGEMAP_VERSION;
+		header.generation = this->generation;
+		header.pageCount = pageCount;
+		header.pageHash = pageCount > 0 && manifest.PageCount() > 0 ? manifest.Get(1) : 0;
+		header.checksum = tools::Xxh64(keys.data(), keys.size() * sizeof(PageKey), 0);
+		header.pageSize = static_cast<uint32_t>(manifest.PageSize());
+		header.hashAlgorithm = static_cast<uint32_t>(manifest.Algorithm());
+
+		//Pages reach the store before the map refers to them
+		this->store->Sync();
+		const std::string tmpPath = this->path + ".tmp";
+		{
+			std::ofstream fMap(tmpPath, std::ios::binary | std::ios::trunc);
+			fMap.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			fMap.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(PageKey));
+			fMap.close();
+			if (!fMap || !tools::SyncFile(tmpPath)) {
+				throw BackupException(tools::FormatString::format("Error writing page map [%s]", tmpPath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+		}
+		this->store->AddRoot(this->filePrefix);
+		boost::filesystem::rename(tmpPath, this->path);
+	}
+
+	PageMaps::PageMaps(const std::string& filePrefix)
+		: filePrefix(boost::filesystem::absolute(filePrefix).string()), linkPath(this->filePrefix + LINK_SUFFIX), restoreMutex(GetRestoreMutex(this->filePrefix)) {
+	}
+
+	std::string PageMaps::Directory() const {
+		std::ifstream fLink(this->linkPath);
+		std::string directory;
+		std::getline(fLink, directory);
+		return directory;
+	}
+
+	void PageMaps::Attach(const std::string& directory) {
+		const std::string absolute = boost::filesystem::absolute(directory).string();
+		this->store = PageStore::Open(absolute);
+		std::ofstream fLink(this->linkPath, std::ios::trunc);
+		fLink << absolute << '\n';
+		if (!fLink) {
+			throw BackupException(tools::FormatString::format("Could not write page store link [%s]", this->linkPath.c_str()).c_str(), BackupException::Error::BackupInit);
+		}
+	}
+
+	std::shared_ptr<PageStore> PageMaps::GetStore() {
+		if (!this->store) {
+			const std::string directory = this->Directory();
+			if (directory.empty()) {
+				throw BackupException(tools::FormatString::format("Backup [%s] is not attached to page store", this->filePrefix.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+			this->store = PageStore::Open(directory);
+		}
+		return this->store;
+	}
+
+	GenerationState PageMaps::Load() const {
+		GenerationState state = {};
+		const std::vector<uint64_t> generations = ListMapGenerations(this->filePrefix);
+		if (!generations.empty()) {
+			state.baseGeneration = generations.front();
+			state.lastGeneration = generations.back();
+		}
+		return state;
+	}
+
+	std::string PageMaps::GetMapPath(uint64_t generation) const {
+		return FormatMapPath(this->filePrefix, generation);
+	}
+
+	std::unique_ptr<StoreWriter> PageMaps::BeginGeneration(uint64_t generation) {
+		const std::string previousMapPath = generation > 1 ? this->GetMapPath(generation - 1) : std::string();
+		return std::make_unique<StoreWriter>(this->GetStore(), this->GetMapPath(generation), previousMapPath, this->filePrefix, generation);
+	}
+
+	RestoreSource PageMaps::Materialize(uint64_t generation) {
+		RestoreSource source;
+		source.lock = std::unique_lock<std::mutex>(*this->restoreMutex);
+		const std::vector<uint64_t> generations = ListMapGenerations(this->filePrefix);
+		const uint64_t target = generation ? generation : (generations.empty() ? 0 : generations.back());
+		if (generations.empty() || !std::binary_search(generations.begin(), generations.end(), target)) {
+			throw BackupException(tools::FormatString::format("Generation %d is not retained, retained generations %d..%d", target,
+				generations.empty() ? 0 : generations.front(), generations.empty() ? 0 : generations.back()).c_str(), BackupException::Error::BackupLoad);
+		}
+		PageMapHeader header = {};
+		std::vector<PageKey> keys;
+		if (!ReadPageMap(this->GetMapPath(target), header, keys) || header.generation != target) {
+			throw BackupException(tools::FormatString::format("Page map [%s] corrupted", this->GetMapPath(target).c_str()).c_str(), BackupException::Error::IntegrityCheck);
+		}
+		source.generation = target;
+		source.latest = target == generations.back();
+		source.pageHash = header.pageHash;
+		source.hashAlgorithm = static_cast<HashAlgorithm>(header.hashAlgorithm);
+		source.path = this->filePrefix + ".restore";
+		source.temporary = true;
+
+		std::remove(source.path.c_str());
+		try {
+			std::ofstream fImage(source.path, std::ios::binary | std::ios::trunc);
+			this->GetStore()->Read(keys, header.pageSize, [&fImage, &header](std::size_t, const char* data) {
+				fImage.write(data, header.pageSize);
+			});
+			fImage.close();
+			if (!fImage) {
+				throw BackupException(tools::FormatString::format("Error writing restore image [%s]", source.path.c_str()).c_str(), BackupException::Error::BackupLoad);
+			}
+		}
+		catch (...) {
+			std::remove(source.path.c_str());
+			throw;
+		}
+		return source;
+	}
+
+	void PageMaps::Compact(unsigned retainGenerations) {
+		std::lock_guard<std::mutex> lock(*this->restoreMutex);
+		const std::vector<uint64_t> generations = ListMapGenerations(this->filePrefix);
+		const std::size_t retain = std::max(1u, retainGenerations);
+		if (generations.size() <= retain)
+			return;
+		for (std::size_t i = 0; i < generations.size() - retain; ++i)
+			std::remove(this->GetMapPath(generations[i]).c_str());
+		this->GetStore()->Collect();
+	}
+
+	void PageMaps::Clear() {
+		std::lock_guard<std::mutex> lock(*this->restoreMutex);
+		for (uint64_t generation : ListMapGenerations(this->filePrefix))
+			std::remove(this->GetMapPath(generation).c_str());
+		std::remove((this->filePrefix + ".restore").c_str());
+		if (!this->IsAttached())
+			return;
+		auto store = this->GetStore();
+		std::remove(this->linkPath.c_str());
+		this->store.reset();
+		store->RemoveRoot(this->filePrefix);
+		store->Collect();
+	}
+}//namespace sqlite3_inc_bkp
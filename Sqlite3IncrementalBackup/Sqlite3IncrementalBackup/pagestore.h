@@ -0,0 +1,247 @@
+#pragma once
+
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/interprocess/sync/file_lock.hpp>
+#include "api.h"
+#include "common.h"
+#include "generation.h"
+#include "manifest.h"
+#include "writer.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Content key of page, first 128 bits of SHA-256 of page data. Empty key marks page without data, it is restored as zeros
+	/// </summary>
+	struct PageKey {
+		uint64_t words[2] = {};
+
+		static PageKey Of(const void* data, std::size_t size);
+		inline bool IsEmpty() const { return words[0] == 0 && words[1] == 0; }
+		inline bool operator==(const PageKey& other) const { return words[0] == other.words[0] && words[1] == other.words[1]; }
+		inline bool operator!=(const PageKey& other) const { return !(*this == other); }
+	};
+	static_assert(sizeof(PageKey) == 16, "Page key layout changed");
+
+	struct PageKeyHash {
+		inline std::size_t operator()(const PageKey& key) const { return static_cast<std::size_t>(key.words[0]); }
+	};
+
+	/// <summary>
+	/// Header of page map file: generation of one backup as pageCount page keys following the header
+	/// </summary>
+	struct PageMapHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t generation;
+		uint64_t pageCount;
+		hash_t pageHash;		//manifest hash of page 1
+		uint64_t checksum;		//XXH64 of keys
+		uint32_t pageSize;
+		uint32_t hashAlgorithm;	//HashAlgorithm of pageHash
+		uint32_t reserved[4];
+	};
+	static_assert(sizeof(PageMapHeader) == 64, "Page map header layout changed");
+
+	/// <summary>
+	/// Directory of pages shared by backups of many databases, every distinct page is stored once. Pages are appended to chunk files,
+	/// append-only index maps page key to its chunk slot. Backups attached to the store are its roots, pages referenced by none of
+	/// their page maps and by no open session are dropped by Collect. Processes sharing the store take its lock file to allocate chunks,
+	/// append index records and collect. Every process writes its own chunks, a process with open sessions or reads holds a marker file,
+	/// Collect drops nothing while another process holds one
+	/// </summary>
+	class PageStore {
+	public:
+		/// <summary>
+		/// Store of directory, all backups of the process attached to directory share one instance
+		/// </summary>
+		static std::shared_ptr<PageStore> Open(const std::string& directory);
+		explicit PageStore(const std::string& directory);
+		PageStore(const PageStore&) = delete;
+		PageStore& operator=(const PageStore&) = delete;
+
+		/// <summary>
+		/// Session of backup being written, its pages survive Collect until EndSession even if no page map references them yet
+		/// </summary>
+		uint64_t BeginSession();
+		void EndSession(uint64_t session);
+
+		/// <summary>
+		/// Store page unless a page with the same key is stored already
+		/// </summary>
+		PageKey Put(uint64_t session, const void* data, std::size_t size);
+
+		/// <summary>
+		/// Read pages of keys in order, every page is checked against its key. Empty key gives zero page
+		/// </summary>
+		void Read(const std::vector<PageKey>& keys, std::size_t pageSize, const std::function<void(std::size_t index, const char* data)>& sink);
+
+		/// <summary>
+		/// Write pages stored so far and their index records through to storage, chunk data goes first so index never points past it
+		/// </summary>
+		void Sync();
+
+		/// <summary>
+		/// Sync and drop written chunk data from OS page cache
+		/// </summary>
+		void DropCache(bool wait);
+
+		/// <summary>
+		/// Register backup by prefix of its page map files as root of live pages
+		/// </summary>
+		void AddRoot(const std::string& filePrefix);
+		void RemoveRoot(const std::string& filePrefix);
+
+		/// <summary>
+		/// Count references of stored pages in page maps of roots and open sessions, unreferenced pages are dropped.
+		/// Chunks mostly of dropped pages are rewritten, chunks without live pages are removed
+		/// </summary>
+		void Collect();
+
+	private:
+		struct Location {
+			uint32_t chunk;
+			uint32_t size;
+			uint64_t offset;
+		};
+		struct IndexRecord {
+			PageKey key;
+			Location location;
+		};
+		static_assert(sizeof(IndexRecord) == 32, "Page store index layout changed");
+
+		std::string GetChunkPath(uint32_t chunk) const;
+		void Load();
+		Location Append(const PageKey& key, const char* data, std::size_t size);
+		void OpenChunk();
+		void SyncUnlocked();
+		std::vector<std::string> LoadRoots() const;
+		void SaveRoots(const std::vector<std::string>& roots) const;
+		void RewriteIndex();
+
+	private:
+	//Sharing with other processes, store lock is taken under mutex and may be taken again by the thread holding it
+		class StoreLock {
+		public:
+			explicit StoreLock(PageStore& store);
+			~StoreLock();
+		private:
+			PageStore& store;
+		};
+		void Refresh();
+		void Hold();
+		void Release();
+		bool HasOtherHolders();
+		void ReadHeld(const std::vector<PageKey>& keys, std::size_t pageSize, const std::function<void(std::size_t index, const char* data)>& sink);
+
+	private:
+		std::string directory;
+		std::string indexPath;
+		std::string rootsPath;
+		std::mutex mutex;
+		std::unordered_map<PageKey, Location, PageKeyHash> index;
+		std::vector<IndexRecord> unsynced;		//records of pages not yet in index file
+		std::map<uint64_t, std::vector<PageKey>> sessions;
+		uint64_t nextSession = 1;
+		uint32_t activeChunk = 0;
+		uint64_t activeSize = 0;
+		std::ofstream fChunk;
+		std::unique_ptr<boost::interprocess::file_lock> storeLock;
+		unsigned storeLockDepth = 0;
+		uint64_t indexSize = 0;			//bytes of index file read into index
+		uint32_t indexEpoch = 0;		//rewrites of index file, index is read again once another process rewrote it
+		unsigned holds = 0;				//open sessions and reads of this process
+		std::string holderPath;
+		std::unique_ptr<boost::interprocess::file_lock> holderLock;
+	};
+
+	/// <summary>
+	/// Writer of generation into page store, page map of generation is the previous one with written pages replaced
+	/// </summary>
+	class StoreWriter : public PageWriter {
+	public:
+		StoreWriter(std::shared_ptr<PageStore> store, const std::string& mapPath, const std::string& previousMapPath, const std::string& filePrefix, uint64_t generation);
+		~StoreWriter();
+
+		/// <summary>
+		/// Write page map with manifest page count, free pages get empty key and pages not written keep their key of the previous map.
+		/// Generation is committed once the map is renamed in place
+		/// </summary>
+		/// <param name="freePages">Free-list leaf pages of the snapshot backed up, indexed by page number</param>
+		void Finish(const Manifest& manifest, std::size_t pageCount, const std::vector<bool>& freePages);
+		inline uint64_t Generation() const { return generation; }
+
+	protected:
+		void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override;
+		void Sync() override;
+		void DropCache(bool wait) override;
+
+	private:
+		std::shared_ptr<PageStore> store;
+		std::string previousMapPath;
+		std::string filePrefix;
+		uint64_t generation;
+		uint64_t session;
+		std::vector<std::pair<std::size_t, PageKey>> pages;
+	};
+
+	/// <summary>
+	/// Page maps of one backup attached to page store, link file of backup names store directory
+	/// </summary>
+	class PageMaps {
+	public:
+		/// <param name="filePrefix">Prefix of link and page map file paths</param>
+		explicit PageMaps(const std::string& filePrefix);
+
+		/// <summary>
+		/// Store directory backup is attached to, empty if backup keeps its own image
+		/// </summary>
+		std::string Directory() const;
+		inline bool IsAttached() const { return !this->Directory().empty(); }
+
+		/// <summary>
+		/// Attach backup without generations to store of directory
+		/// </summary>
+		void Attach(const std::string& directory);
+
+		/// <summary>
+		/// Retained generations, the oldest map is reported as base generation
+		/// </summary>
+		GenerationState Load() const;
+		std::string GetMapPath(uint64_t generation) const;
+		std::unique_ptr<StoreWriter> BeginGeneration(uint64_t generation);
+
+		/// <summary>
+		/// Build image of generation from store into a temporary file
+		/// </summary>
+		/// <param name="generation">Retained generation, 0 - last one</param>
+		RestoreSource Materialize(uint64_t generation);
+
+		/// <summary>
+		/// Drop maps older than the last retainGenerations generations and collect pages no longer referenced
+		/// </summary>
+		void Compact(unsigned retainGenerations);
+
+		/// <summary>
+		/// Remove maps, link and restore copy, detach backup from store and collect its pages
+		/// </summary>
+		void Clear();
+
+	private:
+		std::shared_ptr<PageStore> GetStore();
+
+	private:
+		std::string filePrefix;
+		std::string linkPath;
+		std::shared_ptr<std::mutex> restoreMutex;
+		std::shared_ptr<PageStore> store;
+	};
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,200 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <memory>
+#include <optional>
+#include <thread>
+
+#include <sqlite3.h>
+#include "exception.h"
+
+namespace sqlite3_inc_bkp {
+
+	PagePipeline::PagePipeline(const PageHasher& hasher, unsigned threads, std::size_t batchPages, StatsRecorder* stats, RateLimiter* readLimiter, std::size_t extentPages)
+		: hasher(hasher), stats(stats), readLimiter(readLimiter), workerCount(threads), batchPages(batchPages ? batchPages : 1), extentPages(extentPages ? extentPages : 1) {
+		if (this->workerCount == 0)
+			this->workerCount = std::max(1u, std::thread::hardware_concurrency());
+		this->batchPages = (this->batchPages + this->extentPages - 1) / this->extentPages * this->extentPages;
+	}
+
+	void PagePipeline::Run(sqlite3_stmt* cursor, const Sink& sink, const std::vector<bool>* skipPages) {
+		this->Run([this, cursor, skipPages](PageBatch& batch, std::size_t& skipped) {
+			//Full batch is closed on extent boundary
+			while (batch.size() < this->batchPages || batch.pages.back() % this->extentPages != 0) {
+				int status = sqlite3_step(cursor);
+				if (status == SQLITE_DONE)
+					return false;
+				else if (status == SQLITE_ROW) {
+					const std::size_t pgno = static_cast<std::size_t>(sqlite3_column_int64(cursor, 0));
+					if (skipPages && pgno < skipPages->size() && (*skipPages)[pgno]) {
+						++skipped;
+						continue;
+					}
+					const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(cursor, 1));
+					const std::size_t size = sqlite3_column_bytes(cursor, 1);
+					if (batch.pageSize == 0) {
+						batch.pageSize = size;
+						batch.data.reserve(size * this->batchPages);
+					}
+					else if (batch.pageSize != size) {
+						throw BackupException(tools::FormatString::format("Page %d size %d differs from page size %d", pgno, size, batch.pageSize).c_str(), BackupException::Error::SelectPages);
+					}
+					batch.pages.push_back(pgno);
+					batch.data.insert(batch.data.end(), data, data + size);
+				}
+				else
+					throw BackupException(tools::FormatString::format("Error fetching data: %s", sqlite3_errstr(status)).c_str(), BackupException::Error::SelectPages);
+			}
+			return true;
+		}, sink);
+	}
+
+	void PagePipeline::Run(const char* image, std::size_t pageSize, std::size_t pageCount, const Sink& sink, const std::vector<bool>* skipPages) {
+		std::size_t next = 1;
+		this->Run([&](PageBatch& batch, std::size_t& skipped) {
+			//Batch is a run of pages not skipped, so hashing workers read it in place
+			while (next <= pageCount && skipPages && next < skipPages->size() && (*skipPages)[next]) {
+				++skipped;
+				++next;
+			}
+			batch.pageSize = pageSize;
+			batch.image = image + (next - 1) * pageSize;
+			while (next <= pageCount && batch.size() < this->batchPages && !(skipPages && next < skipPages->size() && (*skipPages)[next]))
+				batch.pages.push_back(next++);
+			return next <= pageCount;
+		}, sink);
+	}
+
+	void PagePipeline::Run(const Reader& read, const Sink& sink) {
+		using BatchPtr = std::unique_ptr<PageBatch>;
+		//Every batch is owned by exactly one queue or thread, so queues never block on capacity
+		const std::size_t inFlight = this->workerCount * 2 + 2;
+		tools::BlockingQueue<BatchPtr> freeBatches(inFlight);
+		tools::BlockingQueue<BatchPtr> toHash(inFlight);
+		tools::BlockingQueue<BatchPtr> hashed(inFlight);
+		for (std::size_t i = 0; i < inFlight; ++i)
+			freeBatches.Push(std::make_unique<PageBatch>());
+
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		auto fail = [&](std::exception_ptr e) {
+			{
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error)
+					error = e;
+			}
+			freeBatches.Close();
+			toHash.Close();
+			hashed.Close();
+		};
+
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < this->workerCount; ++t) {
+			workers.emplace_back([&] {
+				BatchPtr batch;
+				while (toHash.Pop(batch)) {
+					try {
+						StatsRecorder::Scope scope(this->stats, BackupPhase::Hash, true);
+						batch->pageHashes.resize(batch->size());
+						if (this->extentPages > 1)
+							this->HashExtents(*batch);
+						else
+							this->hasher.batch(batch->page(0), batch->pageSize, batch->size(), batch->pageHashes.data());
+					}
+					catch (...) {
+						fail(std::current_exception());
+						return;
+					}
+					hashed.Push(std::move(batch));
+				}
+			});
+		}
+
+		std::thread writer([&] {
+			//Workers finish out of order, hand batches to sink strictly by sequence
+			std::map<std::size_t, BatchPtr> pending;
+			std::size_t next = 0;
+			BatchPtr batch;
+			try {
+				while (hashed.Pop(batch)) {
+					pending.emplace(batch->sequence, std::move(batch));
+					while (!pending.empty() && pending.begin()->first == next) {
+						BatchPtr ready = std::move(pending.begin()->second);
+						pending.erase(pending.begin());
+						{
+							StatsRecorder::Scope scope(this->stats, BackupPhase::Write, true);
+							sink(*ready);
+						}
+						freeBatches.Push(std::move(ready));
+						++next;
+					}
+				}
+			}
+			catch (...) {
+				fail(std::current_exception());
+			}
+		});
+
+		try {
+			std::size_t sequence = 0;
+			std::size_t skipped = 0;
+			bool done = false;
+			while (!done) {
+				BatchPtr batch;
+				if (!freeBatches.Pop(batch))
+					break;
+				batch->sequence = sequence;
+				batch->pageSize = 0;
+				batch->pages.clear();
+				batch->data.clear();
+				batch->image = nullptr;
+				//Read time ends before the batch is handed to hashing threads
+				std::optional<StatsRecorder::Scope> scope;
+				scope.emplace(this->stats, BackupPhase::Read, true);
+				done = !read(*batch, skipped);
+				scope.reset();
+				if (this->stats && skipped > 0)
+					this->stats->AddFree(skipped);
+				skipped = 0;
+				if (batch->size() == 0)
+					break;
+				const std::size_t bytes = batch->size() * batch->pageSize;
+				if (this->stats)
+					this->stats->AddRead(batch->size(), bytes);
+				++sequence;
+				if (!toHash.Push(std::move(batch)))
+					break;
+				//Reader pauses before the next batch, hashing and writing of this one go on meanwhile
+				if (this->readLimiter)
+					this->readLimiter->Acquire(bytes);
+			}
+		}
+		catch (...) {
+			fail(std::current_exception());
+		}
+
+		toHash.Close();
+		for (auto& worker : workers)
+			worker.join();
+		hashed.Close();
+		writer.join();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	void PagePipeline::HashExtents(PageBatch& batch) const {
+		//Consecutive pages of one extent are adjacent in batch data and hashed as one buffer
+		for (std::size_t j = 0; j < batch.size();) {
+			const std::size_t extent = (batch.pages[j] - 1) / this->extentPages;
+			std::size_t run = 1;
+			while (j + run < batch.size() && batch.pages[j + run] == batch.pages[j] + run && (batch.pages[j + run] - 1) / this->extentPages == extent)
+				++run;
+			const hash_t hash = this->hasher.single(batch.page(j), run * batch.pageSize);
+			std::fill(batch.pageHashes.begin() + j, batch.pageHashes.begin() + j + run, hash);
+			j += run;
+		}
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "hasher.h"
+#include "stats.h"
+#include "throttle.h"
+
+struct sqlite3_stmt;
+namespace sqlite3_inc_bkp {
+	namespace tools {
+		/// <summary>
+		/// Bounded multi-producer multi-consumer queue, Pop returns false when the queue is closed and drained
+		/// </summary>
+		template <typename T>
+		class BlockingQueue {
+		public:
+			explicit BlockingQueue(std::size_t capacity) : capacity(capacity) {}
+
+			bool Push(T item) {
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->notFull.wait(lock, [this] { return this->closed || this->items.size() < this->capacity; });
+				if (this->closed)
+					return false;
+				this->items.push_back(std::move(item));
+				this->notEmpty.notify_one();
+				return true;
+			}
+
+			bool Pop(T& item) {
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->notEmpty.wait(lock, [this] { return this->closed || !this->items.empty(); });
+				if (this->items.empty())
+					return false;
+				item = std::move(this->items.front());
+				this->items.pop_front();
+				this->notFull.notify_one();
+				return true;
+			}
+
+			void Close() {
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->closed = true;
+				this->notEmpty.notify_all();
+				this->notFull.notify_all();
+			}
+
+		private:
+			std::mutex mutex;
+			std::condition_variable notEmpty;
+			std::condition_variable notFull;
+			std::deque<T> items;
+			std::size_t capacity;
+			bool closed = false;
+		};
+	}
+
+	/// <summary>
+	/// Batch of consecutive cursor rows or of a run of consecutive image pages, travels reader -> hashing worker -> writer
+	/// </summary>
+	struct PageBatch {
+		std::size_t sequence = 0;
+		std::size_t pageSize = 0;
+		std::vector<std::size_t> pages;	//pgno of every page in batch
+		std::vector<char> data;			//pages.size() * pageSize bytes
+		const char* image = nullptr;	//pages read in place from image instead of data
+		std::vector<hash_t> pageHashes;	//filled by worker, every page of extent gets hash of its run of extent pages in batch
+
+		inline std::size_t size() const { return pages.size(); }
+		inline const char* page(std::size_t i) const { return (image ? image : data.data()) + i * pageSize; }
+	};
+
+	/// <summary>
+	/// Producer/consumer pipeline: calling thread reads batches of pages from cursor,
+	/// a pool of workers hashes them, a single writer thread receives batches in page order
+	/// </summary>
+	class PagePipeline {
+	public:
+		using Sink = std::function<void(const PageBatch&)>;
+
+		/// <param name="stats">Records Read, Hash and Write phase of every batch, may be nullptr</param>
+		/// <param name="readLimiter">Throttles bytes read from cursor, may be nullptr</param>
+		/// <param name="extentPages">Pages hashed together, batches end on extent boundary so cursor returning whole extents never splits one</param>
+		PagePipeline(const PageHasher& hasher, unsigned threads, std::size_t batchPages, StatsRecorder* stats = nullptr, RateLimiter* readLimiter = nullptr, std::size_t extentPages = 1);
+
+		/// <summary>
+		/// Run pipeline until cursor is done, cursor must return (pgno, data) rows
+		/// </summary>
+		/// <param name="cursor">Prepared statement, not finalized by pipeline</param>
+		/// <param name="sink">Called on writer thread for every batch in cursor order</param>
+		/// <param name="skipPages">Pages with set bit are stepped over without hashing and never reach sink, may be nullptr</param>
+		void Run(sqlite3_stmt* cursor, const Sink& sink, const std::vector<bool>* skipPages = nullptr);
+
+		/// <summary>
+		/// Run pipeline over contiguous database image, batches point into image so it must stay unchanged until Run returns
+		/// </summary>
+		/// <param name="image">Pages 1..pageCount one after another</param>
+		/// <param name="sink">Called on writer thread for every batch in page order</param>
+		/// <param name="skipPages">Pages with set bit are stepped over without hashing and never reach sink, may be nullptr</param>
+		void Run(const char* image, std::size_t pageSize, std::size_t pageCount, const Sink& sink, const std::vector<bool>* skipPages = nullptr);
+
+		inline unsigned threads() const { return workerCount; }
+
+	private:
+		/// <summary>
+		/// Fill batch from source, skipped counts pages stepped over. Returns false once source is done, batch may hold its last pages
+		/// </summary>
+		using Reader = std::function<bool(PageBatch& batch, std::size_t& skipped)>;
+		void Run(const Reader& read, const Sink& sink);
+		void HashExtents(PageBatch& batch) const;
+
+	private:
+		const PageHasher& hasher;
+		StatsRecorder* stats;
+		RateLimiter* readLimiter;
+		unsigned workerCount;
+		std::size_t batchPages;
+		std::size_t extentPages;
+	};
+}//namespace sqlite3_inc_bkp
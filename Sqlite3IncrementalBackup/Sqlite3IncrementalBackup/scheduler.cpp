@@ -0,0 +1,270 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+namespace sqlite3_inc_bkp {
+	BackupScheduler::BackupScheduler(const SchedulerOptions& options) {
+		const unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+		this->maxConcurrentIo = options.maxConcurrentIo ? options.maxConcurrentIo : threads;
+		for (unsigned i = 0; i < threads; ++i)
+			this->queues.push_back(std::make_unique<WorkerQueue>());
+		try {
+			for (unsigned i = 0; i < threads; ++i)
+				this->workers.emplace_back(&BackupScheduler::Work, this, i);
+			this->dispatcher = std::thread(&BackupScheduler::Dispatch, this);
+		}
+		catch (...) {
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->stopping = true;
+			}
+			this->WakeWorkers();
+			for (auto& worker : this->workers)
+				worker.join();
+			throw;
+		}
+	}
+
+	BackupScheduler::~BackupScheduler() {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stopping = true;
+		}
+		this->dispatchCondition.notify_all();
+		this->WakeWorkers();
+		this->ioCondition.notify_all();
+		this->dispatcher.join();
+		for (auto& worker : this->workers)
+			worker.join();
+	}
+
+	uint64_t BackupScheduler::Add(sqlite3* db, const std::string& path, const std::string& name, const hash_func& f, const BackupOptions& options, unsigned intervalMs, int priority) {
+		if (!db) {
+			throw BackupException(tools::FormatString::format("Database of scheduled backup [%s] is null", name.c_str()).c_str(), BackupException::Error::Scheduling);
+		}
+		auto job = std::make_shared<Job>();
+		job->db = db;
+		job->path = path;
+		job->name = name;
+		job->f = f;
+		job->options = options;
+		//Workers already run backups in parallel, one hashing thread each unless asked otherwise
+		if (job->options.threads == 0)
+			job->options.threads = 1;
+		job->interval = std::chrono::milliseconds(intervalMs);
+		job->priority = priority;
+		job->nextDue = clock::now();
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (const auto& other : this->jobs) {
+			if (other.second->path == path && other.second->name == name) {
+				throw BackupException(tools::FormatString::format("Backup [%s] in [%s] is already scheduled", name.c_str(), path.c_str()).c_str(), BackupException::Error::Scheduling);
+			}
+		}
+		job->id = this->nextId++;
+		this->jobs.emplace(job->id, job);
+		this->dispatchCondition.notify_one();
+		return job->id;
+	}
+
+	void BackupScheduler::Remove(uint64_t id) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		auto job = this->Find(id);
+		//Queued job is dropped by the worker taking it
+		job->removed = true;
+		this->jobs.erase(id);
+		this->doneCondition.wait(lock, [&job] { return !job->running; });
+	}
+
+	void BackupScheduler::Trigger(uint64_t id) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto job = this->Find(id);
+		if (job->running)
+			job->triggered = true;
+		else if (!job->queued)
+			job->nextDue = clock::now();
+		this->dispatchCondition.notify_one();
+	}
+
+	ScheduleStatus BackupScheduler::Status(uint64_t id) const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto job = this->Find(id);
+		ScheduleStatus status = job->status;
+		status.running = job->running;
+		if (job->queued || job->triggered)
+			status.nextDueMs = 0;
+		else if (job->nextDue == clock::time_point::max())
+			status.nextDueMs = -1;
+		else
+			status.nextDueMs = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(job->nextDue - clock::now()).count());
+		return status;
+	}
+
+	std::shared_ptr<BackupScheduler::Job> BackupScheduler::Find(uint64_t id) const {
+		auto it = this->jobs.find(id);
+		if (it == this->jobs.end()) {
+			throw BackupException(tools::FormatString::format("Scheduled backup [%d] not found", id).c_str(), BackupException::Error::Scheduling);
+		}
+		return it->second;
+	}
+
+	void BackupScheduler::Dispatch() {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (!this->stopping) {
+			const auto now = clock::now();
+			auto wake = clock::time_point::max();
+			std::vector<std::shared_ptr<Job>> due;
+			for (const auto& entry : this->jobs) {
+				Job& job = *entry.second;
+				if (job.queued || job.running)
+					continue;
+				if (job.nextDue <= now)
+					due.push_back(entry.second);
+				else
+					wake = std::min(wake, job.nextDue);
+			}
+
+			//Higher priority first, then the longest overdue, dealt round-robin so every worker starts with its share
+			std::sort(due.begin(), due.end(), [](const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) {
+				return a->priority != b->priority ? a->priority > b->priority : a->nextDue < b->nextDue;
+			});
+			for (const auto& job : due) {
+				job->queued = true;
+				WorkerQueue& queue = *this->queues[this->nextQueue++ % this->queues.size()];
+				std::lock_guard<std::mutex> queueLock(queue.mutex);
+				queue.jobs.push_back(job);
+				++this->pending;
+			}
+			if (!due.empty())
+				this->WakeWorkers();
+
+			if (wake == clock::time_point::max())
+				this->dispatchCondition.wait(lock);
+			else
+				this->dispatchCondition.wait_until(lock, wake);
+		}
+	}
+
+	void BackupScheduler::WakeWorkers() {
+		//Worker checking for work under idleMutex either sees the change or is already waiting
+		{
+			std::lock_guard<std::mutex> idle(this->idleMutex);
+		}
+		this->workCondition.notify_all();
+	}
+
+	std::shared_ptr<BackupScheduler::Job> BackupScheduler::Take(std::size_t index) {
+		//Own queue first, then steal. Every queue gives its highest priority job, workers contend only on the queue they visit
+		for (std::size_t k = 0; k < this->queues.size(); ++k) {
+			WorkerQueue& queue = *this->queues[(index + k) % this->queues.size()];
+			std::lock_guard<std::mutex> queueLock(queue.mutex);
+			if (queue.jobs.empty())
+				continue;
+			auto best = queue.jobs.begin();
+			for (auto it = queue.jobs.begin(); it != queue.jobs.end(); ++it) {
+				if ((*it)->priority > (*best)->priority)
+					best = it;
+			}
+			auto job = *best;
+			queue.jobs.erase(best);
+			--this->pending;
+			return job;
+		}
+		return nullptr;
+	}
+
+	void BackupScheduler::Work(std::size_t index) {
+		while (!this->stopping) {
+			if (auto job = this->Take(index)) {
+				this->Execute(job);
+				continue;
+			}
+			//Job queued after Take looked at its queue raises pending before waking, so it is not missed
+			std::unique_lock<std::mutex> idle(this->idleMutex);
+			this->workCondition.wait(idle, [this] { return this->stopping || this->pending > 0; });
+		}
+	}
+
+	void BackupScheduler::Execute(const std::shared_ptr<Job>& job) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			job->queued = false;
+			if (this->stopping || job->removed)
+				return;
+			job->running = true;
+		}
+
+		BackupOptions options = job->options;
+		options.trace = [this, trace = job->options.trace](BackupPhase phase, bool begin) {
+			this->TraceIo(phase, begin, trace);
+		};
+		int result = 0;
+		BackupStats stats;
+		std::unique_ptr<IBackup> instance;
+		try {
+			instance = IBackup::Create(IBackup::Version::V1, job->path.c_str(), job->name.c_str(), job->f, options);
+			instance->Write(job->db);
+		}
+		catch (const BackupException& e) {
+			result = static_cast<int>(e.code());
+		}
+		catch (const std::exception&) {
+			result = -1;
+		}
+		if (instance)
+			stats = instance->Stats();
+		instance.reset();
+
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			job->running = false;
+			++job->status.runs;
+			if (result != 0)
+				++job->status.failures;
+			job->status.lastResult = result;
+			job->status.lastStats = stats;
+			if (job->triggered || job->interval == clock::duration::zero())
+				job->nextDue = job->triggered ? clock::now() : clock::time_point::max();
+			else
+				job->nextDue = clock::now() + job->interval;
+			job->triggered = false;
+		}
+		this->doneCondition.notify_all();
+		this->dispatchCondition.notify_one();
+	}
+
+	void BackupScheduler::TraceIo(BackupPhase phase, bool begin, const StatsRecorder::trace_func& trace) {
+		if (phase == BackupPhase::Hash) {
+			if (trace)
+				trace(phase, begin);
+			return;
+		}
+		//I/O phases open on this thread, a nested one runs in the slot of the outer one instead of waiting for a second slot
+		thread_local unsigned depth = 0;
+		auto release = [this] {
+			if (--depth > 0)
+				return;
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				--this->ioInUse;
+			}
+			this->ioCondition.notify_one();
+		};
+		if (begin && depth++ == 0) {
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->ioCondition.wait(lock, [this] { return this->stopping || this->ioInUse < this->maxConcurrentIo; });
+			++this->ioInUse;
+		}
+		try {
+			if (trace)
+				trace(phase, begin);
+		}
+		catch (...) {
+			//Phase failing to begin never ends
+			release();
+			throw;
+		}
+		if (!begin)
+			release();
+	}
+}//namespace sqlite3_inc_bkp
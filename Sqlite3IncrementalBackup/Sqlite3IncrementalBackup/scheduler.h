@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api.h"
+#include "backup.h"
+
+struct sqlite3;
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Runs backups of many databases on one pool of workers. Due backups are dealt to per-worker queues by the dispatcher thread,
+	/// a worker takes the highest priority backup of its own queue and steals from other queues when it is empty.
+	/// Every I/O phase of a running backup holds one of I/O slots while hashing does not, a database is never backed up by two workers at once
+	/// </summary>
+	class BackupScheduler {
+	public:
+		using hash_func = std::function<uint64_t(const void*, std::size_t)>;
+
+		explicit BackupScheduler(const SchedulerOptions& options);
+		BackupScheduler(const BackupScheduler&) = delete;
+		BackupScheduler& operator=(const BackupScheduler&) = delete;
+		/// <summary>
+		/// Waits for running backups, queued backups are dropped
+		/// </summary>
+		~BackupScheduler();
+
+		/// <param name="intervalMs">Time from the end of one backup to the start of the next, 0 - only the first backup and triggered ones</param>
+		/// <returns>Id of scheduled database</returns>
+		uint64_t Add(sqlite3* db, const std::string& path, const std::string& name, const hash_func& f, const BackupOptions& options, unsigned intervalMs, int priority);
+
+		/// <summary>
+		/// Unschedule database, waits for its running backup
+		/// </summary>
+		void Remove(uint64_t id);
+
+		/// <summary>
+		/// Make backup of database due now, running backup is followed by another one
+		/// </summary>
+		void Trigger(uint64_t id);
+
+		ScheduleStatus Status(uint64_t id) const;
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		struct Job {
+			uint64_t id = 0;
+			sqlite3* db = nullptr;
+			std::string path;
+			std::string name;
+			hash_func f;
+			BackupOptions options;
+			clock::duration interval;
+			int priority = 0;
+			clock::time_point nextDue;	//max - not scheduled
+			bool queued = false;
+			bool running = false;
+			bool removed = false;
+			bool triggered = false;		//triggered while running
+			ScheduleStatus status;
+		};
+
+		struct WorkerQueue {
+			std::mutex mutex;
+			std::deque<std::shared_ptr<Job>> jobs;
+		};
+
+		void Dispatch();
+		void Work(std::size_t index);
+		//Job of own queue or stolen from another one, only queue locks are taken
+		std::shared_ptr<Job> Take(std::size_t index);
+		void WakeWorkers();
+		void Execute(const std::shared_ptr<Job>& job);
+		//Traced phase of backup takes I/O slot at its begin and releases it at its end
+		void TraceIo(BackupPhase phase, bool begin, const StatsRecorder::trace_func& trace);
+		std::shared_ptr<Job> Find(uint64_t id) const;
+
+	private:
+		unsigned maxConcurrentIo;
+		mutable std::mutex mutex;					//jobs and their state, I/O slots
+		std::mutex idleMutex;						//idle workers wait on workCondition with it, never held while taking jobs
+		std::condition_variable dispatchCondition;	//job became due or finished
+		std::condition_variable workCondition;		//job queued or stopping
+		std::condition_variable ioCondition;		//I/O slot released
+		std::condition_variable doneCondition;		//job finished
+		std::map<uint64_t, std::shared_ptr<Job>> jobs;
+		uint64_t nextId = 1;
+		unsigned ioInUse = 0;
+		std::atomic<std::size_t> pending{ 0 };		//jobs in worker queues, changed under the lock of the queue
+		std::size_t nextQueue = 0;
+		std::atomic<bool> stopping{ false };
+		std::vector<std::unique_ptr<WorkerQueue>> queues;
+		std::vector<std::thread> workers;
+		std::thread dispatcher;
+	};
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,110 @@
+#include "schemas.h"
+
+#include <algorithm>
+#include <exception>
+
+#include <sqlite3.h>
+#include "backup.h"
+#include "exception.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const char* const TEMP_SCHEMA = "temp";
+
+		/// <summary>
+		/// Start read transaction of every schema in one statement, so databases are read at one point in time
+		/// </summary>
+		void PinSnapshot(sqlite3* db, const std::vector<std::string>& schemas) {
+			std::string query("SELECT 0");
+			for (const std::string& schema : schemas)
+				query += " + (SELECT count(*) FROM " + tools::QuoteSql(schema.c_str(), '"') + ".sqlite_master)";
+			sqlite3_stmt* stmt = nullptr;
+			int rc = sqlite3_prepare_v2(db, query.c_str(), static_cast<int>(query.size()), &stmt, nullptr);
+			if (rc == SQLITE_OK)
+				rc = sqlite3_step(stmt);
+			sqlite3_finalize(stmt);
+			if (rc != SQLITE_ROW) {
+				throw BackupException(tools::FormatString::format("Error starting read transaction of attached databases: %s", sqlite3_errmsg(db)).c_str(), BackupException::Error::SelectPages);
+			}
+		}
+	}
+
+	std::vector<std::string> ListSchemas(sqlite3* db) {
+		sqlite3_stmt* stmt = nullptr;
+		int rc = sqlite3_prepare_v2(db, "PRAGMA database_list", -1, &stmt, nullptr);
+		if (rc != SQLITE_OK) {
+			throw BackupException(tools::FormatString::format("Error listing attached databases: %s", sqlite3_errstr(rc)).c_str(), BackupException::Error::SelectPages);
+		}
+		std::vector<std::string> schemas;
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			const char* schema = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+			if (schema && !boost::iequals(schema, TEMP_SCHEMA))
+				schemas.emplace_back(schema);
+		}
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_DONE) {
+			throw BackupException(tools::FormatString::format("Error listing attached databases: %s", sqlite3_errstr(rc)).c_str(), BackupException::Error::SelectPages);
+		}
+		return schemas;
+	}
+
+	std::string GetSchemaBackupName(const std::string& name, const std::string& schema) {
+		//Alias may hold dots and path separators, such alias is hex-encoded behind a dash no plain alias starts with
+		const bool plain = !schema.empty() && std::all_of(schema.begin(), schema.end(), [](char c) {
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+		});
+		if (plain)
+			return name + "." + schema;
+		static const char* const HEX_DIGITS = "0123456789abcdef";
+		std::string encoded("-");
+		for (const char c : schema) {
+			encoded += HEX_DIGITS[static_cast<unsigned char>(c) >> 4];
+			encoded += HEX_DIGITS[static_cast<unsigned char>(c) & 0xF];
+		}
+		return name + "." + encoded;
+	}
+
+	void BackupSchemas(sqlite3* db, const char* path, const char* name, const hash_func& f, const BackupOptions& options, std::vector<std::string>& schemas) {
+		schemas = ListSchemas(db);
+		if (options.outputFd >= 0 && schemas.size() > 1) {
+			throw BackupException("Backup stream holds one database, attached databases can not be streamed to one descriptor", BackupException::Error::BackupInit);
+		}
+
+		//Backup of schema finds the transaction open and reads in its snapshot. Schemas share the connection and its mutex,
+		//they are read one after another and every backup hashes on all threads
+		const bool ownTransaction = sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+		std::exception_ptr error;
+		try {
+			PinSnapshot(db, schemas);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		const bool pinned = !error;
+		for (std::size_t i = 0; pinned && i < schemas.size(); ++i) {
+			BackupOptions schemaOptions = options;
+			schemaOptions.schema = schemas[i];
+			try {
+				IBackup::Create(IBackup::Version::V1, path, GetSchemaBackupName(name, schemas[i]).c_str(), f, schemaOptions)->Write(db);
+			}
+			catch (...) {
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+		if (ownTransaction)
+			sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	void RestoreSchemas(sqlite3* dst, const char* path, const char* name, const hash_func& f, const BackupOptions& options, std::vector<std::string>& schemas) {
+		schemas.clear();
+		for (const std::string& schema : ListSchemas(dst)) {
+			BackupOptions schemaOptions = options;
+			schemaOptions.schema = schema;
+			IBackup::Create(IBackup::Version::V1, path, GetSchemaBackupName(name, schema).c_str(), f, schemaOptions)->Read(dst, 0);
+			schemas.push_back(schema);
+		}
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+
+struct sqlite3;
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Schemas of connection in PRAGMA database_list order, main and attached databases. Temp schema is skipped
+	/// </summary>
+	std::vector<std::string> ListSchemas(sqlite3* db);
+
+	/// <summary>
+	/// Name of backup of schema in a multi-schema backup, schema of characters other than [A-Za-z0-9_] is hex-encoded
+	/// so the name stays in backup directory and does not meet the name of another schema
+	/// </summary>
+	std::string GetSchemaBackupName(const std::string& name, const std::string& schema);
+
+	/// <summary>
+	/// Back up every schema of connection to its own backup within one read transaction, one schema after another.
+	/// Backups of the other schemas are committed even if one fails, the first error is thrown once all are done
+	/// </summary>
+	/// <param name="schemas">Schemas backed up</param>
+	void BackupSchemas(sqlite3* db, const char* path, const char* name, const hash_func& f, const BackupOptions& options, std::vector<std::string>& schemas);
+
+	/// <summary>
+	/// Restore every schema of connection from its backup, one after another as each restore holds its own write transaction
+	/// </summary>
+	/// <param name="schemas">Schemas restored before return or error</param>
+	void RestoreSchemas(sqlite3* dst, const char* path, const char* name, const hash_func& f, const BackupOptions& options, std::vector<std::string>& schemas);
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,363 @@
+#include "sink.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include "exception.h"
+#include "hasher.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t STREAM_MAGIC = 0x544B4249; //IBKT
+		const std::size_t STREAM_COPY_BYTES = 1 << 20;
+#ifdef IOV_MAX
+		const std::size_t MAX_WRITE_PARTS = IOV_MAX;
+#else
+		const std::size_t MAX_WRITE_PARTS = 1024;
+#endif
+
+		inline uint32_t RecordChecksum(const StreamRecord& record) {
+			return static_cast<uint32_t>(tools::Xxh64(&record, offsetof(StreamRecord, checksum), 0));
+		}
+
+		inline std::ptrdiff_t WriteSome(int fd, const void* data, std::size_t size) {
+#ifdef _WIN32
+			return ::_write(fd, data, static_cast<unsigned>(std::min<std::size_t>(size, INT_MAX)));
+#else
+			return ::write(fd, data, size);
+#endif
+		}
+
+		inline std::ptrdiff_t ReadSome(int fd, void* data, std::size_t size) {
+#ifdef _WIN32
+			return ::_read(fd, data, static_cast<unsigned>(std::min<std::size_t>(size, INT_MAX)));
+#else
+			return ::read(fd, data, size);
+#endif
+		}
+
+#ifndef _WIN32
+		/// <summary>
+		/// Block SIGPIPE of calling thread while in scope, write to a closed pipe fails with EPIPE instead of ending the process.
+		/// SIGPIPE raised meanwhile is consumed unless it was pending before
+		/// </summary>
+		class SigPipeBlock {
+		public:
+			explicit SigPipeBlock(bool enable) {
+				if (!enable)
+					return;
+				sigemptyset(&this->pipeSet);
+				sigaddset(&this->pipeSet, SIGPIPE);
+				sigset_t pending;
+				this->wasPending = sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE) == 1;
+				this->blocked = pthread_sigmask(SIG_BLOCK, &this->pipeSet, &this->previous) == 0;
+			}
+			SigPipeBlock(const SigPipeBlock&) = delete;
+			SigPipeBlock& operator=(const SigPipeBlock&) = delete;
+
+			~SigPipeBlock() {
+				if (!this->blocked)
+					return;
+				const int savedErrno = errno;
+				sigset_t pending;
+				if (!this->wasPending && sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE) == 1) {
+					int signal = 0;
+					sigwait(&this->pipeSet, &signal);
+				}
+				pthread_sigmask(SIG_SETMASK, &this->previous, nullptr);
+				errno = savedErrno;
+			}
+
+		private:
+			sigset_t pipeSet;
+			sigset_t previous;
+			bool wasPending = false;
+			bool blocked = false;
+		};
+
+		inline bool IsSocket(int fd) {
+			struct stat st;
+			return ::fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+		}
+#endif
+
+		/// <summary>
+		/// Write buffers in order, resubmitting after short writes of pipes and sockets.
+		/// Sockets are written with MSG_NOSIGNAL, SIGPIPE is blocked around writes to other descriptors
+		/// </summary>
+		void WriteFully(int fd, bool socket, std::vector<PageWriter::Buffer>& parts) {
+#if !defined(_WIN32) && defined(MSG_NOSIGNAL)
+			SigPipeBlock block(!socket);
+#elif !defined(_WIN32)
+			SigPipeBlock block(true);
+#endif
+			std::size_t first = 0;
+			while (first < parts.size()) {
+				if (parts[first].size == 0) {
+					++first;
+					continue;
+				}
+#ifdef _WIN32
+				const std::ptrdiff_t rc = WriteSome(fd, parts[first].data, parts[first].size);
+#else
+				std::vector<iovec> iov(std::min(parts.size() - first, MAX_WRITE_PARTS));
+				for (std::size_t i = 0; i < iov.size(); ++i) {
+					iov[i].iov_base = const_cast<void*>(parts[first + i].data);
+					iov[i].iov_len = parts[first + i].size;
+				}
+#ifdef MSG_NOSIGNAL
+				std::ptrdiff_t rc;
+				if (socket) {
+					msghdr message = {};
+					message.msg_iov = iov.data();
+					message.msg_iovlen = iov.size();
+					rc = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+				}
+				else {
+					rc = ::writev(fd, iov.data(), static_cast<int>(iov.size()));
+				}
+#else
+				const std::ptrdiff_t rc = ::writev(fd, iov.data(), static_cast<int>(iov.size()));
+#endif
+#endif
+				if (rc < 0) {
+					if (errno == EINTR)
+						continue;
+					throw BackupException(tools::FormatString::format("Error writing backup stream: %s", std::strerror(errno)).c_str(), BackupException::Error::BackupInit);
+				}
+				std::size_t written = static_cast<std::size_t>(rc);
+				while (first < parts.size() && written >= parts[first].size) {
+					written -= parts[first].size;
+					++first;
+				}
+				if (written > 0) {
+					parts[first].data = static_cast<const char*>(parts[first].data) + written;
+					parts[first].size -= written;
+				}
+			}
+		}
+
+		/// <returns>false if stream ended before the first byte and end is allowed</returns>
+		bool ReadFully(int fd, void* data, std::size_t size, bool endAllowed) {
+			std::size_t done = 0;
+			while (done < size) {
+				const std::ptrdiff_t rc = ReadSome(fd, static_cast<char*>(data) + done, size - done);
+				if (rc < 0) {
+					if (errno == EINTR)
+						continue;
+					throw BackupException(tools::FormatString::format("Error reading backup stream: %s", std::strerror(errno)).c_str(), BackupException::Error::BackupLoad);
+				}
+				if (rc == 0) {
+					if (done == 0 && endAllowed)
+						return false;
+					throw BackupException("Backup stream ended unexpectedly", BackupException::Error::BackupLoad);
+				}
+				done += static_cast<std::size_t>(rc);
+			}
+			return true;
+		}
+
+		bool ReadRecord(int fd, StreamRecord& record, bool endAllowed) {
+			if (!ReadFully(fd, &record, sizeof(record), endAllowed))
+				return false;
+			if (record.magic != STREAM_MAGIC || record.checksum != RecordChecksum(record)) {
+				throw BackupException("Backup stream corrupted", BackupException::Error::IntegrityCheck);
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Copy size bytes of file to fd, sendfile moves them inside kernel and splices into pipes
+		/// </summary>
+		void SendFile(int fd, bool socket, const std::string& path, uint64_t size) {
+			uint64_t sent = 0;
+#ifdef __linux__
+			const int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (in >= 0) {
+				//sendfile has no MSG_NOSIGNAL, broken pipe or socket ends it with EPIPE
+				SigPipeBlock block(true);
+				off_t offset = 0;
+				while (sent < size) {
+					const ssize_t rc = ::sendfile(fd, in, &offset, static_cast<std::size_t>(size - sent));
+					if (rc < 0 && errno == EINTR)
+						continue;
+					if (rc <= 0)
+						break;
+					sent += static_cast<uint64_t>(rc);
+				}
+				::close(in);
+			}
+#endif
+			//Descriptors sendfile can not write to get a plain copy of the rest
+			if (sent == size)
+				return;
+			std::ifstream fIn(path, std::ios::binary);
+			fIn.seekg(static_cast<std::streamoff>(sent));
+			std::vector<char> buffer(STREAM_COPY_BYTES);
+			std::vector<PageWriter::Buffer> parts;
+			while (sent < size) {
+				const std::size_t chunk = static_cast<std::size_t>(std::min<uint64_t>(buffer.size(), size - sent));
+				if (!fIn.read(buffer.data(), chunk)) {
+					throw BackupException(tools::FormatString::format("Error reading manifest [%s]", path.c_str()).c_str(), BackupException::Error::BackupInit);
+				}
+				parts.assign(1, { buffer.data(), chunk });
+				WriteFully(fd, socket, parts);
+				sent += chunk;
+			}
+		}
+	}
+
+	SinkWriter::SinkWriter(int fd, const Manifest& manifest) : PageWriter(std::string()), fd(fd), manifest(manifest) {
+#ifndef _WIN32
+		this->socket = IsSocket(fd);
+#endif
+		//Empty manifest, committed or reset after an interrupted backup, makes a stream of every page
+		this->WriteRecord(StreamRecordType::Begin, 0, 0, 0, manifest.PageCount() ? manifest.Root() : 0, manifest.PageSize(), this->payload);
+	}
+
+	void SinkWriter::WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) {
+		const std::size_t pageSize = parts.front().size;
+		const uint64_t first = offset / pageSize + 1;
+		//Pages are added after their manifest entries are set, so entries are hashes of the written data
+		this->hashes.resize(parts.size());
+		for (std::size_t i = 0; i < parts.size(); ++i)
+			this->hashes[i] = this->manifest.Get(static_cast<std::size_t>(first + i));
+		this->payload.assign(1, { this->hashes.data(), this->hashes.size() * sizeof(hash_t) });
+		this->payload.insert(this->payload.end(), parts.begin(), parts.end());
+		this->WriteRecord(StreamRecordType::Extent, first, parts.size(), parts.size() * (sizeof(hash_t) + pageSize), 0, pageSize, this->payload);
+	}
+
+	void SinkWriter::Finish(const std::string& manifestPath, std::size_t pageCount) {
+		const uint64_t size = boost::filesystem::file_size(manifestPath);
+		this->payload.clear();
+		this->WriteRecord(StreamRecordType::Manifest, 0, 0, size, 0, this->manifest.PageSize(), this->payload);
+		SendFile(this->fd, this->socket, manifestPath, size);
+		this->WriteRecord(StreamRecordType::End, pageCount, 0, 0, this->manifest.Root(), this->manifest.PageSize(), this->payload);
+	}
+
+	void SinkWriter::WriteRecord(StreamRecordType type, uint64_t first, uint64_t count, uint64_t payloadSize, hash_t root, std::size_t pageSize, std::vector<Buffer>& payload) {
+		StreamRecord record = {};
+		record.magic = STREAM_MAGIC;
+		record.type = static_cast<uint32_t>(type);
+		record.first = first;
+		record.count = count;
+		record.payloadSize = payloadSize;
+		record.root = root;
+		record.pageSize = static_cast<uint32_t>(pageSize);
+		record.hashAlgorithm = static_cast<uint32_t>(this->manifest.Algorithm());
+		record.checksum = RecordChecksum(record);
+		payload.insert(payload.begin(), Buffer{ &record, sizeof(record) });
+		WriteFully(this->fd, this->socket, payload);
+		payload.clear();
+	}
+
+	void ApplyStream(int fd, const std::string& imagePath, const hash_func& callback) {
+		const std::string manifestPath = imagePath + ".manifest";
+		const std::string tmpPath = manifestPath + ".tmp";
+		StreamRecord record = {};
+		bool any = false;
+		std::vector<char> data;
+		while (ReadRecord(fd, record, any)) {
+			any = true;
+			if (record.type != static_cast<uint32_t>(StreamRecordType::Begin)) {
+				throw BackupException("Backup stream corrupted", BackupException::Error::IntegrityCheck);
+			}
+			//Delta goes only on top of the stream it follows, its manifest root names it
+			if (record.root != 0) {
+				Manifest applied;
+				if (boost::filesystem::exists(manifestPath))
+					applied.Open(manifestPath, true, hash_func());
+				if (!applied.IsOpen() || applied.Root() != record.root) {
+					throw BackupException(tools::FormatString::format("Backup stream is a delta of a backup not applied to image [%s]", imagePath.c_str()).c_str(), BackupException::Error::IntegrityCheck);
+				}
+			}
+			//Image stops matching its manifest with the first page written
+			std::remove(manifestPath.c_str());
+			if (record.root == 0 || !boost::filesystem::exists(imagePath))
+				std::ofstream(imagePath, std::ios::binary | std::ios::trunc);
+			std::fstream fImage(imagePath, std::ios::in | std::ios::out | std::ios::binary);
+			if (!fImage.is_open()) {
+				throw BackupException(tools::FormatString::format("Backup database file [%s] is not open", imagePath.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+			const PageHasher hasher = PageHasher::Select(static_cast<HashAlgorithm>(record.hashAlgorithm), callback);
+
+			bool ended = false;
+			while (!ended) {
+				ReadRecord(fd, record, false);
+				switch (static_cast<StreamRecordType>(record.type)) {
+				case StreamRecordType::Extent: {
+					const std::size_t pageSize = record.pageSize;
+					if (pageSize == 0 || record.first == 0 || record.payloadSize != record.count * (sizeof(hash_t) + pageSize)) {
+						throw BackupException("Backup stream corrupted", BackupException::Error::IntegrityCheck);
+					}
+					data.resize(static_cast<std::size_t>(record.payloadSize));
+					ReadFully(fd, data.data(), data.size(), false);
+					const char* pages = data.data() + record.count * sizeof(hash_t);
+					for (std::size_t i = 0; hasher && i < record.count; ++i) {
+						hash_t expected;
+						std::memcpy(&expected, data.data() + i * sizeof(hash_t), sizeof(expected));
+						if (hasher.single(pages + i * pageSize, pageSize) != expected) {
+							throw BackupException(tools::FormatString::format("Page %llu of backup stream corrupted", static_cast<unsigned long long>(record.first + i)).c_str(), BackupException::Error::IntegrityCheck);
+						}
+					}
+					fImage.seekp(static_cast<std::streamoff>((record.first - 1) * pageSize));
+					fImage.write(pages, record.count * pageSize);
+					break;
+				}
+				case StreamRecordType::Manifest: {
+					std::ofstream fManifest(tmpPath, std::ios::binary | std::ios::trunc);
+					data.resize(STREAM_COPY_BYTES);
+					for (uint64_t left = record.payloadSize; left > 0;) {
+						const std::size_t chunk = static_cast<std::size_t>(std::min<uint64_t>(left, data.size()));
+						ReadFully(fd, data.data(), chunk, false);
+						fManifest.write(data.data(), chunk);
+						left -= chunk;
+					}
+					if (!fManifest) {
+						throw BackupException(tools::FormatString::format("Could not write manifest [%s]", tmpPath.c_str()).c_str(), BackupException::Error::BackupInit);
+					}
+					break;
+				}
+				case StreamRecordType::End: {
+					fImage.close();
+					if (!fImage) {
+						throw BackupException(tools::FormatString::format("Error writing backup database file [%s]", imagePath.c_str()).c_str(), BackupException::Error::BackupInit);
+					}
+					boost::filesystem::resize_file(imagePath, record.first * record.pageSize);
+					Manifest streamed;
+					streamed.Open(tmpPath, true, hash_func());
+					if (!streamed.IsCommitted() || streamed.Root() != record.root || !streamed.Verify().empty()) {
+						throw BackupException("Manifest of backup stream corrupted", BackupException::Error::IntegrityCheck);
+					}
+					streamed.Close();
+					boost::filesystem::rename(tmpPath, manifestPath);
+					ended = true;
+					break;
+				}
+				default:
+					throw BackupException("Backup stream corrupted", BackupException::Error::IntegrityCheck);
+				}
+			}
+		}
+	}
+}//namespace sqlite3_inc_bkp
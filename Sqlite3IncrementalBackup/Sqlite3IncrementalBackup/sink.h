@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+#include "manifest.h"
+#include "writer.h"
+
+namespace sqlite3_inc_bkp {
+	enum class StreamRecordType : uint32_t {
+		Begin = 1,		//root is root of manifest the stream is a delta against, 0 - stream holds every page
+		Extent = 2,		//count pages from page first, payload is count manifest hashes followed by count pages
+		Manifest = 3,	//payload is committed manifest file
+		End = 4			//first is database page count, root is root of committed manifest
+	};
+
+	/// <summary>
+	/// Record of backup stream, payloadSize bytes of payload follow it. Stream is Begin, Extent records in write order, Manifest and End
+	/// </summary>
+	struct StreamRecord {
+		uint32_t magic;
+		uint32_t type;			//StreamRecordType
+		uint64_t first;
+		uint64_t count;
+		uint64_t payloadSize;
+		hash_t root;
+		uint32_t pageSize;
+		uint32_t hashAlgorithm;	//HashAlgorithm of page hashes
+		uint32_t reserved[3];
+		uint32_t checksum;		//low half of XXH64 of record fields before it
+	};
+	static_assert(sizeof(StreamRecord) == 64, "Stream record layout changed");
+
+	/// <summary>
+	/// Writer of changed pages as a sequential self-describing stream to file descriptor, nothing is staged on local disk.
+	/// Pages are gathered into one writev per extent, committed manifest is sent from its file with sendfile (Linux)
+	/// </summary>
+	class SinkWriter : public PageWriter {
+	public:
+		/// <param name="fd">Descriptor open for writing: file, pipe or socket, it is not closed by writer</param>
+		/// <param name="manifest">Manifest of backup, hashes of written pages are read from it. Begin record is written at once</param>
+		SinkWriter(int fd, const Manifest& manifest);
+
+		/// <summary>
+		/// Write committed manifest and End record, consumer takes stream as complete only after End
+		/// </summary>
+		void Finish(const std::string& manifestPath, std::size_t pageCount);
+
+	protected:
+		void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override;
+		void DropCache(bool /*wait*/) override {}
+
+	private:
+		void WriteRecord(StreamRecordType type, uint64_t first, uint64_t count, uint64_t payloadSize, hash_t root, std::size_t pageSize, std::vector<Buffer>& payload);
+
+	private:
+		int fd;
+		bool socket = false;	//written with MSG_NOSIGNAL
+		const Manifest& manifest;
+		std::vector<hash_t> hashes;
+		std::vector<Buffer> payload;
+	};
+
+	/// <summary>
+	/// Apply complete streams read from fd until its end to image file. Delta stream is applied only on top of the stream it follows,
+	/// its manifest is kept next to image as imagePath.manifest. Every page is checked against its hash before it is written
+	/// </summary>
+	/// <param name="callback">Hash of HashAlgorithm::Callback, pages are not checked without it</param>
+	void ApplyStream(int fd, const std::string& imagePath, const hash_func& callback);
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,166 @@
+#include "stats.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		uint64_t ElapsedUs(std::chrono::steady_clock::time_point start) {
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+
+		void AddSample(LatencyHistogram& histogram, uint64_t us) {
+			std::size_t bucket = 0;
+			for (uint64_t v = us; v != 0 && bucket + 1 < LatencyHistogram::BUCKETS; v >>= 1)
+				++bucket;
+			++histogram.buckets[bucket];
+			++histogram.count;
+			histogram.totalUs += us;
+			if (us > histogram.maxUs)
+				histogram.maxUs = us;
+		}
+
+		//Totals of limiters since their construction, only throttle fields are set
+		BackupStats LimiterTotals(const RateLimiter* readLimiter, const RateLimiter* writeLimiter) {
+			BackupStats totals;
+			if (readLimiter) {
+				totals.throttledReadBytes = readLimiter->Charged();
+				totals.throttleWaitUs += readLimiter->WaitedUs();
+			}
+			if (writeLimiter) {
+				totals.throttledWriteBytes = writeLimiter->Charged();
+				totals.throttleWaitUs += writeLimiter->WaitedUs();
+			}
+			return totals;
+		}
+	}
+
+	StatsRecorder::Scope::Scope(StatsRecorder* recorder, BackupPhase phase, bool batch)
+		: recorder(recorder), phase(phase), batch(batch) {
+		if (!this->recorder)
+			return;
+		if (this->recorder->trace)
+			this->recorder->trace(phase, true);
+		this->cpuStart = StatsRecorder::ThreadCpuUs();
+		this->wallStart = std::chrono::steady_clock::now();
+	}
+
+	StatsRecorder::Scope::~Scope() {
+		if (!this->recorder)
+			return;
+		const uint64_t wallUs = ElapsedUs(this->wallStart);
+		const uint64_t cpuUs = StatsRecorder::ThreadCpuUs() - this->cpuStart;
+		this->recorder->Add(this->phase, this->batch, wallUs, cpuUs);
+		if (this->recorder->trace) {
+			try {
+				this->recorder->trace(this->phase, false);
+			}
+			catch (...) {
+				//Scope may end during unwinding, trace errors are not reported
+			}
+		}
+	}
+
+	StatsRecorder::StatsRecorder(trace_func trace) : trace(std::move(trace)) {}
+
+	void StatsRecorder::Start() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats = BackupStats();
+		this->started = std::chrono::steady_clock::now();
+		this->running = true;
+		this->limiterBase = LimiterTotals(this->readLimiter, this->writeLimiter);
+	}
+
+	void StatsRecorder::Watch(const RateLimiter* readLimiter, const RateLimiter* writeLimiter) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->readLimiter = readLimiter;
+		this->writeLimiter = writeLimiter;
+	}
+
+	void StatsRecorder::Stop() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->running)
+			this->stats.durationUs = ElapsedUs(this->started);
+		this->running = false;
+	}
+
+	BackupStats StatsRecorder::Get() const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		BackupStats stats = this->stats;
+		if (this->running)
+			stats.durationUs = ElapsedUs(this->started);
+		const BackupStats totals = LimiterTotals(this->readLimiter, this->writeLimiter);
+		stats.throttledReadBytes = totals.throttledReadBytes - this->limiterBase.throttledReadBytes;
+		stats.throttledWriteBytes = totals.throttledWriteBytes - this->limiterBase.throttledWriteBytes;
+		stats.throttleWaitUs = totals.throttleWaitUs - this->limiterBase.throttleWaitUs;
+		return stats;
+	}
+
+	void StatsRecorder::AddRead(std::size_t pages, std::size_t bytes) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats.pagesScanned += pages;
+		this->stats.bytesRead += bytes;
+		++this->stats.batches;
+	}
+
+	void StatsRecorder::AddWritten(std::size_t pages, std::size_t bytes) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats.pagesDirty += pages;
+		this->stats.bytesWritten += bytes;
+	}
+
+	void StatsRecorder::AddRestored(std::size_t pages) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats.pagesRestored += pages;
+	}
+
+	void StatsRecorder::AddFree(std::size_t pages) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats.pagesFree += pages;
+	}
+
+	void StatsRecorder::Add(BackupPhase phase, bool batch, uint64_t wallUs, uint64_t cpuUs) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		PhaseTime& time = this->stats.phases[static_cast<std::size_t>(phase)];
+		time.wallUs += wallUs;
+		time.cpuUs += cpuUs;
+		++time.calls;
+		if (!batch)
+			return;
+		switch (phase) {
+		case BackupPhase::Read:
+			AddSample(this->stats.batchRead, wallUs);
+			break;
+		case BackupPhase::Hash:
+			AddSample(this->stats.batchHash, wallUs);
+			break;
+		case BackupPhase::Write:
+			AddSample(this->stats.batchWrite, wallUs);
+			break;
+		default:
+			break;
+		}
+	}
+
+	uint64_t StatsRecorder::ThreadCpuUs() {
+#ifdef _WIN32
+		FILETIME creation, exit, kernel, user;
+		if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+			return 0;
+		//100 ns units
+		const uint64_t k = (uint64_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+		const uint64_t u = (uint64_t(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+		return (k + u) / 10;
+#else
+		timespec ts = {};
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+			return 0;
+		return uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+#endif
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+#include "api.h"
+#include "throttle.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Thread-safe collector of BackupStats, phases are timed by Scope objects on the threads running them
+	/// </summary>
+	class StatsRecorder {
+	public:
+		using trace_func = std::function<void(BackupPhase, bool)>;
+
+		/// <summary>
+		/// Times phase from construction to destruction and calls trace at both ends, recorder may be nullptr
+		/// </summary>
+		class Scope {
+		public:
+			/// <param name="batch">Latency is also added to batch histogram of Read, Hash or Write phase</param>
+			Scope(StatsRecorder* recorder, BackupPhase phase, bool batch = false);
+			~Scope();
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+
+		private:
+			StatsRecorder* recorder;
+			BackupPhase phase;
+			bool batch;
+			std::chrono::steady_clock::time_point wallStart;
+			uint64_t cpuStart = 0;
+		};
+
+		explicit StatsRecorder(trace_func trace = trace_func());
+
+		/// <summary>
+		/// Start timing of the whole call, durationUs runs until Stop or until Get if not stopped
+		/// </summary>
+		void Start();
+		void Stop();
+		BackupStats Get() const;
+
+		/// <summary>
+		/// Report bytes charged to read and write limiters since Start, limiters must outlive recorder
+		/// </summary>
+		void Watch(const RateLimiter* readLimiter, const RateLimiter* writeLimiter);
+
+		void AddRead(std::size_t pages, std::size_t bytes);
+		void AddWritten(std::size_t pages, std::size_t bytes);
+		void AddRestored(std::size_t pages);
+		void AddFree(std::size_t pages);
+
+	private:
+		void Add(BackupPhase phase, bool batch, uint64_t wallUs, uint64_t cpuUs);
+		static uint64_t ThreadCpuUs();
+
+	private:
+		mutable std::mutex mutex;
+		BackupStats stats;
+		trace_func trace;
+		std::chrono::steady_clock::time_point started;
+		bool running = false;
+		const RateLimiter* readLimiter = nullptr;
+		const RateLimiter* writeLimiter = nullptr;
+		BackupStats limiterBase;	//limiter totals at Start
+	};
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,94 @@
+#include "throttle.h"
+
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const double THROTTLE_BURST_SEC = 0.25;
+	}
+
+	bool tools::DropCache(const std::string& path, bool wait) {
+#if defined(__linux__) && defined(POSIX_FADV_DONTNEED)
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		bool dropped = true;
+		if (wait)
+			dropped = ::fdatasync(fd) == 0;
+		//Dirty pages are skipped by DONTNEED, they are dropped by the next call after writeback started here
+		dropped = dropped && ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+#ifdef SYNC_FILE_RANGE_WRITE
+		if (!wait)
+			::sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+		::close(fd);
+		return dropped;
+#else
+		return false;
+#endif
+	}
+
+	bool tools::SyncFile(const std::string& path) {
+#ifdef __linux__
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		const bool synced = ::fsync(fd) == 0;
+		::close(fd);
+		return synced;
+#elif defined(_WIN32)
+		//Flush of file buffers needs a handle with write access
+		const int fd = ::_open(path.c_str(), _O_WRONLY | _O_BINARY);
+		if (fd < 0)
+			return false;
+		const bool synced = ::_commit(fd) == 0;
+		::_close(fd);
+		return synced;
+#else
+		return true;
+#endif
+	}
+
+	RateLimiter::RateLimiter(uint64_t bytesPerSec)
+		: bytesPerSec(bytesPerSec), burst(static_cast<double>(bytesPerSec) * THROTTLE_BURST_SEC), tokens(burst), refilled(std::chrono::steady_clock::now()) {}
+
+	void RateLimiter::Acquire(std::size_t bytes) {
+		if (this->bytesPerSec == 0 || bytes == 0)
+			return;
+		std::chrono::steady_clock::duration wait;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			const auto now = std::chrono::steady_clock::now();
+			const double elapsed = std::chrono::duration<double>(now - this->refilled).count();
+			this->refilled = now;
+			this->tokens = std::min(this->burst, this->tokens + elapsed * this->bytesPerSec);
+			this->tokens -= static_cast<double>(bytes);
+			this->charged += bytes;
+			if (this->tokens >= 0)
+				return;
+			//Debt is repaid by sleeping, later callers queue behind it
+			wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-this->tokens / this->bytesPerSec));
+			this->waitedUs += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(wait).count());
+		}
+		std::this_thread::sleep_for(wait);
+	}
+
+	uint64_t RateLimiter::Charged() const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->charged;
+	}
+
+	uint64_t RateLimiter::WaitedUs() const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->waitedUs;
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace sqlite3_inc_bkp {
+	namespace tools {
+		/// <summary>
+		/// Drop cached pages of file from OS page cache. Without wait only pages already written back are dropped and writeback of
+		/// the others is started, with wait file is synced first. Returns false if platform can not drop cache (Linux only)
+		/// </summary>
+		bool DropCache(const std::string& path, bool wait);
+
+		/// <summary>
+		/// Write file data and metadata through to storage, false on error
+		/// </summary>
+		bool SyncFile(const std::string& path);
+	}
+
+	/// <summary>
+	/// Thread-safe token bucket limiting bytes per second, bucket holds a quarter of second of tokens.
+	/// Request larger than the bucket leaves it in debt, the caller sleeps until the debt is repaid
+	/// </summary>
+	class RateLimiter {
+	public:
+		/// <param name="bytesPerSec">0 - unlimited</param>
+		explicit RateLimiter(uint64_t bytesPerSec = 0);
+		RateLimiter(const RateLimiter&) = delete;
+		RateLimiter& operator=(const RateLimiter&) = delete;
+
+		/// <summary>
+		/// Take tokens for bytes, sleeps until the bucket is not in debt
+		/// </summary>
+		void Acquire(std::size_t bytes);
+
+		/// <summary>
+		/// Bytes taken from limited bucket since construction, unlimited limiter takes none
+		/// </summary>
+		uint64_t Charged() const;
+
+		/// <summary>
+		/// Time callers slept repaying debt since construction
+		/// </summary>
+		uint64_t WaitedUs() const;
+
+	private:
+		uint64_t bytesPerSec;
+		double burst;
+		mutable std::mutex mutex;
+		double tokens;
+		std::chrono::steady_clock::time_point refilled;
+		uint64_t charged = 0;
+		uint64_t waitedUs = 0;
+	};
+}//namespace sqlite3_inc_bkp
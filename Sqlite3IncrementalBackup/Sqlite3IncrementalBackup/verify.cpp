@@ -0,0 +1,179 @@
+#include "verify.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "exception.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		/// <summary>
+		/// Read only mapping of whole file, empty file is not mapped
+		/// </summary>
+		struct MappedFile {
+			std::unique_ptr<boost::interprocess::file_mapping> mapping;
+			std::unique_ptr<boost::interprocess::mapped_region> region;
+
+			inline const char* data() const { return region ? static_cast<const char*>(region->get_address()) : nullptr; }
+			inline std::size_t size() const { return region ? region->get_size() : 0; }
+		};
+	}
+
+	ImageVerifier::ImageVerifier(const PageHasher& hasher, unsigned threads, std::size_t blockPages, RateLimiter* limiter, bool dropBehind)
+		: hasher(hasher), threads(threads), blockPages(blockPages ? blockPages : 1), limiter(limiter), dropBehind(dropBehind) {
+		if (this->threads == 0)
+			this->threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	void ImageVerifier::Run(const Manifest& manifest, const ImageLayout& layout, std::size_t first, std::size_t count, VerifyResult& result) const {
+		using namespace boost::interprocess;
+		std::vector<MappedFile> files(layout.files.size());
+		for (std::size_t i = 0; i < files.size(); ++i) {
+			if (boost::filesystem::file_size(layout.files[i]) == 0)
+				continue;
+			try {
+				files[i].mapping = std::make_unique<file_mapping>(layout.files[i].c_str(), read_only);
+				files[i].region = std::make_unique<mapped_region>(*files[i].mapping, read_only);
+			}
+			catch (const interprocess_exception& e) {
+				throw BackupException(tools::FormatString::format("Could not map backup file [%s] : %s", layout.files[i].c_str(), e.what()).c_str(), BackupException::Error::BackupLoad);
+			}
+#ifdef __linux__
+			//Base image is read front to back, readahead of segments is left to the kernel
+			if (i == 0)
+				::madvise(files[i].region->get_address(), files[i].region->get_size(), MADV_SEQUENTIAL);
+#endif
+		}
+
+		const std::size_t pageSize = layout.pageSize;
+		//Blocks of extent backup hold whole extents, first is on extent boundary
+		const std::size_t extentPages = manifest.ExtentPages();
+		const std::size_t blockPages = (this->blockPages + extentPages - 1) / extentPages * extentPages;
+		const std::size_t blocks = (count + blockPages - 1) / blockPages;
+		std::atomic<std::size_t> nextBlock(0);
+		std::atomic<uint64_t> checked(0), skipped(0);
+		std::mutex mutex;
+		std::vector<std::size_t> mismatched;
+		std::exception_ptr error;
+
+		auto worker = [&] {
+			std::vector<std::size_t> bad;
+			std::vector<hash_t> hashes(blockPages);
+			std::vector<char> extent;
+			try {
+				for (std::size_t block = nextBlock++; block < blocks; block = nextBlock++) {
+					const std::size_t begin = first + block * blockPages;
+					const std::size_t end = std::min(first + count, begin + blockPages);
+					if (extentPages > 1) {
+						for (std::size_t pgno = begin; pgno < end; pgno += extentPages) {
+							const std::size_t last = std::min(end, pgno + extentPages);
+							if (manifest.Get(pgno) == 0) {
+								skipped += last - pgno;
+								continue;
+							}
+							//Pages of extent may be spread over base image and segments, they are gathered into one buffer
+							extent.resize((last - pgno) * pageSize);
+							bool present = true;
+							for (std::size_t p = pgno; p < last && present; ++p) {
+								const auto location = p <= layout.pages.size() ? layout.pages[p - 1] : std::make_pair(0u, 0u);
+								const uint64_t offset = static_cast<uint64_t>(location.second) * pageSize;
+								present = p <= layout.pages.size() && offset + pageSize <= files[location.first].size();
+								if (present)
+									std::memcpy(extent.data() + (p - pgno) * pageSize, files[location.first].data() + offset, pageSize);
+							}
+							if (present && this->limiter)
+								this->limiter->Acquire(extent.size());
+							if (!present || this->hasher.single(extent.data(), extent.size()) != manifest.Get(pgno)) {
+								for (std::size_t p = pgno; p < last; ++p)
+									bad.push_back(p);
+							}
+							if (present)
+								checked += last - pgno;
+						}
+						continue;
+					}
+					std::size_t pgno = begin;
+					while (pgno < end) {
+						if (manifest.Get(pgno) == 0) {
+							++skipped;
+							++pgno;
+							continue;
+						}
+						//Run of hashed pages stored in consecutive slots of one file
+						const auto location = pgno <= layout.pages.size() ? layout.pages[pgno - 1] : std::make_pair(0u, 0u);
+						const MappedFile& file = files[location.first];
+						const uint64_t offset = static_cast<uint64_t>(location.second) * pageSize;
+						if (pgno > layout.pages.size() || offset + pageSize > file.size()) {
+							bad.push_back(pgno++);
+							continue;
+						}
+						std::size_t run = 1;
+						while (pgno + run < end && pgno + run <= layout.pages.size() && manifest.Get(pgno + run) != 0
+							&& layout.pages[pgno + run - 1] == std::make_pair(location.first, location.second + static_cast<uint32_t>(run))
+							&& offset + (run + 1) * pageSize <= file.size())
+							++run;
+						if (this->limiter)
+							this->limiter->Acquire(run * pageSize);
+						this->hasher.batch(file.data() + offset, pageSize, run, hashes.data());
+						for (std::size_t i = 0; i < run; ++i) {
+							if (hashes[i] != manifest.Get(pgno + i))
+								bad.push_back(pgno + i);
+						}
+						checked += run;
+						pgno += run;
+					}
+				}
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+				nextBlock = blocks;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			mismatched.insert(mismatched.end(), bad.begin(), bad.end());
+		};
+
+		std::vector<std::thread> workers;
+		for (unsigned t = 1; t < std::min<std::size_t>(this->threads, blocks); ++t)
+			workers.emplace_back(worker);
+		worker();
+		for (auto& thread : workers)
+			thread.join();
+
+		if (this->dropBehind) {
+			for (std::size_t i = 0; i < files.size(); ++i) {
+#ifdef __linux__
+				if (files[i].region)
+					::madvise(files[i].region->get_address(), files[i].region->get_size(), MADV_DONTNEED);
+#endif
+				files[i].region.reset();
+				tools::DropCache(layout.files[i], false);
+			}
+		}
+		if (error)
+			std::rethrow_exception(error);
+
+		result.pagesChecked += checked;
+		result.pagesSkipped += skipped;
+		std::sort(mismatched.begin(), mismatched.end());
+		for (std::size_t pgno : mismatched) {
+			if (!result.mismatched.empty() && result.mismatched.back().first + result.mismatched.back().count == pgno)
+				++result.mismatched.back().count;
+			else
+				result.mismatched.push_back({ pgno, 1 });
+		}
+	}
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+#include "generation.h"
+#include "hasher.h"
+#include "manifest.h"
+#include "throttle.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Checker of backup image pages against manifest hashes. Files of image are mapped read only and pages are hashed in place,
+	/// threads take blocks of the checked range one at a time
+	/// </summary>
+	class ImageVerifier {
+	public:
+		/// <param name="threads">Number of hashing threads, 0 - number of hardware threads</param>
+		/// <param name="blockPages">Pages of one block, contiguous pages of one file in a block are hashed by one batch call</param>
+		/// <param name="limiter">Throttle of bytes hashed, may be nullptr</param>
+		/// <param name="dropBehind">Drop mapped files from OS page cache when check is done</param>
+		ImageVerifier(const PageHasher& hasher, unsigned threads, std::size_t blockPages, RateLimiter* limiter, bool dropBehind);
+
+		/// <summary>
+		/// Check count pages from page first, pages of zero manifest hash are skipped. Pages missing in image do not match.
+		/// Extents of several pages are hashed whole, first must be the first page of an extent
+		/// </summary>
+		void Run(const Manifest& manifest, const ImageLayout& layout, std::size_t first, std::size_t count, VerifyResult& result) const;
+
+	private:
+		PageHasher hasher;
+		unsigned threads;
+		std::size_t blockPages;
+		RateLimiter* limiter;
+		bool dropBehind;
+	};
+}//namespace sqlite3_inc_bkp
@@ -0,0 +1,506 @@
+#include "vfs.h"
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+
+#include <boost/filesystem.hpp>
+#include <sqlite3.h>
+#include "exception.h"
+#include "throttle.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t DIRTY_MAGIC = 0x444B4249; //IBKD
+		const uint32_t DIRTY_VERSION = 1;
+		const std::size_t DIRTY_HEADER_SIZE = 24;
+
+		std::mutex g_registryMutex;
+		std::map<std::string, std::shared_ptr<DirtyPageTracker>> g_trackers;
+
+		inline uint32_t GetBigEndian32(const void* data) {
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+			return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+		}
+	}
+
+	std::shared_ptr<DirtyPageTracker> DirtyPageTracker::Find(const std::string& dbPath) {
+		std::lock_guard<std::mutex> lock(g_registryMutex);
+		auto it = g_trackers.find(dbPath);
+		return it == g_trackers.end() ? nullptr : it->second;
+	}
+
+	std::shared_ptr<DirtyPageTracker> DirtyPageTracker::Get(const std::string& dbPath) {
+		std::lock_guard<std::mutex> lock(g_registryMutex);
+		auto& tracker = g_trackers[dbPath];
+		if (!tracker)
+			tracker = std::make_shared<DirtyPageTracker>();
+		return tracker;
+	}
+
+	void DirtyPageTracker::MarkPages(std::size_t first, std::size_t last) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (std::size_t pgno = first; pgno <= last; ++pgno) {
+			const std::size_t word = pgno / 64;
+			const uint64_t bit = uint64_t(1) << (pgno % 64);
+			if (word >= this->bits.size()) {
+				this->bits.resize(word + 1, 0);
+				this->rewrite = true;
+			}
+			if (!(this->bits[word] & bit)) {
+				this->bits[word] |= bit;
+				if (!this->rewrite)
+					this->pendingWords.insert(word);
+			}
+		}
+		for (auto& watch : this->watches) {
+			for (std::size_t pgno = first; pgno <= last; ++pgno)
+				watch.second.insert(pgno);
+		}
+	}
+
+	void DirtyPageTracker::SetPageSize(std::size_t size) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->pageSize = size;
+	}
+
+	std::size_t DirtyPageTracker::GetPageSize() const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->pageSize;
+	}
+
+	void DirtyPageTracker::Bind(const std::string& path) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		bool loaded = false;
+		std::ifstream fDirty(path, std::ios::binary);
+		if (fDirty.is_open()) {
+			uint32_t magic = 0, version = 0;
+			uint64_t generation = 0, words = 0;
+			fDirty.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+			fDirty.read(reinterpret_cast<char*>(&version), sizeof(version));
+			fDirty.read(reinterpret_cast<char*>(&generation), sizeof(generation));
+			fDirty.read(reinterpret_cast<char*>(&words), sizeof(words));
+			if (fDirty && magic == DIRTY_MAGIC && version == DIRTY_VERSION) {
+				std::vector<uint64_t> stored(static_cast<std::size_t>(words));
+				if (fDirty.read(reinterpret_cast<char*>(stored.data()), stored.size() * sizeof(uint64_t))) {
+					if (this->bits.size() < stored.size())
+						this->bits.resize(stored.size(), 0);
+					for (std::size_t i = 0; i < stored.size(); ++i)
+						this->bits[i] |= stored[i];
+					this->generation = generation;
+					loaded = true;
+				}
+			}
+		}
+		fDirty.close();
+
+		if (!loaded) {
+			//Unknown history, a fresh random generation never matches an old backup
+			std::random_device rd;
+			this->generation = (uint64_t(rd()) << 32) | rd();
+		}
+		this->path = path;
+		this->rewrite = true;
+		this->WriteFile();
+	}
+
+	bool DirtyPageTracker::IsBoundTo(const std::string& path) const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return !this->path.empty() && boost::filesystem::path(this->path) == boost::filesystem::path(path);
+	}
+
+	void DirtyPageTracker::Persist() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->path.empty())
+			return;
+		if (this->rewrite) {
+			this->WriteFile();
+			return;
+		}
+		if (this->pendingWords.empty())
+			return;
+		std::fstream fDirty(this->path, std::ios::in | std::ios::out | std::ios::binary);
+		for (std::size_t word : this->pendingWords) {
+			fDirty.seekp(DIRTY_HEADER_SIZE + word * sizeof(uint64_t));
+			fDirty.write(reinterpret_cast<const char*>(&this->bits[word]), sizeof(uint64_t));
+		}
+		fDirty.close();
+		this->pendingWords.clear();
+		//Bitmap is durable before the database sync it precedes, otherwise a crash loses pages the next backup must copy
+		if (!tools::SyncFile(this->path)) {
+			throw BackupException(tools::FormatString::format("Dirty pages file [%s] sync error", this->path.c_str()).c_str(), BackupException::Error::Tracking);
+		}
+	}
+
+	uint64_t DirtyPageTracker::Swap(std::set<std::size_t>& pages) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->CollectPages(pages);
+		this->bits.clear();
+		const uint64_t swapped = this->generation++;
+		this->rewrite = true;
+		if (!this->path.empty())
+			this->WriteFile();
+		return swapped;
+	}
+
+	void DirtyPageTracker::Peek(std::set<std::size_t>& pages) const {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->CollectPages(pages);
+	}
+
+	uint64_t DirtyPageTracker::Watch() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		const uint64_t watch = this->nextWatch++;
+		this->watches[watch];
+		return watch;
+	}
+
+	void DirtyPageTracker::CollectWatched(uint64_t watch, std::set<std::size_t>& pages) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto it = this->watches.find(watch);
+		if (it == this->watches.end())
+			return;
+		pages.insert(it->second.begin(), it->second.end());
+		it->second.clear();
+	}
+
+	void DirtyPageTracker::Unwatch(uint64_t watch) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->watches.erase(watch);
+	}
+
+	void DirtyPageTracker::CollectPages(std::set<std::size_t>& pages) const {
+		for (std::size_t word = 0; word < this->bits.size(); ++word) {
+			if (!this->bits[word])
+				continue;
+			for (std::size_t bit = 0; bit < 64; ++bit) {
+				if (this->bits[word] & (uint64_t(1) << bit))
+					pages.insert(word * 64 + bit);
+			}
+		}
+	}
+
+	void DirtyPageTracker::WriteFile() {
+		std::ofstream fDirty(this->path, std::ios::binary | std::ios::trunc);
+		const uint64_t words = this->bits.size();
+		fDirty.write(reinterpret_cast<const char*>(&DIRTY_MAGIC), sizeof(DIRTY_MAGIC));
+		fDirty.write(reinterpret_cast<const char*>(&DIRTY_VERSION), sizeof(DIRTY_VERSION));
+		fDirty.write(reinterpret_cast<const char*>(&this->generation), sizeof(this->generation));
+		fDirty.write(reinterpret_cast<const char*>(&words), sizeof(words));
+		fDirty.write(reinterpret_cast<const char*>(this->bits.data()), this->bits.size() * sizeof(uint64_t));
+		fDirty.close();
+		this->pendingWords.clear();
+		this->rewrite = false;
+		if (!tools::SyncFile(this->path)) {
+			throw BackupException(tools::FormatString::format("Dirty pages file [%s] sync error", this->path.c_str()).c_str(), BackupException::Error::Tracking);
+		}
+	}
+
+	namespace {
+		/// <summary>
+		/// sqlite3_file of tracking VFS, file of wrapped VFS is allocated right after it
+		/// </summary>
+		struct TrackingFile {
+			sqlite3_file base;
+			sqlite3_file* real;
+			DirtyPageTracker* tracker;
+			bool wal;
+		};
+
+		inline sqlite3_file* Real(sqlite3_file* f) {
+			return reinterpret_cast<TrackingFile*>(f)->real;
+		}
+
+		inline sqlite3_vfs* RealVfs(sqlite3_vfs* vfs) {
+			return reinterpret_cast<sqlite3_vfs*>(vfs->pAppData);
+		}
+
+		void TrackDbWrite(DirtyPageTracker* tracker, int amt, sqlite3_int64 ofst) {
+			std::size_t pageSize = tracker->GetPageSize();
+			if (amt >= 512 && (amt & (amt - 1)) == 0 && ofst % amt == 0 && static_cast<std::size_t>(amt) != pageSize) {
+				pageSize = amt;
+				tracker->SetPageSize(pageSize);
+			}
+			if (pageSize == 0 || amt <= 0)
+				return;
+			tracker->MarkPages(static_cast<std::size_t>(ofst) / pageSize + 1, static_cast<std::size_t>(ofst + amt - 1) / pageSize + 1);
+		}
+
+		void TrackWalWrite(DirtyPageTracker* tracker, const void* buf, int amt, sqlite3_int64 ofst) {
+			if (ofst == 0 && amt >= 32) {
+				const uint32_t pageSize = GetBigEndian32(reinterpret_cast<const char*>(buf) + 8);
+				tracker->SetPageSize(pageSize == 1 ? 0x10000 : pageSize);
+				return;
+			}
+			//Frame header is written separately from page data, it starts with page number
+			const std::size_t pageSize = tracker->GetPageSize();
+			if (amt == 24 && ofst >= 32 && pageSize && (static_cast<std::size_t>(ofst) - 32) % (pageSize + 24) == 0) {
+				const std::size_t pgno = GetBigEndian32(buf);
+				tracker->MarkPages(pgno, pgno);
+			}
+		}
+
+		int xClose(sqlite3_file* f) {
+			TrackingFile* p = reinterpret_cast<TrackingFile*>(f);
+			try {
+				if (p->tracker)
+					p->tracker->Persist();
+			}
+			catch (const std::exception&) {
+				//Pages stay in memory bitmap and are persisted by the next sync of database
+			}
+			return p->real->pMethods ? p->real->pMethods->xClose(p->real) : SQLITE_OK;
+		}
+
+		int xRead(sqlite3_file* f, void* buf, int amt, sqlite3_int64 ofst) {
+			return Real(f)->pMethods->xRead(Real(f), buf, amt, ofst);
+		}
+
+		int xWrite(sqlite3_file* f, const void* buf, int amt, sqlite3_int64 ofst) {
+			TrackingFile* p = reinterpret_cast<TrackingFile*>(f);
+			int rc = p->real->pMethods->xWrite(p->real, buf, amt, ofst);
+			if (rc == SQLITE_OK && p->tracker) {
+				if (p->wal)
+					TrackWalWrite(p->tracker, buf, amt, ofst);
+				else
+					TrackDbWrite(p->tracker, amt, ofst);
+			}
+			return rc;
+		}
+
+		int xTruncate(sqlite3_file* f, sqlite3_int64 size) {
+			return Real(f)->pMethods->xTruncate(Real(f), size);
+		}
+
+		int xSync(sqlite3_file* f, int flags) {
+			//Bitmap goes to disk before the pages it describes become durable, database is not synced if it can not
+			TrackingFile* p = reinterpret_cast<TrackingFile*>(f);
+			try {
+				if (p->tracker)
+					p->tracker->Persist();
+			}
+			catch (const std::exception&) {
+				return SQLITE_IOERR_FSYNC;
+			}
+			return p->real->pMethods->xSync(p->real, flags);
+		}
+
+		int xFileSize(sqlite3_file* f, sqlite3_int64* size) {
+			return Real(f)->pMethods->xFileSize(Real(f), size);
+		}
+
+		int xLock(sqlite3_file* f, int lock) {
+			return Real(f)->pMethods->xLock(Real(f), lock);
+		}
+
+		int xUnlock(sqlite3_file* f, int lock) {
+			return Real(f)->pMethods->xUnlock(Real(f), lock);
+		}
+
+		int xCheckReservedLock(sqlite3_file* f, int* out) {
+			return Real(f)->pMethods->xCheckReservedLock(Real(f), out);
+		}
+
+		int xFileControl(sqlite3_file* f, int op, void* arg) {
+			return Real(f)->pMethods->xFileControl(Real(f), op, arg);
+		}
+
+		int xSectorSize(sqlite3_file* f) {
+			return Real(f)->pMethods->xSectorSize(Real(f));
+		}
+
+		int xDeviceCharacteristics(sqlite3_file* f) {
+			return Real(f)->pMethods->xDeviceCharacteristics(Real(f));
+		}
+
+		int xShmMap(sqlite3_file* f, int region, int size, int extend, void volatile** out) {
+			return Real(f)->pMethods->xShmMap(Real(f), region, size, extend, out);
+		}
+
+		int xShmLock(sqlite3_file* f, int offset, int n, int flags) {
+			return Real(f)->pMethods->xShmLock(Real(f), offset, n, flags);
+		}
+
+		void xShmBarrier(sqlite3_file* f) {
+			Real(f)->pMethods->xShmBarrier(Real(f));
+		}
+
+		int xShmUnmap(sqlite3_file* f, int deleteFlag) {
+			return Real(f)->pMethods->xShmUnmap(Real(f), deleteFlag);
+		}
+
+		int xFetch(sqlite3_file* f, sqlite3_int64 ofst, int amt, void** out) {
+			return Real(f)->pMethods->xFetch(Real(f), ofst, amt, out);
+		}
+
+		int xUnfetch(sqlite3_file* f, sqlite3_int64 ofst, void* data) {
+			return Real(f)->pMethods->xUnfetch(Real(f), ofst, data);
+		}
+
+		sqlite3_io_methods MakeMethods(int version) {
+			sqlite3_io_methods methods;
+			std::memset(&methods, 0, sizeof(methods));
+			methods.iVersion = version;
+			methods.xClose = xClose;
+			methods.xRead = xRead;
+			methods.xWrite = xWrite;
+			methods.xTruncate = xTruncate;
+			methods.xSync = xSync;
+			methods.xFileSize = xFileSize;
+			methods.xLock = xLock;
+			methods.xUnlock = xUnlock;
+			methods.xCheckReservedLock = xCheckReservedLock;
+			methods.xFileControl = xFileControl;
+			methods.xSectorSize = xSectorSize;
+			methods.xDeviceCharacteristics = xDeviceCharacteristics;
+			if (version >= 2) {
+				methods.xShmMap = xShmMap;
+				methods.xShmLock = xShmLock;
+				methods.xShmBarrier = xShmBarrier;
+				methods.xShmUnmap = xShmUnmap;
+			}
+			if (version >= 3) {
+				methods.xFetch = xFetch;
+				methods.xUnfetch = xUnfetch;
+			}
+			return methods;
+		}
+
+		//Wrapped file exposes no more methods than the real one has
+		const sqlite3_io_methods g_methods[3] = { MakeMethods(1), MakeMethods(2), MakeMethods(3) };
+
+		int xOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* f, int flags, int* outFlags) {
+			TrackingFile* p = reinterpret_cast<TrackingFile*>(f);
+			p->real = reinterpret_cast<sqlite3_file*>(p + 1);
+			p->tracker = nullptr;
+			p->wal = false;
+			int rc = RealVfs(vfs)->xOpen(RealVfs(vfs), name, p->real, flags, outFlags);
+			if (p->real->pMethods) {
+				const int version = std::min(std::max(p->real->pMethods->iVersion, 1), 3);
+				p->base.pMethods = &g_methods[version - 1];
+			}
+			else {
+				p->base.pMethods = nullptr;
+			}
+			if (rc == SQLITE_OK && name) {
+				if (flags & SQLITE_OPEN_MAIN_DB) {
+					p->tracker = DirtyPageTracker::Get(name).get();
+				}
+				else if (flags & SQLITE_OPEN_WAL) {
+					const std::size_t length = std::strlen(name);
+					if (length > 4 && std::strcmp(name + length - 4, "-wal") == 0) {
+						p->tracker = DirtyPageTracker::Get(std::string(name, length - 4)).get();
+						p->wal = true;
+					}
+				}
+			}
+			return rc;
+		}
+
+		int xDelete(sqlite3_vfs* vfs, const char* name, int syncDir) {
+			return RealVfs(vfs)->xDelete(RealVfs(vfs), name, syncDir);
+		}
+
+		int xAccess(sqlite3_vfs* vfs, const char* name, int flags, int* out) {
+			return RealVfs(vfs)->xAccess(RealVfs(vfs), name, flags, out);
+		}
+
+		int xFullPathname(sqlite3_vfs* vfs, const char* name, int size, char* out) {
+			return RealVfs(vfs)->xFullPathname(RealVfs(vfs), name, size, out);
+		}
+
+		void* xDlOpen(sqlite3_vfs* vfs, const char* name) {
+			return RealVfs(vfs)->xDlOpen(RealVfs(vfs), name);
+		}
+
+		void xDlError(sqlite3_vfs* vfs, int size, char* out) {
+			RealVfs(vfs)->xDlError(RealVfs(vfs), size, out);
+		}
+
+		void (*xDlSym(sqlite3_vfs* vfs, void* handle, const char* symbol))(void) {
+			return RealVfs(vfs)->xDlSym(RealVfs(vfs), handle, symbol);
+		}
+
+		void xDlClose(sqlite3_vfs* vfs, void* handle) {
+			RealVfs(vfs)->xDlClose(RealVfs(vfs), handle);
+		}
+
+		int xRandomness(sqlite3_vfs* vfs, int size, char* out) {
+			return RealVfs(vfs)->xRandomness(RealVfs(vfs), size, out);
+		}
+
+		int xSleep(sqlite3_vfs* vfs, int microseconds) {
+			return RealVfs(vfs)->xSleep(RealVfs(vfs), microseconds);
+		}
+
+		int xCurrentTime(sqlite3_vfs* vfs, double* out) {
+			return RealVfs(vfs)->xCurrentTime(RealVfs(vfs), out);
+		}
+
+		int xGetLastError(sqlite3_vfs* vfs, int size, char* out) {
+			return RealVfs(vfs)->xGetLastError ? RealVfs(vfs)->xGetLastError(RealVfs(vfs), size, out) : 0;
+		}
+
+		int xCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* out) {
+			return RealVfs(vfs)->xCurrentTimeInt64(RealVfs(vfs), out);
+		}
+
+		int xSetSystemCall(sqlite3_vfs* vfs, const char* name, sqlite3_syscall_ptr call) {
+			return RealVfs(vfs)->xSetSystemCall(RealVfs(vfs), name, call);
+		}
+
+		sqlite3_syscall_ptr xGetSystemCall(sqlite3_vfs* vfs, const char* name) {
+			return RealVfs(vfs)->xGetSystemCall(RealVfs(vfs), name);
+		}
+
+		const char* xNextSystemCall(sqlite3_vfs* vfs, const char* name) {
+			return RealVfs(vfs)->xNextSystemCall(RealVfs(vfs), name);
+		}
+
+		std::map<std::string, std::unique_ptr<sqlite3_vfs>> g_vfs;
+	}
+
+	void RegisterTrackingVfs(const char* vfsName, bool makeDefault) {
+		std::lock_guard<std::mutex> lock(g_registryMutex);
+		auto& vfs = g_vfs[vfsName];
+		if (!vfs) {
+			sqlite3_vfs* real = sqlite3_vfs_find(nullptr);
+			if (real == nullptr)
+				throw BackupException("No default sqlite3 VFS", BackupException::Error::Tracking);
+			if (real->xOpen == xOpen)
+				real = RealVfs(real);
+
+			vfs = std::make_unique<sqlite3_vfs>();
+			std::memset(vfs.get(), 0, sizeof(sqlite3_vfs));
+			vfs->iVersion = std::min(real->iVersion, 3);
+			vfs->szOsFile = static_cast<int>(sizeof(TrackingFile)) + real->szOsFile;
+			vfs->mxPathname = real->mxPathname;
+			vfs->zName = g_vfs.find(vfsName)->first.c_str();
+			vfs->pAppData = real;
+			vfs->xOpen = xOpen;
+			vfs->xDelete = xDelete;
+			vfs->xAccess = xAccess;
+			vfs->xFullPathname = xFullPathname;
+			vfs->xDlOpen = real->xDlOpen ? xDlOpen : nullptr;
+			vfs->xDlError = real->xDlError ? xDlError : nullptr;
+			vfs->xDlSym = real->xDlSym ? xDlSym : nullptr;
+			vfs->xDlClose = real->xDlClose ? xDlClose : nullptr;
+			vfs->xRandomness = xRandomness;
+			vfs->xSleep = xSleep;
+			vfs->xCurrentTime = xCurrentTime;
+			vfs->xGetLastError = xGetLastError;
+			if (vfs->iVersion >= 2)
+				vfs->xCurrentTimeInt64 = xCurrentTimeInt64;
+			if (vfs->iVersion >= 3) {
+				vfs->xSetSystemCall = xSetSystemCall;
+				vfs->xGetSystemCall = xGetSystemCall;
+				vfs->xNextSystemCall = xNextSystemCall;
+			}
+		}
+		int rc = sqlite3_vfs_register(vfs.get(), makeDefault ? 1 : 0);
+		if (rc != SQLITE_OK) {
+			throw BackupException(tools::FormatString::format("sqlite3 VFS register error: (%d) %s", rc, sqlite3_errstr(rc)).c_str(), BackupException::Error::Tracking);
+		}
+	}
+}//namespace sqlite3_inc_bkp
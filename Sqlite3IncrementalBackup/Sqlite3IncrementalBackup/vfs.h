@@ -0,0 +1,78 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Bitmap of pages written to one database file since the tracker generation started
+	/// </summary>
+	class DirtyPageTracker {
+	public:
+		/// <summary>
+		/// Tracker of database file opened through tracking VFS, nullptr if database is not tracked
+		/// </summary>
+		static std::shared_ptr<DirtyPageTracker> Find(const std::string& dbPath);
+		static std::shared_ptr<DirtyPageTracker> Get(const std::string& dbPath);
+
+		void MarkPages(std::size_t first, std::size_t last);
+		void SetPageSize(std::size_t size);
+		std::size_t GetPageSize() const;
+
+		/// <summary>
+		/// Persist bitmap to path and sync it on every sync of database, bitmap already stored in path is merged in
+		/// </summary>
+		void Bind(const std::string& path);
+		bool IsBoundTo(const std::string& path) const;
+		void Persist();
+
+		/// <summary>
+		/// Move pages of current generation to output and start the next generation
+		/// </summary>
+		/// <returns>Generation of returned pages</returns>
+		uint64_t Swap(std::set<std::size_t>& pages);
+
+		/// <summary>
+		/// Copy pages of current generation to output
+		/// </summary>
+		void Peek(std::set<std::size_t>& pages) const;
+
+		/// <summary>
+		/// Start recording written pages apart from generations, used by stepped backup to find pages changed between steps
+		/// </summary>
+		/// <returns>Watch id</returns>
+		uint64_t Watch();
+
+		/// <summary>
+		/// Move pages recorded by watch since previous call to output
+		/// </summary>
+		void CollectWatched(uint64_t watch, std::set<std::size_t>& pages);
+		void Unwatch(uint64_t watch);
+
+	private:
+		void CollectPages(std::set<std::size_t>& pages) const;
+		void WriteFile();
+
+	private:
+		mutable std::mutex mutex;
+		std::vector<uint64_t> bits;
+		std::set<std::size_t> pendingWords;
+		uint64_t generation = 0;
+		std::size_t pageSize = 0;
+		std::string path;
+		bool rewrite = false;
+		std::map<uint64_t, std::set<std::size_t>> watches;
+		uint64_t nextWatch = 1;
+	};
+
+	/// <summary>
+	/// Register SQLITE3 VFS which wraps default VFS and records pages written by xWrite
+	/// </summary>
+	void RegisterTrackingVfs(const char* vfsName, bool makeDefault);
+}//namespace sqlite3_inc_bkp
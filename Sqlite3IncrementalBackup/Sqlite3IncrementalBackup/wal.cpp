@@ -0,0 +1,110 @@
+#include "wal.h"
+
+#include <fstream>
+#include <vector>
+
+namespace sqlite3_inc_bkp {
+	namespace {
+		const uint32_t WAL_MAGIC = 0x377f0682;
+		const std::size_t WAL_HEADER_SIZE = 32;
+		const std::size_t WAL_FRAME_HEADER_SIZE = 24;
+
+		inline uint32_t GetBigEndian32(const unsigned char* p) {
+			return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+		}
+
+		inline uint32_t GetLittleEndian32(const unsigned char* p) {
+			return (uint32_t(p[3]) << 24) | (uint32_t(p[2]) << 16) | (uint32_t(p[1]) << 8) | uint32_t(p[0]);
+		}
+
+		//Same as walChecksumBytes in sqlite3.c, word byte order is taken from the magic number
+		void WalChecksum(bool bigEndian, const unsigned char* data, std::size_t size, uint32_t& s1, uint32_t& s2) {
+			for (std::size_t i = 0; i + 8 <= size; i += 8) {
+				s1 += (bigEndian ? GetBigEndian32(data + i) : GetLittleEndian32(data + i)) + s2;
+				s2 += (bigEndian ? GetBigEndian32(data + i + 4) : GetLittleEndian32(data + i + 4)) + s1;
+			}
+		}
+	}
+
+	bool WalIndex::Scan(const std::string& walPath, WalMarker& marker, std::set<std::size_t>* pages) {
+		std::ifstream fWal(walPath, std::ios::binary);
+		if (!fWal.is_open())
+			return false;
+
+		unsigned char header[WAL_HEADER_SIZE];
+		if (!fWal.read(reinterpret_cast<char*>(header), WAL_HEADER_SIZE))
+			return false;
+		const uint32_t magic = GetBigEndian32(header);
+		if ((magic & 0xFFFFFFFE) != WAL_MAGIC)
+			return false;
+		const bool bigEndian = (magic & 1) != 0;
+		const std::size_t pageSize = GetBigEndian32(header + 8) == 1 ? 0x10000 : GetBigEndian32(header + 8);
+		const uint32_t checkpointSeq = GetBigEndian32(header + 12);
+		const uint32_t salt1 = GetBigEndian32(header + 16);
+		const uint32_t salt2 = GetBigEndian32(header + 20);
+
+		uint32_t s1 = 0, s2 = 0;
+		WalChecksum(bigEndian, header, 24, s1, s2);
+		if (s1 != GetBigEndian32(header + 24) || s2 != GetBigEndian32(header + 28))
+			return false;
+
+		if (!marker.anchored) {
+			marker.checkpointSeq = checkpointSeq;
+			marker.salt1 = salt1;
+			marker.salt2 = salt2;
+			marker.frames = 0;
+			marker.checksum1 = s1;
+			marker.checksum2 = s2;
+			marker.anchored = 1;
+		}
+		else if (marker.checkpointSeq != checkpointSeq || marker.salt1 != salt1 || marker.salt2 != salt2) {
+			//WAL was restarted, frames after marker are gone even if marker saw none of them
+			return false;
+		}
+		s1 = marker.checksum1;
+		s2 = marker.checksum2;
+
+		const std::size_t frameSize = WAL_FRAME_HEADER_SIZE + pageSize;
+		fWal.seekg(WAL_HEADER_SIZE + static_cast<std::size_t>(marker.frames) * frameSize);
+		if (!fWal)
+			return false;
+
+		std::vector<unsigned char> frame(frameSize);
+		std::vector<std::size_t> uncommitted;
+		uint32_t frames = marker.frames;
+		while (fWal.read(reinterpret_cast<char*>(frame.data()), frameSize)) {
+			const unsigned char* frameHeader = frame.data();
+			if (GetBigEndian32(frameHeader + 8) != salt1 || GetBigEndian32(frameHeader + 12) != salt2)
+				break;
+			WalChecksum(bigEndian, frameHeader, 8, s1, s2);
+			WalChecksum(bigEndian, frameHeader + WAL_FRAME_HEADER_SIZE, pageSize, s1, s2);
+			if (s1 != GetBigEndian32(frameHeader + 16) || s2 != GetBigEndian32(frameHeader + 20))
+				break;
+
+			++frames;
+			uncommitted.push_back(GetBigEndian32(frameHeader));
+			if (GetBigEndian32(frameHeader + 4) != 0) {
+				//Commit frame, everything before it is durable
+				if (pages)
+					pages->insert(uncommitted.begin(), uncommitted.end());
+				uncommitted.clear();
+				marker.frames = frames;
+				marker.checksum1 = s1;
+				marker.checksum2 = s2;
+			}
+		}
+		return true;
+	}
+
+	bool WalIndex::ReadMarker(const std::string& path, WalMarker& marker) {
+		std::ifstream fMarker(path, std::ios::binary);
+		if (!fMarker.is_open())
+			return false;
+		return static_cast<bool>(fMarker.read(reinterpret_cast<char*>(&marker), sizeof(marker)));
+	}
+
+	void WalIndex::WriteMarker(const std::string& path, const WalMarker& marker) {
+		std::ofstream fMarker(path, std::ios::binary);
+		fMarker.write(reinterpret_cast<const char*>(&marker), sizeof(marker));
+	}
+}//namespace sqlite3_inc_bkp
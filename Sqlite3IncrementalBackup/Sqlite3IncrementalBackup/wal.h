@@ -0,0 +1,39 @@
+#pragma once
+
+#include <set>
+#include <string>
+
+#include "common.h"
+
+namespace sqlite3_inc_bkp {
+	/// <summary>
+	/// Position in the WAL file up to which database changes are already in backup
+	/// </summary>
+	struct WalMarker {
+		uint32_t checkpointSeq = 0;
+		uint32_t salt1 = 0;
+		uint32_t salt2 = 0;
+		uint32_t frames = 0;	//number of frames up to the last processed commit frame
+		uint32_t checksum1 = 0;	//running frame checksum after marker.frames frames
+		uint32_t checksum2 = 0;
+		uint32_t anchored = 0;	//1 once fields above are taken from a WAL header, frames == 0 then means no frames of that WAL
+	};
+
+	/// <summary>
+	/// Reader of SQLITE3 write-ahead log frames
+	/// </summary>
+	class WalIndex {
+	public:
+		/// <summary>
+		/// Collect page numbers of committed frames appended after marker and move marker to the last commit frame
+		/// </summary>
+		/// <param name="walPath">Path to "-wal" file of database</param>
+		/// <param name="marker">Start position, default marker means scan from WAL header of any salt</param>
+		/// <param name="pages">Output set of changed page numbers, may be nullptr</param>
+		/// <returns>false if WAL is missing, was reset or checkpointed past marker</returns>
+		static bool Scan(const std::string& walPath, WalMarker& marker, std::set<std::size_t>* pages);
+
+		static bool ReadMarker(const std::string& path, WalMarker& marker);
+		static void WriteMarker(const std::string& path, const WalMarker& marker);
+	};
+}//namespace sqlite3_inc_bkp
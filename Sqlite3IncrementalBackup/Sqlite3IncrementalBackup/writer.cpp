@@ -0,0 +1,431 @@
+#include "writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef SQLITE3_INC_BKP_IO_URING
+#include <liburing.h>
+#endif
+
+#include "exception.h"
+
+namespace sqlite3_inc_bkp {
+	namespace {
+#ifdef IOV_MAX
+		const std::size_t MAX_EXTENT_PARTS = IOV_MAX;
+#else
+		const std::size_t MAX_EXTENT_PARTS = 1024;
+#endif
+		const uint64_t DROP_BEHIND_BYTES = 8 << 20;
+		const std::size_t STAGE_CHUNK_BYTES = 1 << 20;
+		const uint64_t STAGE_BYTES = 16 << 20;
+		const std::size_t DIRECT_ALIGNMENT = 4096;
+
+		/// <summary>
+		/// Portable writer, one seek per extent
+		/// </summary>
+		class StreamPageWriter : public PageWriter {
+		public:
+			explicit StreamPageWriter(const std::string& path) : PageWriter(path), fdb(path, std::ios::in | std::ios::out | std::ios::binary) {
+				if (!this->fdb.is_open())
+					throw BackupException(tools::FormatString::format("Backup database file [%s] is not open", path.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+
+		protected:
+			void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override {
+				this->fdb.seekp(offset);
+				for (const Buffer& part : parts)
+					this->fdb.write(reinterpret_cast<const char*>(part.data), part.size);
+				if (!this->fdb)
+					throw BackupException(tools::FormatString::format("Error writing backup database file [%s]", this->path.c_str()).c_str(), BackupException::Error::BackupInit);
+			}
+
+			void Sync() override {
+				this->fdb.flush();
+			}
+
+		private:
+			std::ofstream fdb;
+		};
+
+#ifdef __linux__
+		/// <summary>
+		/// One pwritev per extent
+		/// </summary>
+		class VectoredPageWriter : public PageWriter {
+		public:
+			explicit VectoredPageWriter(const std::string& path) : PageWriter(path) {
+				this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+				if (this->fd < 0)
+					throw BackupException(tools::FormatString::format("Backup database file [%s] is not open: %s", path.c_str(), std::strerror(errno)).c_str(), BackupException::Error::BackupInit);
+			}
+
+			~VectoredPageWriter() override {
+				if (this->fd >= 0)
+					::close(this->fd);
+			}
+
+		protected:
+			void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override {
+				std::vector<iovec> iov = ToIovec(parts);
+				this->WriteFully(offset, iov, 0);
+			}
+
+			static std::vector<iovec> ToIovec(const std::vector<Buffer>& parts) {
+				std::vector<iovec> iov(parts.size());
+				for (std::size_t i = 0; i < parts.size(); ++i) {
+					iov[i].iov_base = const_cast<void*>(parts[i].data);
+					iov[i].iov_len = parts[i].size;
+				}
+				return iov;
+			}
+
+			//Write iov starting from written bytes, resubmitting after short writes
+			void WriteFully(uint64_t offset, std::vector<iovec>& iov, std::size_t written) {
+				std::size_t first = 0;
+				while (first < iov.size()) {
+					while (first < iov.size() && written >= iov[first].iov_len) {
+						written -= iov[first].iov_len;
+						offset += iov[first].iov_len;
+						++first;
+					}
+					if (first == iov.size())
+						break;
+					iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+					iov[first].iov_len -= written;
+					ssize_t rc = ::pwritev(this->fd, iov.data() + first, static_cast<int>(iov.size() - first), static_cast<off_t>(offset));
+					if (rc < 0) {
+						if (errno == EINTR) {
+							written = 0;
+							continue;
+						}
+						throw BackupException(tools::FormatString::format("Error writing backup database file [%s]: %s", this->path.c_str(), std::strerror(errno)).c_str(), BackupException::Error::BackupInit);
+					}
+					written = static_cast<std::size_t>(rc);
+				}
+			}
+
+		protected:
+			int fd = -1;
+		};
+#endif
+
+#if defined(__linux__) && defined(O_DIRECT)
+		/// <summary>
+		/// Extents are copied to an aligned buffer and written with O_DIRECT bypassing page cache. Unaligned extents and
+		/// file systems refusing O_DIRECT are written through page cache, O_DIRECT is switched off the descriptor for them
+		/// </summary>
+		class DirectPageWriter : public VectoredPageWriter {
+		public:
+			explicit DirectPageWriter(const std::string& path) : VectoredPageWriter(path), buffer(nullptr, &::free) {
+				this->direct = this->SetDirect(true);
+			}
+
+		protected:
+			void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override {
+				std::size_t size = 0;
+				for (const Buffer& part : parts)
+					size += part.size;
+				if (this->direct && offset % DIRECT_ALIGNMENT == 0 && size % DIRECT_ALIGNMENT == 0 && this->Reserve(size)) {
+					std::size_t copied = 0;
+					for (const Buffer& part : parts) {
+						std::memcpy(this->buffer.get() + copied, part.data, part.size);
+						copied += part.size;
+					}
+					if (this->WriteDirect(offset, size))
+						return;
+				}
+				const bool wasDirect = this->direct;
+				if (wasDirect)
+					this->SetDirect(false);
+				try {
+					VectoredPageWriter::WriteExtent(offset, parts);
+				}
+				catch (...) {
+					if (wasDirect)
+						this->direct = this->SetDirect(true);
+					throw;
+				}
+				if (wasDirect)
+					this->direct = this->SetDirect(true);
+			}
+
+		private:
+			bool SetDirect(bool on) {
+				const int flags = ::fcntl(this->fd, F_GETFL);
+				return flags >= 0 && ::fcntl(this->fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) == 0;
+			}
+
+			bool Reserve(std::size_t size) {
+				if (size <= this->capacity)
+					return true;
+				void* memory = nullptr;
+				if (::posix_memalign(&memory, DIRECT_ALIGNMENT, size) != 0)
+					return false;
+				this->buffer.reset(static_cast<char*>(memory));
+				this->capacity = size;
+				return true;
+			}
+
+			//Returns false if O_DIRECT is refused, extent is rewritten through page cache and O_DIRECT is not tried again
+			bool WriteDirect(uint64_t offset, std::size_t size) {
+				std::size_t written = 0;
+				while (written < size) {
+					ssize_t rc = ::pwrite(this->fd, this->buffer.get() + written, size - written, static_cast<off_t>(offset + written));
+					if (rc < 0) {
+						if (errno == EINTR)
+							continue;
+						if (errno == EINVAL) {
+							this->SetDirect(false);
+							this->direct = false;
+							return false;
+						}
+						throw BackupException(tools::FormatString::format("Error writing backup database file [%s]: %s", this->path.c_str(), std::strerror(errno)).c_str(), BackupException::Error::BackupInit);
+					}
+					written += static_cast<std::size_t>(rc);
+				}
+				return true;
+			}
+
+		private:
+			bool direct = false;
+			std::unique_ptr<char, decltype(&::free)> buffer;
+			std::size_t capacity = 0;
+		};
+#endif
+
+#if defined(__linux__) && defined(SQLITE3_INC_BKP_IO_URING)
+		/// <summary>
+		/// Extents are submitted as writev requests, up to queue depth in flight
+		/// </summary>
+		class UringPageWriter : public VectoredPageWriter {
+		public:
+			static std::unique_ptr<PageWriter> Create(const std::string& path, unsigned depth) {
+				std::unique_ptr<UringPageWriter> writer(new UringPageWriter(path, depth));
+				if (io_uring_queue_init(writer->depth, &writer->ring, 0) < 0)
+					return nullptr;
+				writer->initialized = true;
+				return writer;
+			}
+
+			~UringPageWriter() override {
+				if (!this->initialized)
+					return;
+				//Kernel may still read iovecs of failed flush
+				while (this->inFlight > 0) {
+					io_uring_cqe* cqe = nullptr;
+					if (io_uring_wait_cqe(&this->ring, &cqe) < 0)
+						break;
+					io_uring_cqe_seen(&this->ring, cqe);
+					--this->inFlight;
+				}
+				io_uring_queue_exit(&this->ring);
+			}
+
+		protected:
+			void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) override {
+				if (this->inFlight == this->depth)
+					this->Reap();
+				Request* request = nullptr;
+				for (Request& slot : this->requests) {
+					if (!slot.busy) {
+						request = &slot;
+						break;
+					}
+				}
+				request->busy = true;
+				request->offset = offset;
+				request->iov = ToIovec(parts);
+				request->size = 0;
+				for (const Buffer& part : parts)
+					request->size += part.size;
+
+				io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
+				io_uring_prep_writev(sqe, this->fd, request->iov.data(), static_cast<unsigned>(request->iov.size()), offset);
+				io_uring_sqe_set_data(sqe, request);
+				int rc = io_uring_submit(&this->ring);
+				if (rc < 0) {
+					request->busy = false;
+					throw BackupException(tools::FormatString::format("io_uring submit error: %s", std::strerror(-rc)).c_str(), BackupException::Error::BackupInit);
+				}
+				++this->inFlight;
+			}
+
+			void Wait() override {
+				while (this->inFlight > 0)
+					this->Reap();
+			}
+
+		private:
+			struct Request {
+				bool busy = false;
+				uint64_t offset = 0;
+				std::size_t size = 0;
+				std::vector<iovec> iov;
+			};
+
+			UringPageWriter(const std::string& path, unsigned depth) : VectoredPageWriter(path), depth(depth ? depth : 1), requests(this->depth) {}
+
+			void Reap() {
+				io_uring_cqe* cqe = nullptr;
+				int rc = io_uring_wait_cqe(&this->ring, &cqe);
+				if (rc < 0)
+					throw BackupException(tools::FormatString::format("io_uring wait error: %s", std::strerror(-rc)).c_str(), BackupException::Error::BackupInit);
+				Request* request = reinterpret_cast<Request*>(io_uring_cqe_get_data(cqe));
+				const int res = cqe->res;
+				io_uring_cqe_seen(&this->ring, cqe);
+				--this->inFlight;
+				request->busy = false;
+				if (res < 0)
+					throw BackupException(tools::FormatString::format("Error writing backup database file [%s]: %s", this->path.c_str(), std::strerror(-res)).c_str(), BackupException::Error::BackupInit);
+				if (static_cast<std::size_t>(res) < request->size)
+					this->WriteFully(request->offset, request->iov, static_cast<std::size_t>(res));
+			}
+
+		private:
+			io_uring ring;
+			bool initialized = false;
+			unsigned depth;
+			unsigned inFlight = 0;
+			std::vector<Request> requests;
+		};
+#endif
+	}
+
+	bool tools::PunchHoles(const std::string& path, const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+		if (ranges.empty())
+			return true;
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+		const int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		bool punched = true;
+		for (const auto& range : ranges) {
+			if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(range.first), static_cast<off_t>(range.second)) != 0) {
+				punched = false;
+				break;
+			}
+		}
+		::close(fd);
+		return punched;
+#else
+		return false;
+#endif
+	}
+
+	std::unique_ptr<PageWriter> PageWriter::Create(const std::string& path, const BackupOptions& options) {
+#if defined(__linux__) && defined(O_DIRECT)
+		if (options.cacheMode == CacheMode::Direct && (options.writeBackend == WriteBackend::Auto || options.writeBackend == WriteBackend::Vectored))
+			return std::make_unique<DirectPageWriter>(path);
+#endif
+		switch (options.writeBackend) {
+		case WriteBackend::Auto:
+		case WriteBackend::IoUring:
+#if defined(__linux__) && defined(SQLITE3_INC_BKP_IO_URING)
+			if (auto writer = UringPageWriter::Create(path, options.ioQueueDepth))
+				return writer;
+#endif
+			//fall through
+		case WriteBackend::Vectored:
+#ifdef __linux__
+			return std::make_unique<VectoredPageWriter>(path);
+#endif
+			//fall through
+		case WriteBackend::Stream:
+		default:
+			return std::make_unique<StreamPageWriter>(path);
+		}
+	}
+
+	void PageWriter::SetIoPolicy(RateLimiter* limiter, bool dropBehind) {
+		this->limiter = limiter;
+		this->dropBehind = dropBehind;
+	}
+
+	void PageWriter::Add(std::size_t pgno, const void* data, std::size_t size) {
+		this->pending.push_back({ pgno, { data, size } });
+	}
+
+	void PageWriter::Copy(std::size_t pgno, const void* data, std::size_t size) {
+		if (this->stage.empty())
+			this->stage.emplace_back(new char[STAGE_CHUNK_BYTES]);
+		if (this->stageUsed + size > STAGE_CHUNK_BYTES) {
+			if (++this->stageChunk == this->stage.size())
+				this->stage.emplace_back(new char[STAGE_CHUNK_BYTES]);
+			this->stageUsed = 0;
+		}
+		char* copy = this->stage[this->stageChunk].get() + this->stageUsed;
+		std::memcpy(copy, data, size);
+		this->stageUsed += size;
+		this->staged += size;
+		this->Add(pgno, copy, size);
+		if (this->staged >= STAGE_BYTES)
+			this->Flush();
+	}
+
+	void PageWriter::Flush() {
+		std::stable_sort(this->pending.begin(), this->pending.end(), [](const Page& a, const Page& b) { return a.pgno < b.pgno; });
+		//Page queued again, e.g. reread by a later step, replaces the earlier copy
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < this->pending.size(); ++i) {
+			if (kept > 0 && this->pending[kept - 1].pgno == this->pending[i].pgno)
+				this->pending[kept - 1] = this->pending[i];
+			else
+				this->pending[kept++] = this->pending[i];
+		}
+		this->pending.resize(kept);
+
+		uint64_t written = 0;
+		std::size_t i = 0;
+		while (i < this->pending.size()) {
+			const Page& first = this->pending[i];
+			this->parts.clear();
+			this->parts.push_back(first.buffer);
+			std::size_t j = i + 1;
+			while (j < this->pending.size() && this->parts.size() < MAX_EXTENT_PARTS
+				&& this->pending[j].pgno == this->pending[j - 1].pgno + 1
+				&& this->pending[j].buffer.size == first.buffer.size) {
+				this->parts.push_back(this->pending[j].buffer);
+				++j;
+			}
+			const uint64_t size = static_cast<uint64_t>(j - i) * first.buffer.size;
+			if (this->limiter)
+				this->limiter->Acquire(size);
+			this->WriteExtent(static_cast<uint64_t>(first.pgno - 1) * first.buffer.size, this->parts);
+			written += size;
+			i = j;
+		}
+		this->Wait();
+		this->pending.clear();
+		this->stageChunk = 0;
+		this->stageUsed = 0;
+		this->staged = 0;
+
+		if (this->dropBehind) {
+			this->unsynced += written;
+			if (this->unsynced >= DROP_BEHIND_BYTES) {
+				this->Sync();
+				this->DropCache(false);
+				this->unsynced = 0;
+			}
+		}
+	}
+
+	void PageWriter::ReleaseCache() {
+		if (!this->dropBehind)
+			return;
+		this->Sync();
+		this->DropCache(true);
+		this->unsynced = 0;
+	}
+}//namespace sqlite3_inc_bkp
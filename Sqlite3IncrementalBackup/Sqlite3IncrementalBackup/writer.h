@@ -0,0 +1,95 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+#include "throttle.h"
+
+namespace sqlite3_inc_bkp {
+	namespace tools {
+		/// <summary>
+		/// Deallocate (offset, length) byte ranges of file keeping its size, ranges read back as zeros.
+		/// Returns false if platform or file system can not punch holes, file contents are left as they are then
+		/// </summary>
+		bool PunchHoles(const std::string& path, const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+	}
+
+	/// <summary>
+	/// Writer of dirty pages to backup image, pages are sorted and contiguous runs are written as one extent
+	/// </summary>
+	class PageWriter {
+	public:
+		struct Buffer {
+			const void* data;
+			std::size_t size;
+		};
+
+		/// <summary>
+		/// Create writer of options.writeBackend, unavailable backends fall back to the next portable one
+		/// </summary>
+		static std::unique_ptr<PageWriter> Create(const std::string& path, const BackupOptions& options);
+		explicit PageWriter(const std::string& path) : path(path) {}
+		virtual ~PageWriter() {}
+
+		/// <summary>
+		/// Throttle extent writes with limiter and drop written data from page cache every few megabytes, limiter must outlive writer and may be nullptr
+		/// </summary>
+		void SetIoPolicy(RateLimiter* limiter, bool dropBehind);
+
+		/// <summary>
+		/// Queue page for writing, data must stay valid until Flush returns
+		/// </summary>
+		void Add(std::size_t pgno, const void* data, std::size_t size);
+
+		/// <summary>
+		/// Queue copy of page, data may be reused once call returns. Copies of several batches are coalesced together,
+		/// queued pages are flushed once a few megabytes are held
+		/// </summary>
+		void Copy(std::size_t pgno, const void* data, std::size_t size);
+
+		/// <summary>
+		/// Write all queued pages and wait for completion, of a page queued twice the last one is written
+		/// </summary>
+		void Flush();
+
+		/// <summary>
+		/// With drop-behind sync file written so far and drop it from page cache, called once writing is finished
+		/// </summary>
+		void ReleaseCache();
+
+	protected:
+		virtual void WriteExtent(uint64_t offset, const std::vector<Buffer>& parts) = 0;
+		virtual void Wait() {}
+		/// <summary>
+		/// Pass data buffered in process to OS
+		/// </summary>
+		virtual void Sync() {}
+		/// <summary>
+		/// Drop data written so far from OS page cache, see tools::DropCache
+		/// </summary>
+		virtual void DropCache(bool wait) { tools::DropCache(this->path, wait); }
+
+	protected:
+		std::string path;
+
+	private:
+		struct Page {
+			std::size_t pgno;
+			Buffer buffer;
+		};
+		std::vector<Page> pending;
+		std::vector<Buffer> parts;
+		//Chunks holding page copies, filled up to stageChunk and stageUsed bytes of it
+		std::vector<std::unique_ptr<char[]>> stage;
+		std::size_t stageChunk = 0;
+		std::size_t stageUsed = 0;
+		uint64_t staged = 0;
+		RateLimiter* limiter = nullptr;
+		bool dropBehind = false;
+		uint64_t unsynced = 0;
+	};
+}//namespace sqlite3_inc_bkp